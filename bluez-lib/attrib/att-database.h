@@ -28,6 +28,12 @@ enum {
 	ATT_NOT_PERMITTED,	/* Operation not permitted */
 };
 
+/* Deferred access in progress, see attrib_request_complete() */
+struct attrib_request;
+
+/* Shared attribute value storage, see attrib_db_set_value() */
+struct attrib_value;
+
 struct attribute {
 	uint16_t handle;
 	bt_uuid_t uuid;
@@ -37,7 +43,13 @@ struct attribute {
 							gpointer user_data);
 	uint8_t (*write_cb)(struct attribute *a, struct btd_device *device,
 							gpointer user_data);
+	/* Deferred variants, the response is sent on completion */
+	void (*read_async)(struct attribute *a, struct btd_device *device,
+				struct attrib_request *req, gpointer user_data);
+	void (*write_async)(struct attribute *a, struct btd_device *device,
+				struct attrib_request *req, gpointer user_data);
 	gpointer cb_user_data;
 	size_t len;
 	uint8_t *data;
+	struct attrib_value *value;	/* Owner of data if not heap copy */
 };
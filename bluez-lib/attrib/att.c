@@ -87,35 +87,56 @@ const char *att_ecode2str(uint8_t status)
 
 void att_data_list_free(struct att_data_list *list)
 {
-	if (list == NULL)
-		return;
-
-	if (list->data) {
-		int i;
-		for (i = 0; i < list->num; i++)
-			g_free(list->data[i]);
-	}
-
-	g_free(list->data);
 	g_free(list);
 }
 
 struct att_data_list *att_data_list_alloc(uint16_t num, uint16_t len)
 {
 	struct att_data_list *list;
+	uint8_t *entries;
 	int i;
 
 	if (len > UINT8_MAX)
 		return NULL;
 
-	list = g_new0(struct att_data_list, 1);
+	list = g_malloc0(sizeof(*list) + num * (sizeof(uint8_t *) + len));
 	list->len = len;
 	list->num = num;
 
-	list->data = g_malloc0(sizeof(uint8_t *) * num);
+	list->data = (uint8_t **) (list + 1);
+	entries = (uint8_t *) (list->data + num);
 
 	for (i = 0; i < num; i++)
-		list->data[i] = g_malloc0(sizeof(uint8_t) * len);
+		list->data[i] = entries + i * len;
+
+	return list;
+}
+
+/* A trailing partial entry is ignored */
+static uint16_t data_iter_init(struct att_data_iter *iter, const uint8_t *ptr,
+						size_t len, uint16_t elen)
+{
+	if (iter == NULL || elen == 0 || len < elen)
+		return 0;
+
+	iter->ptr = ptr;
+	iter->end = ptr + len - len % elen;
+	iter->len = elen;
+
+	return len / elen;
+}
+
+static struct att_data_list *data_list_from_iter(struct att_data_iter *iter,
+								uint16_t num)
+{
+	struct att_data_list *list;
+
+	list = att_data_list_alloc(num, iter->len);
+	if (list == NULL)
+		return NULL;
+
+	/* Entries are contiguous on both sides */
+	memcpy(list->data[0], iter->ptr, num * iter->len);
 
 	return list;
 }
@@ -165,6 +186,10 @@ uint16_t dec_read_by_grp_req(const uint8_t *pdu, size_t len, uint16_t *start,
 	if (len < min_len + 2)
 		return 0;
 
+	/* Attribute type is either a 16 or a 128 bit UUID */
+	if (len != min_len + 2 && len != min_len + 16)
+		return 0;
+
 	*start = att_get_u16(&pdu[1]);
 	*end = att_get_u16(&pdu[3]);
 	if (len == min_len + 2)
@@ -202,30 +227,28 @@ uint16_t enc_read_by_grp_resp(struct att_data_list *list, uint8_t *pdu,
 	return w;
 }
 
-struct att_data_list *dec_read_by_grp_resp(const uint8_t *pdu, size_t len)
+uint16_t dec_read_by_grp_resp_iter(const uint8_t *pdu, size_t len,
+						struct att_data_iter *iter)
 {
-	struct att_data_list *list;
-	const uint8_t *ptr;
-	uint16_t elen, num;
-	int i;
+	if (pdu == NULL || len < 2)
+		return 0;
 
 	if (pdu[0] != ATT_OP_READ_BY_GROUP_RESP)
-		return NULL;
+		return 0;
 
-	elen = pdu[1];
-	num = (len - 2) / elen;
-	list = att_data_list_alloc(num, elen);
-	if (list == NULL)
-		return NULL;
+	return data_iter_init(iter, &pdu[2], len - 2, pdu[1]);
+}
 
-	ptr = &pdu[2];
+struct att_data_list *dec_read_by_grp_resp(const uint8_t *pdu, size_t len)
+{
+	struct att_data_iter iter;
+	uint16_t num;
 
-	for (i = 0; i < num; i++) {
-		memcpy(list->data[i], ptr, list->len);
-		ptr += list->len;
-	}
+	num = dec_read_by_grp_resp_iter(pdu, len, &iter);
+	if (num == 0)
+		return NULL;
 
-	return list;
+	return data_list_from_iter(&iter, num);
 }
 
 uint16_t enc_find_by_type_req(uint16_t start, uint16_t end, bt_uuid_t *uuid,
@@ -396,6 +419,10 @@ uint16_t dec_read_by_type_req(const uint8_t *pdu, size_t len, uint16_t *start,
 	if (pdu[0] != ATT_OP_READ_BY_TYPE_REQ)
 		return 0;
 
+	/* Attribute type is either a 16 or a 128 bit UUID */
+	if (len != min_len + 2 && len != min_len + 16)
+		return 0;
+
 	*start = att_get_u16(&pdu[1]);
 	*end = att_get_u16(&pdu[3]);
 
@@ -434,30 +461,28 @@ uint16_t enc_read_by_type_resp(struct att_data_list *list, uint8_t *pdu,
 	return w;
 }
 
-struct att_data_list *dec_read_by_type_resp(const uint8_t *pdu, size_t len)
+uint16_t dec_read_by_type_resp_iter(const uint8_t *pdu, size_t len,
+						struct att_data_iter *iter)
 {
-	struct att_data_list *list;
-	const uint8_t *ptr;
-	uint16_t elen, num;
-	int i;
+	if (pdu == NULL || len < 2)
+		return 0;
 
 	if (pdu[0] != ATT_OP_READ_BY_TYPE_RESP)
-		return NULL;
+		return 0;
 
-	elen = pdu[1];
-	num = (len - 2) / elen;
-	list = att_data_list_alloc(num, elen);
-	if (list == NULL)
-		return NULL;
+	return data_iter_init(iter, &pdu[2], len - 2, pdu[1]);
+}
 
-	ptr = &pdu[2];
+struct att_data_list *dec_read_by_type_resp(const uint8_t *pdu, size_t len)
+{
+	struct att_data_iter iter;
+	uint16_t num;
 
-	for (i = 0; i < num; i++) {
-		memcpy(list->data[i], ptr, list->len);
-		ptr += list->len;
-	}
+	num = dec_read_by_type_resp_iter(pdu, len, &iter);
+	if (num == 0)
+		return NULL;
 
-	return list;
+	return data_list_from_iter(&iter, num);
 }
 
 uint16_t enc_write_cmd(uint16_t handle, const uint8_t *value, size_t vlen,
@@ -804,15 +829,12 @@ uint16_t enc_find_info_resp(uint8_t format, struct att_data_list *list,
 	return w;
 }
 
-struct att_data_list *dec_find_info_resp(const uint8_t *pdu, size_t len,
-							uint8_t *format)
+uint16_t dec_find_info_resp_iter(const uint8_t *pdu, size_t len,
+				uint8_t *format, struct att_data_iter *iter)
 {
-	struct att_data_list *list;
-	uint8_t *ptr;
-	uint16_t elen, num;
-	int i;
+	uint16_t elen;
 
-	if (pdu == NULL)
+	if (pdu == NULL || len < 2)
 		return 0;
 
 	if (format == NULL)
@@ -822,26 +844,29 @@ struct att_data_list *dec_find_info_resp(const uint8_t *pdu, size_t len,
 		return 0;
 
 	*format = pdu[1];
-	elen = sizeof(pdu[0]) + sizeof(*format);
-	if (*format == 0x01)
-		elen += 2;
-	else if (*format == 0x02)
-		elen += 16;
 
-	num = (len - 2) / elen;
+	/* Handle, then a 16 or a 128 bit UUID */
+	if (*format == ATT_FIND_INFO_RESP_FMT_16BIT)
+		elen = 2 + 2;
+	else if (*format == ATT_FIND_INFO_RESP_FMT_128BIT)
+		elen = 2 + 16;
+	else
+		return 0;
 
-	ptr = (void *) &pdu[2];
+	return data_iter_init(iter, &pdu[2], len - 2, elen);
+}
 
-	list = att_data_list_alloc(num, elen);
-	if (list == NULL)
-		return NULL;
+struct att_data_list *dec_find_info_resp(const uint8_t *pdu, size_t len,
+							uint8_t *format)
+{
+	struct att_data_iter iter;
+	uint16_t num;
 
-	for (i = 0; i < num; i++) {
-		memcpy(list->data[i], ptr, list->len);
-		ptr += list->len;
-	}
+	num = dec_find_info_resp_iter(pdu, len, format, &iter);
+	if (num == 0)
+		return NULL;
 
-	return list;
+	return data_list_from_iter(&iter, num);
 }
 
 uint16_t enc_notification(uint16_t handle, uint8_t *value, size_t vlen,
@@ -1036,7 +1061,7 @@ uint16_t dec_prep_write_resp(const uint8_t *pdu, size_t len, uint16_t *handle,
 	if (len < min_len)
 		return 0;
 
-	if (pdu[0] != ATT_OP_PREP_WRITE_REQ)
+	if (pdu[0] != ATT_OP_PREP_WRITE_RESP)
 		return 0;
 
 	*handle = att_get_u16(&pdu[1]);
@@ -1082,3 +1107,240 @@ uint16_t dec_exec_write_resp(const uint8_t *pdu, size_t len)
 
 	return len;
 }
+
+uint16_t dec_prep_write_req(const uint8_t *pdu, size_t len, uint16_t *handle,
+				uint16_t *offset, uint8_t *value, size_t *vlen)
+{
+	const uint16_t min_len = sizeof(pdu[0]) + sizeof(*handle) +
+								sizeof(*offset);
+
+	if (pdu == NULL)
+		return 0;
+
+	if (handle == NULL || offset == NULL || value == NULL || vlen == NULL)
+		return 0;
+
+	if (len < min_len)
+		return 0;
+
+	if (pdu[0] != ATT_OP_PREP_WRITE_REQ)
+		return 0;
+
+	*handle = att_get_u16(&pdu[1]);
+	*offset = att_get_u16(&pdu[3]);
+	*vlen = len - min_len;
+	if (*vlen > 0)
+		memcpy(value, pdu + min_len, *vlen);
+
+	return len;
+}
+
+uint16_t enc_prep_write_resp(uint16_t handle, uint16_t offset,
+					const uint8_t *value, size_t vlen,
+					uint8_t *pdu, size_t len)
+{
+	const uint16_t min_len = sizeof(pdu[0]) + sizeof(handle) +
+								sizeof(offset);
+
+	if (pdu == NULL)
+		return 0;
+
+	if (len < min_len)
+		return 0;
+
+	if (vlen > len - min_len)
+		vlen = len - min_len;
+
+	pdu[0] = ATT_OP_PREP_WRITE_RESP;
+	att_put_u16(handle, &pdu[1]);
+	att_put_u16(offset, &pdu[3]);
+
+	if (vlen > 0) {
+		memcpy(&pdu[5], value, vlen);
+		return min_len + vlen;
+	}
+
+	return min_len;
+}
+
+uint16_t dec_exec_write_req(const uint8_t *pdu, size_t len, uint8_t *flags)
+{
+	const uint16_t min_len = sizeof(pdu[0]) + sizeof(*flags);
+
+	if (pdu == NULL)
+		return 0;
+
+	if (flags == NULL)
+		return 0;
+
+	if (len < min_len)
+		return 0;
+
+	if (pdu[0] != ATT_OP_EXEC_WRITE_REQ)
+		return 0;
+
+	*flags = pdu[1];
+
+	return min_len;
+}
+
+uint16_t enc_exec_write_resp(uint8_t *pdu, size_t len)
+{
+	if (pdu == NULL)
+		return 0;
+
+	if (len < sizeof(pdu[0]))
+		return 0;
+
+	pdu[0] = ATT_OP_EXEC_WRITE_RESP;
+
+	return sizeof(pdu[0]);
+}
+
+uint16_t dec_read_multi_req(const uint8_t *pdu, size_t len, uint16_t *handles,
+								size_t *num)
+{
+	const uint16_t min_len = sizeof(pdu[0]) + 2 * sizeof(uint16_t);
+	size_t i, count;
+
+	if (pdu == NULL)
+		return 0;
+
+	if (handles == NULL || num == NULL)
+		return 0;
+
+	if (len < min_len || (len - 1) % sizeof(uint16_t))
+		return 0;
+
+	if (pdu[0] != ATT_OP_READ_MULTI_REQ)
+		return 0;
+
+	count = (len - 1) / sizeof(uint16_t);
+	if (count > *num)
+		return 0;
+
+	for (i = 0; i < count; i++)
+		handles[i] = att_get_u16(&pdu[1 + i * sizeof(uint16_t)]);
+
+	*num = count;
+
+	return len;
+}
+
+uint16_t enc_read_multi_resp(uint8_t **values, size_t *vlens, size_t num,
+						uint8_t *pdu, size_t len)
+{
+	uint16_t w;
+	size_t i;
+
+	if (pdu == NULL)
+		return 0;
+
+	if (len < sizeof(pdu[0]))
+		return 0;
+
+	pdu[0] = ATT_OP_READ_MULTI_RESP;
+	w = sizeof(pdu[0]);
+
+	/* Values that do not fit are truncated at the PDU boundary */
+	for (i = 0; i < num && w < len; i++) {
+		size_t vlen = MIN(vlens[i], len - w);
+
+		memcpy(&pdu[w], values[i], vlen);
+		w += vlen;
+	}
+
+	return w;
+}
+
+static uint16_t enc_read_multi(uint8_t opcode, const uint16_t *handles,
+					size_t num, uint8_t *pdu, size_t len)
+{
+	size_t i;
+
+	if (pdu == NULL || handles == NULL)
+		return 0;
+
+	/* At least two handles, and all of them must fit */
+	if (num < 2 || len < sizeof(pdu[0]) + num * sizeof(uint16_t))
+		return 0;
+
+	pdu[0] = opcode;
+
+	for (i = 0; i < num; i++)
+		att_put_u16(handles[i], &pdu[1 + i * sizeof(uint16_t)]);
+
+	return sizeof(pdu[0]) + num * sizeof(uint16_t);
+}
+
+uint16_t enc_read_multi_req(const uint16_t *handles, size_t num,
+						uint8_t *pdu, size_t len)
+{
+	return enc_read_multi(ATT_OP_READ_MULTI_REQ, handles, num, pdu, len);
+}
+
+ssize_t dec_read_multi_resp(const uint8_t *pdu, size_t len, uint8_t *value,
+								size_t vlen)
+{
+	if (pdu == NULL || value == NULL)
+		return -EINVAL;
+
+	if (len < sizeof(pdu[0]))
+		return -EINVAL;
+
+	if (pdu[0] != ATT_OP_READ_MULTI_RESP)
+		return -EINVAL;
+
+	if (vlen < len - 1)
+		return -ENOBUFS;
+
+	memcpy(value, pdu + 1, len - 1);
+
+	return len - 1;
+}
+
+uint16_t enc_read_multi_vl_req(const uint16_t *handles, size_t num,
+						uint8_t *pdu, size_t len)
+{
+	return enc_read_multi(ATT_OP_READ_MULTI_VL_REQ, handles, num, pdu,
+									len);
+}
+
+uint16_t dec_read_multi_vl_resp(const uint8_t *pdu, size_t len,
+				const uint8_t **values, uint16_t *vlens,
+				size_t *num)
+{
+	size_t offset, count;
+
+	if (pdu == NULL)
+		return 0;
+
+	if (values == NULL || vlens == NULL || num == NULL)
+		return 0;
+
+	if (len < sizeof(pdu[0]))
+		return 0;
+
+	if (pdu[0] != ATT_OP_READ_MULTI_VL_RESP)
+		return 0;
+
+	/* Length/value tuples pointing into the PDU, in request order */
+	for (offset = 1, count = 0; offset < len; count++) {
+		uint16_t vlen;
+
+		if (count == *num || len - offset < sizeof(uint16_t))
+			return 0;
+
+		vlen = att_get_u16(&pdu[offset]);
+		offset += sizeof(uint16_t);
+
+		/* Only the last value may be cut short at the MTU */
+		vlens[count] = MIN(vlen, len - offset);
+		values[count] = &pdu[offset];
+		offset += vlens[count];
+	}
+
+	*num = count;
+
+	return len;
+}
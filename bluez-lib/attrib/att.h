@@ -50,6 +50,8 @@
 #define ATT_OP_HANDLE_NOTIFY		0x1B
 #define ATT_OP_HANDLE_IND		0x1D
 #define ATT_OP_HANDLE_CNF		0x1E
+#define ATT_OP_READ_MULTI_VL_REQ	0x20
+#define ATT_OP_READ_MULTI_VL_RESP	0x21
 #define ATT_OP_SIGNED_WRITE_CMD		0xD2
 
 /* Error codes for Error response PDU */
@@ -100,12 +102,20 @@
 #define ATT_FIND_INFO_RESP_FMT_16BIT		0x01
 #define ATT_FIND_INFO_RESP_FMT_128BIT		0x02
 
+/* Allocated as one block: the entries follow the pointers to them */
 struct att_data_list {
 	uint16_t num;
 	uint16_t len;
 	uint8_t **data;
 };
 
+/* Entries of a list response, walked in place */
+struct att_data_iter {
+	const uint8_t *ptr;
+	const uint8_t *end;
+	uint16_t len;
+};
+
 struct att_range {
 	uint16_t start;
 	uint16_t end;
@@ -203,6 +213,19 @@ static inline bt_uuid_t att_get_uuid128(const void *ptr)
 struct att_data_list *att_data_list_alloc(uint16_t num, uint16_t len);
 void att_data_list_free(struct att_data_list *list);
 
+/* Next entry of iter->len bytes, NULL past the last one */
+static inline const uint8_t *att_data_iter_next(struct att_data_iter *iter)
+{
+	const uint8_t *entry = iter->ptr;
+
+	if (entry >= iter->end)
+		return NULL;
+
+	iter->ptr += iter->len;
+
+	return entry;
+}
+
 const char *att_ecode2str(uint8_t status);
 uint16_t enc_read_by_grp_req(uint16_t start, uint16_t end, bt_uuid_t *uuid,
 						uint8_t *pdu, size_t len);
@@ -218,6 +241,8 @@ uint16_t dec_find_by_type_req(const uint8_t *pdu, size_t len, uint16_t *start,
 uint16_t enc_find_by_type_resp(GSList *ranges, uint8_t *pdu, size_t len);
 GSList *dec_find_by_type_resp(const uint8_t *pdu, size_t len);
 struct att_data_list *dec_read_by_grp_resp(const uint8_t *pdu, size_t len);
+uint16_t dec_read_by_grp_resp_iter(const uint8_t *pdu, size_t len,
+						struct att_data_iter *iter);
 uint16_t enc_read_by_type_req(uint16_t start, uint16_t end, bt_uuid_t *uuid,
 						uint8_t *pdu, size_t len);
 uint16_t dec_read_by_type_req(const uint8_t *pdu, size_t len, uint16_t *start,
@@ -229,6 +254,8 @@ uint16_t enc_write_cmd(uint16_t handle, const uint8_t *value, size_t vlen,
 uint16_t dec_write_cmd(const uint8_t *pdu, size_t len, uint16_t *handle,
 						uint8_t *value, size_t *vlen);
 struct att_data_list *dec_read_by_type_resp(const uint8_t *pdu, size_t len);
+uint16_t dec_read_by_type_resp_iter(const uint8_t *pdu, size_t len,
+						struct att_data_iter *iter);
 uint16_t enc_write_req(uint16_t handle, const uint8_t *value, size_t vlen,
 						uint8_t *pdu, size_t len);
 uint16_t dec_write_req(const uint8_t *pdu, size_t len, uint16_t *handle,
@@ -256,6 +283,8 @@ uint16_t enc_find_info_resp(uint8_t format, struct att_data_list *list,
 						uint8_t *pdu, size_t len);
 struct att_data_list *dec_find_info_resp(const uint8_t *pdu, size_t len,
 							uint8_t *format);
+uint16_t dec_find_info_resp_iter(const uint8_t *pdu, size_t len,
+				uint8_t *format, struct att_data_iter *iter);
 uint16_t enc_notification(uint16_t handle, uint8_t *value, size_t vlen,
 						uint8_t *pdu, size_t len);
 uint16_t enc_indication(uint16_t handle, uint8_t *value, size_t vlen,
@@ -277,3 +306,24 @@ uint16_t dec_prep_write_resp(const uint8_t *pdu, size_t len, uint16_t *handle,
 						size_t *vlen);
 uint16_t enc_exec_write_req(uint8_t flags, uint8_t *pdu, size_t len);
 uint16_t dec_exec_write_resp(const uint8_t *pdu, size_t len);
+uint16_t dec_prep_write_req(const uint8_t *pdu, size_t len, uint16_t *handle,
+						uint16_t *offset, uint8_t *value,
+						size_t *vlen);
+uint16_t enc_prep_write_resp(uint16_t handle, uint16_t offset,
+					const uint8_t *value, size_t vlen,
+					uint8_t *pdu, size_t len);
+uint16_t dec_exec_write_req(const uint8_t *pdu, size_t len, uint8_t *flags);
+uint16_t enc_exec_write_resp(uint8_t *pdu, size_t len);
+uint16_t dec_read_multi_req(const uint8_t *pdu, size_t len, uint16_t *handles,
+								size_t *num);
+uint16_t enc_read_multi_resp(uint8_t **values, size_t *vlens, size_t num,
+						uint8_t *pdu, size_t len);
+uint16_t enc_read_multi_req(const uint16_t *handles, size_t num,
+						uint8_t *pdu, size_t len);
+ssize_t dec_read_multi_resp(const uint8_t *pdu, size_t len, uint8_t *value,
+								size_t vlen);
+uint16_t enc_read_multi_vl_req(const uint16_t *handles, size_t num,
+						uint8_t *pdu, size_t len);
+uint16_t dec_read_multi_vl_resp(const uint8_t *pdu, size_t len,
+				const uint8_t **values, uint16_t *vlens,
+				size_t *num);
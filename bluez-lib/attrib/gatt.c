@@ -191,8 +191,9 @@ static void primary_all_cb(guint8 status, const guint8 *ipdu, guint16 iplen,
 							gpointer user_data)
 {
 	struct discover_primary *dp = user_data;
-	struct att_data_list *list;
-	unsigned int i, err;
+	struct att_data_iter iter;
+	const uint8_t *data;
+	unsigned int err;
 	uint16_t start, end;
 
 	if (status) {
@@ -200,24 +201,22 @@ static void primary_all_cb(guint8 status, const guint8 *ipdu, guint16 iplen,
 		goto done;
 	}
 
-	list = dec_read_by_grp_resp(ipdu, iplen);
-	if (list == NULL) {
+	if (dec_read_by_grp_resp_iter(ipdu, iplen, &iter) == 0) {
 		err = ATT_ECODE_IO;
 		goto done;
 	}
 
-	for (i = 0, end = 0; i < list->num; i++) {
-		const uint8_t *data = list->data[i];
+	for (end = 0; (data = att_data_iter_next(&iter)); ) {
 		struct gatt_primary *primary;
 		bt_uuid_t uuid;
 
 		start = att_get_u16(&data[0]);
 		end = att_get_u16(&data[2]);
 
-		if (list->len == 6) {
+		if (iter.len == 6) {
 			bt_uuid_t uuid16 = att_get_uuid16(&data[4]);
 			bt_uuid_to_uuid128(&uuid16, &uuid);
-		} else if (list->len == 20) {
+		} else if (iter.len == 20) {
 			uuid = att_get_uuid128(&data[4]);
 		} else {
 			/* Skipping invalid data */
@@ -226,7 +225,6 @@ static void primary_all_cb(guint8 status, const guint8 *ipdu, guint16 iplen,
 
 	//	primary = g_try_new0(struct gatt_primary, 1);
 		if (!primary) {
-			att_data_list_free(list);
 			err = ATT_ECODE_INSUFF_RESOURCES;
 			goto done;
 		}
@@ -236,7 +234,6 @@ static void primary_all_cb(guint8 status, const guint8 *ipdu, guint16 iplen,
 		dp->primaries = g_slist_append(dp->primaries, primary);
 	}
 
-	att_data_list_free(list);
 	err = 0;
 
 	if (end != 0xffff) {
@@ -381,8 +378,8 @@ static void find_included_cb(uint8_t status, const uint8_t *pdu, uint16_t len,
 	struct included_discovery *isd = user_data;
 	uint16_t last_handle = isd->end_handle;
 	unsigned int err = status;
-	struct att_data_list *list;
-	int i;
+	struct att_data_iter iter;
+	const uint8_t *data;
 
 	if (err == ATT_ECODE_ATTR_NOT_FOUND)
 		err = 0;
@@ -390,26 +387,24 @@ static void find_included_cb(uint8_t status, const uint8_t *pdu, uint16_t len,
 	if (status)
 		goto done;
 
-	list = dec_read_by_type_resp(pdu, len);
-	if (list == NULL) {
+	if (dec_read_by_type_resp_iter(pdu, len, &iter) == 0) {
 		err = ATT_ECODE_IO;
 		goto done;
 	}
 
-	if (list->len != 6 && list->len != 8) {
+	if (iter.len != 6 && iter.len != 8) {
 		err = ATT_ECODE_IO;
-		att_data_list_free(list);
 		goto done;
 	}
 
-	for (i = 0; i < list->num; i++) {
+	while ((data = att_data_iter_next(&iter))) {
 		struct gatt_included *incl;
 
-		incl = included_from_buf(list->data[i], list->len);
+		incl = included_from_buf(data, iter.len);
 		last_handle = incl->handle;
 
 		/* 128 bit UUID, needs resolving */
-		if (list->len == 6) {
+		if (iter.len == 6) {
 			resolve_included_uuid(isd, incl);
 			continue;
 		}
@@ -417,8 +412,6 @@ static void find_included_cb(uint8_t status, const uint8_t *pdu, uint16_t len,
 		isd->includes = g_slist_append(isd->includes, incl);
 	}
 
-	att_data_list_free(list);
-
 	if (last_handle < isd->end_handle)
 		find_included(isd, last_handle + 1);
 
@@ -447,8 +440,9 @@ static void char_discovered_cb(guint8 status, const guint8 *ipdu, guint16 iplen,
 							gpointer user_data)
 {
 	struct discover_char *dc = user_data;
-	struct att_data_list *list;
-	unsigned int i, err = ATT_ECODE_ATTR_NOT_FOUND;
+	struct att_data_iter iter;
+	const uint8_t *value;
+	unsigned int err = ATT_ECODE_ATTR_NOT_FOUND;
 	size_t buflen;
 	uint8_t *buf;
 	guint16 oplen;
@@ -460,20 +454,18 @@ static void char_discovered_cb(guint8 status, const guint8 *ipdu, guint16 iplen,
 		goto done;
 	}
 
-	list = dec_read_by_type_resp(ipdu, iplen);
-	if (list == NULL) {
+	if (dec_read_by_type_resp_iter(ipdu, iplen, &iter) == 0) {
 		err = ATT_ECODE_IO;
 		goto done;
 	}
 
-	for (i = 0; i < list->num; i++) {
-		uint8_t *value = list->data[i];
+	while ((value = att_data_iter_next(&iter))) {
 		struct gatt_char *chars;
 		bt_uuid_t uuid;
 
 		last = att_get_u16(value);
 
-		if (list->len == 7) {
+		if (iter.len == 7) {
 			bt_uuid_t uuid16 = att_get_uuid16(&value[5]);
 			bt_uuid_to_uuid128(&uuid16, &uuid);
 		} else
@@ -496,8 +488,6 @@ static void char_discovered_cb(guint8 status, const guint8 *ipdu, guint16 iplen,
 									chars);
 	}
 
-	att_data_list_free(list);
-
 	if (last != 0 && (last + 1 < dc->end)) {
 		buf = g_attrib_get_buffer(dc->attrib, &buflen);
 
@@ -570,9 +560,13 @@ guint gatt_read_char_by_uuid(GAttrib *attrib, uint16_t start, uint16_t end,
 struct read_long_data {
 	GAttrib *attrib;
 	GAttribResultFunc func;
+	gatt_chunk_cb_t chunk;
 	gpointer user_data;
 	guint8 *buffer;
-	guint16 size;
+	size_t size;
+	size_t alloc;
+	size_t hint;
+	size_t offset;
 	guint16 handle;
 	guint id;
 	gint ref;
@@ -591,51 +585,120 @@ static void read_long_destroy(gpointer user_data)
 	g_free(long_read);
 }
 
+/*
+ * Streams the value part of a response to the caller, or appends it to
+ * a buffer laid out as one Read Response. The buffer starts at the size
+ * hint, or twice the first response, and doubles from there.
+ */
+static guint8 read_long_append(struct read_long_data *long_read,
+					const guint8 *rpdu, guint16 rlen)
+{
+	const guint8 *value = &rpdu[1];
+	size_t vlen = rlen - 1;
+	guint8 *tmp;
+	size_t alloc;
+
+	if (long_read->chunk != NULL) {
+		if (!long_read->chunk(long_read->offset, value, vlen,
+						long_read->user_data))
+			return ATT_ECODE_ABORTED;
+
+		long_read->offset += vlen;
+		return 0;
+	}
+
+	/* The opcode of the first response heads the buffer */
+	if (long_read->size == 0) {
+		value = rpdu;
+		vlen = rlen;
+	}
+
+	if (long_read->size + vlen > long_read->alloc) {
+		alloc = long_read->alloc;
+		if (alloc == 0)
+			alloc = MAX(long_read->hint + 1, 2 * (size_t) rlen);
+
+		while (alloc < long_read->size + vlen)
+			alloc *= 2;
+
+		tmp = g_try_realloc(long_read->buffer, alloc);
+		if (tmp == NULL)
+			return ATT_ECODE_INSUFF_RESOURCES;
+
+		long_read->buffer = tmp;
+		long_read->alloc = alloc;
+	}
+
+	memcpy(&long_read->buffer[long_read->size], value, vlen);
+	long_read->size += vlen;
+	long_read->offset += rlen - 1;
+
+	return 0;
+}
+
+static void read_long_done(struct read_long_data *long_read, guint8 status)
+{
+	if (long_read->chunk != NULL)
+		long_read->func(status, NULL, 0, long_read->user_data);
+	else
+		long_read->func(status, long_read->buffer, long_read->size,
+							long_read->user_data);
+}
+
 static void read_blob_helper(guint8 status, const guint8 *rpdu, guint16 rlen,
-							gpointer user_data)
+							gpointer user_data);
+
+static guint8 read_blob_next(struct read_long_data *long_read)
 {
-	struct read_long_data *long_read = user_data;
 	uint8_t *buf;
 	size_t buflen;
-	guint8 *tmp;
 	guint16 plen;
 	guint id;
 
+	buf = g_attrib_get_buffer(long_read->attrib, &buflen);
+	plen = enc_read_blob_req(long_read->handle, long_read->offset,
+								buf, buflen);
+	id = g_attrib_send(long_read->attrib, long_read->id, buf, plen,
+				read_blob_helper, long_read, read_long_destroy);
+	if (id == 0)
+		return ATT_ECODE_IO;
+
+	__sync_fetch_and_add(&long_read->ref, 1);
+
+	return 0;
+}
+
+static void read_blob_helper(guint8 status, const guint8 *rpdu, guint16 rlen,
+							gpointer user_data)
+{
+	struct read_long_data *long_read = user_data;
+	size_t buflen;
+
 	if (status != 0 || rlen == 1) {
 		status = 0;
 		goto done;
 	}
 
-	tmp = g_try_realloc(long_read->buffer, long_read->size + rlen - 1);
-
-	if (tmp == NULL) {
-		status = ATT_ECODE_INSUFF_RESOURCES;
+	status = read_long_append(long_read, rpdu, rlen);
+	if (status != 0)
 		goto done;
-	}
-
-	memcpy(&tmp[long_read->size], &rpdu[1], rlen - 1);
-	long_read->buffer = tmp;
-	long_read->size += rlen - 1;
 
-	buf = g_attrib_get_buffer(long_read->attrib, &buflen);
+	g_attrib_get_buffer(long_read->attrib, &buflen);
 	if (rlen < buflen)
 		goto done;
 
-	plen = enc_read_blob_req(long_read->handle, long_read->size - 1,
-								buf, buflen);
-	id = g_attrib_send(long_read->attrib, long_read->id, buf, plen,
-				read_blob_helper, long_read, read_long_destroy);
-
-	if (id != 0) {
-		__sync_fetch_and_add(&long_read->ref, 1);
-		return;
+	/* Blob offsets and the result length are both 16 bit */
+	if (long_read->offset + buflen > UINT16_MAX) {
+		status = ATT_ECODE_INSUFF_RESOURCES;
+		goto done;
 	}
 
-	status = ATT_ECODE_IO;
+	status = read_blob_next(long_read);
+	if (status == 0)
+		return;
 
 done:
-	long_read->func(status, long_read->buffer, long_read->size,
-							long_read->user_data);
+	read_long_done(long_read, status);
 }
 
 static void read_char_helper(guint8 status, const guint8 *rpdu,
@@ -643,39 +706,28 @@ static void read_char_helper(guint8 status, const guint8 *rpdu,
 {
 	struct read_long_data *long_read = user_data;
 	size_t buflen;
-	uint8_t *buf = g_attrib_get_buffer(long_read->attrib, &buflen);
-	guint16 plen;
-	guint id;
-
-	if (status != 0 || rlen < buflen)
-		goto done;
-
-	long_read->buffer = g_malloc(rlen);
-	if (long_read->buffer == NULL) {
-		status = ATT_ECODE_INSUFF_RESOURCES;
-		goto done;
-	}
-
-	memcpy(long_read->buffer, rpdu, rlen);
-	long_read->size = rlen;
 
-	plen = enc_read_blob_req(long_read->handle, rlen - 1, buf, buflen);
+	g_attrib_get_buffer(long_read->attrib, &buflen);
 
-	id = g_attrib_send(long_read->attrib, long_read->id, buf, plen,
-				read_blob_helper, long_read, read_long_destroy);
-	if (id != 0) {
-		__sync_fetch_and_add(&long_read->ref, 1);
+	/* A value that fits one response goes out as it came */
+	if (status != 0 || (rlen < buflen && long_read->chunk == NULL)) {
+		long_read->func(status, rpdu, rlen, long_read->user_data);
 		return;
 	}
 
-	status = ATT_ECODE_IO;
+	status = read_long_append(long_read, rpdu, rlen);
+	if (status == 0 && rlen >= buflen) {
+		status = read_blob_next(long_read);
+		if (status == 0)
+			return;
+	}
 
-done:
-	long_read->func(status, rpdu, rlen, long_read->user_data);
+	read_long_done(long_read, status);
 }
 
-guint gatt_read_char(GAttrib *attrib, uint16_t handle, GAttribResultFunc func,
-							gpointer user_data)
+guint gatt_read_long(GAttrib *attrib, uint16_t handle, size_t size_hint,
+				gatt_chunk_cb_t chunk, GAttribResultFunc func,
+				gpointer user_data)
 {
 	uint8_t *buf;
 	size_t buflen;
@@ -690,8 +742,10 @@ guint gatt_read_char(GAttrib *attrib, uint16_t handle, GAttribResultFunc func,
 
 	long_read->attrib = attrib;
 	long_read->func = func;
+	long_read->chunk = chunk;
 	long_read->user_data = user_data;
 	long_read->handle = handle;
+	long_read->hint = size_hint;
 
 	buf = g_attrib_get_buffer(attrib, &buflen);
 	plen = enc_read_req(handle, buf, buflen);
@@ -707,6 +761,246 @@ guint gatt_read_char(GAttrib *attrib, uint16_t handle, GAttribResultFunc func,
 	return id;
 }
 
+guint gatt_read_char(GAttrib *attrib, uint16_t handle, GAttribResultFunc func,
+							gpointer user_data)
+{
+	return gatt_read_long(attrib, handle, 0, NULL, func, user_data);
+}
+
+struct read_multi_data {
+	GAttrib *attrib;
+	gatt_multi_cb_t func;
+	gpointer user_data;
+	uint16_t *handles;
+	uint16_t *lens;
+	struct gatt_multi_value *values;
+	const uint8_t **vl_values;
+	uint16_t *vl_lens;
+	size_t num;
+	size_t next;
+	size_t count;
+	GSList *chunks;
+	gboolean single;
+	guint id;
+	gint ref;
+};
+
+static void read_multi_destroy(gpointer user_data)
+{
+	struct read_multi_data *rm = user_data;
+
+	if (__sync_sub_and_fetch(&rm->ref, 1) > 0)
+		return;
+
+	g_slist_free_full(rm->chunks, g_free);
+	g_free(rm->handles);
+	g_free(rm->lens);
+	g_free(rm->values);
+	g_free(rm->vl_values);
+	g_free(rm->vl_lens);
+	g_free(rm);
+}
+
+static void read_multi_cb(guint8 status, const guint8 *rpdu, guint16 rlen,
+							gpointer user_data);
+
+static guint read_multi_send(struct read_multi_data *rm)
+{
+	const uint16_t *handles = &rm->handles[rm->next];
+	size_t buflen, count, total = 0;
+	uint8_t *buf;
+	guint16 plen;
+	guint id;
+
+	buf = g_attrib_get_buffer(rm->attrib, &buflen);
+
+	/*
+	 * As many handles as the request holds and, when their lengths are
+	 * known, as many values as the response holds.
+	 */
+	for (count = 0; rm->next + count < rm->num; count++) {
+		if (count > 0 && rm->single)
+			break;
+
+		if (1 + (count + 1) * sizeof(uint16_t) > buflen)
+			break;
+
+		if (rm->lens == NULL)
+			continue;
+
+		total += rm->lens[rm->next + count];
+		if (count > 0 && total > buflen - 1)
+			break;
+	}
+
+	if (count == 1)
+		plen = enc_read_req(handles[0], buf, buflen);
+	else if (rm->lens != NULL)
+		plen = enc_read_multi_req(handles, count, buf, buflen);
+	else
+		plen = enc_read_multi_vl_req(handles, count, buf, buflen);
+
+	if (plen == 0)
+		return 0;
+
+	rm->count = count;
+
+	id = g_attrib_send(rm->attrib, rm->id, buf, plen, read_multi_cb, rm,
+							read_multi_destroy);
+	if (id != 0)
+		__sync_fetch_and_add(&rm->ref, 1);
+
+	return id;
+}
+
+static uint8_t *read_multi_chunk(struct read_multi_data *rm,
+					const guint8 *rpdu, guint16 rlen)
+{
+	uint8_t *chunk;
+
+	/* Values point into a copy of each response until completion */
+	chunk = g_try_malloc(rlen);
+	if (chunk == NULL)
+		return NULL;
+
+	memcpy(chunk, rpdu, rlen);
+	rm->chunks = g_slist_prepend(rm->chunks, chunk);
+
+	return chunk;
+}
+
+static guint8 read_multi_store(struct read_multi_data *rm,
+					const guint8 *rpdu, guint16 rlen)
+{
+	struct gatt_multi_value *values = &rm->values[rm->next];
+	uint8_t *chunk;
+	size_t i, num, pos;
+
+	chunk = read_multi_chunk(rm, rpdu, rlen);
+	if (chunk == NULL)
+		return ATT_ECODE_INSUFF_RESOURCES;
+
+	if (rm->count == 1) {
+		values[0].value = &chunk[1];
+		values[0].len = rlen - 1;
+		return 0;
+	}
+
+	if (rm->lens == NULL) {
+		num = rm->count;
+
+		if (dec_read_multi_vl_resp(chunk, rlen, rm->vl_values,
+						rm->vl_lens, &num) == 0 ||
+								num == 0)
+			return ATT_ECODE_INVALID_PDU;
+
+		/*
+		 * A value cut short at the end of the PDU, its length field
+		 * just before it, is read again at the head of the next
+		 * request unless it came alone.
+		 */
+		if (num > 1 && att_get_u16(rm->vl_values[num - 1] - 2) >
+						rm->vl_lens[num - 1])
+			num--;
+
+		for (i = 0; i < num; i++) {
+			values[i].value = rm->vl_values[i];
+			values[i].len = rm->vl_lens[i];
+		}
+
+		/* Handles the response had no room for go out again */
+		rm->count = num;
+
+		return 0;
+	}
+
+	/* Read Multiple values are split at the lengths given */
+	for (i = 0, pos = 1; i < rm->count; i++) {
+		uint16_t vlen = MIN(rm->lens[rm->next + i], rlen - pos);
+
+		values[i].value = &chunk[pos];
+		values[i].len = vlen;
+		pos += vlen;
+	}
+
+	return 0;
+}
+
+static void read_multi_cb(guint8 status, const guint8 *rpdu, guint16 rlen,
+							gpointer user_data)
+{
+	struct read_multi_data *rm = user_data;
+
+	if (status == ATT_ECODE_REQ_NOT_SUPP && rm->count > 1) {
+		rm->single = TRUE;
+		goto next;
+	}
+
+	if (status != 0)
+		goto done;
+
+	status = read_multi_store(rm, rpdu, rlen);
+	if (status != 0)
+		goto done;
+
+	rm->next += rm->count;
+	if (rm->next == rm->num) {
+		rm->func(0, rm->values, rm->num, rm->user_data);
+		return;
+	}
+
+next:
+	if (read_multi_send(rm) != 0)
+		return;
+
+	status = ATT_ECODE_IO;
+
+done:
+	rm->func(status, NULL, 0, rm->user_data);
+}
+
+guint gatt_read_multiple(GAttrib *attrib, const uint16_t *handles,
+				const uint16_t *lens, size_t num,
+				gatt_multi_cb_t func, gpointer user_data)
+{
+	struct read_multi_data *rm;
+	size_t i;
+	guint id;
+
+	if (num == 0)
+		return 0;
+
+	rm = g_try_new0(struct read_multi_data, 1);
+	if (rm == NULL)
+		return 0;
+
+	rm->attrib = attrib;
+	rm->func = func;
+	rm->user_data = user_data;
+	rm->num = num;
+	rm->handles = g_memdup(handles, num * sizeof(*handles));
+	rm->values = g_new0(struct gatt_multi_value, num);
+
+	if (lens != NULL) {
+		rm->lens = g_memdup(lens, num * sizeof(*lens));
+	} else {
+		rm->vl_values = g_new0(const uint8_t *, num);
+		rm->vl_lens = g_new0(uint16_t, num);
+	}
+
+	for (i = 0; i < num; i++)
+		rm->values[i].handle = handles[i];
+
+	id = read_multi_send(rm);
+	if (id == 0) {
+		rm->ref = 1;
+		read_multi_destroy(rm);
+	} else
+		rm->id = id;
+
+	return id;
+}
+
 struct write_long_data {
 	GAttrib *attrib;
 	GAttribResultFunc func;
@@ -856,9 +1150,283 @@ guint gatt_write_cmd(GAttrib *attrib, uint16_t handle, uint8_t *value, int vlen,
 	size_t buflen;
 	guint16 plen;
 
-	buf = g_attrib_get_buffer(attrib, &buflen);
+	/* Encoded in place in the queued command, no copy */
+	buf = g_attrib_reserve(attrib, &buflen);
+	if (buf == NULL)
+		return 0;
+
 	plen = enc_write_cmd(handle, value, vlen, buf, buflen);
-	return g_attrib_send(attrib, 0, buf, plen, NULL, user_data, notify);
+	return g_attrib_commit(attrib, 0, plen, NULL, user_data, notify);
+}
+
+struct gatt_bulk {
+	GAttrib *attrib;
+	uint16_t handle;
+	uint16_t ack_handle;
+	const uint8_t *data;
+	size_t len;
+	size_t start;
+	size_t queued;
+	size_t written;
+	size_t acked;
+	size_t chunk;
+	unsigned int window;
+	guint flow;
+	guint notify_id;
+	guint ind_id;
+	gint64 started;
+	gboolean finished;
+	gboolean pdu_written;		/* The PDU being released went out */
+	gatt_bulk_progress_cb_t progress;
+	gatt_bulk_done_cb_t done;
+	gpointer user_data;
+	gint ref;
+};
+
+static void bulk_unref(gpointer user_data)
+{
+	struct gatt_bulk *bulk = user_data;
+
+	if (__sync_sub_and_fetch(&bulk->ref, 1) > 0)
+		return;
+
+	g_attrib_unref(bulk->attrib);
+	g_free(bulk);
+}
+
+static void bulk_get_progress(struct gatt_bulk *bulk,
+					struct gatt_bulk_progress *progress)
+{
+	progress->offset = bulk->ack_handle ? bulk->acked : bulk->written;
+	progress->total = bulk->len;
+	progress->elapsed = g_get_monotonic_time() - bulk->started;
+	progress->rate = 0;
+
+	if (progress->elapsed > 0)
+		progress->rate = (progress->offset - bulk->start) * 1000000 /
+							progress->elapsed;
+}
+
+static void bulk_report(struct gatt_bulk *bulk)
+{
+	struct gatt_bulk_progress progress;
+
+	if (bulk->progress == NULL)
+		return;
+
+	bulk_get_progress(bulk, &progress);
+	bulk->progress(&progress, bulk->user_data);
+}
+
+static void bulk_finish(struct gatt_bulk *bulk, guint8 status)
+{
+	struct gatt_bulk_progress progress;
+
+	if (bulk->finished)
+		return;
+
+	bulk->finished = TRUE;
+
+	if (bulk->notify_id)
+		g_attrib_unregister(bulk->attrib, bulk->notify_id);
+
+	if (bulk->ind_id)
+		g_attrib_unregister(bulk->attrib, bulk->ind_id);
+
+	if (bulk->done) {
+		bulk_get_progress(bulk, &progress);
+		bulk->done(status, &progress, bulk->user_data);
+	}
+
+	/* PDUs still queued are dropped along with the flow */
+	g_attrib_flow_remove(bulk->attrib, bulk->flow);
+
+	bulk_unref(bulk);
+}
+
+static void bulk_written(guint8 status, const guint8 *pdu, guint16 len,
+							gpointer user_data)
+{
+	struct gatt_bulk *bulk = user_data;
+
+	if (status != 0) {
+		bulk_finish(bulk, status);
+		return;
+	}
+
+	bulk->pdu_written = TRUE;
+
+	if (bulk->finished)
+		return;
+
+	/* Flow order is send order, only the last PDU is short */
+	bulk->written = MIN(bulk->written + bulk->chunk, bulk->len);
+
+	if (bulk->ack_handle)
+		return;
+
+	bulk_report(bulk);
+
+	if (bulk->written == bulk->len)
+		bulk_finish(bulk, 0);
+}
+
+static void bulk_released(gpointer user_data)
+{
+	struct gatt_bulk *bulk = user_data;
+
+	/* Dropped unsent, by g_attrib_cancel_all() or a flow teardown */
+	if (!bulk->pdu_written)
+		bulk_finish(bulk, ATT_ECODE_ABORTED);
+
+	bulk->pdu_written = FALSE;
+
+	bulk_unref(bulk);
+}
+
+static void bulk_fill(struct gatt_bulk *bulk)
+{
+	while (!bulk->finished && bulk->queued < bulk->len) {
+		size_t vlen = MIN(bulk->chunk, bulk->len - bulk->queued);
+		uint8_t *buf;
+		size_t buflen;
+		guint16 plen;
+
+		/* With acknowledgements the window runs up to the peer */
+		if (bulk->ack_handle && bulk->queued - bulk->acked >=
+						bulk->window * bulk->chunk)
+			break;
+
+		buf = g_attrib_reserve(bulk->attrib, &buflen);
+		if (buf == NULL)
+			break;
+
+		plen = enc_write_cmd(bulk->handle, &bulk->data[bulk->queued],
+							vlen, buf, buflen);
+
+		/* A full flow calls bulk_ready once half of it has drained */
+		if (g_attrib_commit_flow(bulk->attrib, bulk->flow, plen,
+					bulk_written, bulk, bulk_released) == 0)
+			break;
+
+		__sync_fetch_and_add(&bulk->ref, 1);
+		bulk->queued += vlen;
+	}
+}
+
+static void bulk_ready(guint flow, gpointer user_data)
+{
+	bulk_fill(user_data);
+}
+
+static void bulk_ack(const uint8_t *pdu, uint16_t len, gpointer user_data)
+{
+	struct gatt_bulk *bulk = user_data;
+	uint8_t *buf;
+	size_t buflen;
+	uint32_t offset;
+
+	if (pdu[0] == ATT_OP_HANDLE_IND) {
+		buf = g_attrib_get_buffer(bulk->attrib, &buflen);
+		g_attrib_send(bulk->attrib, 0, buf, enc_confirmation(buf,
+					buflen), NULL, NULL, NULL);
+	}
+
+	/* Opcode, handle and the 32 bit count of bytes received */
+	if (len < 7 || bulk->finished)
+		return;
+
+	offset = att_get_u32(&pdu[3]);
+	if (offset <= bulk->acked)
+		return;
+
+	bulk->acked = MIN(offset, bulk->queued);
+	bulk_report(bulk);
+
+	if (bulk->acked == bulk->len)
+		bulk_finish(bulk, 0);
+	else
+		bulk_fill(bulk);
+}
+
+struct gatt_bulk *gatt_bulk_write(GAttrib *attrib, uint16_t handle,
+				const uint8_t *data, size_t len, size_t offset,
+				unsigned int window, uint16_t ack_handle,
+				gatt_bulk_progress_cb_t progress,
+				gatt_bulk_done_cb_t done, gpointer user_data)
+{
+	struct gatt_bulk *bulk;
+	size_t buflen;
+
+	if (data == NULL || offset >= len || window == 0)
+		return NULL;
+
+	g_attrib_get_buffer(attrib, &buflen);
+	if (buflen <= 3)
+		return NULL;
+
+	bulk = g_try_new0(struct gatt_bulk, 1);
+	if (bulk == NULL)
+		return NULL;
+
+	bulk->attrib = g_attrib_ref(attrib);
+	bulk->handle = handle;
+	bulk->ack_handle = ack_handle;
+	bulk->data = data;
+	bulk->len = len;
+	bulk->start = offset;
+	bulk->queued = offset;
+	bulk->written = offset;
+	bulk->acked = offset;
+	bulk->chunk = buflen - 3;
+	bulk->window = window;
+	bulk->progress = progress;
+	bulk->done = done;
+	bulk->user_data = user_data;
+
+	/* One reference for the transfer, one for the flow */
+	bulk->ref = 2;
+
+	bulk->flow = g_attrib_flow_new(attrib, GATTRIB_PRIO_BULK, 1, window,
+					bulk_ready, bulk, bulk_unref);
+	if (bulk->flow == 0) {
+		g_attrib_unref(attrib);
+		g_free(bulk);
+		return NULL;
+	}
+
+	if (ack_handle) {
+		bulk->notify_id = g_attrib_register(attrib,
+					ATT_OP_HANDLE_NOTIFY, ack_handle,
+					bulk_ack, bulk, NULL);
+		bulk->ind_id = g_attrib_register(attrib, ATT_OP_HANDLE_IND,
+					ack_handle, bulk_ack, bulk, NULL);
+
+		/* Without acknowledgements the transfer would never end */
+		if (bulk->notify_id == 0 || bulk->ind_id == 0) {
+			if (bulk->notify_id)
+				g_attrib_unregister(attrib, bulk->notify_id);
+
+			if (bulk->ind_id)
+				g_attrib_unregister(attrib, bulk->ind_id);
+
+			g_attrib_flow_remove(attrib, bulk->flow);
+			bulk_unref(bulk);
+			return NULL;
+		}
+	}
+
+	bulk->started = g_get_monotonic_time();
+
+	bulk_fill(bulk);
+
+	return bulk;
+}
+
+void gatt_bulk_cancel(struct gatt_bulk *bulk)
+{
+	bulk->done = NULL;
+	bulk_finish(bulk, ATT_ECODE_ABORTED);
 }
 
 static sdp_data_t *proto_seq_find(sdp_list_t *proto_list)
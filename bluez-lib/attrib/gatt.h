@@ -74,6 +74,35 @@ struct gatt_char {
 	uint16_t value_handle;
 };
 
+struct gatt_multi_value {
+	uint16_t handle;
+	const uint8_t *value;
+	uint16_t len;
+};
+
+typedef void (*gatt_multi_cb_t) (guint8 status,
+					const struct gatt_multi_value *values,
+					size_t num, gpointer user_data);
+
+typedef gboolean (*gatt_chunk_cb_t) (uint16_t offset, const guint8 *value,
+					size_t vlen, gpointer user_data);
+
+struct gatt_bulk;
+
+struct gatt_bulk_progress {
+	size_t offset;			/* Bytes out, or acknowledged */
+	size_t total;
+	uint64_t elapsed;		/* Microseconds since the start */
+	uint64_t rate;			/* Bytes per second since the start */
+};
+
+typedef void (*gatt_bulk_progress_cb_t) (
+				const struct gatt_bulk_progress *progress,
+				gpointer user_data);
+typedef void (*gatt_bulk_done_cb_t) (guint8 status,
+				const struct gatt_bulk_progress *progress,
+				gpointer user_data);
+
 guint gatt_discover_primary(GAttrib *attrib, bt_uuid_t *uuid, gatt_cb_t func,
 							gpointer user_data);
 
@@ -87,6 +116,31 @@ guint gatt_discover_char(GAttrib *attrib, uint16_t start, uint16_t end,
 guint gatt_read_char(GAttrib *attrib, uint16_t handle, GAttribResultFunc func,
 							gpointer user_data);
 
+/*
+ * Long read with Read Blob Requests. The value is collected into one
+ * Read Response handed to func, in a buffer first sized for size_hint
+ * bytes. With chunk set, each part goes to chunk as it arrives instead,
+ * func then only reports the final status; chunk returning FALSE stops
+ * the read with ATT_ECODE_ABORTED. A value that does not fit a 16-bit
+ * offset ends the read with ATT_ECODE_INSUFF_RESOURCES, func receiving
+ * what was read so far.
+ */
+guint gatt_read_long(GAttrib *attrib, uint16_t handle, size_t size_hint,
+				gatt_chunk_cb_t chunk, GAttribResultFunc func,
+				gpointer user_data);
+
+/*
+ * Reads all handles with as few requests as the MTU allows and reports
+ * the values once, in the order given. With lens, the expected length of
+ * each value, Read Multiple Requests are used; without, Read Multiple
+ * Variable Requests. Values are truncated at the MTU like the responses
+ * carrying them. Servers refusing either request are read one handle at
+ * a time.
+ */
+guint gatt_read_multiple(GAttrib *attrib, const uint16_t *handles,
+				const uint16_t *lens, size_t num,
+				gatt_multi_cb_t func, gpointer user_data);
+
 guint gatt_write_char(GAttrib *attrib, uint16_t handle, uint8_t *value,
 					size_t vlen, GAttribResultFunc func,
 					gpointer user_data);
@@ -97,6 +151,26 @@ guint gatt_find_info(GAttrib *attrib, uint16_t start, uint16_t end,
 guint gatt_write_cmd(GAttrib *attrib, uint16_t handle, uint8_t *value, int vlen,
 				GDestroyNotify notify, gpointer user_data);
 
+/*
+ * Streams data[offset..len) to handle as MTU sized Write Commands on a
+ * bulk class flow holding at most window PDUs, so other traffic goes
+ * first. With ack_handle set, the peer notifies or indicates it with the
+ * 32 bit little endian count of bytes received, window then also bounds
+ * the PDUs sent past that count, and done waits for all of them. data
+ * must stay valid until done; a transfer is resumed by passing the last
+ * reported offset. Offsets only count PDUs written out; one dropped
+ * unsent, e.g. by g_attrib_cancel_all(), ends the transfer with
+ * ATT_ECODE_ABORTED. gatt_bulk_cancel() stops it without calling done;
+ * the transfer is freed once done returns, so it may not be cancelled
+ * after that.
+ */
+struct gatt_bulk *gatt_bulk_write(GAttrib *attrib, uint16_t handle,
+				const uint8_t *data, size_t len, size_t offset,
+				unsigned int window, uint16_t ack_handle,
+				gatt_bulk_progress_cb_t progress,
+				gatt_bulk_done_cb_t done, gpointer user_data);
+void gatt_bulk_cancel(struct gatt_bulk *bulk);
+
 guint gatt_read_char_by_uuid(GAttrib *attrib, uint16_t start, uint16_t end,
 				bt_uuid_t *uuid, GAttribResultFunc func,
 				gpointer user_data);
@@ -0,0 +1,186 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2010  Nokia Corporation
+ *  Copyright (C) 2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Worker threads serving GAttrib bearers. Each worker runs a loop on its
+ * own GMainContext; a bearer handed to it is created there, so all of its
+ * I/O, timeouts and callbacks stay on that thread (see
+ * g_attrib_get_context()). Bearers are handed out round robin.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <glib.h>
+
+#include "gattrib.h"
+#include "gattrib-shards.h"
+
+struct shard {
+	GMainContext *context;
+	GMainLoop *loop;
+	GThread *thread;
+};
+
+struct gattrib_shards {
+	unsigned int count;
+	unsigned int next;
+	struct shard *shards;
+};
+
+struct shard_attach {
+	GIOChannel *io;
+	GAttribAttachFunc func;
+	gpointer user_data;
+};
+
+static gpointer shard_run(gpointer data)
+{
+	struct shard *shard = data;
+
+	g_main_context_push_thread_default(shard->context);
+
+	g_main_loop_run(shard->loop);
+
+	/* Let the hand-offs and releases queued before the quit complete */
+	while (g_main_context_iteration(shard->context, FALSE))
+		;
+
+	g_main_context_pop_thread_default(shard->context);
+
+	return NULL;
+}
+
+struct gattrib_shards *g_attrib_shards_new(unsigned int count)
+{
+	struct gattrib_shards *shards;
+	unsigned int i;
+
+	if (count == 0)
+		return NULL;
+
+	shards = g_new0(struct gattrib_shards, 1);
+	shards->count = count;
+	shards->shards = g_new0(struct shard, count);
+
+	for (i = 0; i < count; i++) {
+		struct shard *shard = &shards->shards[i];
+		char name[16];
+
+		snprintf(name, sizeof(name), "gattrib-%u", i);
+
+		shard->context = g_main_context_new();
+		shard->loop = g_main_loop_new(shard->context, FALSE);
+		shard->thread = g_thread_new(name, shard_run, shard);
+	}
+
+	return shards;
+}
+
+/*
+ * Stops and joins the workers. Bearers still attached to them are not
+ * dispatched anymore and should have been released before.
+ */
+void g_attrib_shards_free(struct gattrib_shards *shards)
+{
+	unsigned int i;
+
+	if (shards == NULL)
+		return;
+
+	for (i = 0; i < shards->count; i++)
+		g_main_loop_quit(shards->shards[i].loop);
+
+	for (i = 0; i < shards->count; i++) {
+		struct shard *shard = &shards->shards[i];
+
+		g_thread_join(shard->thread);
+		g_main_loop_unref(shard->loop);
+		g_main_context_unref(shard->context);
+	}
+
+	g_free(shards->shards);
+	g_free(shards);
+}
+
+unsigned int g_attrib_shards_count(struct gattrib_shards *shards)
+{
+	if (shards == NULL)
+		return 0;
+
+	return shards->count;
+}
+
+static gboolean shard_attach(gpointer data)
+{
+	struct shard_attach *attach = data;
+	GAttrib *attrib;
+
+	attrib = g_attrib_new(attach->io);
+
+	attach->func(attrib, attach->user_data);
+
+	g_attrib_unref(attrib);
+
+	return FALSE;
+}
+
+static void shard_attach_free(gpointer data)
+{
+	struct shard_attach *attach = data;
+
+	g_io_channel_unref(attach->io);
+	g_free(attach);
+}
+
+/*
+ * Creates the GAttrib of @io on the next worker and passes it to @func
+ * there. @func takes its own reference to keep the bearer.
+ */
+gboolean g_attrib_shards_attach(struct gattrib_shards *shards,
+				GIOChannel *io, GAttribAttachFunc func,
+				gpointer user_data)
+{
+	struct shard_attach *attach;
+	struct shard *shard;
+
+	if (shards == NULL || io == NULL || func == NULL)
+		return FALSE;
+
+	shard = &shards->shards[shards->next];
+	shards->next = (shards->next + 1) % shards->count;
+
+	attach = g_new0(struct shard_attach, 1);
+	attach->io = g_io_channel_ref(io);
+	attach->func = func;
+	attach->user_data = user_data;
+
+	g_main_context_invoke_full(shard->context, G_PRIORITY_DEFAULT,
+				shard_attach, attach, shard_attach_free);
+
+	return TRUE;
+}
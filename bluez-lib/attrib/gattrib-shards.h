@@ -0,0 +1,48 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2010  Nokia Corporation
+ *  Copyright (C) 2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+#ifndef __GATTRIB_SHARDS_H
+#define __GATTRIB_SHARDS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct gattrib_shards;
+
+/* Called on the worker with the new bearer, or NULL if it failed */
+typedef void (*GAttribAttachFunc)(GAttrib *attrib, gpointer user_data);
+
+struct gattrib_shards *g_attrib_shards_new(unsigned int count);
+void g_attrib_shards_free(struct gattrib_shards *shards);
+
+unsigned int g_attrib_shards_count(struct gattrib_shards *shards);
+
+gboolean g_attrib_shards_attach(struct gattrib_shards *shards,
+				GIOChannel *io, GAttribAttachFunc func,
+				gpointer user_data);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -26,8 +26,11 @@
 #include "config.h"
 #endif
 
+#include <errno.h>
 #include <stdint.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
 #include <glib.h>
 
 #include <stdio.h>
@@ -36,27 +39,61 @@
 #include <btio/btio.h>
 
 #include "lib/uuid.h"
+#include "src/shared/io.h"
+#include "src/shared/timeout.h"
+#include "src/shared/capture.h"
 #include "log.h"
 #include "att.h"
 #include "gattrib.h"
 
 #define GATT_TIMEOUT 30
 
+/* Response-less PDUs written per G_IO_OUT wakeup */
+#define GATTRIB_BURST_DEFAULT 32
+#define GATTRIB_BURST_MAX 64
+
+/* PDUs read per G_IO_IN wakeup */
+#define GATTRIB_RECV_BATCH 8
+
+/* Released commands kept per GAttrib for reuse */
+#define COMMAND_POOL_MAX 32
+
 struct _GAttrib {
 	GIOChannel *io;
+	struct io *bearer;
 	gint refs;
+	GMainContext *context;
+	GThread *owner;
 	uint8_t *buf;
 	size_t buflen;
-	guint read_watch;
-	guint write_watch;
-	guint timeout_watch;
-	GQueue *requests;
+	uint8_t *rbuf;
+	size_t rmtu;
+	size_t rmtu_next;
+	gboolean writing;
+	unsigned int timeout_watch;
 	GQueue *responses;
-	GSList *events;
+	GHashTable *flows;
+	struct flow *default_flow;
+	GQueue active[GATTRIB_PRIO_COUNT];
+	unsigned int queued;
+	struct command *pending;
+	GSList *ready;
+	guint next_flow_id;
+	GHashTable *events;
+	GQueue *all_events;
+	GQueue *all_reqs;
+	struct event_bucket *buckets[256];
+	guint dispatching;
+	GSList *removed;
 	guint next_cmd_id;
 	GDestroyNotify destroy;
 	gpointer destroy_user_data;
 	gboolean stale;
+	unsigned int burst;
+	struct command *pool;
+	unsigned int pool_len;
+	struct command *reserved;
+	struct gattrib_stats stats;
 };
 
 struct command {
@@ -69,6 +106,48 @@ struct command {
 	GAttribResultFunc func;
 	gpointer user_data;
 	GDestroyNotify notify;
+	GAttrib *attrib;
+	gint64 sent_at;
+	unsigned int timeout_watch;
+	GAttribTimeoutFunc timeout_func;
+	gpointer timeout_data;
+	struct flow *flow;
+	struct command *next;
+	guint16 size;
+	guint8 data[0];
+};
+
+/*
+ * A producer of requests, commands and server-initiated PDUs. The flows
+ * of a class share the link by deficit round robin, a turn being worth
+ * weight MTU-sized PDUs; classes are served in priority order, and
+ * responses ahead of all of them.
+ */
+struct flow {
+	guint id;
+	unsigned int prio;
+	unsigned int weight;
+	unsigned int depth;
+	unsigned int deficit;
+	gboolean turn;
+	gboolean full;
+	GQueue queue;
+	GList *link;
+	GAttribFlowFunc func;
+	gpointer user_data;
+	GDestroyNotify notify;
+};
+
+/* g_attrib_send() or g_attrib_cancel() called off the owner thread */
+struct remote_op {
+	GAttrib *attrib;
+	guint id;
+	gboolean head;
+	GAttribResultFunc func;
+	gpointer user_data;
+	GDestroyNotify notify;
+	guint16 len;
+	guint8 pdu[0];
 };
 
 struct event {
@@ -78,6 +157,18 @@ struct event {
 	GAttribNotifyFunc func;
 	gpointer user_data;
 	GDestroyNotify notify;
+	GQueue *queue;
+	GList *link;
+	gboolean removed;
+};
+
+/*
+ * Registrations for one opcode: those for any handle, and per handle
+ * queues. Each queue is kept in registration order.
+ */
+struct event_bucket {
+	GQueue *any;
+	GHashTable *handles;
 };
 
 static guint8 opcode2expected(guint8 opcode)
@@ -104,6 +195,9 @@ static guint8 opcode2expected(guint8 opcode)
 	case ATT_OP_READ_MULTI_REQ:
 		return ATT_OP_READ_MULTI_RESP;
 
+	case ATT_OP_READ_MULTI_VL_REQ:
+		return ATT_OP_READ_MULTI_VL_RESP;
+
 	case ATT_OP_READ_BY_GROUP_REQ:
 		return ATT_OP_READ_BY_GROUP_RESP;
 
@@ -134,6 +228,7 @@ static gboolean is_response(guint8 opcode)
 	case ATT_OP_READ_RESP:
 	case ATT_OP_READ_BLOB_RESP:
 	case ATT_OP_READ_MULTI_RESP:
+	case ATT_OP_READ_MULTI_VL_RESP:
 	case ATT_OP_READ_BY_GROUP_RESP:
 	case ATT_OP_WRITE_RESP:
 	case ATT_OP_PREP_WRITE_RESP:
@@ -159,485 +254,1531 @@ GAttrib *g_attrib_ref(GAttrib *attrib)
 	return attrib;
 }
 
-static void command_destroy(struct command *cmd)
+/*
+ * Commands carry their PDU inline, in a slot sized to the MTU. Released
+ * ones go back to a per-GAttrib free list, so queueing a PDU normally
+ * costs no allocation.
+ */
+static struct command *command_alloc(GAttrib *attrib, size_t len)
 {
-	if (cmd->notify)
-		cmd->notify(cmd->user_data);
+	struct command *cmd = attrib->pool;
+	size_t size = MAX(len, attrib->buflen);
+
+	if (cmd && cmd->size >= len) {
+		attrib->pool = cmd->next;
+		attrib->pool_len--;
+
+		size = cmd->size;
+		memset(cmd, 0, sizeof(*cmd));
+	} else {
+		cmd = g_try_malloc0(sizeof(*cmd) + size);
+		if (cmd == NULL)
+			return NULL;
+	}
+
+	cmd->size = size;
+	cmd->pdu = cmd->data;
+	cmd->attrib = attrib;
 
-	g_free(cmd->pdu);
-	g_free(cmd);
+	return cmd;
 }
 
-static void event_destroy(struct event *evt)
+static void command_free(GAttrib *attrib, struct command *cmd)
 {
-	if (evt->notify)
-		evt->notify(evt->user_data);
+	if (cmd->timeout_watch > 0)
+		timeout_remove(cmd->timeout_watch);
 
-	g_free(evt);
+	if (cmd->size != attrib->buflen ||
+				attrib->pool_len >= COMMAND_POOL_MAX) {
+		g_free(cmd);
+		return;
+	}
+
+	cmd->next = attrib->pool;
+	attrib->pool = cmd;
+	attrib->pool_len++;
 }
 
-static void attrib_destroy(GAttrib *attrib)
+static void command_pool_flush(GAttrib *attrib)
 {
-	GSList *l;
-	struct command *c;
-
-	while ((c = g_queue_pop_head(attrib->requests)))
-		command_destroy(c);
+	struct command *cmd;
 
-	while ((c = g_queue_pop_head(attrib->responses)))
-		command_destroy(c);
+	while ((cmd = attrib->pool)) {
+		attrib->pool = cmd->next;
+		g_free(cmd);
+	}
 
-	g_queue_free(attrib->requests);
-	attrib->requests = NULL;
+	attrib->pool_len = 0;
+}
 
-	g_queue_free(attrib->responses);
-	attrib->responses = NULL;
+static void command_destroy(GAttrib *attrib, struct command *cmd)
+{
+	if (cmd->notify)
+		cmd->notify(cmd->user_data);
 
-	for (l = attrib->events; l; l = l->next)
-		event_destroy(l->data);
+	command_free(attrib, cmd);
+}
 
-	g_slist_free(attrib->events);
-	attrib->events = NULL;
+/* A command without response is done once written, func hears of it */
+static void command_written(GAttrib *attrib, struct command *cmd)
+{
+	if (cmd->func)
+		cmd->func(0, NULL, 0, cmd->user_data);
 
-	if (attrib->timeout_watch > 0)
-		g_source_remove(attrib->timeout_watch);
+	command_destroy(attrib, cmd);
+}
 
-	if (attrib->write_watch > 0)
-		g_source_remove(attrib->write_watch);
+static void stats_sent(GAttrib *attrib, const struct command *cmd)
+{
+	attrib->stats.sent[cmd->opcode]++;
+	attrib->stats.bytes_out += cmd->len;
+}
 
-	if (attrib->read_watch > 0)
-		g_source_remove(attrib->read_watch);
+static void stats_queued(GAttrib *attrib)
+{
+	struct gattrib_stats *stats = &attrib->stats;
 
-	if (attrib->io)
-		g_io_channel_unref(attrib->io);
+	stats->requests_max = MAX(stats->requests_max, attrib->queued);
+	stats->responses_max = MAX(stats->responses_max,
+					g_queue_get_length(attrib->responses));
+}
 
-	g_free(attrib->buf);
+/* Bucket 0 counts answers under 1 ms, bucket i those under 2^i ms */
+static void stats_latency(GAttrib *attrib, gint64 usec)
+{
+	struct gattrib_stats *stats = &attrib->stats;
+	gint64 msec = usec / 1000;
+	unsigned int i = 0;
 
-	if (attrib->destroy)
-		attrib->destroy(attrib->destroy_user_data);
+	while (msec > 0 && i < GATTRIB_LATENCY_BUCKETS - 1) {
+		msec >>= 1;
+		i++;
+	}
 
-	g_free(attrib);
+	stats->latency[i]++;
+	stats->latency_usec += usec;
+	stats->answered++;
 }
 
-void g_attrib_unref(GAttrib *attrib)
+static struct flow *flow_create(GAttrib *attrib, guint id, unsigned int prio,
+				unsigned int weight, unsigned int depth,
+				GAttribFlowFunc func, gpointer user_data,
+				GDestroyNotify notify)
 {
-	int refs;
+	struct flow *flow;
 
-	if (!attrib)
-		return;
+	flow = g_try_new0(struct flow, 1);
+	if (flow == NULL)
+		return NULL;
 
-	refs = __sync_sub_and_fetch(&attrib->refs, 1);
+	flow->id = id;
+	flow->prio = prio;
+	flow->weight = weight;
+	flow->depth = depth;
+	flow->func = func;
+	flow->user_data = user_data;
+	flow->notify = notify;
+	g_queue_init(&flow->queue);
 
-	DBG("%p: ref=%d", attrib, refs);
+	g_hash_table_insert(attrib->flows, GUINT_TO_POINTER(id), flow);
 
-	if (refs > 0)
+	return flow;
+}
+
+static void flow_activate(GAttrib *attrib, struct flow *flow)
+{
+	GQueue *ring = &attrib->active[flow->prio];
+
+	if (flow->link)
 		return;
 
-	attrib_destroy(attrib);
+	g_queue_push_tail(ring, flow);
+	flow->link = g_queue_peek_tail_link(ring);
 }
 
-GIOChannel *g_attrib_get_channel(GAttrib *attrib)
+static void flow_deactivate(GAttrib *attrib, struct flow *flow)
 {
-	if (!attrib)
-		return NULL;
+	if (flow->link == NULL)
+		return;
 
-	return attrib->io;
+	g_queue_delete_link(&attrib->active[flow->prio], flow->link);
+	flow->link = NULL;
+	flow->deficit = 0;
+	flow->turn = FALSE;
 }
 
-gboolean g_attrib_set_destroy_function(GAttrib *attrib,
-		GDestroyNotify destroy, gpointer user_data)
+static void flow_push(GAttrib *attrib, struct flow *flow,
+					struct command *cmd, gboolean head)
 {
-	if (attrib == NULL)
-		return FALSE;
+	if (head)
+		g_queue_push_head(&flow->queue, cmd);
+	else
+		g_queue_push_tail(&flow->queue, cmd);
 
-	attrib->destroy = destroy;
-	attrib->destroy_user_data = user_data;
+	cmd->flow = flow;
+	attrib->queued++;
 
-	return TRUE;
+	flow_activate(attrib, flow);
 }
 
-static gboolean disconnect_timeout(gpointer data)
+static void flow_pop(GAttrib *attrib, struct flow *flow)
 {
-	struct _GAttrib *attrib = data;
-	struct command *c;
+	struct command *cmd = g_queue_pop_head(&flow->queue);
 
-	g_attrib_ref(attrib);
+	attrib->queued--;
+	flow->deficit -= MIN(cmd->len, flow->deficit);
 
-	c = g_queue_pop_head(attrib->requests);
-	if (c == NULL)
-		goto done;
+	if (g_queue_is_empty(&flow->queue))
+		flow_deactivate(attrib, flow);
 
-	if (c->func)
-		c->func(ATT_ECODE_TIMEOUT, NULL, 0, c->user_data);
+	/* A refused producer hears back once the queue is half drained */
+	if (flow->full && g_queue_get_length(&flow->queue) <= flow->depth / 2) {
+		flow->full = FALSE;
+		attrib->ready = g_slist_append(attrib->ready,
+						GUINT_TO_POINTER(flow->id));
+	}
+}
 
-	command_destroy(c);
+/* Puts back a PDU taken by flow_pop() that could not be written */
+static void flow_requeue(GAttrib *attrib, struct command *cmd)
+{
+	struct flow *flow = cmd->flow;
+	GQueue *ring = &attrib->active[flow->prio];
 
-	while ((c = g_queue_pop_head(attrib->requests))) {
-		if (c->func)
-			c->func(ATT_ECODE_ABORTED, NULL, 0, c->user_data);
-		command_destroy(c);
+	g_queue_push_head(&flow->queue, cmd);
+	attrib->queued++;
+	flow->deficit += cmd->len;
+
+	if (flow->link == NULL) {
+		g_queue_push_head(ring, flow);
+		flow->link = g_queue_peek_head_link(ring);
+		flow->turn = TRUE;
 	}
+}
 
-done:
-	attrib->stale = TRUE;
+static void flow_remove_command(GAttrib *attrib, struct command *cmd)
+{
+	struct flow *flow = cmd->flow;
 
-	g_attrib_unref(attrib);
+	g_queue_remove(&flow->queue, cmd);
+	attrib->queued--;
 
-	return FALSE;
+	if (g_queue_is_empty(&flow->queue))
+		flow_deactivate(attrib, flow);
 }
 
-static gboolean can_write_data(GIOChannel *io, GIOCondition cond,
-								gpointer data)
+/* Requests wait while another one is unanswered, other PDUs don't */
+static gboolean flow_blocked(GAttrib *attrib, struct flow *flow)
 {
-	struct _GAttrib *attrib = data;
-	struct command *cmd;
-	GError *gerr = NULL;
-	gsize len;
-	GIOStatus iostat;
-	GQueue *queue;
+	struct command *cmd = g_queue_peek_head(&flow->queue);
 
-	if (attrib->stale)
-		return FALSE;
+	return cmd->expected != 0 && attrib->pending != NULL;
+}
 
-	if (cond & (G_IO_HUP | G_IO_ERR | G_IO_NVAL))
-		return FALSE;
+static struct flow *flow_next(GAttrib *attrib)
+{
+	unsigned int prio, i, n;
 
-	queue = attrib->responses;
-	cmd = g_queue_peek_head(queue);
-	if (cmd == NULL) {
-		queue = attrib->requests;
-		cmd = g_queue_peek_head(queue);
-	}
-	if (cmd == NULL)
-		return FALSE;
+	for (prio = 0; prio < GATTRIB_PRIO_COUNT; prio++) {
+		GQueue *ring = &attrib->active[prio];
 
-	/*
-	 * Verify that we didn't already send this command. This can only
-	 * happen with elementes from attrib->requests.
-	 */
-	if (cmd->sent)
-		return FALSE;
+		n = g_queue_get_length(ring);
 
-	iostat = g_io_channel_write_chars(io, (gchar *) cmd->pdu, cmd->len,
-								&len, &gerr);
-	if (iostat != G_IO_STATUS_NORMAL) {
-		if (gerr) {
-			error("%s", gerr->message);
-			g_error_free(gerr);
-		}
+		for (i = 0; i < n; i++) {
+			struct flow *flow = g_queue_peek_head(ring);
+			struct command *cmd = g_queue_peek_head(&flow->queue);
 
-		return FALSE;
-	}
+			if (!flow_blocked(attrib, flow)) {
+				/* A PDU over the quantum takes a whole turn */
+				if (!flow->turn) {
+					flow->deficit += MAX(cmd->len,
+						flow->weight * attrib->buflen);
+					flow->turn = TRUE;
+				}
 
-	if (cmd->expected == 0) {
-		g_queue_pop_head(queue);
-		command_destroy(cmd);
+				if (cmd->len <= flow->deficit)
+					return flow;
+			}
 
-		return TRUE;
+			flow->turn = FALSE;
+			g_queue_unlink(ring, flow->link);
+			g_queue_push_tail_link(ring, flow->link);
+		}
 	}
 
-	cmd->sent = TRUE;
-
-	if (attrib->timeout_watch == 0)
-		attrib->timeout_watch = g_timeout_add_seconds(GATT_TIMEOUT,
-						disconnect_timeout, attrib);
-
-	return FALSE;
+	return NULL;
 }
 
-static void destroy_sender(gpointer data)
+/* Takes every queued PDU out of the flows, in no particular order */
+static void flows_drain(GAttrib *attrib, GQueue *out)
 {
-	struct _GAttrib *attrib = data;
+	GHashTableIter iter;
+	gpointer value;
 
-	attrib->write_watch = 0;
-	g_attrib_unref(attrib);
+	g_hash_table_iter_init(&iter, attrib->flows);
+
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		struct flow *flow = value;
+		struct command *c;
+
+		while ((c = g_queue_pop_head(&flow->queue))) {
+			c->flow = NULL;
+			g_queue_push_tail(out, c);
+		}
+
+		flow_deactivate(attrib, flow);
+
+		if (flow->full) {
+			flow->full = FALSE;
+			attrib->ready = g_slist_append(attrib->ready,
+						GUINT_TO_POINTER(flow->id));
+		}
+	}
+
+	attrib->queued = 0;
 }
 
-static void wake_up_sender(struct _GAttrib *attrib)
+/* Run once the queues are consistent: callbacks may queue or remove */
+static void flows_ready(GAttrib *attrib)
 {
-	if (attrib->write_watch > 0)
-		return;
+	while (attrib->ready) {
+		guint id = GPOINTER_TO_UINT(attrib->ready->data);
+		struct flow *flow;
 
-	attrib = g_attrib_ref(attrib);
-	attrib->write_watch = g_io_add_watch_full(attrib->io,
-				G_PRIORITY_DEFAULT, G_IO_OUT,
-				can_write_data, attrib, destroy_sender);
+		attrib->ready = g_slist_delete_link(attrib->ready,
+							attrib->ready);
+
+		flow = g_hash_table_lookup(attrib->flows, GUINT_TO_POINTER(id));
+		if (flow && flow->func)
+			flow->func(id, flow->user_data);
+	}
 }
 
-static gboolean match_event(struct event *evt, const uint8_t *pdu, gsize len)
+static void flow_free(GAttrib *attrib, struct flow *flow)
 {
-	guint16 handle;
+	struct command *c;
 
-	if (evt->expected == GATTRIB_ALL_EVENTS)
-		return TRUE;
+	while ((c = g_queue_pop_head(&flow->queue))) {
+		attrib->queued--;
+		command_destroy(attrib, c);
+	}
 
-	if (is_response(pdu[0]) == FALSE && evt->expected == GATTRIB_ALL_REQS)
-		return TRUE;
+	flow_deactivate(attrib, flow);
 
-	if (evt->expected == pdu[0] && evt->handle == GATTRIB_ALL_HANDLES)
-		return TRUE;
+	if (flow->notify)
+		flow->notify(flow->user_data);
 
-	if (len < 3)
-		return FALSE;
+	g_free(flow);
+}
 
-	handle = att_get_u16(&pdu[1]);
+/* Responses first, then the flows by class and share */
+static struct command *command_next(GAttrib *attrib)
+{
+	struct flow *flow;
 
-	if (evt->expected == pdu[0] && evt->handle == handle)
-		return TRUE;
+	if (!g_queue_is_empty(attrib->responses))
+		return g_queue_peek_head(attrib->responses);
 
-	return FALSE;
+	flow = flow_next(attrib);
+	if (flow == NULL)
+		return NULL;
+
+	return g_queue_peek_head(&flow->queue);
 }
 
-static gboolean received_data(GIOChannel *io, GIOCondition cond, gpointer data)
+/* cmd is the one command_next() returned */
+static void command_dequeue(GAttrib *attrib, struct command *cmd)
 {
-	struct _GAttrib *attrib = data;
-	struct command *cmd = NULL;
-	GSList *l;
-	uint8_t buf[512], status;
-	gsize len;
-	GIOStatus iostat;
+	if (cmd->flow)
+		flow_pop(attrib, cmd->flow);
+	else
+		g_queue_pop_head(attrib->responses);
+}
 
-	if (attrib->stale)
-		return FALSE;
+static void command_unqueue(GAttrib *attrib, struct command *cmd)
+{
+	if (cmd->flow)
+		flow_remove_command(attrib, cmd);
+	else
+		g_queue_remove(attrib->responses, cmd);
+}
 
-	if (cond & (G_IO_HUP | G_IO_ERR | G_IO_NVAL)) {
-		attrib->read_watch = 0;
-		return FALSE;
-	}
+static gboolean command_queued(GAttrib *attrib)
+{
+	return attrib->queued > 0 || !g_queue_is_empty(attrib->responses);
+}
 
-	memset(buf, 0, sizeof(buf));
+static gint command_cmp_by_id(gconstpointer a, gconstpointer b)
+{
+	const struct command *cmd = a;
+	guint id = GPOINTER_TO_UINT(b);
 
-	iostat = g_io_channel_read_chars(io, (gchar *) buf, sizeof(buf),
-								&len, NULL);
-	if (iostat != G_IO_STATUS_NORMAL) {
-		status = ATT_ECODE_IO;
-		goto done;
-	}
+	return cmd->id - id;
+}
 
-	for (l = attrib->events; l; l = l->next) {
-		struct event *evt = l->data;
+/* A queued command, or the request awaiting its response */
+static struct command *command_find(GAttrib *attrib, guint id)
+{
+	GHashTableIter iter;
+	gpointer value;
+	GList *l;
 
-		if (match_event(evt, buf, len))
-			evt->func(buf, len, evt->user_data);
-	}
+	if (attrib->pending && attrib->pending->id == id)
+		return attrib->pending;
 
-	if (is_response(buf[0]) == FALSE)
-		return TRUE;
+	g_hash_table_iter_init(&iter, attrib->flows);
 
-	if (attrib->timeout_watch > 0) {
-		g_source_remove(attrib->timeout_watch);
-		attrib->timeout_watch = 0;
-	}
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		struct flow *flow = value;
 
-	cmd = g_queue_pop_head(attrib->requests);
-	if (cmd == NULL) {
-		/* Keep the watch if we have events to report */
-		return attrib->events != NULL;
+		l = g_queue_find_custom(&flow->queue, GUINT_TO_POINTER(id),
+							command_cmp_by_id);
+		if (l)
+			return l->data;
 	}
 
-	if (buf[0] == ATT_OP_ERROR) {
-		status = buf[4];
-		goto done;
-	}
+	l = g_queue_find_custom(attrib->responses, GUINT_TO_POINTER(id),
+							command_cmp_by_id);
 
-	if (cmd->expected != buf[0]) {
-		status = ATT_ECODE_IO;
-		goto done;
-	}
+	return l ? l->data : NULL;
+}
 
-	status = 0;
+static void event_destroy(struct event *evt)
+{
+	if (evt->notify)
+		evt->notify(evt->user_data);
 
-done:
-	if (!g_queue_is_empty(attrib->requests) ||
-					!g_queue_is_empty(attrib->responses))
-		wake_up_sender(attrib);
+	g_free(evt);
+}
 
-	if (cmd) {
-		if (cmd->func)
-			cmd->func(status, buf, len, cmd->user_data);
+static gint event_cmp_id(gconstpointer a, gconstpointer b)
+{
+	const struct event *evt1 = a;
+	const struct event *evt2 = b;
 
-		command_destroy(cmd);
-	}
+	return evt1->id - evt2->id;
+}
 
-	return TRUE;
+/* All registrations of attrib in registration order */
+static GList *events_sorted(GAttrib *attrib)
+{
+	return g_list_sort(g_hash_table_get_values(attrib->events),
+								event_cmp_id);
 }
 
-GAttrib *g_attrib_new(GIOChannel *io)
+static GQueue *event_queue(GAttrib *attrib, guint8 opcode, guint16 handle,
+							gboolean create)
 {
-	struct _GAttrib *attrib;
-	uint16_t imtu;
-	uint16_t att_mtu;
-	uint16_t cid;
-	GError *gerr = NULL;
+	struct event_bucket *bucket;
+	GQueue *queue;
 
-	g_io_channel_set_encoding(io, NULL, NULL);
-	g_io_channel_set_buffered(io, FALSE);
+	if (opcode == GATTRIB_ALL_EVENTS)
+		return attrib->all_events;
 
-	bt_io_get(io, &gerr, BT_IO_OPT_IMTU, &imtu,
-				BT_IO_OPT_CID, &cid, BT_IO_OPT_INVALID);
-	if (gerr) {
-		error("%s", gerr->message);
-		g_error_free(gerr);
-		return NULL;
-	}
+	if (opcode == GATTRIB_ALL_REQS)
+		return attrib->all_reqs;
 
-	attrib = g_try_new0(struct _GAttrib, 1);
-	if (attrib == NULL)
-		return NULL;
+	bucket = attrib->buckets[opcode];
+	if (bucket == NULL) {
+		if (!create)
+			return NULL;
 
-	att_mtu = (cid == ATT_CID) ? ATT_DEFAULT_LE_MTU : imtu;
+		bucket = g_new0(struct event_bucket, 1);
+		bucket->any = g_queue_new();
+		attrib->buckets[opcode] = bucket;
+	}
 
-	attrib->buf = g_malloc0(att_mtu);
-	attrib->buflen = att_mtu;
+	if (handle == GATTRIB_ALL_HANDLES)
+		return bucket->any;
 
-	attrib->io = g_io_channel_ref(io);
-	attrib->requests = g_queue_new();
-	attrib->responses = g_queue_new();
+	if (bucket->handles == NULL) {
+		if (!create)
+			return NULL;
 
-	attrib->read_watch = g_io_add_watch(attrib->io,
-			G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
-			received_data, attrib);
+		bucket->handles = g_hash_table_new_full(g_direct_hash,
+					g_direct_equal, NULL,
+					(GDestroyNotify) g_queue_free);
+	}
 
-	return g_attrib_ref(attrib);
+	queue = g_hash_table_lookup(bucket->handles, GUINT_TO_POINTER(handle));
+	if (queue == NULL && create) {
+		queue = g_queue_new();
+		g_hash_table_insert(bucket->handles, GUINT_TO_POINTER(handle),
+									queue);
+	}
+
+	return queue;
 }
 
-guint g_attrib_send(GAttrib *attrib, guint id, const guint8 *pdu, guint16 len,
-			GAttribResultFunc func, gpointer user_data,
-			GDestroyNotify notify)
+static void event_link(GAttrib *attrib, struct event *evt)
 {
-	struct command *c;
-	GQueue *queue;
-	uint8_t opcode;
+	evt->queue = event_queue(attrib, evt->expected, evt->handle, TRUE);
+	g_queue_push_tail(evt->queue, evt);
+	evt->link = g_queue_peek_tail_link(evt->queue);
 
-	if (attrib->stale)
-		return 0;
+	g_hash_table_insert(attrib->events, GUINT_TO_POINTER(evt->id), evt);
+}
+
+static void event_unlink(GAttrib *attrib, struct event *evt)
+{
+	struct event_bucket *bucket;
+
+	g_queue_delete_link(evt->queue, evt->link);
+
+	if (evt->expected == GATTRIB_ALL_EVENTS ||
+					evt->expected == GATTRIB_ALL_REQS ||
+					evt->handle == GATTRIB_ALL_HANDLES)
+		return;
+
+	bucket = attrib->buckets[evt->expected];
+	if (g_queue_is_empty(evt->queue))
+		g_hash_table_remove(bucket->handles,
+					GUINT_TO_POINTER(evt->handle));
+}
+
+/*
+ * Events unregistered from a notification callback stay linked until
+ * the dispatch loop is done with them.
+ */
+static void event_remove(GAttrib *attrib, struct event *evt)
+{
+	g_hash_table_remove(attrib->events, GUINT_TO_POINTER(evt->id));
+
+	if (evt->notify)
+		evt->notify(evt->user_data);
+
+	if (attrib->dispatching) {
+		evt->removed = TRUE;
+		attrib->removed = g_slist_prepend(attrib->removed, evt);
+		return;
+	}
+
+	event_unlink(attrib, evt);
+	g_free(evt);
+}
+
+static void attrib_destroy(GAttrib *attrib)
+{
+	GHashTableIter iter;
+	gpointer value;
+	GList *events, *l;
+	struct command *c;
+	int i;
+
+	if (attrib->pending)
+		command_destroy(attrib, attrib->pending);
+
+	attrib->pending = NULL;
+
+	g_hash_table_iter_init(&iter, attrib->flows);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		flow_free(attrib, value);
+		g_hash_table_iter_remove(&iter);
+	}
+
+	g_hash_table_destroy(attrib->flows);
+	attrib->flows = NULL;
+
+	g_slist_free(attrib->ready);
+	attrib->ready = NULL;
+
+	while ((c = g_queue_pop_head(attrib->responses)))
+		command_destroy(attrib, c);
+
+	g_queue_free(attrib->responses);
+	attrib->responses = NULL;
+
+	g_free(attrib->reserved);
+	command_pool_flush(attrib);
+
+	events = events_sorted(attrib);
+	for (l = events; l; l = l->next)
+		event_destroy(l->data);
+
+	g_list_free(events);
+	g_hash_table_destroy(attrib->events);
+	attrib->events = NULL;
+
+	g_slist_free_full(attrib->removed, g_free);
+
+	g_queue_free(attrib->all_events);
+	g_queue_free(attrib->all_reqs);
+
+	for (i = 0; i < 256; i++) {
+		struct event_bucket *bucket = attrib->buckets[i];
+
+		if (bucket == NULL)
+			continue;
+
+		g_queue_free(bucket->any);
+		if (bucket->handles)
+			g_hash_table_destroy(bucket->handles);
+		g_free(bucket);
+	}
+
+	if (attrib->timeout_watch > 0)
+		timeout_remove(attrib->timeout_watch);
+
+	io_destroy(attrib->bearer);
+
+	if (attrib->io)
+		g_io_channel_unref(attrib->io);
+
+	g_free(attrib->buf);
+	g_free(attrib->rbuf);
+
+	if (attrib->destroy)
+		attrib->destroy(attrib->destroy_user_data);
+
+	g_main_context_unref(attrib->context);
+	g_thread_unref(attrib->owner);
+	g_free(attrib);
+}
+
+/*
+ * Calls from other threads are marshalled through the owner's context,
+ * which the epoll backend never iterates: it serves a single thread.
+ */
+static gboolean off_owner(GAttrib *attrib, const char *func)
+{
+	if (io_main_context())
+		return TRUE;
+
+	error("%s: %p used off its owner thread", func, attrib);
+
+	return FALSE;
+}
+
+static gboolean owner_destroy(gpointer user_data)
+{
+	attrib_destroy(user_data);
+
+	return FALSE;
+}
+
+void g_attrib_unref(GAttrib *attrib)
+{
+	int refs;
+
+	if (!attrib)
+		return;
+
+	refs = __sync_sub_and_fetch(&attrib->refs, 1);
+
+	DBG("%p: ref=%d", attrib, refs);
+
+	if (refs > 0)
+		return;
+
+	/* The watches and timeouts live in the owner's context */
+	if (attrib->owner != g_thread_self()) {
+		if (!off_owner(attrib, __FUNCTION__))
+			return;
+
+		g_main_context_invoke(attrib->context, owner_destroy, attrib);
+		return;
+	}
+
+	attrib_destroy(attrib);
+}
+
+GIOChannel *g_attrib_get_channel(GAttrib *attrib)
+{
+	if (!attrib)
+		return NULL;
+
+	return attrib->io;
+}
+
+GMainContext *g_attrib_get_context(GAttrib *attrib)
+{
+	if (!attrib)
+		return NULL;
+
+	return attrib->context;
+}
+
+gboolean g_attrib_set_destroy_function(GAttrib *attrib,
+		GDestroyNotify destroy, gpointer user_data)
+{
+	if (attrib == NULL)
+		return FALSE;
+
+	attrib->destroy = destroy;
+	attrib->destroy_user_data = user_data;
+
+	return TRUE;
+}
+
+static bool disconnect_timeout(void *data)
+{
+	struct _GAttrib *attrib = data;
+	struct command *c;
+	GQueue aborted;
+
+	attrib->timeout_watch = 0;
+
+	g_attrib_ref(attrib);
+
+	c = attrib->pending;
+	if (c == NULL)
+		goto done;
+
+	attrib->pending = NULL;
+
+	if (c->func)
+		c->func(ATT_ECODE_TIMEOUT, NULL, 0, c->user_data);
+
+	command_destroy(attrib, c);
+
+	g_queue_init(&aborted);
+	flows_drain(attrib, &aborted);
+
+	while ((c = g_queue_pop_head(&aborted))) {
+		if (c->func)
+			c->func(ATT_ECODE_ABORTED, NULL, 0, c->user_data);
+		command_destroy(attrib, c);
+	}
+
+done:
+	attrib->stale = TRUE;
+
+	g_attrib_unref(attrib);
+
+	return false;
+}
+
+/*
+ * Write Commands, notifications, confirmations and responses don't wait
+ * for anything from the peer, so the ones the scheduler picks in a row
+ * are handed to the socket with a single sendmmsg() call instead of one
+ * write and one main loop iteration each. The socket keeps the PDU
+ * boundaries; the burst ends at the first PDU expecting a response.
+ */
+static int send_burst(struct _GAttrib *attrib, struct io *io)
+{
+	struct mmsghdr msgs[GATTRIB_BURST_MAX];
+	struct iovec iov[GATTRIB_BURST_MAX];
+	struct command *cmds[GATTRIB_BURST_MAX];
+	unsigned int num = 0, i;
+	int sent, err = 0;
+
+	while (num < attrib->burst) {
+		struct command *cmd = command_next(attrib);
+
+		if (cmd == NULL || cmd->expected != 0)
+			break;
+
+		command_dequeue(attrib, cmd);
+		cmds[num++] = cmd;
+	}
+
+	memset(msgs, 0, num * sizeof(msgs[0]));
+
+	for (i = 0; i < num; i++) {
+		iov[i].iov_base = cmds[i]->pdu;
+		iov[i].iov_len = cmds[i]->len;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	sent = sendmmsg(io_get_fd(io), msgs, num,
+						MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (sent < 0) {
+		err = errno;
+		sent = 0;
+	}
+
+	/*
+	 * Put back what didn't go out, last first, before running the
+	 * destroy callbacks: they may queue new PDUs.
+	 */
+	for (i = num; i > (unsigned int) sent; i--) {
+		if (cmds[i - 1]->flow)
+			flow_requeue(attrib, cmds[i - 1]);
+		else
+			g_queue_push_head(attrib->responses, cmds[i - 1]);
+	}
+
+	if (err != 0 && err != EAGAIN && err != EINTR)
+		return -err;
+
+	for (i = 0; i < (unsigned int) sent; i++) {
+		stats_sent(attrib, cmds[i]);
+
+		if (capture_enabled())
+			capture_att(io_get_fd(io), true, cmds[i]->pdu,
+								cmds[i]->len);
+	}
+
+	for (i = 0; i < (unsigned int) sent; i++)
+		command_written(attrib, cmds[i]);
+
+	flows_ready(attrib);
+
+	return 0;
+}
+
+static bool can_write_data(struct io *io, void *user_data)
+{
+	struct _GAttrib *attrib = user_data;
+	struct command *cmd;
+	int err;
+
+	if (attrib->stale)
+		return false;
+
+	/* Nothing, or only requests waiting for the one in flight */
+	cmd = command_next(attrib);
+	if (cmd == NULL)
+		return false;
+
+	if (cmd->expected == 0 && attrib->burst > 1) {
+		err = send_burst(attrib, io);
+		if (err == 0)
+			return true;
+
+		if (err != -ENOTSOCK && err != -ENOSYS && err != -EOPNOTSUPP) {
+			error("sendmmsg: %s (%d)", strerror(-err), -err);
+			return false;
+		}
+
+		/* Not a socket sendmmsg() can write to: one PDU at a time */
+		attrib->burst = 1;
+	}
+
+	if (write(io_get_fd(io), cmd->pdu, cmd->len) < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return true;
+
+		error("write: %s (%d)", strerror(errno), errno);
+
+		return false;
+	}
+
+	command_dequeue(attrib, cmd);
+	stats_sent(attrib, cmd);
+
+	if (capture_enabled())
+		capture_att(io_get_fd(io), true, cmd->pdu, cmd->len);
+
+	if (cmd->expected == 0) {
+		command_written(attrib, cmd);
+		flows_ready(attrib);
+
+		return true;
+	}
+
+	/* Commands of other flows may still go out meanwhile */
+	cmd->flow = NULL;
+	cmd->sent = TRUE;
+	cmd->sent_at = g_get_monotonic_time();
+	attrib->pending = cmd;
+
+	if (attrib->timeout_watch == 0)
+		attrib->timeout_watch = timeout_add(GATT_TIMEOUT * 1000,
+						disconnect_timeout, attrib, NULL);
+
+	flows_ready(attrib);
+
+	return true;
+}
+
+static void destroy_sender(void *data)
+{
+	struct _GAttrib *attrib = data;
+
+	attrib->writing = FALSE;
+	g_attrib_unref(attrib);
+}
+
+static void wake_up_sender(struct _GAttrib *attrib)
+{
+	if (attrib->writing)
+		return;
+
+	attrib = g_attrib_ref(attrib);
+	attrib->writing = TRUE;
+
+	if (!io_set_write_handler(attrib->bearer, can_write_data, attrib,
+							destroy_sender)) {
+		attrib->writing = FALSE;
+		g_attrib_unref(attrib);
+	}
+}
+
+/*
+ * Deliver pdu to the registrations it matches: the wildcard queues, the
+ * opcode's any-handle queue and its queue for the PDU handle. Callbacks
+ * run in registration order, as if all queues were a single list.
+ */
+static void dispatch_event(GAttrib *attrib, const uint8_t *pdu, gsize len)
+{
+	struct event_bucket *bucket;
+	GList *heads[4];
+	GQueue *queue;
+	int i, num = 0;
+
+	heads[num++] = g_queue_peek_head_link(attrib->all_events);
+
+	if (is_response(pdu[0]) == FALSE)
+		heads[num++] = g_queue_peek_head_link(attrib->all_reqs);
+
+	bucket = attrib->buckets[pdu[0]];
+	if (bucket) {
+		heads[num++] = g_queue_peek_head_link(bucket->any);
+
+		if (len >= 3 && bucket->handles) {
+			queue = g_hash_table_lookup(bucket->handles,
+				GUINT_TO_POINTER(att_get_u16(&pdu[1])));
+			if (queue)
+				heads[num++] = g_queue_peek_head_link(queue);
+		}
+	}
+
+	attrib->dispatching++;
+
+	while (TRUE) {
+		struct event *evt = NULL;
+		int next = 0;
+
+		for (i = 0; i < num; i++) {
+			struct event *e;
+
+			if (heads[i] == NULL)
+				continue;
+
+			e = heads[i]->data;
+			if (evt == NULL || e->id < evt->id) {
+				evt = e;
+				next = i;
+			}
+		}
+
+		if (evt == NULL)
+			break;
+
+		heads[next] = heads[next]->next;
+
+		if (!evt->removed)
+			evt->func(pdu, len, evt->user_data);
+	}
+
+	if (--attrib->dispatching > 0)
+		return;
+
+	while (attrib->removed) {
+		struct event *evt = attrib->removed->data;
+
+		attrib->removed = g_slist_delete_link(attrib->removed,
+							attrib->removed);
+		event_unlink(attrib, evt);
+		g_free(evt);
+	}
+}
+
+static gboolean received_pdu(GAttrib *attrib, const uint8_t *buf, gsize len)
+{
+	struct command *cmd;
+	uint8_t status;
+
+	if (capture_enabled())
+		capture_att(io_get_fd(attrib->bearer), false, buf, len);
+
+	dispatch_event(attrib, buf, len);
+
+	if (is_response(buf[0]) == FALSE)
+		return TRUE;
+
+	if (attrib->timeout_watch > 0) {
+		timeout_remove(attrib->timeout_watch);
+		attrib->timeout_watch = 0;
+	}
+
+	cmd = attrib->pending;
+	if (cmd == NULL) {
+		/* Keep the watch if we have events to report */
+		return g_hash_table_size(attrib->events) > 0;
+	}
+
+	attrib->pending = NULL;
+
+	if (cmd->sent_at)
+		stats_latency(attrib, g_get_monotonic_time() - cmd->sent_at);
+
+	if (buf[0] == ATT_OP_ERROR)
+		status = len > 4 ? buf[4] : ATT_ECODE_IO;
+	else if (cmd->expected != buf[0])
+		status = ATT_ECODE_IO;
+	else
+		status = 0;
+
+	if (command_queued(attrib))
+		wake_up_sender(attrib);
+
+	if (cmd->func)
+		cmd->func(status, buf, len, cmd->user_data);
+
+	command_destroy(attrib, cmd);
+
+	return TRUE;
+}
+
+/*
+ * PDUs are read straight from the socket into GATTRIB_RECV_BATCH slots
+ * of rmtu bytes each, up to a whole batch per recvmmsg() call. A larger
+ * MTU set while PDUs of a batch are being handled takes effect on the
+ * next wakeup, so the slots never move under the callbacks.
+ */
+static int receive_batch(GAttrib *attrib, int fd, struct iovec *iov)
+{
+	struct mmsghdr msgs[GATTRIB_RECV_BATCH];
+	ssize_t len;
+	int i, num;
+
+	if (attrib->rmtu_next > attrib->rmtu) {
+		attrib->rbuf = g_realloc(attrib->rbuf,
+				GATTRIB_RECV_BATCH * attrib->rmtu_next);
+		attrib->rmtu = attrib->rmtu_next;
+	}
+
+	memset(msgs, 0, sizeof(msgs));
+
+	for (i = 0; i < GATTRIB_RECV_BATCH; i++) {
+		iov[i].iov_base = attrib->rbuf + i * attrib->rmtu;
+		iov[i].iov_len = attrib->rmtu;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	num = recvmmsg(fd, msgs, GATTRIB_RECV_BATCH, MSG_DONTWAIT, NULL);
+	if (num >= 0) {
+		for (i = 0; i < num; i++)
+			iov[i].iov_len = msgs[i].msg_len;
+
+		return num;
+	}
+
+	if (errno != ENOTSOCK && errno != ENOSYS)
+		return -errno;
+
+	/* Not a socket recvmmsg() can read from: one PDU at a time */
+	len = read(fd, iov[0].iov_base, iov[0].iov_len);
+	if (len < 0)
+		return -errno;
+
+	iov[0].iov_len = len;
+
+	return 1;
+}
+
+static bool received_data(struct io *io, void *user_data)
+{
+	struct _GAttrib *attrib = user_data;
+	struct iovec iov[GATTRIB_RECV_BATCH];
+	gboolean keep = TRUE;
+	int i, num;
+
+	if (attrib->stale)
+		return false;
+
+	num = receive_batch(attrib, io_get_fd(io), iov);
+	if (num < 0) {
+		if (num != -EAGAIN && num != -EINTR)
+			error("recv: %s (%d)", strerror(-num), -num);
+
+		if (command_queued(attrib))
+			wake_up_sender(attrib);
+
+		return true;
+	}
+
+	g_attrib_ref(attrib);
+
+	for (i = 0; i < num && keep && !attrib->stale; i++) {
+		/* Empty PDUs carry no opcode */
+		if (iov[i].iov_len == 0)
+			continue;
+
+		attrib->stats.received[((uint8_t *) iov[i].iov_base)[0]]++;
+		attrib->stats.bytes_in += iov[i].iov_len;
+
+		keep = received_pdu(attrib, iov[i].iov_base, iov[i].iov_len);
+	}
+
+	g_attrib_unref(attrib);
+
+	return keep;
+}
+
+GAttrib *g_attrib_new(GIOChannel *io)
+{
+	struct _GAttrib *attrib;
+	uint16_t imtu;
+	uint16_t att_mtu;
+	uint16_t cid;
+	GError *gerr = NULL;
+	int i;
+
+	g_io_channel_set_encoding(io, NULL, NULL);
+	g_io_channel_set_buffered(io, FALSE);
 
-	c = g_try_new0(struct command, 1);
-	if (c == NULL)
-		return 0;
+	bt_io_get(io, &gerr, BT_IO_OPT_IMTU, &imtu,
+				BT_IO_OPT_CID, &cid, BT_IO_OPT_INVALID);
+	if (gerr) {
+		error("%s", gerr->message);
+		g_error_free(gerr);
+		return NULL;
+	}
+
+	attrib = g_try_new0(struct _GAttrib, 1);
+	if (attrib == NULL)
+		return NULL;
+
+	att_mtu = (cid == ATT_CID) ? ATT_DEFAULT_LE_MTU : imtu;
+
+	attrib->buf = g_malloc0(att_mtu);
+	attrib->buflen = att_mtu;
+
+	/* Incoming PDUs are bounded by the channel MTU, not the ATT one */
+	attrib->rmtu = MAX(imtu, att_mtu);
+	attrib->rbuf = g_malloc(GATTRIB_RECV_BATCH * attrib->rmtu);
+
+	attrib->burst = GATTRIB_BURST_DEFAULT;
+
+	/*
+	 * The bearer is served by the thread creating it, from its
+	 * thread-default context; see g_attrib_get_context().
+	 */
+	attrib->context = g_main_context_ref_thread_default();
+	attrib->owner = g_thread_ref(g_thread_self());
+
+	attrib->io = g_io_channel_ref(io);
+	attrib->responses = g_queue_new();
+
+	for (i = 0; i < GATTRIB_PRIO_COUNT; i++)
+		g_queue_init(&attrib->active[i]);
+
+	attrib->flows = g_hash_table_new(g_direct_hash, g_direct_equal);
+	attrib->default_flow = flow_create(attrib, 0, GATTRIB_PRIO_DEFAULT, 1,
+							0, NULL, NULL, NULL);
+	attrib->events = g_hash_table_new(g_direct_hash, g_direct_equal);
+	attrib->all_events = g_queue_new();
+	attrib->all_reqs = g_queue_new();
+
+	attrib->bearer = io_new(g_io_channel_unix_get_fd(io));
+	io_set_read_handler(attrib->bearer, received_data, attrib, NULL);
+
+	return g_attrib_ref(attrib);
+}
 
-	opcode = pdu[0];
+static guint command_queue(GAttrib *attrib, struct command *c,
+					struct flow *flow, guint id,
+					GAttribResultFunc func,
+					gpointer user_data, GDestroyNotify notify)
+{
+	uint8_t opcode;
+
+	opcode = c->pdu[0];
 
 	c->opcode = opcode;
 	c->expected = opcode2expected(opcode);
-	c->pdu = g_malloc(len);
-	memcpy(c->pdu, pdu, len);
-	c->len = len;
 	c->func = func;
 	c->user_data = user_data;
 	c->notify = notify;
 
+	if (id)
+		c->id = id;
+	else if (c->id == 0)
+		c->id = __sync_add_and_fetch(&attrib->next_cmd_id, 1);
+
+	/* Don't re-order responses even if an ID is given */
 	if (is_response(opcode))
-		queue = attrib->responses;
+		g_queue_push_tail(attrib->responses, c);
 	else
-		queue = attrib->requests;
-
-	if (id) {
-		c->id = id;
-		if (!is_response(opcode))
-			g_queue_push_head(queue, c);
-		else
-			/* Don't re-order responses even if an ID is given */
-			g_queue_push_tail(queue, c);
-	} else {
-		c->id = ++attrib->next_cmd_id;
-		g_queue_push_tail(queue, c);
-	}
+		flow_push(attrib, flow, c, id != 0);
 
 	/*
-	 * If a command was added to the queue and it was empty before, wake up
-	 * the sender. If the sender was already woken up by the second queue,
-	 * wake_up_sender will just return.
+	 * Any new PDU may be sendable: a command can go out while a request
+	 * is in flight. If the sender is already awake this just returns.
 	 */
-	if (g_queue_get_length(queue) == 1)
-		wake_up_sender(attrib);
+	wake_up_sender(attrib);
+
+	stats_queued(attrib);
 
 	return c->id;
 }
 
-static gint command_cmp_by_id(gconstpointer a, gconstpointer b)
+static void remote_op_free(gpointer data)
 {
-	const struct command *cmd = a;
-	guint id = GPOINTER_TO_UINT(b);
+	struct remote_op *op = data;
 
-	return cmd->id - id;
+	g_attrib_unref(op->attrib);
+	g_free(op);
+}
+
+static gboolean remote_send(gpointer data)
+{
+	struct remote_op *op = data;
+	GAttrib *attrib = op->attrib;
+	struct command *c;
+
+	c = attrib->stale ? NULL : command_alloc(attrib, op->len);
+	if (c == NULL) {
+		if (op->notify)
+			op->notify(op->user_data);
+		return FALSE;
+	}
+
+	memcpy(c->pdu, op->pdu, op->len);
+	c->len = op->len;
+	c->id = op->id;
+
+	command_queue(attrib, c, attrib->default_flow, op->head ? op->id : 0,
+				op->func, op->user_data, op->notify);
+
+	return FALSE;
+}
+
+/*
+ * The PDU is copied and queued from the owner's context. The id is taken
+ * right away so that it can be cancelled; the callbacks run on the owner.
+ */
+static guint send_remote(GAttrib *attrib, guint id, const guint8 *pdu,
+				guint16 len, GAttribResultFunc func,
+				gpointer user_data, GDestroyNotify notify)
+{
+	struct remote_op *op;
+
+	op = g_try_malloc0(sizeof(*op) + len);
+	if (op == NULL)
+		return 0;
+
+	op->attrib = g_attrib_ref(attrib);
+	op->head = id != 0;
+	op->id = id ? id : __sync_add_and_fetch(&attrib->next_cmd_id, 1);
+	op->func = func;
+	op->user_data = user_data;
+	op->notify = notify;
+	op->len = len;
+	memcpy(op->pdu, pdu, len);
+
+	id = op->id;
+
+	g_main_context_invoke_full(attrib->context, G_PRIORITY_DEFAULT,
+					remote_send, op, remote_op_free);
+
+	return id;
+}
+
+guint g_attrib_send(GAttrib *attrib, guint id, const guint8 *pdu, guint16 len,
+			GAttribResultFunc func, gpointer user_data,
+			GDestroyNotify notify)
+{
+	struct command *c;
+
+	if (attrib->stale)
+		return 0;
+
+	if (attrib->owner != g_thread_self()) {
+		if (!off_owner(attrib, __FUNCTION__))
+			return 0;
+
+		return send_remote(attrib, id, pdu, len, func, user_data,
+								notify);
+	}
+
+	c = command_alloc(attrib, len);
+	if (c == NULL)
+		return 0;
+
+	memcpy(c->pdu, pdu, len);
+	c->len = len;
+
+	return command_queue(attrib, c, attrib->default_flow, id, func,
+							user_data, notify);
+}
+
+/*
+ * Hands out the slot the next command will be sent from, so callers can
+ * encode the PDU in place and queue it with g_attrib_commit() without a
+ * copy. The slot stays reserved until committed, or re-sized by the next
+ * call once the MTU has changed.
+ */
+uint8_t *g_attrib_reserve(GAttrib *attrib, size_t *len)
+{
+	if (attrib->stale || len == NULL)
+		return NULL;
+
+	if (attrib->reserved && attrib->reserved->size != attrib->buflen) {
+		command_free(attrib, attrib->reserved);
+		attrib->reserved = NULL;
+	}
+
+	if (attrib->reserved == NULL) {
+		attrib->reserved = command_alloc(attrib, attrib->buflen);
+		if (attrib->reserved == NULL)
+			return NULL;
+	}
+
+	*len = attrib->reserved->size;
+
+	return attrib->reserved->pdu;
+}
+
+guint g_attrib_commit(GAttrib *attrib, guint id, guint16 len,
+			GAttribResultFunc func, gpointer user_data,
+			GDestroyNotify notify)
+{
+	struct command *c = attrib->reserved;
+
+	if (c == NULL || len == 0 || len > c->size)
+		return 0;
+
+	attrib->reserved = NULL;
+
+	if (attrib->stale) {
+		command_free(attrib, c);
+		return 0;
+	}
+
+	c->len = len;
+
+	return command_queue(attrib, c, attrib->default_flow, id, func,
+							user_data, notify);
+}
+
+guint g_attrib_flow_new(GAttrib *attrib, enum gattrib_priority prio,
+				unsigned int weight, unsigned int depth,
+				GAttribFlowFunc func, gpointer user_data,
+				GDestroyNotify notify)
+{
+	struct flow *flow;
+
+	if (attrib == NULL || prio >= GATTRIB_PRIO_COUNT || weight == 0)
+		return 0;
+
+	flow = flow_create(attrib, ++attrib->next_flow_id, prio, weight,
+					depth, func, user_data, notify);
+	if (flow == NULL)
+		return 0;
+
+	return flow->id;
+}
+
+gboolean g_attrib_flow_remove(GAttrib *attrib, guint flow)
+{
+	struct flow *f;
+
+	/* The default flow goes with the GAttrib */
+	if (attrib == NULL || attrib->flows == NULL || flow == 0)
+		return FALSE;
+
+	f = g_hash_table_lookup(attrib->flows, GUINT_TO_POINTER(flow));
+	if (f == NULL)
+		return FALSE;
+
+	g_hash_table_remove(attrib->flows, GUINT_TO_POINTER(flow));
+	flow_free(attrib, f);
+
+	return TRUE;
+}
+
+/* NULL when full, and the producer is then owed a ready callback */
+static struct flow *flow_accept(GAttrib *attrib, guint id)
+{
+	struct flow *flow;
+
+	if (attrib->stale)
+		return NULL;
+
+	flow = g_hash_table_lookup(attrib->flows, GUINT_TO_POINTER(id));
+	if (flow == NULL)
+		return NULL;
+
+	if (flow->depth && g_queue_get_length(&flow->queue) >= flow->depth) {
+		flow->full = TRUE;
+		attrib->stats.refused++;
+		return NULL;
+	}
+
+	return flow;
+}
+
+guint g_attrib_send_flow(GAttrib *attrib, guint flow, const guint8 *pdu,
+				guint16 len, GAttribResultFunc func,
+				gpointer user_data, GDestroyNotify notify)
+{
+	struct flow *f;
+	struct command *c;
+
+	f = flow_accept(attrib, flow);
+	if (f == NULL)
+		return 0;
+
+	c = command_alloc(attrib, len);
+	if (c == NULL)
+		return 0;
+
+	memcpy(c->pdu, pdu, len);
+	c->len = len;
+
+	return command_queue(attrib, c, f, 0, func, user_data, notify);
+}
+
+/* A refused commit keeps the slot reserved for a later attempt */
+guint g_attrib_commit_flow(GAttrib *attrib, guint flow, guint16 len,
+				GAttribResultFunc func, gpointer user_data,
+				GDestroyNotify notify)
+{
+	struct command *c = attrib->reserved;
+	struct flow *f;
+
+	if (c == NULL || len == 0 || len > c->size)
+		return 0;
+
+	f = flow_accept(attrib, flow);
+	if (f == NULL)
+		return 0;
+
+	attrib->reserved = NULL;
+	c->len = len;
+
+	return command_queue(attrib, c, f, 0, func, user_data, notify);
+}
+
+static gboolean remote_cancel(gpointer data)
+{
+	struct remote_op *op = data;
+
+	g_attrib_cancel(op->attrib, op->id);
+
+	return FALSE;
 }
 
 gboolean g_attrib_cancel(GAttrib *attrib, guint id)
 {
-	GList *l = NULL;
 	struct command *cmd;
-	GQueue *queue;
 
 	if (attrib == NULL)
 		return FALSE;
 
-	queue = attrib->requests;
-	if (queue)
-		l = g_queue_find_custom(queue, GUINT_TO_POINTER(id),
-					command_cmp_by_id);
-	if (l == NULL) {
-		queue = attrib->responses;
-		if (!queue)
+	if (attrib->owner != g_thread_self()) {
+		struct remote_op *op;
+
+		if (!off_owner(attrib, __FUNCTION__))
 			return FALSE;
-		l = g_queue_find_custom(queue, GUINT_TO_POINTER(id),
-					command_cmp_by_id);
+
+		op = g_new0(struct remote_op, 1);
+
+		op->attrib = g_attrib_ref(attrib);
+		op->id = id;
+
+		g_main_context_invoke_full(attrib->context, G_PRIORITY_DEFAULT,
+					remote_cancel, op, remote_op_free);
+
+		return TRUE;
 	}
 
-	if (l == NULL)
+	if (attrib->flows == NULL)
 		return FALSE;
 
-	cmd = l->data;
+	cmd = command_find(attrib, id);
+	if (cmd == NULL)
+		return FALSE;
 
-	if (cmd == g_queue_peek_head(queue) && cmd->sent)
+	if (cmd->sent)
 		cmd->func = NULL;
 	else {
-		g_queue_remove(queue, cmd);
-		command_destroy(cmd);
+		command_unqueue(attrib, cmd);
+		command_destroy(attrib, cmd);
 	}
 
 	return TRUE;
 }
 
-static gboolean cancel_all_per_queue(GQueue *queue)
+/*
+ * A request past its deadline completes with ATT_ECODE_TIMEOUT. One
+ * still queued is dropped; one already sent keeps its place, as for
+ * g_attrib_cancel(), so the late response is swallowed. The bearer only
+ * goes down on GATT_TIMEOUT.
+ */
+static bool command_timeout(void *data)
+{
+	struct command *cmd = data;
+	GAttrib *attrib = cmd->attrib;
+	GAttribResultFunc func = cmd->func;
+
+	cmd->timeout_watch = 0;
+	cmd->func = NULL;
+
+	attrib->stats.timeouts++;
+
+	g_attrib_ref(attrib);
+
+	if (!cmd->sent)
+		command_unqueue(attrib, cmd);
+
+	if (cmd->timeout_func)
+		cmd->timeout_func(cmd->id, cmd->timeout_data);
+
+	if (func)
+		func(ATT_ECODE_TIMEOUT, NULL, 0, cmd->user_data);
+
+	if (!cmd->sent)
+		command_destroy(attrib, cmd);
+
+	g_attrib_unref(attrib);
+
+	return false;
+}
+
+gboolean g_attrib_set_timeout(GAttrib *attrib, guint id, unsigned int msec,
+				GAttribTimeoutFunc func, gpointer user_data)
 {
-	struct command *c, *head = NULL;
-	gboolean first = TRUE;
+	struct command *cmd;
 
-	if (queue == NULL)
+	if (attrib == NULL || msec == 0)
 		return FALSE;
 
-	while ((c = g_queue_pop_head(queue))) {
-		if (first && c->sent) {
-			/* If the command was sent ignore its callback ... */
-			c->func = NULL;
-			head = c;
-			continue;
-		}
+	cmd = command_find(attrib, id);
+	if (cmd == NULL)
+		return FALSE;
 
-		first = FALSE;
-		command_destroy(c);
-	}
+	if (cmd->timeout_watch > 0)
+		timeout_remove(cmd->timeout_watch);
 
-	if (head) {
-		/* ... and put it back in the queue */
-		g_queue_push_head(queue, head);
-	}
+	cmd->timeout_func = func;
+	cmd->timeout_data = user_data;
+	cmd->timeout_watch = timeout_add(msec, command_timeout, cmd, NULL);
 
 	return TRUE;
 }
 
 gboolean g_attrib_cancel_all(GAttrib *attrib)
 {
-	gboolean ret;
+	struct command *c;
+	GQueue cancelled;
 
-	if (attrib == NULL)
+	if (attrib == NULL || attrib->flows == NULL)
 		return FALSE;
 
-	ret = cancel_all_per_queue(attrib->requests);
-	ret = cancel_all_per_queue(attrib->responses) && ret;
+	/* The request in flight keeps its slot, its callback is dropped */
+	if (attrib->pending)
+		attrib->pending->func = NULL;
+
+	g_queue_init(&cancelled);
+	flows_drain(attrib, &cancelled);
+
+	while ((c = g_queue_pop_head(&cancelled)))
+		command_destroy(attrib, c);
 
-	return ret;
+	while ((c = g_queue_pop_head(attrib->responses)))
+		command_destroy(attrib, c);
+
+	flows_ready(attrib);
+
+	return TRUE;
 }
 
 gboolean g_attrib_set_debug(GAttrib *attrib,
@@ -664,6 +1805,36 @@ gboolean g_attrib_set_mtu(GAttrib *attrib, int mtu)
 	attrib->buf = g_realloc(attrib->buf, mtu);
 
 	attrib->buflen = mtu;
+	attrib->rmtu_next = mtu;
+
+	/* Pooled slots are sized to the old MTU */
+	command_pool_flush(attrib);
+
+	return TRUE;
+}
+
+const struct gattrib_stats *g_attrib_get_stats(GAttrib *attrib)
+{
+	if (attrib == NULL)
+		return NULL;
+
+	return &attrib->stats;
+}
+
+void g_attrib_reset_stats(GAttrib *attrib)
+{
+	if (attrib == NULL)
+		return;
+
+	memset(&attrib->stats, 0, sizeof(attrib->stats));
+}
+
+gboolean g_attrib_set_burst(GAttrib *attrib, unsigned int budget)
+{
+	if (attrib == NULL || budget == 0)
+		return FALSE;
+
+	attrib->burst = MIN(budget, GATTRIB_BURST_MAX);
 
 	return TRUE;
 }
@@ -672,6 +1843,7 @@ guint g_attrib_register(GAttrib *attrib, guint8 opcode, guint16 handle,
 				GAttribNotifyFunc func, gpointer user_data,
 				GDestroyNotify notify)
 {
+	/* Unique over all bearers, whatever thread serves them */
 	static guint next_evt_id = 0;
 	struct event *event;
 
@@ -684,21 +1856,13 @@ guint g_attrib_register(GAttrib *attrib, guint8 opcode, guint16 handle,
 	event->func = func;
 	event->user_data = user_data;
 	event->notify = notify;
-	event->id = ++next_evt_id;
+	event->id = __sync_add_and_fetch(&next_evt_id, 1);
 
-	attrib->events = g_slist_append(attrib->events, event);
+	event_link(attrib, event);
 
 	return event->id;
 }
 
-static gint event_cmp_by_id(gconstpointer a, gconstpointer b)
-{
-	const struct event *evt = a;
-	guint id = GPOINTER_TO_UINT(b);
-
-	return evt->id - id;
-}
-
 gboolean g_attrib_is_encrypted(GAttrib *attrib)
 {
 	BtIOSecLevel sec_level;
@@ -714,48 +1878,33 @@ gboolean g_attrib_is_encrypted(GAttrib *attrib)
 gboolean g_attrib_unregister(GAttrib *attrib, guint id)
 {
 	struct event *evt;
-	GSList *l;
 
 	if (id == 0) {
 		warn("%s: invalid id", __FUNCTION__);
 		return FALSE;
 	}
 
-	l = g_slist_find_custom(attrib->events, GUINT_TO_POINTER(id),
-							event_cmp_by_id);
-	if (l == NULL)
+	evt = g_hash_table_lookup(attrib->events, GUINT_TO_POINTER(id));
+	if (evt == NULL)
 		return FALSE;
 
-	evt = l->data;
-
-	attrib->events = g_slist_remove(attrib->events, evt);
-
-	if (evt->notify)
-		evt->notify(evt->user_data);
-
-	g_free(evt);
+	event_remove(attrib, evt);
 
 	return TRUE;
 }
 
 gboolean g_attrib_unregister_all(GAttrib *attrib)
 {
-	GSList *l;
+	GList *events, *l;
 
-	if (attrib->events == NULL)
+	if (g_hash_table_size(attrib->events) == 0)
 		return FALSE;
 
-	for (l = attrib->events; l; l = l->next) {
-		struct event *evt = l->data;
-
-		if (evt->notify)
-			evt->notify(evt->user_data);
+	events = events_sorted(attrib);
+	for (l = events; l; l = l->next)
+		event_remove(attrib, l->data);
 
-		g_free(evt);
-	}
-
-	g_slist_free(attrib->events);
-	attrib->events = NULL;
+	g_list_free(events);
 
 	return TRUE;
 }
@@ -32,15 +32,42 @@ extern "C" {
 #define GATTRIB_ALL_REQS 0xFE
 #define GATTRIB_ALL_HANDLES 0x0000
 
+#define GATTRIB_LATENCY_BUCKETS 16
+
 struct _GAttrib;
 typedef struct _GAttrib GAttrib;
 
+/* Classes of queued PDUs, served in this order after responses */
+enum gattrib_priority {
+	GATTRIB_PRIO_INTERACTIVE,
+	GATTRIB_PRIO_DEFAULT,
+	GATTRIB_PRIO_BULK,
+	GATTRIB_PRIO_COUNT
+};
+
+struct gattrib_stats {
+	uint64_t sent[256];		/* PDUs written, by opcode */
+	uint64_t received[256];		/* PDUs read, by opcode */
+	uint64_t bytes_out;
+	uint64_t bytes_in;
+	unsigned int requests_max;	/* Queue depth high-water marks */
+	unsigned int responses_max;
+	uint64_t refused;		/* Sends turned away by a full flow */
+	uint64_t timeouts;
+	uint64_t answered;		/* Requests with a response */
+	uint64_t latency_usec;		/* Sum over answered requests */
+	/* Bucket 0: under 1 ms, bucket i: [2^(i-1), 2^i) ms, last: above */
+	uint64_t latency[GATTRIB_LATENCY_BUCKETS];
+};
+
 typedef void (*GAttribResultFunc) (guint8 status, const guint8 *pdu,
 					guint16 len, gpointer user_data);
 typedef void (*GAttribDisconnectFunc)(gpointer user_data);
 typedef void (*GAttribDebugFunc)(const char *str, gpointer user_data);
 typedef void (*GAttribNotifyFunc)(const guint8 *pdu, guint16 len,
 							gpointer user_data);
+typedef void (*GAttribTimeoutFunc)(guint id, gpointer user_data);
+typedef void (*GAttribFlowFunc)(guint flow, gpointer user_data);
 
 GAttrib *g_attrib_new(GIOChannel *io);
 GAttrib *g_attrib_ref(GAttrib *attrib);
@@ -48,6 +75,17 @@ void g_attrib_unref(GAttrib *attrib);
 
 GIOChannel *g_attrib_get_channel(GAttrib *attrib);
 
+/*
+ * A GAttrib belongs to the thread that created it and is dispatched from
+ * that thread's default context. g_attrib_send(), g_attrib_cancel(),
+ * g_attrib_ref() and g_attrib_unref() may be called from any thread, the
+ * rest only from the owner; callbacks always run on the owner. On the
+ * epoll backend nothing iterates the context, so a GAttrib is then single
+ * threaded: those calls fail off the owner, and a last reference dropped
+ * there leaks the bearer.
+ */
+GMainContext *g_attrib_get_context(GAttrib *attrib);
+
 gboolean g_attrib_set_destroy_function(GAttrib *attrib,
 		GDestroyNotify destroy, gpointer user_data);
 
@@ -55,9 +93,42 @@ guint g_attrib_send(GAttrib *attrib, guint id, const guint8 *pdu, guint16 len,
 			GAttribResultFunc func, gpointer user_data,
 			GDestroyNotify notify);
 
+uint8_t *g_attrib_reserve(GAttrib *attrib, size_t *len);
+guint g_attrib_commit(GAttrib *attrib, guint id, guint16 len,
+			GAttribResultFunc func, gpointer user_data,
+			GDestroyNotify notify);
+
+/*
+ * Requests, commands and server-initiated PDUs are queued per flow, and
+ * g_attrib_send() and g_attrib_commit() use flow 0, of the default class.
+ * A class is only served while the ones above it have nothing to send;
+ * within a class flows share the link in proportion to their weight. A
+ * flow created with a depth holds at most that many PDUs: sends past it
+ * return 0, and func is called once the queue is down to half of it.
+ *
+ * The func of a PDU without response is called with status 0 once it is
+ * written out. One that is dropped unsent is only destroyed, or told
+ * ATT_ECODE_ABORTED when the bearer times out.
+ */
+guint g_attrib_flow_new(GAttrib *attrib, enum gattrib_priority prio,
+				unsigned int weight, unsigned int depth,
+				GAttribFlowFunc func, gpointer user_data,
+				GDestroyNotify notify);
+gboolean g_attrib_flow_remove(GAttrib *attrib, guint flow);
+
+guint g_attrib_send_flow(GAttrib *attrib, guint flow, const guint8 *pdu,
+				guint16 len, GAttribResultFunc func,
+				gpointer user_data, GDestroyNotify notify);
+guint g_attrib_commit_flow(GAttrib *attrib, guint flow, guint16 len,
+				GAttribResultFunc func, gpointer user_data,
+				GDestroyNotify notify);
+
 gboolean g_attrib_cancel(GAttrib *attrib, guint id);
 gboolean g_attrib_cancel_all(GAttrib *attrib);
 
+gboolean g_attrib_set_timeout(GAttrib *attrib, guint id, unsigned int msec,
+				GAttribTimeoutFunc func, gpointer user_data);
+
 gboolean g_attrib_set_debug(GAttrib *attrib,
 		GAttribDebugFunc func, gpointer user_data);
 
@@ -69,6 +140,10 @@ gboolean g_attrib_is_encrypted(GAttrib *attrib);
 
 uint8_t *g_attrib_get_buffer(GAttrib *attrib, size_t *len);
 gboolean g_attrib_set_mtu(GAttrib *attrib, int mtu);
+gboolean g_attrib_set_burst(GAttrib *attrib, unsigned int budget);
+
+const struct gattrib_stats *g_attrib_get_stats(GAttrib *attrib);
+void g_attrib_reset_stats(GAttrib *attrib);
 
 gboolean g_attrib_unregister(GAttrib *attrib, guint id);
 gboolean g_attrib_unregister_all(GAttrib *attrib);
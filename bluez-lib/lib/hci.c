@@ -44,6 +44,7 @@
 #include "bluetooth.h"
 #include "hci.h"
 #include "hci_lib.h"
+#include "src/shared/capture.h"
 
 #ifndef MIN
 #define MIN(x, y) ((x) < (y) ? (x) : (y))
@@ -1050,6 +1051,18 @@ int hci_close_dev(int dd)
 /* HCI functions that require open device
  * dd - Device descriptor returned by hci_open_dev. */
 
+/* Controller index of an HCI socket, for packet capture */
+static uint16_t capture_index(int dd)
+{
+	struct sockaddr_hci addr;
+	socklen_t len = sizeof(addr);
+
+	if (getsockname(dd, (struct sockaddr *) &addr, &len) < 0)
+		return CAPTURE_INDEX_NONE;
+
+	return addr.hci_dev;
+}
+
 int hci_send_cmd(int dd, uint16_t ogf, uint16_t ocf, uint8_t plen, void *param)
 {
 	uint8_t type = HCI_COMMAND_PKT;
@@ -1077,6 +1090,12 @@ int hci_send_cmd(int dd, uint16_t ogf, uint16_t ocf, uint8_t plen, void *param)
 			continue;
 		return -1;
 	}
+
+	/* The packet type is implied by the record type */
+	if (capture_enabled())
+		capture_record(capture_index(dd), CAPTURE_HCI_COMMAND,
+							iv + 1, ivn - 1);
+
 	return 0;
 }
 
@@ -1143,6 +1162,13 @@ int hci_send_req(int dd, struct hci_request *r, int to)
 			goto failed;
 		}
 
+		if (capture_enabled() && len > 1) {
+			struct iovec iv = { buf + 1, len - 1 };
+
+			capture_record(capture_index(dd), CAPTURE_HCI_EVENT,
+								&iv, 1);
+		}
+
 		hdr = (void *) (buf + 1);
 		ptr = buf + (1 + HCI_EVENT_HDR_SIZE);
 		len -= (1 + HCI_EVENT_HDR_SIZE);
@@ -47,6 +47,7 @@
 #include "adapter.h"
 #include "device.h"
 #include "attrib/gattrib.h"
+#include "attrib/gattrib-shards.h"
 #include "attrib/att.h"
 #include "attrib/gatt.h"
 #include "attrib/att-database.h"
@@ -54,20 +55,227 @@
 
 #include "attrib-server.h"
 
+/*
+ * Bearers may be spread over worker threads, see attrib_server_set_workers().
+ * A channel and its GAttrib belong to the thread the bearer was handed to,
+ * and its ATT traffic and callbacks run there. Each server has its own
+ * locks, see db_lock(), and is reference counted by its channels and
+ * requests so that it outlives them once stopped. The servers list and
+ * the request pool are guarded by servers_lock, held only briefly.
+ * Adapters and devices belong to the main thread: a device and its CCC
+ * values are resolved there before its bearer is handed off, and released
+ * there.
+ */
 static GSList *servers = NULL;
+static GThreadPool *request_pool = NULL;
+static GMutex servers_lock;
+static struct gattrib_shards *shards = NULL;
+static unsigned int shard_channels = 0;	/* Not released from a worker yet */
+
+/*
+ * The attribute database is a two level radix table over the 16-bit handle
+ * space: the high byte of a handle selects a page, the low byte a slot in
+ * it. Pages are allocated on demand and carry an occupancy bitmap so that
+ * ordered iteration only visits populated slots.
+ */
+#define DB_PAGE_SHIFT		8
+#define DB_PAGE_SIZE		(1 << DB_PAGE_SHIFT)
+#define DB_PAGE_MASK		(DB_PAGE_SIZE - 1)
+#define DB_PAGES		(0x10000 >> DB_PAGE_SHIFT)
+#define DB_MAP_WORDS		(DB_PAGE_SIZE / 64)
+
+struct attrib_page {
+	uint16_t count;
+	uint64_t map[DB_MAP_WORDS];
+	struct attribute *attrs[DB_PAGE_SIZE];
+};
+
+/* Seconds a CCC change may stay in memory before it is written to disk */
+#define CCC_FLUSH_TIMEOUT	2
+
+/*
+ * Client Characteristic Configuration values of one peer. Loaded from the
+ * device "ccc" file when the first channel is set up, shared by all of its
+ * channels and written back in batches by ccc_flush(). Like the device it
+ * keeps, it is loaded and released on the main thread, so bearer threads
+ * never touch storage.
+ */
+struct device_ccc {
+	struct gatt_server *server;
+	struct btd_device *device;
+	unsigned int refs;
+	gboolean releasing;
+	GHashTable *values;	/* handle -> configuration */
+	gboolean dirty;
+};
+
+/*
+ * Notifications handed to GAttrib but not yet written to the socket, and
+ * distinct value handles allowed to wait behind them, per channel.
+ */
+#define NOTIFY_WINDOW		4
+#define NOTIFY_QUEUE_MAX	64
+
+/*
+ * Free handle ranges usable for new services, kept as a max segment tree
+ * over the handle space: the leaf of a handle holds the length of the free
+ * range starting there if that range ends right before a service
+ * declaration (or at 0xffff), and 0 otherwise.
+ */
+#define AVAIL_LEAVES		0x10000
+
+/* Sorted handles of service declarations */
+struct handle_set {
+	unsigned int num;
+	unsigned int size;
+	uint16_t *handles;
+};
+
+/* Encoded discovery responses kept per server, least recently used evicted */
+#define DISC_CACHE_MAX		64
+
+struct disc_key {
+	uint8_t opcode;
+	uint16_t start;
+	uint16_t end;
+	uint16_t mtu;
+	bt_uuid_t uuid;		/* 128-bit form, zeroed for Find Information */
+};
+
+struct disc_entry {
+	struct disc_key key;
+	GList link;		/* In disc_lru, least recently used first */
+	uint16_t len;
+	uint8_t pdu[0];
+};
+
+/* Worker threads running deferred attribute accesses */
+#define REQUEST_WORKERS		4
+
+/* Requests received while a deferred response is outstanding */
+#define HELD_PDUS_MAX		8
+
+struct attrib_request {
+	struct gatt_server *server;
+	struct gatt_channel *channel;	/* NULL once the channel is gone */
+	uint8_t opcode;
+	uint16_t handle;
+	uint16_t offset;
+	uint8_t *value;
+	size_t vlen;
+	gboolean has_value;
+	gboolean starting;
+	gboolean done;
+	uint8_t status;
+	attrib_request_func_t func;
+	gpointer user_data;
+	GMainContext *context;		/* of the thread owning the bearer */
+};
+
+struct held_pdu {
+	uint16_t len;
+	uint8_t data[0];
+};
+
+/* Bounds of the per-channel Prepare Write queue */
+#define PREP_QUEUE_MAX_WRITES	64
+#define PREP_QUEUE_MAX_BYTES	(4 * ATT_MAX_VALUE_LEN)
+
+struct prep_write {
+	uint16_t handle;
+	uint16_t offset;
+	uint16_t len;
+	uint8_t value[0];
+};
+
+/* Value of one attribute being assembled by an Execute Write */
+struct exec_value {
+	struct attribute *a;
+	gboolean ccc;
+	size_t len;
+	size_t size;
+	uint8_t *data;
+	uint8_t *old_data;		/* Value replaced, until applied */
+	size_t old_len;
+	struct attrib_value *old_value;
+};
 
+/*
+ * Notification or indication PDU shared by all channels it is sent to,
+ * possibly served by different threads.
+ */
+struct notify_pdu {
+	unsigned int refs;
+	uint16_t handle;
+	uint16_t len;
+	uint8_t data[0];
+};
+
+/*
+ * Outgoing value updates of one channel. Only the latest PDU per handle is
+ * kept while the channel is backlogged. The queue is reference counted by
+ * the commands in flight so it can outlive the channel. Updates are pushed
+ * by whichever thread changed the value, and sent ones are reaped on the
+ * thread owning the bearer: the state below is guarded by lock, which is
+ * recursive as GAttrib may drop a command it could not queue right away.
+ */
+struct notify_queue {
+	unsigned int refs;
+	GRecMutex lock;
+	struct gatt_channel *channel;	/* NULL once the channel is gone */
+	GQueue *order;			/* struct notify_pdu, oldest first */
+	GHashTable *pending;		/* handle -> GList link in order */
+	unsigned int inflight;
+	guint ind_id;
+};
+
+/* Attributes sharing one type, sorted by handle */
+struct attrib_type {
+	bt_uuid_t uuid;		/* 128-bit form, used as hash key */
+	unsigned int num;
+	unsigned int size;
+	struct attribute **attrs;
+};
+
+/*
+ * The database (attributes, indexes, free ranges and the channels list) is
+ * guarded by db_lock. CCC values have ccc_lock, the discovery cache has
+ * cache_lock and the notify statistics are updated atomically.
+ */
 struct gatt_server {
+	unsigned int refs;
+	gboolean stopped;
+	GRWLock db_lock;
+	GThread *writer;		/* holding db_lock for writing */
+	unsigned int writer_depth;
+	GMutex ccc_lock;
+	GMutex cache_lock;
 	struct btd_adapter *adapter;
 	GIOChannel *l2cap_io;
 	GIOChannel *le_io;
 	uint32_t gatt_sdp_handle;
 	uint32_t gap_sdp_handle;
-	GList *database;
+	struct attrib_page *database[DB_PAGES];
+	unsigned int db_count;
+	GHashTable *types;
+	struct handle_set svc16;
+	struct handle_set svc128;
+	uint16_t *avail;
 	GSList *clients;
+	GSList *ccc_devices;
+	guint ccc_flush_id;
+	struct attrib_notify_stats notify_stats;
+	GHashTable *disc_cache;
+	GQueue disc_lru;
+	struct attrib_cache_stats cache_stats;
 	uint16_t name_handle;
 	uint16_t appearance_handle;
 };
 
+/*
+ * Channel state is used by the thread owning the bearer with db_lock held,
+ * and changed by other threads only with it held for writing.
+ */
 struct gatt_channel {
 	bdaddr_t src;
 	bdaddr_t dst;
@@ -77,8 +285,17 @@ struct gatt_channel {
 	guint id;
 	gboolean encrypted;
 	struct gatt_server *server;
-	guint cleanup_id;
+	GSource *cleanup;
+	gboolean closed;
 	struct btd_device *device;
+	struct device_ccc *ccc;
+	struct notify_queue *notify;
+	GQueue *prep_queue;
+	size_t prep_bytes;
+	GSList *requests;
+	struct attrib_request *pending;
+	GQueue *held;
+	gboolean sharded;		/* Counted in shard_channels */
 };
 
 struct group_elem {
@@ -96,558 +313,2154 @@ static bt_uuid_t snd_uuid = {
 			.type = BT_UUID16,
 			.value.u16 = GATT_SND_SVC_UUID
 };
+static bt_uuid_t chr_uuid = {
+			.type = BT_UUID16,
+			.value.u16 = GATT_CHARAC_UUID
+};
 static bt_uuid_t ccc_uuid = {
 			.type = BT_UUID16,
 			.value.u16 = GATT_CLIENT_CHARAC_CFG_UUID
 };
 
-static void attrib_free(void *data)
-{
-	struct attribute *a = data;
-
-	g_free(a->data);
-	g_free(a);
-}
+struct attrib_value {
+	unsigned int refs;
+	const uint8_t *data;
+	size_t len;
+	GMappedFile *map;
+	GDestroyNotify destroy;
+	gpointer user_data;
+};
 
-static void channel_free(struct gatt_channel *channel)
+struct attrib_value *attrib_value_new(const uint8_t *data, size_t len,
+				GDestroyNotify destroy, gpointer user_data)
 {
+	struct attrib_value *value;
 
-	if (channel->cleanup_id)
-		g_source_remove(channel->cleanup_id);
+	value = g_new0(struct attrib_value, 1);
+	value->refs = 1;
+	value->data = data;
+	value->len = len;
+	value->destroy = destroy;
+	value->user_data = user_data;
 
-	if (channel->device)
-		btd_device_unref(channel->device);
-
-	g_attrib_unref(channel->attrib);
-	g_free(channel);
+	return value;
 }
 
-static void gatt_server_free(struct gatt_server *server)
+struct attrib_value *attrib_value_new_file(const char *path)
 {
-	g_list_free_full(server->database, attrib_free);
+	struct attrib_value *value;
+	GMappedFile *map;
+	GError *gerr = NULL;
 
-	if (server->l2cap_io != NULL) {
-		g_io_channel_shutdown(server->l2cap_io, FALSE, NULL);
-		g_io_channel_unref(server->l2cap_io);
+	map = g_mapped_file_new(path, FALSE, &gerr);
+	if (map == NULL) {
+		error("Unable to map %s: %s", path, gerr->message);
+		g_error_free(gerr);
+		return NULL;
 	}
 
-	if (server->le_io != NULL) {
-		g_io_channel_shutdown(server->le_io, FALSE, NULL);
-		g_io_channel_unref(server->le_io);
+	if (g_mapped_file_get_length(map) > 0xffff) {
+		error("%s is too large for an attribute value", path);
+		g_mapped_file_unref(map);
+		return NULL;
 	}
 
-	g_slist_free_full(server->clients, (GDestroyNotify) channel_free);
+	value = attrib_value_new(NULL, g_mapped_file_get_length(map), NULL,
+									NULL);
+	value->data = (const uint8_t *) g_mapped_file_get_contents(map);
+	value->map = map;
 
-	if (server->gatt_sdp_handle > 0)
-		remove_record_from_server(server->gatt_sdp_handle);
+	return value;
+}
 
-	if (server->gap_sdp_handle > 0)
-		remove_record_from_server(server->gap_sdp_handle);
+struct attrib_value *attrib_value_ref(struct attrib_value *value)
+{
+	__sync_fetch_and_add(&value->refs, 1);
 
-	if (server->adapter != NULL)
-		btd_adapter_unref(server->adapter);
+	return value;
+}
 
-	g_free(server);
+void attrib_value_unref(struct attrib_value *value)
+{
+	if (value == NULL || __sync_sub_and_fetch(&value->refs, 1) > 0)
+		return;
+
+	if (value->map)
+		g_mapped_file_unref(value->map);
+
+	if (value->destroy)
+		value->destroy(value->user_data);
+
+	g_free(value);
 }
 
-static gint adapter_cmp_addr(gconstpointer a, gconstpointer b)
+/* Release the current value of @a, whatever backs it */
+static void attrib_value_release(struct attribute *a)
 {
-	const struct gatt_server *server = a;
-	const bdaddr_t *bdaddr = b;
+	if (a->value) {
+		attrib_value_unref(a->value);
+		a->value = NULL;
+	} else {
+		g_free(a->data);
+	}
 
-	return bacmp(adapter_get_address(server->adapter), bdaddr);
+	a->data = NULL;
+	a->len = 0;
 }
 
-static gint adapter_cmp(gconstpointer a, gconstpointer b)
+static void attrib_free(void *data)
 {
-	const struct gatt_server *server = a;
-	const struct btd_adapter *adapter = b;
+	struct attribute *a = data;
 
-	if (server->adapter == adapter)
-		return 0;
+	attrib_value_release(a);
+	g_free(a);
+}
 
-	return -1;
+/*
+ * Discovery and reads take db_lock for reading, so bearers of one server
+ * are served in parallel; updates take it for writing. Attribute callbacks
+ * may update the database, so they only run with it held for writing and
+ * a thread holding it so takes it again without blocking, in either mode.
+ * A callback must not update the database of another adapter.
+ */
+static gboolean db_is_writer(struct gatt_server *server)
+{
+	return g_atomic_pointer_get(&server->writer) == g_thread_self();
 }
 
-static struct gatt_server *find_gatt_server(const bdaddr_t *bdaddr)
+static void db_lock(struct gatt_server *server, gboolean write)
 {
-	GSList *l;
+	if (db_is_writer(server)) {
+		server->writer_depth++;
+		return;
+	}
 
-	l = g_slist_find_custom(servers, bdaddr, adapter_cmp_addr);
-	if (l == NULL) {
-		char addr[18];
+	if (!write) {
+		g_rw_lock_reader_lock(&server->db_lock);
+		return;
+	}
 
-		ba2str(bdaddr, addr);
-		error("No GATT server found in %s", addr);
-		return NULL;
+	g_rw_lock_writer_lock(&server->db_lock);
+	g_atomic_pointer_set(&server->writer, g_thread_self());
+	server->writer_depth = 1;
+}
+
+static void db_unlock(struct gatt_server *server)
+{
+	if (!db_is_writer(server)) {
+		g_rw_lock_reader_unlock(&server->db_lock);
+		return;
 	}
 
-	return l->data;
+	if (--server->writer_depth > 0)
+		return;
+
+	g_atomic_pointer_set(&server->writer, NULL);
+	g_rw_lock_writer_unlock(&server->db_lock);
 }
 
-static sdp_record_t *server_record_new(uuid_t *uuid, uint16_t start, uint16_t end)
+static struct gatt_server *server_ref(struct gatt_server *server)
 {
-	sdp_list_t *svclass_id, *apseq, *proto[2], *root, *aproto;
-	uuid_t root_uuid, proto_uuid, l2cap;
-	sdp_record_t *record;
-	sdp_data_t *psm, *sh, *eh;
-	uint16_t lp = ATT_PSM;
+	__sync_fetch_and_add(&server->refs, 1);
 
-	if (uuid == NULL)
-		return NULL;
+	return server;
+}
 
-	if (start > end)
-		return NULL;
+static void server_unref(struct gatt_server *server);
 
-	record = sdp_record_alloc();
-	if (record == NULL)
+static struct attribute *db_lookup(struct gatt_server *server,
+							uint16_t handle)
+{
+	struct attrib_page *page = server->database[handle >> DB_PAGE_SHIFT];
+
+	if (page == NULL)
 		return NULL;
 
-	sdp_uuid16_create(&root_uuid, PUBLIC_BROWSE_GROUP);
-	root = sdp_list_append(NULL, &root_uuid);
-	sdp_set_browse_groups(record, root);
-	sdp_list_free(root, NULL);
+	return page->attrs[handle & DB_PAGE_MASK];
+}
 
-	svclass_id = sdp_list_append(NULL, uuid);
-	sdp_set_service_classes(record, svclass_id);
-	sdp_list_free(svclass_id, NULL);
+/* First attribute whose handle is greater than or equal to @handle */
+static struct attribute *db_first(struct gatt_server *server,
+							unsigned int handle)
+{
+	unsigned int p, slot;
 
-	sdp_uuid16_create(&l2cap, L2CAP_UUID);
-	proto[0] = sdp_list_append(NULL, &l2cap);
-	psm = sdp_data_alloc(SDP_UINT16, &lp);
-	proto[0] = sdp_list_append(proto[0], psm);
-	apseq = sdp_list_append(NULL, proto[0]);
+	for (p = handle >> DB_PAGE_SHIFT, slot = handle & DB_PAGE_MASK;
+					p < DB_PAGES; p++, slot = 0) {
+		struct attrib_page *page = server->database[p];
+		unsigned int w;
 
-	sdp_uuid16_create(&proto_uuid, ATT_UUID);
-	proto[1] = sdp_list_append(NULL, &proto_uuid);
-	sh = sdp_data_alloc(SDP_UINT16, &start);
-	proto[1] = sdp_list_append(proto[1], sh);
-	eh = sdp_data_alloc(SDP_UINT16, &end);
-	proto[1] = sdp_list_append(proto[1], eh);
-	apseq = sdp_list_append(apseq, proto[1]);
+		if (page == NULL)
+			continue;
 
-	aproto = sdp_list_append(NULL, apseq);
-	sdp_set_access_protos(record, aproto);
+		for (w = slot / 64; w < DB_MAP_WORDS; w++) {
+			uint64_t bits = page->map[w];
 
-	sdp_data_free(psm);
-	sdp_data_free(sh);
-	sdp_data_free(eh);
-	sdp_list_free(proto[0], NULL);
-	sdp_list_free(proto[1], NULL);
-	sdp_list_free(apseq, NULL);
-	sdp_list_free(aproto, NULL);
+			if (w == slot / 64)
+				bits &= ~0ULL << (slot % 64);
 
-	return record;
+			if (bits)
+				return page->attrs[w * 64 +
+							__builtin_ctzll(bits)];
+		}
+	}
+
+	return NULL;
 }
 
-static int handle_cmp(gconstpointer a, gconstpointer b)
+/* Last attribute whose handle is less than or equal to @handle */
+static struct attribute *db_last(struct gatt_server *server,
+							unsigned int handle)
 {
-	const struct attribute *attrib = a;
-	uint16_t handle = GPOINTER_TO_UINT(b);
+	int p, w, slot;
 
-	return attrib->handle - handle;
-}
+	for (p = handle >> DB_PAGE_SHIFT, slot = handle & DB_PAGE_MASK;
+				p >= 0; p--, slot = DB_PAGE_SIZE - 1) {
+		struct attrib_page *page = server->database[p];
 
-static int attribute_cmp(gconstpointer a1, gconstpointer a2)
-{
-	const struct attribute *attrib1 = a1;
-	const struct attribute *attrib2 = a2;
+		if (page == NULL)
+			continue;
 
-	return attrib1->handle - attrib2->handle;
-}
+		for (w = slot / 64; w >= 0; w--) {
+			uint64_t bits = page->map[w];
 
-static struct attribute *find_svc_range(struct gatt_server *server,
-					uint16_t start, uint16_t *end)
-{
-	struct attribute *attrib;
-	guint h = start;
-	GList *l;
+			if (w == slot / 64 && slot % 64 != 63)
+				bits &= (1ULL << (slot % 64 + 1)) - 1;
 
-	if (end == NULL)
-		return NULL;
+			if (bits)
+				return page->attrs[w * 64 + 63 -
+							__builtin_clzll(bits)];
+		}
+	}
 
-	l = g_list_find_custom(server->database, GUINT_TO_POINTER(h),
-								handle_cmp);
-	if (!l)
-		return NULL;
+	return NULL;
+}
 
-	attrib = l->data;
+static struct attribute *db_next(struct gatt_server *server,
+							struct attribute *a)
+{
+	return db_first(server, a->handle + 1);
+}
 
-	if (bt_uuid_cmp(&attrib->uuid, &prim_uuid) != 0 &&
-			bt_uuid_cmp(&attrib->uuid, &snd_uuid) != 0)
+static struct attribute *db_prev(struct gatt_server *server,
+							struct attribute *a)
+{
+	if (a->handle == 0x0000)
 		return NULL;
 
-	*end = start;
+	return db_last(server, a->handle - 1);
+}
 
-	for (l = l->next; l; l = l->next) {
-		struct attribute *a = l->data;
+static gboolean db_insert(struct gatt_server *server, struct attribute *a)
+{
+	struct attrib_page *page = server->database[a->handle >> DB_PAGE_SHIFT];
+	unsigned int slot = a->handle & DB_PAGE_MASK;
 
-		if (bt_uuid_cmp(&a->uuid, &prim_uuid) == 0 ||
-				bt_uuid_cmp(&a->uuid, &snd_uuid) == 0)
-			break;
+	if (page == NULL) {
+		page = g_try_new0(struct attrib_page, 1);
+		if (page == NULL)
+			return FALSE;
 
-		*end = a->handle;
+		server->database[a->handle >> DB_PAGE_SHIFT] = page;
 	}
 
-	return attrib;
+	page->attrs[slot] = a;
+	page->map[slot / 64] |= 1ULL << (slot % 64);
+	page->count++;
+	server->db_count++;
+
+	return TRUE;
 }
 
-static uint32_t attrib_create_sdp_new(struct gatt_server *server,
-					uint16_t handle, const char *name)
+static void db_remove(struct gatt_server *server, struct attribute *a)
 {
-	sdp_record_t *record;
-	struct attribute *a;
-	uint16_t end = 0;
-	uuid_t svc, gap_uuid;
+	unsigned int p = a->handle >> DB_PAGE_SHIFT;
+	unsigned int slot = a->handle & DB_PAGE_MASK;
+	struct attrib_page *page = server->database[p];
 
-	a = find_svc_range(server, handle, &end);
+	page->attrs[slot] = NULL;
+	page->map[slot / 64] &= ~(1ULL << (slot % 64));
+	server->db_count--;
 
-	if (a == NULL)
-		return 0;
+	if (--page->count > 0)
+		return;
 
-	if (a->len == 2)
-		sdp_uuid16_create(&svc, att_get_u16(a->data));
-	else if (a->len == 16)
-		sdp_uuid128_create(&svc, a->data);
-	else
-		return 0;
+	g_free(page);
+	server->database[p] = NULL;
+}
 
-	record = server_record_new(&svc, handle, end);
-	if (record == NULL)
-		return 0;
+static guint type_hash(gconstpointer key)
+{
+	const bt_uuid_t *uuid = key;
+	guint h = 0;
+	int i;
 
-	if (name != NULL)
-		sdp_set_info_attr(record, name, "BlueZ", NULL);
+	for (i = 0; i < 16; i++)
+		h = (h << 5) - h + uuid->value.u128.data[i];
 
-	sdp_uuid16_create(&gap_uuid, GENERIC_ACCESS_PROFILE_ID);
-	if (sdp_uuid_cmp(&svc, &gap_uuid) == 0) {
-		sdp_set_url_attr(record, "http://www.bluez.org/",
-				"http://www.bluez.org/",
-				"http://www.bluez.org/");
-	}
+	return h;
+}
 
-	if (add_record_to_server(adapter_get_address(server->adapter), record)
-			== 0)
-		return record->handle;
+static gboolean type_equal(gconstpointer a, gconstpointer b)
+{
+	const bt_uuid_t *u1 = a;
+	const bt_uuid_t *u2 = b;
 
-	sdp_record_free(record);
-	return 0;
+	return memcmp(&u1->value.u128, &u2->value.u128,
+						sizeof(uint128_t)) == 0;
 }
 
-static struct attribute *attrib_db_add_new(struct gatt_server *server,
-				uint16_t handle, bt_uuid_t *uuid,
-				int read_req, int write_req,
-				const uint8_t *value, size_t len)
+static void type_free(gpointer data)
 {
-	struct attribute *a;
-	guint h = handle;
+	struct attrib_type *type = data;
 
-	DBG("handle=0x%04x", handle);
+	g_free(type->attrs);
+	g_free(type);
+}
 
-	if (g_list_find_custom(server->database, GUINT_TO_POINTER(h),
-								handle_cmp))
-		return NULL;
+static struct attrib_type *type_lookup(struct gatt_server *server,
+							const bt_uuid_t *uuid)
+{
+	bt_uuid_t u128;
 
-	a = g_new0(struct attribute, 1);
-	a->len = len;
-	a->data = g_memdup(value, len);
-	a->handle = handle;
-	a->uuid = *uuid;
-	a->read_req = read_req;
-	a->write_req = write_req;
+	bt_uuid_to_uuid128(uuid, &u128);
 
-	server->database = g_list_insert_sorted(server->database, a,
-								attribute_cmp);
+	return g_hash_table_lookup(server->types, &u128);
+}
 
-	return a;
+/* Index of the first attribute of @type with handle >= @handle */
+static unsigned int type_lower_bound(struct attrib_type *type,
+							unsigned int handle)
+{
+	unsigned int lo = 0, hi = type->num;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+
+		if (type->attrs[mid]->handle < handle)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
 }
 
-static uint8_t att_check_reqs(struct gatt_channel *channel, uint8_t opcode,
-								int reqs)
+static struct attribute *type_first(struct attrib_type *type,
+							unsigned int handle)
 {
-	/* FIXME: currently, it is assumed an encrypted link is enough for
-	 * authentication. This will allow to enable the SMP negotiation once
-	 * it is on upstream kernel. High security level should be mapped
-	 * to authentication and medium to encryption permission. */
-	if (!channel->encrypted)
-		channel->encrypted = g_attrib_is_encrypted(channel->attrib);
-	if (reqs == ATT_AUTHENTICATION && !channel->encrypted)
-		return ATT_ECODE_AUTHENTICATION;
-	else if (reqs == ATT_AUTHORIZATION)
-		return ATT_ECODE_AUTHORIZATION;
+	unsigned int i;
 
-	switch (opcode) {
-	case ATT_OP_READ_BY_GROUP_REQ:
-	case ATT_OP_READ_BY_TYPE_REQ:
-	case ATT_OP_READ_REQ:
-	case ATT_OP_READ_BLOB_REQ:
-	case ATT_OP_READ_MULTI_REQ:
-		if (reqs == ATT_NOT_PERMITTED)
-			return ATT_ECODE_READ_NOT_PERM;
-		break;
-	case ATT_OP_PREP_WRITE_REQ:
-	case ATT_OP_WRITE_REQ:
-	case ATT_OP_WRITE_CMD:
-		if (reqs == ATT_NOT_PERMITTED)
-			return ATT_ECODE_WRITE_NOT_PERM;
-		break;
+	if (type == NULL)
+		return NULL;
+
+	i = type_lower_bound(type, handle);
+	if (i == type->num)
+		return NULL;
+
+	return type->attrs[i];
+}
+
+static void type_index_add(struct gatt_server *server, struct attribute *a)
+{
+	struct attrib_type *type;
+	unsigned int i;
+
+	type = type_lookup(server, &a->uuid);
+	if (type == NULL) {
+		type = g_new0(struct attrib_type, 1);
+		bt_uuid_to_uuid128(&a->uuid, &type->uuid);
+		g_hash_table_insert(server->types, &type->uuid, type);
 	}
 
-	return 0;
+	if (type->num == type->size) {
+		type->size = type->size ? type->size * 2 : 4;
+		type->attrs = g_renew(struct attribute *, type->attrs,
+								type->size);
+	}
+
+	i = type_lower_bound(type, a->handle);
+	memmove(&type->attrs[i + 1], &type->attrs[i],
+				(type->num - i) * sizeof(type->attrs[0]));
+	type->attrs[i] = a;
+	type->num++;
 }
 
-static uint16_t read_by_group(struct gatt_channel *channel, uint16_t start,
-						uint16_t end, bt_uuid_t *uuid,
-						uint8_t *pdu, size_t len)
+static void type_index_del(struct gatt_server *server, struct attribute *a)
 {
-	struct att_data_list *adl;
-	struct attribute *a;
-	struct group_elem *cur, *old = NULL;
-	GSList *l, *groups;
-	GList *dl, *database;
-	uint16_t length, last_handle, last_size = 0;
-	uint8_t status;
-	int i;
+	struct attrib_type *type;
+	unsigned int i;
 
-	if (start > end || start == 0x0000)
-		return enc_error_resp(ATT_OP_READ_BY_GROUP_REQ, start,
-					ATT_ECODE_INVALID_HANDLE, pdu, len);
+	type = type_lookup(server, &a->uuid);
+	if (type == NULL)
+		return;
 
-	/*
-	 * Only <<Primary Service>> and <<Secondary Service>> grouping
-	 * types may be used in the Read By Group Type Request.
-	 */
+	i = type_lower_bound(type, a->handle);
+	if (i == type->num || type->attrs[i] != a)
+		return;
 
-	if (bt_uuid_cmp(uuid, &prim_uuid) != 0 &&
-		bt_uuid_cmp(uuid, &snd_uuid) != 0)
-		return enc_error_resp(ATT_OP_READ_BY_GROUP_REQ, 0x0000,
-					ATT_ECODE_UNSUPP_GRP_TYPE, pdu, len);
+	type->num--;
+	memmove(&type->attrs[i], &type->attrs[i + 1],
+				(type->num - i) * sizeof(type->attrs[0]));
 
-	last_handle = end;
-	database = channel->server->database;
-	for (dl = database, groups = NULL, cur = NULL; dl; dl = dl->next) {
+	if (type->num == 0)
+		g_hash_table_remove(server->types, &type->uuid);
+}
 
-		a = dl->data;
+/* First primary or secondary service declaration after @handle */
+static struct attribute *next_service(struct gatt_server *server,
+							uint16_t handle)
+{
+	struct attribute *prim, *snd;
 
-		if (a->handle < start)
-			continue;
+	prim = type_first(type_lookup(server, &prim_uuid), handle + 1);
+	snd = type_first(type_lookup(server, &snd_uuid), handle + 1);
 
-		if (a->handle >= end)
-			break;
+	if (prim == NULL)
+		return snd;
 
-		/* The old group ends when a new one starts */
-		if (old && (bt_uuid_cmp(&a->uuid, &prim_uuid) == 0 ||
-				bt_uuid_cmp(&a->uuid, &snd_uuid) == 0)) {
-			old->end = last_handle;
-			old = NULL;
-		}
+	if (snd == NULL || prim->handle < snd->handle)
+		return prim;
 
-		if (bt_uuid_cmp(&a->uuid, uuid) != 0) {
-			/* Still inside a service, update its last handle */
-			if (old)
-				last_handle = a->handle;
-			continue;
-		}
+	return snd;
+}
 
-		if (last_size && (last_size != a->len))
-			break;
+/*
+ * Last handle of the group started at @handle: the group ends right before
+ * the next service declaration, and never reaches @limit.
+ */
+static uint16_t group_end(struct gatt_server *server, uint16_t handle,
+							unsigned int limit)
+{
+	struct attribute *next;
 
-		status = att_check_reqs(channel, ATT_OP_READ_BY_GROUP_REQ,
-								a->read_req);
+	next = next_service(server, handle);
+	if (next && next->handle < limit)
+		limit = next->handle;
 
-		if (status == 0x00 && a->read_cb)
-			status = a->read_cb(a, channel->device,
-							a->cb_user_data);
+	return db_last(server, limit - 1)->handle;
+}
 
-		if (status) {
-			g_slist_free_full(groups, g_free);
-			return enc_error_resp(ATT_OP_READ_BY_GROUP_REQ,
-						a->handle, status, pdu, len);
-		}
+static gboolean is_service(struct attribute *a)
+{
+	return bt_uuid_cmp(&a->uuid, &prim_uuid) == 0 ||
+					bt_uuid_cmp(&a->uuid, &snd_uuid) == 0;
+}
 
-		cur = g_new0(struct group_elem, 1);
-		cur->handle = a->handle;
-		cur->data = a->data;
-		cur->len = a->len;
+static unsigned int handle_set_lower_bound(struct handle_set *set,
+							uint16_t handle)
+{
+	unsigned int lo = 0, hi = set->num;
 
-		/* Attribute Grouping Type found */
-		groups = g_slist_append(groups, cur);
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
 
-		last_size = a->len;
-		old = cur;
-		last_handle = cur->handle;
+		if (set->handles[mid] < handle)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
 
-	if (groups == NULL)
-		return enc_error_resp(ATT_OP_READ_BY_GROUP_REQ, start,
-					ATT_ECODE_ATTR_NOT_FOUND, pdu, len);
+	return lo;
+}
 
-	if (dl == NULL)
-		cur->end = a->handle;
-	else
-		cur->end = last_handle;
+static void handle_set_add(struct handle_set *set, uint16_t handle)
+{
+	unsigned int i = handle_set_lower_bound(set, handle);
 
-	length = g_slist_length(groups);
+	if (i < set->num && set->handles[i] == handle)
+		return;
 
-	adl = att_data_list_alloc(length, last_size + 4);
-	if (adl == NULL) {
-		g_slist_free_full(groups, g_free);
-		return enc_error_resp(ATT_OP_READ_BY_GROUP_REQ, start,
-					ATT_ECODE_UNLIKELY, pdu, len);
+	if (set->num == set->size) {
+		set->size = set->size ? set->size * 2 : 8;
+		set->handles = g_renew(uint16_t, set->handles, set->size);
 	}
 
-	for (i = 0, l = groups; l; l = l->next, i++) {
-		uint8_t *value;
+	memmove(&set->handles[i + 1], &set->handles[i],
+				(set->num - i) * sizeof(set->handles[0]));
+	set->handles[i] = handle;
+	set->num++;
+}
 
-		cur = l->data;
+static void handle_set_del(struct handle_set *set, uint16_t handle)
+{
+	unsigned int i = handle_set_lower_bound(set, handle);
 
-		value = (void *) adl->data[i];
+	if (i == set->num || set->handles[i] != handle)
+		return;
 
-		att_put_u16(cur->handle, value);
-		att_put_u16(cur->end, &value[2]);
-		/* Attribute Value */
-		memcpy(&value[4], cur->data, cur->len);
-	}
+	set->num--;
+	memmove(&set->handles[i], &set->handles[i + 1],
+				(set->num - i) * sizeof(set->handles[0]));
+}
 
-	length = enc_read_by_grp_resp(adl, pdu, len);
+static void handle_set_free(struct handle_set *set)
+{
+	g_free(set->handles);
+	memset(set, 0, sizeof(*set));
+}
 
-	att_data_list_free(adl);
-	g_slist_free_full(groups, g_free);
+/* Service declarations are split by the width of their UUID */
+static struct handle_set *service_set(struct gatt_server *server,
+							struct attribute *a)
+{
+	if (!is_service(a))
+		return NULL;
 
-	return length;
+	if (a->len == 2)
+		return &server->svc16;
+
+	if (a->len == 16)
+		return &server->svc128;
+
+	return NULL;
 }
 
-static uint16_t read_by_type(struct gatt_channel *channel, uint16_t start,
-						uint16_t end, bt_uuid_t *uuid,
-						uint8_t *pdu, size_t len)
+static void avail_set(struct gatt_server *server, unsigned int start,
+							unsigned int size)
 {
-	struct att_data_list *adl;
-	GSList *l, *types;
-	GList *dl, *database;
-	struct attribute *a;
-	uint16_t num, length;
-	uint8_t status;
-	int i;
+	unsigned int i = AVAIL_LEAVES + start;
 
-	if (start > end || start == 0x0000)
-		return enc_error_resp(ATT_OP_READ_BY_TYPE_REQ, start,
-					ATT_ECODE_INVALID_HANDLE, pdu, len);
+	server->avail[i] = size;
 
-	database = channel->server->database;
-	for (dl = database, length = 0, types = NULL; dl; dl = dl->next) {
+	for (i >>= 1; i > 0; i >>= 1)
+		server->avail[i] = MAX(server->avail[2 * i],
+						server->avail[2 * i + 1]);
+}
 
-		a = dl->data;
+/* Record the free range [start, end] */
+static void avail_update(struct gatt_server *server, unsigned int start,
+							unsigned int end)
+{
+	struct attribute *next = NULL;
 
-		if (a->handle < start)
-			continue;
+	if (end < 0xffff)
+		next = db_lookup(server, end + 1);
 
-		if (a->handle > end)
-			break;
+	if (next == NULL || is_service(next))
+		avail_set(server, start, end - start + 1);
+	else
+		avail_set(server, start, 0);
+}
 
-		if (bt_uuid_cmp(&a->uuid, uuid)  != 0)
-			continue;
+/* Bounds of the free range around @handle, which must be free */
+static void avail_bounds(struct gatt_server *server, uint16_t handle,
+				unsigned int *start, unsigned int *end)
+{
+	struct attribute *a;
 
-		status = att_check_reqs(channel, ATT_OP_READ_BY_TYPE_REQ,
-								a->read_req);
+	a = handle > 0x0001 ? db_last(server, handle - 1) : NULL;
+	*start = a ? a->handle + 1 : 0x0001;
 
-		if (status == 0x00 && a->read_cb)
-			status = a->read_cb(a, channel->device,
-							a->cb_user_data);
+	a = handle < 0xffff ? db_first(server, handle + 1) : NULL;
+	*end = a ? a->handle - 1 : 0xffff;
+}
 
-		if (status) {
-			g_slist_free(types);
-			return enc_error_resp(ATT_OP_READ_BY_TYPE_REQ,
-						a->handle, status, pdu, len);
-		}
+static void avail_reset(struct gatt_server *server)
+{
+	memset(server->avail, 0, 2 * AVAIL_LEAVES * sizeof(uint16_t));
+	avail_set(server, 0x0001, 0xffff);
 
-		/* All elements must have the same length */
-		if (length == 0)
-			length = a->len;
-		else if (a->len != length)
-			break;
+	handle_set_free(&server->svc16);
+	handle_set_free(&server->svc128);
+}
 
-		types = g_slist_append(types, a);
-	}
+/* The range ending before @a may have become (un)usable */
+static void avail_refresh_before(struct gatt_server *server,
+							struct attribute *a)
+{
+	struct attribute *prev;
+	unsigned int start;
 
-	if (types == NULL)
-		return enc_error_resp(ATT_OP_READ_BY_TYPE_REQ, start,
-					ATT_ECODE_ATTR_NOT_FOUND, pdu, len);
+	if (a->handle <= 0x0001)
+		return;
 
-	num = g_slist_length(types);
+	prev = db_last(server, a->handle - 1);
+	start = prev ? prev->handle + 1 : 0x0001;
 
-	/* Handle length plus attribute value length */
-	length += 2;
+	if (start < a->handle)
+		avail_update(server, start, a->handle - 1);
+}
 
-	adl = att_data_list_alloc(num, length);
-	if (adl == NULL) {
-		g_slist_free(types);
-		return enc_error_resp(ATT_OP_READ_BY_TYPE_REQ, start,
-					ATT_ECODE_UNLIKELY, pdu, len);
-	}
+static void avail_service_add(struct gatt_server *server, struct attribute *a)
+{
+	struct handle_set *set = service_set(server, a);
 
-	for (i = 0, l = types; l; i++, l = l->next) {
-		uint8_t *value;
+	if (set)
+		handle_set_add(set, a->handle);
 
-		a = l->data;
+	avail_refresh_before(server, a);
+}
 
-		value = (void *) adl->data[i];
+static void avail_service_del(struct gatt_server *server, struct attribute *a)
+{
+	struct handle_set *set = service_set(server, a);
 
-		att_put_u16(a->handle, value);
+	if (set)
+		handle_set_del(set, a->handle);
+}
 
-		/* Attribute Value */
-		memcpy(&value[2], a->data, a->len);
-	}
+/* @a has just been inserted: split the free range it landed in */
+static void avail_insert(struct gatt_server *server, struct attribute *a)
+{
+	unsigned int start, end;
 
-	length = enc_read_by_type_resp(adl, pdu, len);
+	if (a->handle == 0x0000)
+		return;
 
-	att_data_list_free(adl);
-	g_slist_free(types);
+	avail_bounds(server, a->handle, &start, &end);
 
-	return length;
+	avail_set(server, start, 0);
+
+	if (a->handle > start)
+		avail_update(server, start, a->handle - 1);
+
+	if (a->handle < end)
+		avail_update(server, a->handle + 1, end);
+
+	avail_service_add(server, a);
 }
 
-static uint16_t find_info(struct gatt_channel *channel, uint16_t start,
-				uint16_t end, uint8_t *pdu, size_t len)
+/* @a has just been removed: merge the free ranges around its handle */
+static void avail_remove(struct gatt_server *server, struct attribute *a)
 {
-	struct attribute *a;
-	struct att_data_list *adl;
-	GSList *l, *info;
-	GList *dl, *database;
-	uint8_t format, last_type = BT_UUID_UNSPEC;
-	uint16_t length, num;
-	int i;
+	unsigned int start, end;
 
-	if (start > end || start == 0x0000)
-		return enc_error_resp(ATT_OP_FIND_INFO_REQ, start,
-					ATT_ECODE_INVALID_HANDLE, pdu, len);
+	if (a->handle == 0x0000)
+		return;
 
-	database = channel->server->database;
-	for (dl = database, info = NULL, num = 0; dl; dl = dl->next) {
-		a = dl->data;
+	avail_service_del(server, a);
 
-		if (a->handle < start)
-			continue;
+	avail_bounds(server, a->handle, &start, &end);
 
-		if (a->handle > end)
-			break;
+	if (a->handle < 0xffff)
+		avail_set(server, a->handle + 1, 0);
 
-		if (last_type == BT_UUID_UNSPEC)
-			last_type = a->uuid.type;
+	avail_update(server, start, end);
+}
 
-		if (a->uuid.type != last_type)
-			break;
+/* Lowest usable range of at least @size handles starting in [lo, hi] */
+static unsigned int avail_first(struct gatt_server *server, unsigned int node,
+				unsigned int l, unsigned int r,
+				unsigned int lo, unsigned int hi,
+				unsigned int size)
+{
+	unsigned int mid, found;
 
-		info = g_slist_append(info, a);
-		num++;
+	if (r < lo || l > hi || server->avail[node] < size)
+		return 0;
 
-		last_type = a->uuid.type;
-	}
+	if (l == r)
+		return l;
 
-	if (info == NULL)
-		return enc_error_resp(ATT_OP_FIND_INFO_REQ, start,
-					ATT_ECODE_ATTR_NOT_FOUND, pdu, len);
+	mid = l + (r - l) / 2;
 
-	if (last_type == BT_UUID16) {
+	found = avail_first(server, 2 * node, l, mid, lo, hi, size);
+	if (found)
+		return found;
+
+	return avail_first(server, 2 * node + 1, mid + 1, r, lo, hi, size);
+}
+
+/* Highest usable range of at least @size handles starting in [lo, hi] */
+static unsigned int avail_last(struct gatt_server *server, unsigned int node,
+				unsigned int l, unsigned int r,
+				unsigned int lo, unsigned int hi,
+				unsigned int size)
+{
+	unsigned int mid, found;
+
+	if (r < lo || l > hi || server->avail[node] < size)
+		return 0;
+
+	if (l == r)
+		return l;
+
+	mid = l + (r - l) / 2;
+
+	found = avail_last(server, 2 * node + 1, mid + 1, r, lo, hi, size);
+	if (found)
+		return found;
+
+	return avail_last(server, 2 * node, l, mid, lo, hi, size);
+}
+
+static guint disc_hash(gconstpointer key)
+{
+	const struct disc_key *k = key;
+
+	return k->opcode ^ (k->start << 8) ^ (k->end << 16) ^ (k->mtu << 4) ^
+						type_hash(&k->uuid);
+}
+
+static gboolean disc_equal(gconstpointer a, gconstpointer b)
+{
+	return memcmp(a, b, sizeof(struct disc_key)) == 0;
+}
+
+static void disc_key_init(struct disc_key *key, uint8_t opcode,
+					uint16_t start, uint16_t end,
+					const bt_uuid_t *uuid, uint16_t mtu)
+{
+	memset(key, 0, sizeof(*key));
+
+	key->opcode = opcode;
+	key->start = start;
+	key->end = end;
+	key->mtu = mtu;
+
+	if (uuid)
+		bt_uuid_to_uuid128(uuid, &key->uuid);
+}
+
+/* Copy a cached response for the request into @pdu, 0 on a miss */
+static uint16_t disc_cache_lookup(struct gatt_server *server, uint8_t opcode,
+					uint16_t start, uint16_t end,
+					const bt_uuid_t *uuid, uint8_t *pdu,
+					size_t len)
+{
+	struct disc_entry *entry;
+	struct disc_key key;
+	uint16_t plen;
+
+	disc_key_init(&key, opcode, start, end, uuid, len);
+
+	g_mutex_lock(&server->cache_lock);
+
+	entry = g_hash_table_lookup(server->disc_cache, &key);
+	if (entry == NULL) {
+		server->cache_stats.misses++;
+		g_mutex_unlock(&server->cache_lock);
+		return 0;
+	}
+
+	server->cache_stats.hits++;
+	g_queue_unlink(&server->disc_lru, &entry->link);
+	g_queue_push_tail_link(&server->disc_lru, &entry->link);
+	memcpy(pdu, entry->pdu, entry->len);
+	plen = entry->len;
+
+	g_mutex_unlock(&server->cache_lock);
+
+	return plen;
+}
+
+static void disc_cache_add(struct gatt_server *server, uint8_t opcode,
+					uint16_t start, uint16_t end,
+					const bt_uuid_t *uuid, const uint8_t *pdu,
+					size_t len, uint16_t plen)
+{
+	struct disc_entry *entry, *old;
+
+	if (plen == 0)
+		return;
+
+	entry = g_malloc0(sizeof(*entry) + plen);
+	disc_key_init(&entry->key, opcode, start, end, uuid, len);
+	entry->link.data = entry;
+	entry->len = plen;
+	memcpy(entry->pdu, pdu, plen);
+
+	g_mutex_lock(&server->cache_lock);
+
+	old = g_hash_table_lookup(server->disc_cache, &entry->key);
+	if (old) {
+		g_queue_unlink(&server->disc_lru, &old->link);
+		g_hash_table_remove(server->disc_cache, &old->key);
+	} else if (g_hash_table_size(server->disc_cache) >= DISC_CACHE_MAX) {
+		GList *lru = g_queue_pop_head_link(&server->disc_lru);
+		struct disc_entry *victim = lru->data;
+
+		g_hash_table_remove(server->disc_cache, &victim->key);
+	}
+
+	g_hash_table_insert(server->disc_cache, &entry->key, entry);
+	g_queue_push_tail_link(&server->disc_lru, &entry->link);
+
+	g_mutex_unlock(&server->cache_lock);
+}
+
+struct disc_change {
+	uint16_t handle;
+	gboolean value_only;
+	GQueue *lru;
+};
+
+static gboolean disc_entry_stale(gpointer key, gpointer value,
+							gpointer user_data)
+{
+	struct disc_entry *entry = value;
+	struct disc_change *change = user_data;
+
+	if (change->handle < entry->key.start ||
+					change->handle > entry->key.end)
+		return FALSE;
+
+	/* Find Information only reports handles and types */
+	if (change->value_only && entry->key.opcode == ATT_OP_FIND_INFO_REQ)
+		return FALSE;
+
+	g_queue_unlink(change->lru, &entry->link);
+
+	return TRUE;
+}
+
+/* Drop the cached responses covering a modified attribute */
+static void disc_cache_invalidate(struct gatt_server *server, uint16_t handle,
+							gboolean value_only)
+{
+	struct disc_change change = { handle, value_only, &server->disc_lru };
+
+	if (server->disc_cache == NULL)
+		return;
+
+	g_mutex_lock(&server->cache_lock);
+
+	if (g_hash_table_size(server->disc_cache) > 0)
+		g_hash_table_foreach_remove(server->disc_cache,
+						disc_entry_stale, &change);
+
+	g_mutex_unlock(&server->cache_lock);
+}
+
+/*
+ * Responses involving attributes with access requirements or read
+ * callbacks depend on the requesting channel and are not cached.
+ */
+static gboolean attr_is_static(struct attribute *a)
+{
+	return a->read_req == ATT_NONE && a->read_cb == NULL &&
+							a->read_async == NULL;
+}
+
+/*
+ * Reading @a runs callbacks, which a reader of the database leaves to the
+ * writer serving the request again.
+ */
+static gboolean read_needs_writer(struct gatt_server *server,
+							struct attribute *a)
+{
+	if (a->read_cb == NULL && a->read_async == NULL)
+		return FALSE;
+
+	return !db_is_writer(server);
+}
+
+static void db_free(struct gatt_server *server)
+{
+	unsigned int p, i;
+
+	for (p = 0; p < DB_PAGES; p++) {
+		struct attrib_page *page = server->database[p];
+
+		if (page == NULL)
+			continue;
+
+		for (i = 0; i < DB_PAGE_SIZE; i++)
+			if (page->attrs[i])
+				attrib_free(page->attrs[i]);
+
+		g_free(page);
+		server->database[p] = NULL;
+	}
+
+	server->db_count = 0;
+
+	if (server->avail)
+		avail_reset(server);
+
+	if (server->types)
+		g_hash_table_remove_all(server->types);
+
+	if (server->disc_cache) {
+		g_mutex_lock(&server->cache_lock);
+		g_hash_table_remove_all(server->disc_cache);
+		g_queue_init(&server->disc_lru);
+		g_mutex_unlock(&server->cache_lock);
+	}
+}
+
+static struct device_ccc *ccc_load(struct btd_device *device)
+{
+	struct device_ccc *ccc;
+	GKeyFile *key_file;
+	char *filename;
+	char **groups;
+	int i;
+
+	ccc = g_new0(struct device_ccc, 1);
+	ccc->device = btd_device_ref(device);
+	ccc->values = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	filename = btd_device_get_storage_path(device, "ccc");
+
+	key_file = g_key_file_new();
+	g_key_file_load_from_file(key_file, filename, 0, NULL);
+
+	groups = g_key_file_get_groups(key_file, NULL);
+
+	for (i = 0; groups && groups[i]; i++) {
+		unsigned int handle, config;
+		char *str;
+
+		if (sscanf(groups[i], "%u", &handle) != 1 || handle > 0xffff)
+			continue;
+
+		str = g_key_file_get_string(key_file, groups[i], "Value", NULL);
+		if (str && sscanf(str, "%04X", &config) == 1)
+			g_hash_table_insert(ccc->values,
+						GUINT_TO_POINTER(handle),
+						GUINT_TO_POINTER(config));
+
+		g_free(str);
+	}
+
+	g_strfreev(groups);
+	g_free(filename);
+	g_key_file_free(key_file);
+
+	return ccc;
+}
+
+/* Write back the values of @ccc, with ccc_lock held only to copy them */
+static void ccc_store(struct device_ccc *ccc)
+{
+	struct gatt_server *server = ccc->server;
+	GHashTableIter iter;
+	gpointer key, val;
+	char *filename;
+	GKeyFile *key_file;
+	char *data;
+	gsize length = 0;
+
+	key_file = g_key_file_new();
+
+	g_mutex_lock(&server->ccc_lock);
+
+	ccc->dirty = FALSE;
+
+	g_hash_table_iter_init(&iter, ccc->values);
+	while (g_hash_table_iter_next(&iter, &key, &val)) {
+		char group[6], value[5];
+
+		sprintf(group, "%hu", (uint16_t) GPOINTER_TO_UINT(key));
+		sprintf(value, "%hhX", (uint16_t) GPOINTER_TO_UINT(val));
+		g_key_file_set_string(key_file, group, "Value", value);
+	}
+
+	g_mutex_unlock(&server->ccc_lock);
+
+	data = g_key_file_to_data(key_file, &length, NULL);
+	if (length > 0) {
+		filename = btd_device_get_storage_path(ccc->device, "ccc");
+		create_file(filename, S_IRUSR | S_IWUSR);
+		g_file_set_contents(filename, data, length, NULL);
+		g_free(filename);
+	}
+
+	g_free(data);
+	g_key_file_free(key_file);
+}
+
+static void ccc_put(struct device_ccc *ccc);
+
+static gboolean ccc_flush(gpointer user_data)
+{
+	struct gatt_server *server = user_data;
+	GSList *dirty = NULL, *l;
+
+	g_mutex_lock(&server->ccc_lock);
+
+	server->ccc_flush_id = 0;
+
+	for (l = server->ccc_devices; l; l = l->next) {
+		struct device_ccc *ccc = l->data;
+
+		if (ccc->dirty) {
+			ccc->refs++;
+			dirty = g_slist_prepend(dirty, ccc);
+		}
+	}
+
+	g_mutex_unlock(&server->ccc_lock);
+
+	for (l = dirty; l; l = l->next) {
+		ccc_store(l->data);
+		ccc_put(l->data);
+	}
+
+	g_slist_free(dirty);
+
+	return FALSE;
+}
+
+/* Share or load the CCC values of @device, on the main thread */
+static struct device_ccc *ccc_get(struct gatt_server *server,
+						struct btd_device *device)
+{
+	struct device_ccc *ccc;
+	GSList *l;
+
+	g_mutex_lock(&server->ccc_lock);
+
+	for (l = server->ccc_devices; l; l = l->next) {
+		ccc = l->data;
+
+		if (ccc->device == device) {
+			ccc->refs++;
+			g_mutex_unlock(&server->ccc_lock);
+			return ccc;
+		}
+	}
+
+	g_mutex_unlock(&server->ccc_lock);
+
+	/* Nobody else adds values, so the file is read unlocked */
+	ccc = ccc_load(device);
+	ccc->server = server_ref(server);
+	ccc->refs = 1;
+
+	g_mutex_lock(&server->ccc_lock);
+	server->ccc_devices = g_slist_prepend(server->ccc_devices, ccc);
+	g_mutex_unlock(&server->ccc_lock);
+
+	return ccc;
+}
+
+/*
+ * Unused values stay listed until released on the main thread: a channel
+ * set up for the device meanwhile takes them back rather than reloading a
+ * file not yet written.
+ */
+static gboolean ccc_release(gpointer user_data)
+{
+	struct device_ccc *ccc = user_data;
+	struct gatt_server *server = ccc->server;
+
+	g_mutex_lock(&server->ccc_lock);
+
+	ccc->releasing = FALSE;
+
+	if (ccc->refs > 0) {
+		g_mutex_unlock(&server->ccc_lock);
+		return FALSE;
+	}
+
+	server->ccc_devices = g_slist_remove(server->ccc_devices, ccc);
+
+	g_mutex_unlock(&server->ccc_lock);
+
+	if (ccc->dirty)
+		ccc_store(ccc);
+
+	btd_device_unref(ccc->device);
+	g_hash_table_destroy(ccc->values);
+	g_free(ccc);
+
+	server_unref(server);
+
+	return FALSE;
+}
+
+static void ccc_put(struct device_ccc *ccc)
+{
+	struct gatt_server *server = ccc->server;
+
+	g_mutex_lock(&server->ccc_lock);
+
+	if (--ccc->refs > 0 || ccc->releasing) {
+		g_mutex_unlock(&server->ccc_lock);
+		return;
+	}
+
+	ccc->releasing = TRUE;
+
+	g_mutex_unlock(&server->ccc_lock);
+
+	g_main_context_invoke(NULL, ccc_release, ccc);
+}
+
+static void ccc_set(struct gatt_server *server, struct device_ccc *ccc,
+					uint16_t handle, uint16_t value)
+{
+	gpointer old;
+
+	g_mutex_lock(&server->ccc_lock);
+
+	if (g_hash_table_lookup_extended(ccc->values, GUINT_TO_POINTER(handle),
+							NULL, &old) &&
+				GPOINTER_TO_UINT(old) == value) {
+		g_mutex_unlock(&server->ccc_lock);
+		return;
+	}
+
+	g_hash_table_insert(ccc->values, GUINT_TO_POINTER(handle),
+						GUINT_TO_POINTER(value));
+	ccc->dirty = TRUE;
+
+	if (server->ccc_flush_id == 0)
+		server->ccc_flush_id = g_timeout_add_seconds(CCC_FLUSH_TIMEOUT,
+							ccc_flush, server);
+
+	g_mutex_unlock(&server->ccc_lock);
+}
+
+static gboolean ccc_lookup(struct device_ccc *ccc, uint16_t handle,
+							uint16_t *value)
+{
+	gpointer config;
+	gboolean found;
+
+	if (ccc == NULL)
+		return FALSE;
+
+	g_mutex_lock(&ccc->server->ccc_lock);
+
+	found = g_hash_table_lookup_extended(ccc->values,
+				GUINT_TO_POINTER(handle), NULL, &config);
+	if (found)
+		*value = GPOINTER_TO_UINT(config);
+
+	g_mutex_unlock(&ccc->server->ccc_lock);
+
+	return found;
+}
+
+static struct notify_pdu *notify_pdu_new(uint8_t opcode, struct attribute *a)
+{
+	struct notify_pdu *pdu;
+	size_t vlen = MIN(a->len, ATT_MAX_VALUE_LEN);
+	size_t len = 3 + vlen;
+
+	pdu = g_malloc(sizeof(*pdu) + len);
+	pdu->refs = 1;
+	pdu->handle = a->handle;
+
+	if (opcode == ATT_OP_HANDLE_NOTIFY)
+		pdu->len = enc_notification(a->handle, a->data, vlen,
+							pdu->data, len);
+	else
+		pdu->len = enc_indication(a->handle, a->data, vlen,
+							pdu->data, len);
+
+	return pdu;
+}
+
+static struct notify_pdu *notify_pdu_ref(struct notify_pdu *pdu)
+{
+	__sync_fetch_and_add(&pdu->refs, 1);
+
+	return pdu;
+}
+
+static void notify_pdu_unref(gpointer data)
+{
+	struct notify_pdu *pdu = data;
+
+	if (pdu != NULL && __sync_sub_and_fetch(&pdu->refs, 1) == 0)
+		g_free(pdu);
+}
+
+static struct notify_queue *notify_queue_new(struct gatt_channel *channel)
+{
+	struct notify_queue *nq;
+
+	nq = g_new0(struct notify_queue, 1);
+	nq->refs = 1;
+	g_rec_mutex_init(&nq->lock);
+	nq->channel = channel;
+	nq->order = g_queue_new();
+	nq->pending = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	return nq;
+}
+
+static struct notify_queue *notify_queue_ref(struct notify_queue *nq)
+{
+	__sync_fetch_and_add(&nq->refs, 1);
+
+	return nq;
+}
+
+static void notify_queue_clear(struct notify_queue *nq)
+{
+	struct notify_pdu *pdu;
+
+	while ((pdu = g_queue_pop_head(nq->order)))
+		notify_pdu_unref(pdu);
+
+	g_hash_table_remove_all(nq->pending);
+}
+
+static void notify_queue_unref(gpointer data)
+{
+	struct notify_queue *nq = data;
+
+	if (__sync_sub_and_fetch(&nq->refs, 1) > 0)
+		return;
+
+	notify_queue_clear(nq);
+	g_queue_free(nq->order);
+	g_hash_table_destroy(nq->pending);
+	g_rec_mutex_clear(&nq->lock);
+	g_free(nq);
+}
+
+static void notify_queue_drain(struct notify_queue *nq);
+
+static void notification_sent(gpointer user_data)
+{
+	struct notify_queue *nq = user_data;
+
+	g_rec_mutex_lock(&nq->lock);
+
+	nq->inflight--;
+
+	if (nq->channel)
+		notify_queue_drain(nq);
+
+	g_rec_mutex_unlock(&nq->lock);
+
+	notify_queue_unref(nq);
+}
+
+static void indication_cb(guint8 status, const guint8 *pdu, guint16 plen,
+							gpointer user_data)
+{
+	struct notify_queue *nq = user_data;
+
+	g_rec_mutex_lock(&nq->lock);
+
+	nq->ind_id = 0;
+
+	if (status)
+		DBG("Indication not confirmed: 0x%02x", status);
+
+	if (nq->channel)
+		notify_queue_drain(nq);
+
+	g_rec_mutex_unlock(&nq->lock);
+}
+
+static void indication_done(gpointer user_data)
+{
+	notify_queue_unref(user_data);
+}
+
+static gboolean notify_send(struct notify_queue *nq, struct notify_pdu *pdu)
+{
+	struct gatt_channel *channel = nq->channel;
+	struct attrib_notify_stats *stats = &channel->server->notify_stats;
+	uint16_t len = MIN(pdu->len, channel->mtu);
+	guint id;
+
+	if (pdu->data[0] == ATT_OP_HANDLE_IND) {
+		id = g_attrib_send(channel->attrib, 0, pdu->data, len,
+					indication_cb, notify_queue_ref(nq),
+					indication_done);
+		if (id == 0) {
+			notify_queue_unref(nq);
+			__sync_fetch_and_add(&stats->dropped, 1);
+			return FALSE;
+		}
+
+		nq->ind_id = id;
+		__sync_fetch_and_add(&stats->indications, 1);
+
+		return TRUE;
+	}
+
+	nq->inflight++;
+
+	id = g_attrib_send(channel->attrib, 0, pdu->data, len, NULL,
+				notify_queue_ref(nq), notification_sent);
+	if (id == 0) {
+		nq->inflight--;
+		notify_queue_unref(nq);
+		__sync_fetch_and_add(&stats->dropped, 1);
+		return FALSE;
+	}
+
+	__sync_fetch_and_add(&stats->notifications, 1);
+
+	return TRUE;
+}
+
+static gboolean notify_can_send(struct notify_queue *nq,
+						struct notify_pdu *pdu)
+{
+	if (pdu->data[0] == ATT_OP_HANDLE_IND)
+		return nq->ind_id == 0;
+
+	return nq->inflight < NOTIFY_WINDOW;
+}
+
+static void notify_queue_drain(struct notify_queue *nq)
+{
+	struct notify_pdu *pdu;
+
+	while ((pdu = g_queue_peek_head(nq->order))) {
+		if (!notify_can_send(nq, pdu))
+			break;
+
+		g_queue_pop_head(nq->order);
+		g_hash_table_remove(nq->pending,
+					GUINT_TO_POINTER(pdu->handle));
+
+		notify_send(nq, pdu);
+		notify_pdu_unref(pdu);
+	}
+}
+
+static void notify_queue_push(struct notify_queue *nq, struct notify_pdu *pdu)
+{
+	struct attrib_notify_stats *stats = &nq->channel->server->notify_stats;
+	GList *link;
+
+	link = g_hash_table_lookup(nq->pending, GUINT_TO_POINTER(pdu->handle));
+	if (link) {
+		/* Backlogged: the latest value wins */
+		notify_pdu_unref(link->data);
+		link->data = notify_pdu_ref(pdu);
+		__sync_fetch_and_add(&stats->coalesced, 1);
+		return;
+	}
+
+	if (g_queue_is_empty(nq->order) && notify_can_send(nq, pdu)) {
+		notify_send(nq, pdu);
+		return;
+	}
+
+	if (g_queue_get_length(nq->order) >= NOTIFY_QUEUE_MAX) {
+		__sync_fetch_and_add(&stats->dropped, 1);
+		return;
+	}
+
+	g_queue_push_tail(nq->order, notify_pdu_ref(pdu));
+	g_hash_table_insert(nq->pending, GUINT_TO_POINTER(pdu->handle),
+						g_queue_peek_tail_link(nq->order));
+}
+
+/* Handle of the CCC descriptor of the characteristic whose value is @a */
+static uint16_t find_ccc(struct gatt_server *server, struct attribute *a)
+{
+	struct attribute *decl, *ccc, *next;
+	unsigned int limit;
+
+	decl = db_prev(server, a);
+	if (decl == NULL || decl->len < 3 ||
+				bt_uuid_cmp(&decl->uuid, &chr_uuid) != 0 ||
+				att_get_u16(&decl->data[1]) != a->handle)
+		return 0;
+
+	ccc = type_first(type_lookup(server, &ccc_uuid), a->handle + 1);
+	if (ccc == NULL)
+		return 0;
+
+	limit = 0x10000;
+
+	next = type_first(type_lookup(server, &chr_uuid), a->handle + 1);
+	if (next)
+		limit = next->handle;
+
+	next = next_service(server, a->handle);
+	if (next && next->handle < limit)
+		limit = next->handle;
+
+	return ccc->handle < limit ? ccc->handle : 0;
+}
+
+/*
+ * Push the current value of @a to every channel that enabled notifications
+ * or indications on it. Each PDU is encoded once and shared by the queues.
+ */
+static void notify_subscribers(struct gatt_server *server,
+							struct attribute *a)
+{
+	struct notify_pdu *notif = NULL, *ind = NULL;
+	uint16_t handle;
+	GSList *l;
+
+	if (server->clients == NULL)
+		return;
+
+	handle = find_ccc(server, a);
+	if (handle == 0)
+		return;
+
+	for (l = server->clients; l; l = l->next) {
+		struct gatt_channel *channel = l->data;
+		struct notify_pdu *pdu;
+		uint16_t cfg;
+
+		if (!ccc_lookup(channel->ccc, handle, &cfg))
+			continue;
+
+		if (cfg & GATT_CLIENT_CHARAC_CFG_NOTIF_BIT) {
+			if (notif == NULL)
+				notif = notify_pdu_new(ATT_OP_HANDLE_NOTIFY,
+									a);
+			pdu = notif;
+		} else if (cfg & GATT_CLIENT_CHARAC_CFG_IND_BIT) {
+			if (ind == NULL)
+				ind = notify_pdu_new(ATT_OP_HANDLE_IND, a);
+			pdu = ind;
+		} else {
+			continue;
+		}
+
+		g_rec_mutex_lock(&channel->notify->lock);
+		notify_queue_push(channel->notify, pdu);
+		g_rec_mutex_unlock(&channel->notify->lock);
+	}
+
+	notify_pdu_unref(notif);
+	notify_pdu_unref(ind);
+}
+
+static void prep_queue_clear(struct gatt_channel *channel)
+{
+	struct prep_write *prep;
+
+	while ((prep = g_queue_pop_head(channel->prep_queue)))
+		g_free(prep);
+
+	channel->prep_bytes = 0;
+}
+
+static gboolean device_release(gpointer user_data)
+{
+	btd_device_unref(user_data);
+
+	return FALSE;
+}
+
+/* Device references are dropped on the main thread */
+static void device_put(struct btd_device *device)
+{
+	g_main_context_invoke(NULL, device_release, device);
+}
+
+/* Bearer side of a channel, torn down on the thread owning it */
+static gboolean channel_release(gpointer user_data)
+{
+	struct gatt_channel *channel = user_data;
+
+	g_attrib_unregister(channel->attrib, channel->id);
+
+	g_source_destroy(channel->cleanup);
+	g_source_unref(channel->cleanup);
+
+	device_put(channel->device);
+
+	g_attrib_unref(channel->attrib);
+	server_unref(channel->server);
+
+	if (channel->sharded)
+		__sync_sub_and_fetch(&shard_channels, 1);
+
+	g_free(channel);
+
+	return FALSE;
+}
+
+/* Called with db_lock held for writing */
+static void channel_free(struct gatt_channel *channel)
+{
+	struct notify_queue *nq = channel->notify;
+	struct held_pdu *held;
+	GSList *l;
+
+	/* Deferred requests still running complete into the void */
+	for (l = channel->requests; l; l = l->next) {
+		struct attrib_request *req = l->data;
+
+		req->channel = NULL;
+	}
+
+	g_slist_free(channel->requests);
+
+	if (channel->held) {
+		while ((held = g_queue_pop_head(channel->held)))
+			g_free(held);
+
+		g_queue_free(channel->held);
+	}
+
+	if (channel->prep_queue) {
+		prep_queue_clear(channel);
+		g_queue_free(channel->prep_queue);
+	}
+
+	if (nq) {
+		guint ind_id;
+
+		g_rec_mutex_lock(&nq->lock);
+		nq->channel = NULL;
+		notify_queue_clear(nq);
+		ind_id = nq->ind_id;
+		g_rec_mutex_unlock(&nq->lock);
+
+		if (ind_id)
+			g_attrib_cancel(channel->attrib, ind_id);
+
+		notify_queue_unref(nq);
+		channel->notify = NULL;
+	}
+
+	if (channel->ccc) {
+		ccc_put(channel->ccc);
+		channel->ccc = NULL;
+	}
+
+	/* A PDU being dispatched on the owner finds the channel closed */
+	channel->closed = TRUE;
+
+	g_main_context_invoke(g_attrib_get_context(channel->attrib),
+						channel_release, channel);
+}
+
+/*
+ * Stop serving: close the channels and empty the database. The server is
+ * freed once the last channel and request referencing it are gone.
+ */
+static void gatt_server_stop(struct gatt_server *server)
+{
+	db_lock(server, TRUE);
+
+	server->stopped = TRUE;
+
+	g_slist_free_full(server->clients, (GDestroyNotify) channel_free);
+	server->clients = NULL;
+
+	db_free(server);
+
+	db_unlock(server);
+
+	g_mutex_lock(&server->ccc_lock);
+
+	/* Values still in use are stored when released */
+	if (server->ccc_flush_id > 0) {
+		g_source_remove(server->ccc_flush_id);
+		server->ccc_flush_id = 0;
+	}
+
+	g_mutex_unlock(&server->ccc_lock);
+
+	if (server->l2cap_io != NULL) {
+		g_io_channel_shutdown(server->l2cap_io, FALSE, NULL);
+		g_io_channel_unref(server->l2cap_io);
+		server->l2cap_io = NULL;
+	}
+
+	if (server->le_io != NULL) {
+		g_io_channel_shutdown(server->le_io, FALSE, NULL);
+		g_io_channel_unref(server->le_io);
+		server->le_io = NULL;
+	}
+
+	if (server->gatt_sdp_handle > 0)
+		remove_record_from_server(server->gatt_sdp_handle);
+
+	if (server->gap_sdp_handle > 0)
+		remove_record_from_server(server->gap_sdp_handle);
+
+	server->gatt_sdp_handle = 0;
+	server->gap_sdp_handle = 0;
+
+	if (server->adapter != NULL)
+		btd_adapter_unref(server->adapter);
+
+	server->adapter = NULL;
+}
+
+static void gatt_server_free(struct gatt_server *server)
+{
+	/* Attributes may have been added by a caller racing the stop */
+	db_free(server);
+
+	if (server->types)
+		g_hash_table_destroy(server->types);
+
+	if (server->disc_cache)
+		g_hash_table_destroy(server->disc_cache);
+
+	handle_set_free(&server->svc16);
+	handle_set_free(&server->svc128);
+	g_free(server->avail);
+
+	g_rw_lock_clear(&server->db_lock);
+	g_mutex_clear(&server->ccc_lock);
+	g_mutex_clear(&server->cache_lock);
+
+	g_free(server);
+}
+
+static void server_unref(struct gatt_server *server)
+{
+	if (__sync_sub_and_fetch(&server->refs, 1) > 0)
+		return;
+
+	gatt_server_free(server);
+}
+
+static gint adapter_cmp_addr(gconstpointer a, gconstpointer b)
+{
+	const struct gatt_server *server = a;
+	const bdaddr_t *bdaddr = b;
+
+	return bacmp(adapter_get_address(server->adapter), bdaddr);
+}
+
+static gint adapter_cmp(gconstpointer a, gconstpointer b)
+{
+	const struct gatt_server *server = a;
+	const struct btd_adapter *adapter = b;
+
+	if (server->adapter == adapter)
+		return 0;
+
+	return -1;
+}
+
+/* Running server of @adapter, referenced */
+static struct gatt_server *server_get(struct btd_adapter *adapter)
+{
+	struct gatt_server *server = NULL;
+	GSList *l;
+
+	g_mutex_lock(&servers_lock);
+
+	l = g_slist_find_custom(servers, adapter, adapter_cmp);
+	if (l)
+		server = server_ref(l->data);
+
+	g_mutex_unlock(&servers_lock);
+
+	return server;
+}
+
+/* Running server of @adapter, referenced and with db_lock held */
+static struct gatt_server *lock_server(struct btd_adapter *adapter,
+							gboolean write)
+{
+	struct gatt_server *server;
+
+	server = server_get(adapter);
+	if (server == NULL)
+		return NULL;
+
+	db_lock(server, write);
+
+	if (!server->stopped)
+		return server;
+
+	db_unlock(server);
+	server_unref(server);
+
+	return NULL;
+}
+
+static void unlock_server(struct gatt_server *server)
+{
+	db_unlock(server);
+	server_unref(server);
+}
+
+static struct gatt_server *find_gatt_server(const bdaddr_t *bdaddr)
+{
+	struct gatt_server *server = NULL;
+	GSList *l;
+
+	g_mutex_lock(&servers_lock);
+
+	l = g_slist_find_custom(servers, bdaddr, adapter_cmp_addr);
+	if (l)
+		server = server_ref(l->data);
+
+	g_mutex_unlock(&servers_lock);
+
+	if (server == NULL) {
+		char addr[18];
+
+		ba2str(bdaddr, addr);
+		error("No GATT server found in %s", addr);
+	}
+
+	return server;
+}
+
+static sdp_record_t *server_record_new(uuid_t *uuid, uint16_t start, uint16_t end)
+{
+	sdp_list_t *svclass_id, *apseq, *proto[2], *root, *aproto;
+	uuid_t root_uuid, proto_uuid, l2cap;
+	sdp_record_t *record;
+	sdp_data_t *psm, *sh, *eh;
+	uint16_t lp = ATT_PSM;
+
+	if (uuid == NULL)
+		return NULL;
+
+	if (start > end)
+		return NULL;
+
+	record = sdp_record_alloc();
+	if (record == NULL)
+		return NULL;
+
+	sdp_uuid16_create(&root_uuid, PUBLIC_BROWSE_GROUP);
+	root = sdp_list_append(NULL, &root_uuid);
+	sdp_set_browse_groups(record, root);
+	sdp_list_free(root, NULL);
+
+	svclass_id = sdp_list_append(NULL, uuid);
+	sdp_set_service_classes(record, svclass_id);
+	sdp_list_free(svclass_id, NULL);
+
+	sdp_uuid16_create(&l2cap, L2CAP_UUID);
+	proto[0] = sdp_list_append(NULL, &l2cap);
+	psm = sdp_data_alloc(SDP_UINT16, &lp);
+	proto[0] = sdp_list_append(proto[0], psm);
+	apseq = sdp_list_append(NULL, proto[0]);
+
+	sdp_uuid16_create(&proto_uuid, ATT_UUID);
+	proto[1] = sdp_list_append(NULL, &proto_uuid);
+	sh = sdp_data_alloc(SDP_UINT16, &start);
+	proto[1] = sdp_list_append(proto[1], sh);
+	eh = sdp_data_alloc(SDP_UINT16, &end);
+	proto[1] = sdp_list_append(proto[1], eh);
+	apseq = sdp_list_append(apseq, proto[1]);
+
+	aproto = sdp_list_append(NULL, apseq);
+	sdp_set_access_protos(record, aproto);
+
+	sdp_data_free(psm);
+	sdp_data_free(sh);
+	sdp_data_free(eh);
+	sdp_list_free(proto[0], NULL);
+	sdp_list_free(proto[1], NULL);
+	sdp_list_free(apseq, NULL);
+	sdp_list_free(aproto, NULL);
+
+	return record;
+}
+
+static struct attribute *find_svc_range(struct gatt_server *server,
+					uint16_t start, uint16_t *end)
+{
+	struct attribute *attrib, *a;
+
+	if (end == NULL)
+		return NULL;
+
+	attrib = db_lookup(server, start);
+	if (!attrib)
+		return NULL;
+
+	if (bt_uuid_cmp(&attrib->uuid, &prim_uuid) != 0 &&
+			bt_uuid_cmp(&attrib->uuid, &snd_uuid) != 0)
+		return NULL;
+
+	*end = start;
+
+	for (a = db_next(server, attrib); a; a = db_next(server, a)) {
+		if (bt_uuid_cmp(&a->uuid, &prim_uuid) == 0 ||
+				bt_uuid_cmp(&a->uuid, &snd_uuid) == 0)
+			break;
+
+		*end = a->handle;
+	}
+
+	return attrib;
+}
+
+static uint32_t attrib_create_sdp_new(struct gatt_server *server,
+					uint16_t handle, const char *name)
+{
+	sdp_record_t *record;
+	struct attribute *a;
+	uint16_t end = 0;
+	uuid_t svc, gap_uuid;
+
+	a = find_svc_range(server, handle, &end);
+
+	if (a == NULL)
+		return 0;
+
+	if (a->len == 2)
+		sdp_uuid16_create(&svc, att_get_u16(a->data));
+	else if (a->len == 16)
+		sdp_uuid128_create(&svc, a->data);
+	else
+		return 0;
+
+	record = server_record_new(&svc, handle, end);
+	if (record == NULL)
+		return 0;
+
+	if (name != NULL)
+		sdp_set_info_attr(record, name, "BlueZ", NULL);
+
+	sdp_uuid16_create(&gap_uuid, GENERIC_ACCESS_PROFILE_ID);
+	if (sdp_uuid_cmp(&svc, &gap_uuid) == 0) {
+		sdp_set_url_attr(record, "http://www.bluez.org/",
+				"http://www.bluez.org/",
+				"http://www.bluez.org/");
+	}
+
+	if (add_record_to_server(adapter_get_address(server->adapter), record)
+			== 0)
+		return record->handle;
+
+	sdp_record_free(record);
+	return 0;
+}
+
+static struct attribute *attrib_db_add_new(struct gatt_server *server,
+				uint16_t handle, bt_uuid_t *uuid,
+				int read_req, int write_req,
+				const uint8_t *value, size_t len)
+{
+	struct attribute *a;
+
+	DBG("handle=0x%04x", handle);
+
+	if (db_lookup(server, handle))
+		return NULL;
+
+	a = g_new0(struct attribute, 1);
+	a->len = len;
+	a->data = g_memdup(value, len);
+	a->handle = handle;
+	a->uuid = *uuid;
+	a->read_req = read_req;
+	a->write_req = write_req;
+
+	if (!db_insert(server, a)) {
+		attrib_free(a);
+		return NULL;
+	}
+
+	type_index_add(server, a);
+	avail_insert(server, a);
+	disc_cache_invalidate(server, handle, FALSE);
+
+	return a;
+}
+
+static uint8_t att_check_reqs(struct gatt_channel *channel, uint8_t opcode,
+								int reqs)
+{
+	/* FIXME: currently, it is assumed an encrypted link is enough for
+	 * authentication. This will allow to enable the SMP negotiation once
+	 * it is on upstream kernel. High security level should be mapped
+	 * to authentication and medium to encryption permission. */
+	if (!channel->encrypted)
+		channel->encrypted = g_attrib_is_encrypted(channel->attrib);
+	if (reqs == ATT_AUTHENTICATION && !channel->encrypted)
+		return ATT_ECODE_AUTHENTICATION;
+	else if (reqs == ATT_AUTHORIZATION)
+		return ATT_ECODE_AUTHORIZATION;
+
+	switch (opcode) {
+	case ATT_OP_READ_BY_GROUP_REQ:
+	case ATT_OP_READ_BY_TYPE_REQ:
+	case ATT_OP_READ_REQ:
+	case ATT_OP_READ_BLOB_REQ:
+	case ATT_OP_READ_MULTI_REQ:
+		if (reqs == ATT_NOT_PERMITTED)
+			return ATT_ECODE_READ_NOT_PERM;
+		break;
+	case ATT_OP_PREP_WRITE_REQ:
+	case ATT_OP_WRITE_REQ:
+	case ATT_OP_WRITE_CMD:
+		if (reqs == ATT_NOT_PERMITTED)
+			return ATT_ECODE_WRITE_NOT_PERM;
+		break;
+	}
+
+	return 0;
+}
+
+static uint16_t read_by_group(struct gatt_channel *channel, uint16_t start,
+						uint16_t end, bt_uuid_t *uuid,
+						uint8_t *pdu, size_t len)
+{
+	struct gatt_server *server = channel->server;
+	struct att_data_list *adl;
+	struct attrib_type *type;
+	struct attribute *a;
+	struct group_elem *cur;
+	GSList *l, *groups;
+	uint16_t length, last_size = 0;
+	gboolean cacheable = TRUE;
+	unsigned int idx;
+	uint8_t status;
+	int i;
+
+	if (start > end || start == 0x0000)
+		return enc_error_resp(ATT_OP_READ_BY_GROUP_REQ, start,
+					ATT_ECODE_INVALID_HANDLE, pdu, len);
+
+	/*
+	 * Only <<Primary Service>> and <<Secondary Service>> grouping
+	 * types may be used in the Read By Group Type Request.
+	 */
+
+	if (bt_uuid_cmp(uuid, &prim_uuid) != 0 &&
+		bt_uuid_cmp(uuid, &snd_uuid) != 0)
+		return enc_error_resp(ATT_OP_READ_BY_GROUP_REQ, 0x0000,
+					ATT_ECODE_UNSUPP_GRP_TYPE, pdu, len);
+
+	length = disc_cache_lookup(server, ATT_OP_READ_BY_GROUP_REQ, start,
+							end, uuid, pdu, len);
+	if (length)
+		return length;
+
+	type = type_lookup(server, uuid);
+	idx = type ? type_lower_bound(type, start) : 0;
+
+	for (groups = NULL, length = 0; type && idx < type->num; idx++) {
+		a = type->attrs[idx];
+
+		if (!attr_is_static(a))
+			cacheable = FALSE;
+
+		if (a->handle >= end)
+			break;
+
+		if (last_size && (last_size != a->len))
+			break;
+
+		/* Stop once the response PDU is full */
+		if (last_size && length >= (len - 2) / (last_size + 4))
+			break;
+
+		status = att_check_reqs(channel, ATT_OP_READ_BY_GROUP_REQ,
+								a->read_req);
+
+		if (status == 0x00 && read_needs_writer(server, a)) {
+			g_slist_free_full(groups, g_free);
+			return 0;
+		}
+
+		if (status == 0x00 && a->read_cb)
+			status = a->read_cb(a, channel->device,
+							a->cb_user_data);
+
+		if (status) {
+			g_slist_free_full(groups, g_free);
+			return enc_error_resp(ATT_OP_READ_BY_GROUP_REQ,
+						a->handle, status, pdu, len);
+		}
+
+		cur = g_new0(struct group_elem, 1);
+		cur->handle = a->handle;
+		cur->end = group_end(server, a->handle, end);
+		cur->data = a->data;
+		cur->len = a->len;
+
+		/* Attribute Grouping Type found */
+		groups = g_slist_append(groups, cur);
+		length++;
+
+		last_size = a->len;
+	}
+
+	if (groups == NULL) {
+		length = enc_error_resp(ATT_OP_READ_BY_GROUP_REQ, start,
+					ATT_ECODE_ATTR_NOT_FOUND, pdu, len);
+		goto done;
+	}
+
+	adl = att_data_list_alloc(length, last_size + 4);
+	if (adl == NULL) {
+		g_slist_free_full(groups, g_free);
+		return enc_error_resp(ATT_OP_READ_BY_GROUP_REQ, start,
+					ATT_ECODE_UNLIKELY, pdu, len);
+	}
+
+	for (i = 0, l = groups; l; l = l->next, i++) {
+		uint8_t *value;
+
+		cur = l->data;
+
+		value = (void *) adl->data[i];
+
+		att_put_u16(cur->handle, value);
+		att_put_u16(cur->end, &value[2]);
+		/* Attribute Value */
+		memcpy(&value[4], cur->data, cur->len);
+	}
+
+	length = enc_read_by_grp_resp(adl, pdu, len);
+
+	att_data_list_free(adl);
+	g_slist_free_full(groups, g_free);
+
+done:
+	if (cacheable)
+		disc_cache_add(server, ATT_OP_READ_BY_GROUP_REQ, start, end,
+						uuid, pdu, len, length);
+
+	return length;
+}
+
+static uint16_t read_by_type(struct gatt_channel *channel, uint16_t start,
+						uint16_t end, bt_uuid_t *uuid,
+						uint8_t *pdu, size_t len)
+{
+	struct gatt_server *server = channel->server;
+	struct att_data_list *adl;
+	struct attrib_type *type;
+	GSList *l, *types;
+	struct attribute *a;
+	uint16_t num, length;
+	gboolean cacheable = TRUE;
+	unsigned int idx;
+	uint8_t status;
+	int i;
+
+	if (start > end || start == 0x0000)
+		return enc_error_resp(ATT_OP_READ_BY_TYPE_REQ, start,
+					ATT_ECODE_INVALID_HANDLE, pdu, len);
+
+	length = disc_cache_lookup(server, ATT_OP_READ_BY_TYPE_REQ, start, end,
+							uuid, pdu, len);
+	if (length)
+		return length;
+
+	type = type_lookup(server, uuid);
+	idx = type ? type_lower_bound(type, start) : 0;
+
+	for (length = 0, num = 0, types = NULL; type && idx < type->num;
+								idx++) {
+		a = type->attrs[idx];
+
+		if (a->handle > end)
+			break;
+
+		if (!attr_is_static(a))
+			cacheable = FALSE;
+
+		/* Stop once the response PDU is full */
+		if (length && num >= (len - 2) / (length + 2))
+			break;
+
+		status = att_check_reqs(channel, ATT_OP_READ_BY_TYPE_REQ,
+								a->read_req);
+
+		if (status == 0x00 && read_needs_writer(server, a)) {
+			g_slist_free(types);
+			return 0;
+		}
+
+		if (status == 0x00 && a->read_cb)
+			status = a->read_cb(a, channel->device,
+							a->cb_user_data);
+
+		if (status) {
+			g_slist_free(types);
+			return enc_error_resp(ATT_OP_READ_BY_TYPE_REQ,
+						a->handle, status, pdu, len);
+		}
+
+		/* All elements must have the same length */
+		if (length == 0)
+			length = a->len;
+		else if (a->len != length)
+			break;
+
+		types = g_slist_append(types, a);
+		num++;
+	}
+
+	if (types == NULL) {
+		length = enc_error_resp(ATT_OP_READ_BY_TYPE_REQ, start,
+					ATT_ECODE_ATTR_NOT_FOUND, pdu, len);
+		goto done;
+	}
+
+	/* Handle length plus attribute value length */
+	length += 2;
+
+	adl = att_data_list_alloc(num, length);
+	if (adl == NULL) {
+		g_slist_free(types);
+		return enc_error_resp(ATT_OP_READ_BY_TYPE_REQ, start,
+					ATT_ECODE_UNLIKELY, pdu, len);
+	}
+
+	for (i = 0, l = types; l; i++, l = l->next) {
+		uint8_t *value;
+
+		a = l->data;
+
+		value = (void *) adl->data[i];
+
+		att_put_u16(a->handle, value);
+
+		/* Attribute Value */
+		memcpy(&value[2], a->data, a->len);
+	}
+
+	length = enc_read_by_type_resp(adl, pdu, len);
+
+	att_data_list_free(adl);
+	g_slist_free(types);
+
+done:
+	if (cacheable)
+		disc_cache_add(server, ATT_OP_READ_BY_TYPE_REQ, start, end,
+						uuid, pdu, len, length);
+
+	return length;
+}
+
+static uint16_t find_info(struct gatt_channel *channel, uint16_t start,
+				uint16_t end, uint8_t *pdu, size_t len)
+{
+	struct gatt_server *server = channel->server;
+	struct attribute *a;
+	struct att_data_list *adl;
+	GSList *l, *info;
+	uint8_t format, last_type = BT_UUID_UNSPEC;
+	uint16_t length, num;
+	int i;
+
+	if (start > end || start == 0x0000)
+		return enc_error_resp(ATT_OP_FIND_INFO_REQ, start,
+					ATT_ECODE_INVALID_HANDLE, pdu, len);
+
+	length = disc_cache_lookup(server, ATT_OP_FIND_INFO_REQ, start, end,
+							NULL, pdu, len);
+	if (length)
+		return length;
+
+	for (a = db_first(server, start), info = NULL, num = 0;
+				a; a = db_next(server, a)) {
+		if (a->handle > end)
+			break;
+
+		if (last_type == BT_UUID_UNSPEC)
+			last_type = a->uuid.type;
+
+		if (a->uuid.type != last_type)
+			break;
+
+		info = g_slist_append(info, a);
+		num++;
+
+		last_type = a->uuid.type;
+	}
+
+	if (info == NULL) {
+		length = enc_error_resp(ATT_OP_FIND_INFO_REQ, start,
+					ATT_ECODE_ATTR_NOT_FOUND, pdu, len);
+		goto done;
+	}
+
+	if (last_type == BT_UUID16) {
 		length = 2;
 		format = 0x01;
 	} else if (last_type == BT_UUID128) {
@@ -658,266 +2471,763 @@ static uint16_t find_info(struct gatt_channel *channel, uint16_t start,
 		return 0;
 	}
 
-	adl = att_data_list_alloc(num, length + 2);
-	if (adl == NULL) {
-		g_slist_free(info);
-		return enc_error_resp(ATT_OP_FIND_INFO_REQ, start,
-					ATT_ECODE_UNLIKELY, pdu, len);
+	adl = att_data_list_alloc(num, length + 2);
+	if (adl == NULL) {
+		g_slist_free(info);
+		return enc_error_resp(ATT_OP_FIND_INFO_REQ, start,
+					ATT_ECODE_UNLIKELY, pdu, len);
+	}
+
+	for (i = 0, l = info; l; i++, l = l->next) {
+		uint8_t *value;
+
+		a = l->data;
+
+		value = (void *) adl->data[i];
+
+		att_put_u16(a->handle, value);
+
+		/* Attribute Value */
+		att_put_uuid(a->uuid, &value[2]);
+	}
+
+	length = enc_find_info_resp(format, adl, pdu, len);
+
+	att_data_list_free(adl);
+	g_slist_free(info);
+
+done:
+	disc_cache_add(server, ATT_OP_FIND_INFO_REQ, start, end, NULL, pdu,
+							len, length);
+
+	return length;
+}
+
+static uint16_t find_by_type(struct gatt_channel *channel, uint16_t start,
+				uint16_t end, bt_uuid_t *uuid,
+				const uint8_t *value, size_t vlen,
+				uint8_t *opdu, size_t mtu)
+{
+	struct gatt_server *server = channel->server;
+	struct attrib_type *type;
+	struct attribute *a;
+	struct att_range *range;
+	GSList *matches;
+	unsigned int idx;
+	uint16_t len;
+
+	if (start > end || start == 0x0000)
+		return enc_error_resp(ATT_OP_FIND_BY_TYPE_REQ, start,
+					ATT_ECODE_INVALID_HANDLE, opdu, mtu);
+
+	type = type_lookup(server, uuid);
+	idx = type ? type_lower_bound(type, start) : 0;
+
+	/* Searching first requested handle number */
+	for (matches = NULL, range = NULL; type && idx < type->num; idx++) {
+		a = type->attrs[idx];
+
+		if (a->handle > end)
+			break;
+
+		/* Attribute value matches? */
+		if (a->len != vlen || memcmp(a->data, value, vlen) != 0)
+			continue;
+
+		/* A new match closes the range being tracked */
+		if (range)
+			range->end = group_end(server, range->start,
+								a->handle);
+
+		range = g_new0(struct att_range, 1);
+		range->start = a->handle;
+
+		matches = g_slist_append(matches, range);
+	}
+
+	if (matches == NULL)
+		return enc_error_resp(ATT_OP_FIND_BY_TYPE_REQ, start,
+				ATT_ECODE_ATTR_NOT_FOUND, opdu, mtu);
+
+	/* It is allowed to have end group handle the same as start handle,
+	 * for groups with only one attribute. */
+	range->end = group_end(server, range->start, end + 1);
+
+	len = enc_find_by_type_resp(matches, opdu, mtu);
+
+	g_slist_free_full(matches, g_free);
+
+	return len;
+}
+
+static int read_device_ccc(struct gatt_channel *channel, uint16_t handle,
+				uint16_t *value)
+{
+	if (!ccc_lookup(channel->ccc, handle, value))
+		return -ENOENT;
+
+	return 0;
+}
+
+static gboolean channel_handler(const uint8_t *ipdu, uint16_t len,
+					struct gatt_channel *channel);
+
+static void request_complete(struct attrib_request *req, uint8_t status);
+
+static int db_update_locked(struct gatt_server *server, uint16_t handle,
+					bt_uuid_t *uuid, const uint8_t *value,
+					size_t len, struct attribute **attr);
+
+static void request_free(struct attrib_request *req)
+{
+	server_unref(req->server);
+	g_main_context_unref(req->context);
+	g_free(req->value);
+	g_free(req);
+}
+
+/*
+ * Start a deferred access to @a. Returns TRUE when the response is sent
+ * on completion, which may already have happened, rather than by the
+ * caller.
+ */
+static gboolean request_start(struct gatt_channel *channel,
+					struct attribute *a, uint8_t opcode,
+					uint16_t offset, const uint8_t *value,
+					size_t vlen)
+{
+	struct attrib_request *req;
+
+	req = g_new0(struct attrib_request, 1);
+	req->server = server_ref(channel->server);
+	req->channel = channel;
+	req->context = g_main_context_ref(g_attrib_get_context(channel->attrib));
+	req->opcode = opcode;
+	req->handle = a->handle;
+	req->offset = offset;
+
+	if (value) {
+		req->value = g_memdup(value, vlen);
+		req->vlen = vlen;
+	}
+
+	channel->requests = g_slist_prepend(channel->requests, req);
+
+	/* Write Commands have no response to wait for */
+	if (opcode != ATT_OP_WRITE_CMD)
+		channel->pending = req;
+
+	req->starting = TRUE;
+
+	if (opcode == ATT_OP_READ_REQ || opcode == ATT_OP_READ_BLOB_REQ)
+		a->read_async(a, channel->device, req, a->cb_user_data);
+	else
+		a->write_async(a, channel->device, req, a->cb_user_data);
+
+	req->starting = FALSE;
+
+	/* Completed from within the callback */
+	if (req->done)
+		request_complete(req, req->status);
+
+	return opcode != ATT_OP_WRITE_CMD;
+}
+
+static uint16_t request_response(struct gatt_channel *channel,
+					struct attrib_request *req,
+					uint8_t *pdu, size_t len)
+{
+	struct gatt_server *server = channel->server;
+	struct attribute *a;
+
+	if (req->status)
+		return enc_error_resp(req->opcode, req->handle, req->status,
+								pdu, len);
+
+	if (req->opcode == ATT_OP_WRITE_REQ)
+		return enc_write_resp(pdu, len);
+
+	a = db_lookup(server, req->handle);
+	if (a == NULL)
+		return enc_error_resp(req->opcode, req->handle,
+					ATT_ECODE_INVALID_HANDLE, pdu, len);
+
+	if (req->has_value)
+		db_update_locked(server, req->handle, NULL, req->value,
+							req->vlen, &a);
+
+	if (req->opcode == ATT_OP_READ_REQ)
+		return enc_read_resp(a->data, a->len, pdu, len);
+
+	if (a->len <= req->offset)
+		return enc_error_resp(req->opcode, req->handle,
+					ATT_ECODE_INVALID_OFFSET, pdu, len);
+
+	return enc_read_blob_resp(a->data, a->len, req->offset, pdu, len);
+}
+
+/* Handle the requests that arrived while a response was outstanding */
+static void channel_release_held(struct gatt_channel *channel)
+{
+	struct held_pdu *held;
+
+	while (channel->pending == NULL &&
+				(held = g_queue_pop_head(channel->held))) {
+		channel_handler(held->data, held->len, channel);
+		g_free(held);
 	}
+}
 
-	for (i = 0, l = info; l; i++, l = l->next) {
-		uint8_t *value;
+uint16_t attrib_request_get_handle(struct attrib_request *req)
+{
+	return req->handle;
+}
 
-		a = l->data;
+const uint8_t *attrib_request_get_value(struct attrib_request *req,
+								size_t *len)
+{
+	if (len)
+		*len = req->vlen;
 
-		value = (void *) adl->data[i];
+	return req->value;
+}
 
-		att_put_u16(a->handle, value);
+void attrib_request_set_value(struct attrib_request *req,
+					const uint8_t *value, size_t len)
+{
+	g_free(req->value);
 
-		/* Attribute Value */
-		att_put_uuid(a->uuid, &value[2]);
+	req->value = g_memdup(value, len);
+	req->vlen = len;
+	req->has_value = TRUE;
+}
+
+static void request_complete(struct attrib_request *req, uint8_t status)
+{
+	struct gatt_channel *channel = req->channel;
+	uint16_t length;
+
+	req->status = status;
+
+	if (req->starting) {
+		req->done = TRUE;
+		return;
 	}
 
-	length = enc_find_info_resp(format, adl, pdu, len);
+	if (channel == NULL) {
+		request_free(req);
+		return;
+	}
 
-	att_data_list_free(adl);
-	g_slist_free(info);
+	channel->requests = g_slist_remove(channel->requests, req);
 
-	return length;
+	if (channel->pending == req) {
+		uint8_t opdu[channel->mtu];
+
+		channel->pending = NULL;
+
+		length = request_response(channel, req, opdu, channel->mtu);
+		g_attrib_send(channel->attrib, 0, opdu, length, NULL, NULL,
+									NULL);
+	} else if (status) {
+		DBG("Deferred write to 0x%04x failed: 0x%02x", req->handle,
+									status);
+	}
+
+	request_free(req);
+
+	channel_release_held(channel);
 }
 
-static uint16_t find_by_type(struct gatt_channel *channel, uint16_t start,
-				uint16_t end, bt_uuid_t *uuid,
-				const uint8_t *value, size_t vlen,
-				uint8_t *opdu, size_t mtu)
+void attrib_request_complete(struct attrib_request *req, uint8_t status)
+{
+	struct gatt_server *server = server_ref(req->server);
+
+	db_lock(server, TRUE);
+	request_complete(req, status);
+	unlock_server(server);
+}
+
+static gboolean request_done(gpointer user_data)
+{
+	struct attrib_request *req = user_data;
+
+	attrib_request_complete(req, req->status);
+
+	return FALSE;
+}
+
+static void request_worker(gpointer data, gpointer user_data)
+{
+	struct attrib_request *req = data;
+
+	req->status = req->func(req, req->user_data);
+
+	/* Completed on the thread the request came from */
+	g_main_context_invoke(req->context, request_done, req);
+}
+
+gboolean attrib_request_run(struct attrib_request *req,
+				attrib_request_func_t func, gpointer user_data)
+{
+	GError *gerr = NULL;
+	gboolean queued;
+
+	req->func = func;
+	req->user_data = user_data;
+
+	g_mutex_lock(&servers_lock);
+
+	if (request_pool == NULL)
+		request_pool = g_thread_pool_new(request_worker, NULL,
+						REQUEST_WORKERS, FALSE, &gerr);
+
+	queued = request_pool && g_thread_pool_push(request_pool, req, &gerr);
+
+	g_mutex_unlock(&servers_lock);
+
+	if (!queued) {
+		error("Unable to queue attribute request: %s", gerr->message);
+		g_error_free(gerr);
+	}
+
+	return queued;
+}
+
+static uint16_t read_value(struct gatt_channel *channel, uint16_t handle,
+				uint8_t *pdu, size_t len, gboolean *deferred)
 {
 	struct attribute *a;
-	struct att_range *range;
-	GSList *matches;
-	GList *dl, *database;
-	uint16_t len;
+	uint8_t status;
+	uint16_t cccval;
 
-	if (start > end || start == 0x0000)
-		return enc_error_resp(ATT_OP_FIND_BY_TYPE_REQ, start,
-					ATT_ECODE_INVALID_HANDLE, opdu, mtu);
+	a = db_lookup(channel->server, handle);
+	if (!a)
+		return enc_error_resp(ATT_OP_READ_REQ, handle,
+					ATT_ECODE_INVALID_HANDLE, pdu, len);
 
-	/* Searching first requested handle number */
-	database = channel->server->database;
-	for (dl = database, matches = NULL, range = NULL; dl; dl = dl->next) {
-		a = dl->data;
+	if (bt_uuid_cmp(&ccc_uuid, &a->uuid) == 0 &&
+		read_device_ccc(channel, handle, &cccval) == 0) {
+		uint8_t config[2];
+
+		att_put_u16(cccval, config);
+		return enc_read_resp(config, sizeof(config), pdu, len);
+	}
+
+	status = att_check_reqs(channel, ATT_OP_READ_REQ, a->read_req);
+
+	if (status == 0x00 && read_needs_writer(channel->server, a))
+		return 0;
+
+	if (status == 0x00 && a->read_async) {
+		*deferred = request_start(channel, a, ATT_OP_READ_REQ, 0,
+								NULL, 0);
+		return 0;
+	}
+
+	if (status == 0x00 && a->read_cb)
+		status = a->read_cb(a, channel->device, a->cb_user_data);
+
+	if (status)
+		return enc_error_resp(ATT_OP_READ_REQ, handle, status, pdu,
+									len);
+
+	return enc_read_resp(a->data, a->len, pdu, len);
+}
+
+static uint16_t read_blob(struct gatt_channel *channel, uint16_t handle,
+				uint16_t offset, uint8_t *pdu, size_t len,
+				gboolean *deferred)
+{
+	struct attribute *a;
+	uint8_t status;
+	uint16_t cccval;
+
+	a = db_lookup(channel->server, handle);
+	if (!a)
+		return enc_error_resp(ATT_OP_READ_BLOB_REQ, handle,
+					ATT_ECODE_INVALID_HANDLE, pdu, len);
+
+	if (a->len <= offset)
+		return enc_error_resp(ATT_OP_READ_BLOB_REQ, handle,
+					ATT_ECODE_INVALID_OFFSET, pdu, len);
+
+	if (bt_uuid_cmp(&ccc_uuid, &a->uuid) == 0 &&
+		read_device_ccc(channel, handle, &cccval) == 0) {
+		uint8_t config[2];
+
+		att_put_u16(cccval, config);
+		return enc_read_blob_resp(config, sizeof(config), offset,
+								pdu, len);
+	}
+
+	status = att_check_reqs(channel, ATT_OP_READ_BLOB_REQ, a->read_req);
+
+	if (status == 0x00 && read_needs_writer(channel->server, a))
+		return 0;
+
+	if (status == 0x00 && a->read_async) {
+		*deferred = request_start(channel, a, ATT_OP_READ_BLOB_REQ,
+							offset, NULL, 0);
+		return 0;
+	}
+
+	if (status == 0x00 && a->read_cb)
+		status = a->read_cb(a, channel->device, a->cb_user_data);
+
+	if (status)
+		return enc_error_resp(ATT_OP_READ_BLOB_REQ, handle, status,
+								pdu, len);
+
+	return enc_read_blob_resp(a->data, a->len, offset, pdu, len);
+}
+
+static uint16_t write_value(struct gatt_channel *channel, uint8_t opcode,
+					uint16_t handle, const uint8_t *value,
+					size_t vlen, uint8_t *pdu, size_t len,
+					gboolean *deferred)
+{
+	struct attribute *a;
+	uint8_t status;
+
+	a = db_lookup(channel->server, handle);
+	if (!a)
+		return enc_error_resp(ATT_OP_WRITE_REQ, handle,
+				ATT_ECODE_INVALID_HANDLE, pdu, len);
+
+	status = att_check_reqs(channel, opcode, a->write_req);
+	if (status)
+		return enc_error_resp(ATT_OP_WRITE_REQ, handle, status, pdu,
+									len);
+
+	if (bt_uuid_cmp(&ccc_uuid, &a->uuid) != 0) {
+
+		db_update_locked(channel->server, handle, NULL, value, vlen,
+									NULL);
+
+		if (a->write_async) {
+			*deferred = request_start(channel, a, opcode, 0, value,
+									vlen);
+			return 0;
+		}
+
+		if (a->write_cb) {
+			status = a->write_cb(a, channel->device,
+							a->cb_user_data);
+			if (status)
+				return enc_error_resp(ATT_OP_WRITE_REQ, handle,
+							status, pdu, len);
+		}
+	} else if (channel->ccc) {
+		ccc_set(channel->server, channel->ccc, handle,
+							att_get_u16(value));
+	}
+
+	return enc_write_resp(pdu, len);
+}
+
+static uint16_t read_multiple(struct gatt_channel *channel,
+					const uint16_t *handles, size_t num,
+					uint8_t *pdu, size_t len)
+{
+	struct gatt_server *server = channel->server;
+	struct attribute *attrs[num];
+	uint8_t *values[num];
+	size_t vlens[num];
+	uint8_t config[num][2];
+	uint16_t cccval;
+	uint8_t status;
+	size_t i;
+
+	/*
+	 * Permission checks and read callbacks run for every handle first:
+	 * a callback may update other attributes, so value pointers are
+	 * only collected once all of them have completed.
+	 */
+	for (i = 0; i < num; i++) {
+		struct attribute *a = db_lookup(server, handles[i]);
+
+		if (a == NULL)
+			return enc_error_resp(ATT_OP_READ_MULTI_REQ, handles[i],
+					ATT_ECODE_INVALID_HANDLE, pdu, len);
+
+		attrs[i] = a;
+
+		if (bt_uuid_cmp(&ccc_uuid, &a->uuid) == 0 &&
+			read_device_ccc(channel, a->handle, &cccval) == 0)
+			continue;
+
+		status = att_check_reqs(channel, ATT_OP_READ_MULTI_REQ,
+								a->read_req);
+
+		if (status == 0x00 && read_needs_writer(server, a))
+			return 0;
+
+		if (status == 0x00 && a->read_cb)
+			status = a->read_cb(a, channel->device,
+							a->cb_user_data);
+
+		if (status)
+			return enc_error_resp(ATT_OP_READ_MULTI_REQ, handles[i],
+							status, pdu, len);
+	}
 
-		if (a->handle < start)
+	for (i = 0; i < num; i++) {
+		struct attribute *a = attrs[i];
+
+		if (bt_uuid_cmp(&ccc_uuid, &a->uuid) == 0 &&
+			read_device_ccc(channel, a->handle, &cccval) == 0) {
+			att_put_u16(cccval, config[i]);
+			values[i] = config[i];
+			vlens[i] = sizeof(config[i]);
 			continue;
+		}
+
+		values[i] = a->data;
+		vlens[i] = a->len;
+	}
+
+	return enc_read_multi_resp(values, vlens, num, pdu, len);
+}
+
+static uint16_t prepare_write(struct gatt_channel *channel, uint16_t handle,
+				uint16_t offset, const uint8_t *value,
+				size_t vlen, uint8_t *pdu, size_t len)
+{
+	struct prep_write *prep;
+	struct attribute *a;
+	uint8_t status;
+
+	a = db_lookup(channel->server, handle);
+	if (!a)
+		return enc_error_resp(ATT_OP_PREP_WRITE_REQ, handle,
+				ATT_ECODE_INVALID_HANDLE, pdu, len);
+
+	status = att_check_reqs(channel, ATT_OP_PREP_WRITE_REQ, a->write_req);
+	if (status)
+		return enc_error_resp(ATT_OP_PREP_WRITE_REQ, handle, status,
+								pdu, len);
+
+	/* Queued writes are applied atomically, which a deferred write
+	 * callback cannot guarantee */
+	if (a->write_async)
+		return enc_error_resp(ATT_OP_PREP_WRITE_REQ, handle,
+					ATT_ECODE_REQ_NOT_SUPP, pdu, len);
+
+	if (g_queue_get_length(channel->prep_queue) >= PREP_QUEUE_MAX_WRITES ||
+			channel->prep_bytes + vlen > PREP_QUEUE_MAX_BYTES)
+		return enc_error_resp(ATT_OP_PREP_WRITE_REQ, handle,
+				ATT_ECODE_PREP_QUEUE_FULL, pdu, len);
+
+	prep = g_malloc(sizeof(*prep) + vlen);
+	prep->handle = handle;
+	prep->offset = offset;
+	prep->len = vlen;
+	memcpy(prep->value, value, vlen);
+
+	g_queue_push_tail(channel->prep_queue, prep);
+	channel->prep_bytes += vlen;
+
+	return enc_prep_write_resp(handle, offset, value, vlen, pdu, len);
+}
+
+static struct exec_value *exec_value_get(struct gatt_channel *channel,
+						GSList **values,
+						struct attribute *a)
+{
+	struct exec_value *ev;
+	uint16_t cccval;
+	GSList *l;
 
-		if (a->handle > end)
-			break;
+	for (l = *values; l; l = l->next) {
+		ev = l->data;
 
-		/* Primary service? Attribute value matches? */
-		if ((bt_uuid_cmp(&a->uuid, uuid) == 0) && (a->len == vlen) &&
-					(memcmp(a->data, value, vlen) == 0)) {
-
-			range = g_new0(struct att_range, 1);
-			range->start = a->handle;
-			/* It is allowed to have end group handle the same as
-			 * start handle, for groups with only one attribute. */
-			range->end = a->handle;
-
-			matches = g_slist_append(matches, range);
-		} else if (range) {
-			/* Update the last found handle or reset the pointer
-			 * to track that a new group started: Primary or
-			 * Secondary service. */
-			if (bt_uuid_cmp(&a->uuid, &prim_uuid) == 0 ||
-					bt_uuid_cmp(&a->uuid, &snd_uuid) == 0)
-				range = NULL;
-			else
-				range->end = a->handle;
-		}
+		if (ev->a == a)
+			return ev;
 	}
 
-	if (matches == NULL)
-		return enc_error_resp(ATT_OP_FIND_BY_TYPE_REQ, start,
-				ATT_ECODE_ATTR_NOT_FOUND, opdu, mtu);
+	ev = g_new0(struct exec_value, 1);
+	ev->a = a;
+	ev->ccc = bt_uuid_cmp(&ccc_uuid, &a->uuid) == 0;
 
-	len = enc_find_by_type_resp(matches, opdu, mtu);
+	if (ev->ccc) {
+		if (read_device_ccc(channel, a->handle, &cccval) < 0)
+			cccval = 0x0000;
 
-	g_slist_free_full(matches, g_free);
+		ev->size = 2;
+		ev->data = g_malloc(ev->size);
+		att_put_u16(cccval, ev->data);
+		ev->len = 2;
+	} else {
+		/*
+		 * Values longer than ATT_MAX_VALUE_LEN are patched in place
+		 * and may not grow. A shared value is copied: like a Write
+		 * Request, the write leaves the attribute a private copy.
+		 */
+		ev->size = MAX(a->len, (size_t) ATT_MAX_VALUE_LEN);
+		ev->data = g_malloc(ev->size);
+		ev->len = a->len;
+		memcpy(ev->data, a->data, a->len);
+	}
 
-	return len;
+	*values = g_slist_append(*values, ev);
+
+	return ev;
 }
 
-static int read_device_ccc(struct btd_device *device, uint16_t handle,
-				uint16_t *value)
+static void exec_value_free(gpointer data)
 {
-	char *filename;
-	GKeyFile *key_file;
-	char group[6];
-	char *str;
-	unsigned int config;
-	int err = 0;
-
-	filename = btd_device_get_storage_path(device, "ccc");
-
-	key_file = g_key_file_new();
-	g_key_file_load_from_file(key_file, filename, 0, NULL);
+	struct exec_value *ev = data;
 
-	sprintf(group, "%hu", handle);
-
-	str = g_key_file_get_string(key_file, group, "Value", NULL);
-	if (!str || sscanf(str, "%04X", &config) != 1)
-		err = -ENOENT;
+	if (ev->old_value)
+		attrib_value_unref(ev->old_value);
 	else
-		*value = config;
-
-	g_free(str);
-	g_free(filename);
-	g_key_file_free(key_file);
+		g_free(ev->old_data);
 
-	return err;
+	g_free(ev->data);
+	g_free(ev);
 }
 
-static uint16_t read_value(struct gatt_channel *channel, uint16_t handle,
-						uint8_t *pdu, size_t len)
+/* Make the assembled value current, keeping the one it replaces */
+static void exec_value_install(struct gatt_server *server,
+						struct exec_value *ev)
 {
-	struct attribute *a;
-	uint8_t status;
-	GList *l;
-	uint16_t cccval;
-	guint h = handle;
+	struct attribute *a = ev->a;
 
-	l = g_list_find_custom(channel->server->database,
-					GUINT_TO_POINTER(h), handle_cmp);
-	if (!l)
-		return enc_error_resp(ATT_OP_READ_REQ, handle,
-					ATT_ECODE_INVALID_HANDLE, pdu, len);
+	avail_service_del(server, a);
 
-	a = l->data;
+	ev->old_data = a->data;
+	ev->old_len = a->len;
+	ev->old_value = a->value;
 
-	if (bt_uuid_cmp(&ccc_uuid, &a->uuid) == 0 &&
-		read_device_ccc(channel->device, handle, &cccval) == 0) {
-		uint8_t config[2];
+	a->data = ev->data;
+	a->len = ev->len;
+	a->value = NULL;
+	ev->data = NULL;
 
-		att_put_u16(cccval, config);
-		return enc_read_resp(config, sizeof(config), pdu, len);
-	}
+	avail_service_add(server, a);
+}
 
-	status = att_check_reqs(channel, ATT_OP_READ_REQ, a->read_req);
+static void exec_value_restore(struct gatt_server *server,
+						struct exec_value *ev)
+{
+	struct attribute *a = ev->a;
 
-	if (status == 0x00 && a->read_cb)
-		status = a->read_cb(a, channel->device, a->cb_user_data);
+	avail_service_del(server, a);
 
-	if (status)
-		return enc_error_resp(ATT_OP_READ_REQ, handle, status, pdu,
-									len);
+	attrib_value_release(a);
+	a->data = ev->old_data;
+	a->len = ev->old_len;
+	a->value = ev->old_value;
+	ev->old_data = NULL;
+	ev->old_value = NULL;
 
-	return enc_read_resp(a->data, a->len, pdu, len);
+	avail_service_add(server, a);
 }
 
-static uint16_t read_blob(struct gatt_channel *channel, uint16_t handle,
-				uint16_t offset, uint8_t *pdu, size_t len)
+/*
+ * Apply the queued Prepare Writes. Every write is validated against the
+ * value it builds up, then all values are installed and their write
+ * callbacks run. If one refuses, the previous values are put back; only
+ * once the whole queue is accepted are CCCs set and subscribers told.
+ */
+static uint16_t execute_write(struct gatt_channel *channel, uint8_t flags,
+						uint8_t *pdu, size_t len)
 {
-	struct attribute *a;
-	uint8_t status;
-	GList *l;
-	uint16_t cccval;
-	guint h = handle;
+	struct gatt_server *server = channel->server;
+	GSList *values = NULL, *l;
+	uint16_t handle = 0x0000;
+	uint8_t status = 0;
+	GList *q;
 
-	l = g_list_find_custom(channel->server->database,
-					GUINT_TO_POINTER(h), handle_cmp);
-	if (!l)
-		return enc_error_resp(ATT_OP_READ_BLOB_REQ, handle,
-					ATT_ECODE_INVALID_HANDLE, pdu, len);
+	if (flags == ATT_CANCEL_ALL_PREP_WRITES) {
+		prep_queue_clear(channel);
+		return enc_exec_write_resp(pdu, len);
+	}
 
-	a = l->data;
+	for (q = channel->prep_queue->head; q; q = q->next) {
+		struct prep_write *prep = q->data;
+		struct exec_value *ev;
+		struct attribute *a;
 
-	if (a->len <= offset)
-		return enc_error_resp(ATT_OP_READ_BLOB_REQ, handle,
-					ATT_ECODE_INVALID_OFFSET, pdu, len);
+		handle = prep->handle;
 
-	if (bt_uuid_cmp(&ccc_uuid, &a->uuid) == 0 &&
-		read_device_ccc(channel->device, handle, &cccval) == 0) {
-		uint8_t config[2];
+		a = db_lookup(channel->server, prep->handle);
+		if (a == NULL) {
+			status = ATT_ECODE_INVALID_HANDLE;
+			goto done;
+		}
 
-		att_put_u16(cccval, config);
-		return enc_read_blob_resp(config, sizeof(config), offset,
-								pdu, len);
-	}
+		ev = exec_value_get(channel, &values, a);
 
-	status = att_check_reqs(channel, ATT_OP_READ_BLOB_REQ, a->read_req);
+		if (prep->offset > ev->len) {
+			status = ATT_ECODE_INVALID_OFFSET;
+			goto done;
+		}
 
-	if (status == 0x00 && a->read_cb)
-		status = a->read_cb(a, channel->device, a->cb_user_data);
+		if (prep->offset + prep->len > ev->size) {
+			status = ATT_ECODE_INVAL_ATTR_VALUE_LEN;
+			goto done;
+		}
 
-	if (status)
-		return enc_error_resp(ATT_OP_READ_BLOB_REQ, handle, status,
-								pdu, len);
+		memcpy(&ev->data[prep->offset], prep->value, prep->len);
+		ev->len = MAX(ev->len, (size_t) (prep->offset + prep->len));
+	}
 
-	return enc_read_blob_resp(a->data, a->len, offset, pdu, len);
-}
+	for (l = values; l; l = l->next) {
+		struct exec_value *ev = l->data;
 
-static uint16_t write_value(struct gatt_channel *channel, uint16_t handle,
-					const uint8_t *value, size_t vlen,
-					uint8_t *pdu, size_t len)
-{
-	struct attribute *a;
-	uint8_t status;
-	GList *l;
-	guint h = handle;
+		handle = ev->a->handle;
 
-	l = g_list_find_custom(channel->server->database,
-					GUINT_TO_POINTER(h), handle_cmp);
-	if (!l)
-		return enc_error_resp(ATT_OP_WRITE_REQ, handle,
-				ATT_ECODE_INVALID_HANDLE, pdu, len);
+		if (ev->ccc && ev->len != 2) {
+			status = ATT_ECODE_INVAL_ATTR_VALUE_LEN;
+			goto done;
+		}
+	}
 
-	a = l->data;
+	for (l = values; l; l = l->next) {
+		struct exec_value *ev = l->data;
 
-	status = att_check_reqs(channel, ATT_OP_WRITE_REQ, a->write_req);
-	if (status)
-		return enc_error_resp(ATT_OP_WRITE_REQ, handle, status, pdu,
-									len);
+		if (!ev->ccc)
+			exec_value_install(server, ev);
+	}
 
-	if (bt_uuid_cmp(&ccc_uuid, &a->uuid) != 0) {
+	for (l = values; l && status == 0; l = l->next) {
+		struct exec_value *ev = l->data;
+		struct attribute *a = ev->a;
 
-		attrib_db_update(channel->server->adapter, handle, NULL,
-							value, vlen, NULL);
+		handle = a->handle;
 
-		if (a->write_cb) {
+		if (!ev->ccc && a->write_cb)
 			status = a->write_cb(a, channel->device,
 							a->cb_user_data);
-			if (status)
-				return enc_error_resp(ATT_OP_WRITE_REQ, handle,
-							status, pdu, len);
-		}
-	} else {
-		uint16_t cccval = att_get_u16(value);
-		char *filename;
-		GKeyFile *key_file;
-		char group[6], value[5];
-		char *data;
-		gsize length = 0;
-
-		filename = btd_device_get_storage_path(channel->device, "ccc");
-
-		key_file = g_key_file_new();
-		g_key_file_load_from_file(key_file, filename, 0, NULL);
+	}
 
-		sprintf(group, "%hu", handle);
-		sprintf(value, "%hhX", cccval);
-		g_key_file_set_string(key_file, group, "Value", value);
+	for (l = values; l; l = l->next) {
+		struct exec_value *ev = l->data;
+		struct attribute *a = ev->a;
 
-		data = g_key_file_to_data(key_file, &length, NULL);
-		if (length > 0) {
-			create_file(filename, S_IRUSR | S_IWUSR);
-			g_file_set_contents(filename, data, length, NULL);
+		if (status) {
+			if (!ev->ccc)
+				exec_value_restore(server, ev);
+		} else if (!ev->ccc) {
+			disc_cache_invalidate(server, a->handle, TRUE);
+			notify_subscribers(server, a);
+		} else if (channel->ccc) {
+			ccc_set(server, channel->ccc, a->handle,
+							att_get_u16(ev->data));
 		}
-
-		g_free(data);
-		g_free(filename);
-		g_key_file_free(key_file);
 	}
 
-	return enc_write_resp(pdu, len);
+done:
+	g_slist_free_full(values, exec_value_free);
+	prep_queue_clear(channel);
+
+	if (status)
+		return enc_error_resp(ATT_OP_EXEC_WRITE_REQ, handle, status,
+								pdu, len);
+
+	return enc_exec_write_resp(pdu, len);
 }
 
 static uint16_t mtu_exchange(struct gatt_channel *channel, uint16_t mtu,
@@ -955,24 +3265,57 @@ static void channel_remove(struct gatt_channel *channel)
 static gboolean channel_watch_cb(GIOChannel *io, GIOCondition cond,
 						gpointer user_data)
 {
-	channel_remove(user_data);
+	struct gatt_channel *channel = user_data;
+	struct gatt_server *server = server_ref(channel->server);
+
+	db_lock(server, TRUE);
+
+	if (!channel->closed)
+		channel_remove(channel);
+
+	unlock_server(server);
 
 	return FALSE;
 }
 
-static void channel_handler(const uint8_t *ipdu, uint16_t len,
-							gpointer user_data)
+/*
+ * Serve one PDU with db_lock held. Returns FALSE when it was left to be
+ * served again with the lock held for writing, see db_is_writer().
+ */
+static gboolean channel_handler(const uint8_t *ipdu, uint16_t len,
+					struct gatt_channel *channel)
 {
-	struct gatt_channel *channel = user_data;
 	uint8_t opdu[channel->mtu];
 	uint16_t length, start, end, mtu, offset;
+	uint16_t handles[ATT_MAX_VALUE_LEN / 2];
 	bt_uuid_t uuid;
-	uint8_t status = 0;
-	size_t vlen;
+	uint8_t status = 0, flags;
+	gboolean deferred = FALSE;
+	size_t vlen, num;
 	uint8_t *value = g_attrib_get_buffer(channel->attrib, &vlen);
 
 	DBG("op 0x%02x", ipdu[0]);
 
+	/* One outstanding request per bearer: hold any new one back */
+	if (channel->pending && ipdu[0] != ATT_OP_WRITE_CMD &&
+					ipdu[0] != ATT_OP_SIGNED_WRITE_CMD &&
+					ipdu[0] != ATT_OP_HANDLE_CNF) {
+		struct held_pdu *held;
+
+		if (g_queue_get_length(channel->held) >= HELD_PDUS_MAX) {
+			DBG("Dropping request 0x%02x, response pending",
+								ipdu[0]);
+			return TRUE;
+		}
+
+		held = g_malloc(sizeof(*held) + len);
+		held->len = len;
+		memcpy(held->data, ipdu, len);
+		g_queue_push_tail(channel->held, held);
+
+		return TRUE;
+	}
+
 	switch (ipdu[0]) {
 	case ATT_OP_READ_BY_GROUP_REQ:
 		length = dec_read_by_grp_req(ipdu, len, &start, &end, &uuid);
@@ -1001,7 +3344,8 @@ static void channel_handler(const uint8_t *ipdu, uint16_t len,
 			goto done;
 		}
 
-		length = read_value(channel, start, opdu, channel->mtu);
+		length = read_value(channel, start, opdu, channel->mtu,
+								&deferred);
 		break;
 	case ATT_OP_READ_BLOB_REQ:
 		length = dec_read_blob_req(ipdu, len, &start, &offset);
@@ -1010,7 +3354,8 @@ static void channel_handler(const uint8_t *ipdu, uint16_t len,
 			goto done;
 		}
 
-		length = read_blob(channel, start, offset, opdu, channel->mtu);
+		length = read_blob(channel, start, offset, opdu, channel->mtu,
+								&deferred);
 		break;
 	case ATT_OP_MTU_REQ:
 		if (!channel->le) {
@@ -1042,15 +3387,15 @@ static void channel_handler(const uint8_t *ipdu, uint16_t len,
 			goto done;
 		}
 
-		length = write_value(channel, start, value, vlen, opdu,
-								channel->mtu);
+		length = write_value(channel, ATT_OP_WRITE_REQ, start, value,
+					vlen, opdu, channel->mtu, &deferred);
 		break;
 	case ATT_OP_WRITE_CMD:
 		length = dec_write_cmd(ipdu, len, &start, value, &vlen);
 		if (length > 0)
-			write_value(channel, start, value, vlen, opdu,
-								channel->mtu);
-		return;
+			write_value(channel, ATT_OP_WRITE_CMD, start, value,
+					vlen, opdu, channel->mtu, &deferred);
+		return TRUE;
 	case ATT_OP_FIND_BY_TYPE_REQ:
 		length = dec_find_by_type_req(ipdu, len, &start, &end,
 							&uuid, value, &vlen);
@@ -1063,22 +3408,59 @@ static void channel_handler(const uint8_t *ipdu, uint16_t len,
 							opdu, channel->mtu);
 		break;
 	case ATT_OP_HANDLE_CNF:
-		return;
+		return TRUE;
 	case ATT_OP_HANDLE_IND:
 	case ATT_OP_HANDLE_NOTIFY:
 		/* The attribute client is already handling these */
-		return;
+		return TRUE;
 	case ATT_OP_READ_MULTI_REQ:
+		num = G_N_ELEMENTS(handles);
+		length = dec_read_multi_req(ipdu, len, handles, &num);
+		if (length == 0) {
+			status = ATT_ECODE_INVALID_PDU;
+			goto done;
+		}
+
+		length = read_multiple(channel, handles, num, opdu,
+								channel->mtu);
+		break;
 	case ATT_OP_PREP_WRITE_REQ:
+		length = dec_prep_write_req(ipdu, len, &start, &offset,
+								value, &vlen);
+		if (length == 0) {
+			status = ATT_ECODE_INVALID_PDU;
+			goto done;
+		}
+
+		length = prepare_write(channel, start, offset, value, vlen,
+							opdu, channel->mtu);
+		break;
 	case ATT_OP_EXEC_WRITE_REQ:
+		length = dec_exec_write_req(ipdu, len, &flags);
+		if (length == 0 || flags > ATT_WRITE_ALL_PREP_WRITES) {
+			status = ATT_ECODE_INVALID_PDU;
+			goto done;
+		}
+
+		length = execute_write(channel, flags, opdu, channel->mtu);
+		break;
 	default:
 		DBG("Unsupported request 0x%02x", ipdu[0]);
 		status = ATT_ECODE_REQ_NOT_SUPP;
 		goto done;
 	}
 
-	if (length == 0)
+	/* The response is sent when the deferred access completes */
+	if (deferred)
+		return TRUE;
+
+	if (length == 0) {
+		/* Attribute callbacks to run */
+		if (!db_is_writer(channel->server))
+			return FALSE;
+
 		status = ATT_ECODE_IO;
+	}
 
 done:
 	if (status)
@@ -1086,20 +3468,20 @@ done:
 								channel->mtu);
 
 	g_attrib_send(channel->attrib, 0, opdu, length, NULL, NULL, NULL);
+
+	return TRUE;
 }
 
-guint attrib_channel_attach(GAttrib *attrib)
+/* Resolve the server and device of a bearer, on the main thread */
+static struct gatt_channel *channel_new(GIOChannel *io)
 {
 	struct gatt_server *server;
 	struct btd_device *device;
 	struct gatt_channel *channel;
-	GIOChannel *io;
 	GError *gerr = NULL;
 	uint16_t cid;
 	guint mtu = 0;
 
-	io = g_attrib_get_channel(attrib);
-
 	channel = g_new0(struct gatt_channel, 1);
 
 	bt_io_get(io, &gerr,
@@ -1112,56 +3494,218 @@ guint attrib_channel_attach(GAttrib *attrib)
 		error("bt_io_get: %s", gerr->message);
 		g_error_free(gerr);
 		g_free(channel);
+		return NULL;
+	}
+
+	server = find_gatt_server(&channel->src);
+	if (server == NULL) {
+		g_free(channel);
+		return NULL;
+	}
+
+	channel->server = server;
+
+	device = adapter_find_device(server->adapter, &channel->dst);
+	if (device == NULL) {
+		error("Device object not found for attrib server");
+		server_unref(server);
+		g_free(channel);
+		return NULL;
+	}
+
+	if (device_is_bonded(device) == FALSE) {
+		char *filename;
+
+		filename = btd_device_get_storage_path(device, "ccc");
+		unlink(filename);
+		g_free(filename);
+	}
+
+	if (cid != ATT_CID) {
+		channel->le = FALSE;
+		channel->mtu = mtu;
+	} else {
+		channel->le = TRUE;
+		channel->mtu = ATT_DEFAULT_LE_MTU;
+	}
+
+	channel->device = btd_device_ref(device);
+	channel->ccc = ccc_get(server, device);
+
+	/* Values an unbonded peer left pending release are not kept either */
+	g_mutex_lock(&server->ccc_lock);
+
+	if (device_is_bonded(device) == FALSE && channel->ccc->refs == 1) {
+		g_hash_table_remove_all(channel->ccc->values);
+		channel->ccc->dirty = FALSE;
+	}
+
+	g_mutex_unlock(&server->ccc_lock);
+
+	return channel;
+}
+
+/* Requests that update the database are served as writers at once */
+static gboolean opcode_writes(uint8_t opcode)
+{
+	switch (opcode) {
+	case ATT_OP_WRITE_REQ:
+	case ATT_OP_WRITE_CMD:
+	case ATT_OP_EXEC_WRITE_REQ:
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+static void channel_dispatch(const uint8_t *ipdu, uint16_t len,
+							gpointer user_data)
+{
+	struct gatt_channel *channel = user_data;
+	struct gatt_server *server = channel->server;
+	gboolean done;
+
+	db_lock(server, opcode_writes(ipdu[0]));
+	done = channel->closed || channel_handler(ipdu, len, channel);
+	db_unlock(server);
+
+	if (done)
+		return;
+
+	db_lock(server, TRUE);
+
+	if (!channel->closed)
+		channel_handler(ipdu, len, channel);
+
+	db_unlock(server);
+}
+
+static void channel_abort(struct gatt_channel *channel)
+{
+	ccc_put(channel->ccc);
+	device_put(channel->device);
+	server_unref(channel->server);
+
+	if (channel->sharded)
+		__sync_sub_and_fetch(&shard_channels, 1);
+
+	g_free(channel);
+}
+
+/* Start serving @attrib, on the thread owning it */
+static guint channel_start(struct gatt_channel *channel, GAttrib *attrib)
+{
+	struct gatt_server *server = channel->server;
+	GIOChannel *io = g_attrib_get_channel(attrib);
+
+	db_lock(server, TRUE);
+
+	/* The server may have stopped while the bearer was handed off */
+	if (server->stopped) {
+		db_unlock(server);
+		channel_abort(channel);
 		return 0;
 	}
 
-	server = find_gatt_server(&channel->src);
-	if (server == NULL) {
-		char src[18];
+	channel->attrib = g_attrib_ref(attrib);
+	channel->id = g_attrib_register(channel->attrib, GATTRIB_ALL_REQS,
+			GATTRIB_ALL_HANDLES, channel_dispatch, channel, NULL);
+
+	channel->cleanup = g_io_create_watch(io, G_IO_HUP);
+	g_source_set_callback(channel->cleanup, (GSourceFunc) channel_watch_cb,
+								channel, NULL);
+	g_source_attach(channel->cleanup, g_attrib_get_context(attrib));
+
+	channel->notify = notify_queue_new(channel);
+	channel->prep_queue = g_queue_new();
+	channel->held = g_queue_new();
+
+	server->clients = g_slist_append(server->clients, channel);
+
+	db_unlock(server);
+
+	return channel->id;
+}
+
+guint attrib_channel_attach(GAttrib *attrib)
+{
+	struct gatt_channel *channel;
+
+	channel = channel_new(g_attrib_get_channel(attrib));
+	if (channel == NULL)
+		return 0;
+
+	return channel_start(channel, attrib);
+}
+
+static void channel_attached(GAttrib *attrib, gpointer user_data)
+{
+	struct gatt_channel *channel = user_data;
 
-		ba2str(&channel->src, src);
-		error("No GATT server found in %s", src);
-		g_free(channel);
-		return 0;
+	if (attrib == NULL) {
+		channel_abort(channel);
+		return;
 	}
 
-	channel->server = server;
+	channel_start(channel, attrib);
+}
 
-	device = adapter_find_device(server->adapter, &channel->dst);
-	if (device == NULL) {
-		error("Device object not found for attrib server");
-		g_free(channel);
-		return 0;
-	}
+/*
+ * Serve the bearer @io, from a worker thread when they are enabled. The
+ * device is resolved here, so this runs on the main thread.
+ */
+gboolean attrib_channel_attach_io(GIOChannel *io)
+{
+	struct gatt_channel *channel;
+	GAttrib *attrib;
 
-	if (device_is_bonded(device) == FALSE) {
-		char *filename;
+	channel = channel_new(io);
+	if (channel == NULL)
+		return FALSE;
 
-		filename = btd_device_get_storage_path(device, "ccc");
-		unlink(filename);
-		g_free(filename);
-	}
+	if (shards) {
+		channel->sharded = TRUE;
+		__sync_fetch_and_add(&shard_channels, 1);
 
-	if (cid != ATT_CID) {
-		channel->le = FALSE;
-		channel->mtu = mtu;
-	} else {
-		channel->le = TRUE;
-		channel->mtu = ATT_DEFAULT_LE_MTU;
+		if (g_attrib_shards_attach(shards, io, channel_attached,
+								channel))
+			return TRUE;
+
+		channel_abort(channel);
+		return FALSE;
 	}
 
-	channel->attrib = g_attrib_ref(attrib);
-	channel->id = g_attrib_register(channel->attrib, GATTRIB_ALL_REQS,
-			GATTRIB_ALL_HANDLES, channel_handler, channel, NULL);
+	attrib = g_attrib_new(io);
+	channel_attached(attrib, channel);
+	g_attrib_unref(attrib);
 
-	channel->cleanup_id = g_io_add_watch(io, G_IO_HUP, channel_watch_cb,
-								channel);
+	return attrib != NULL;
+}
 
-	channel->device = btd_device_ref(device);
+/*
+ * Spread the bearers of new connections over @count worker threads, or
+ * serve them from the main loop when 0. Changing it stops the workers,
+ * so it fails with -EBUSY until every bearer handed to them is released.
+ */
+int attrib_server_set_workers(unsigned int count)
+{
+	if (g_attrib_shards_count(shards) == count)
+		return 0;
 
-	server->clients = g_slist_append(server->clients, channel);
+	if (__sync_fetch_and_add(&shard_channels, 0) > 0)
+		return -EBUSY;
 
-	return channel->id;
+	g_attrib_shards_free(shards);
+	shards = NULL;
+
+	if (count == 0)
+		return 0;
+
+	shards = g_attrib_shards_new(count);
+	if (shards == NULL)
+		return -ENOMEM;
+
+	return 0;
 }
 
 static gint channel_id_cmp(gconstpointer data, gconstpointer user_data)
@@ -1195,31 +3739,33 @@ gboolean attrib_channel_detach(GAttrib *attrib, guint id)
 	if (server == NULL)
 		return FALSE;
 
+	db_lock(server, TRUE);
+
 	l = g_slist_find_custom(server->clients, GUINT_TO_POINTER(id),
 								channel_id_cmp);
-	if (!l)
+	if (!l) {
+		unlock_server(server);
 		return FALSE;
+	}
 
 	channel = l->data;
 
 	g_attrib_unregister(channel->attrib, channel->id);
 	channel_remove(channel);
 
+	unlock_server(server);
+
 	return TRUE;
 }
 
 static void connect_event(GIOChannel *io, GError *gerr, void *user_data)
 {
-	GAttrib *attrib;
-
 	if (gerr) {
 		error("%s", gerr->message);
 		return;
 	}
 
-	attrib = g_attrib_new(io);
-	attrib_channel_attach(attrib);
-	g_attrib_unref(attrib);
+	attrib_channel_attach_io(io);
 }
 
 static void confirm_event(GIOChannel *io, void *user_data)
@@ -1307,7 +3853,17 @@ int btd_adapter_gatt_server_start(struct btd_adapter *adapter)
 	DBG("Start GATT server in hci%d", btd_adapter_get_index(adapter));
 
 	server = g_new0(struct gatt_server, 1);
+	server->refs = 1;
+	g_rw_lock_init(&server->db_lock);
+	g_mutex_init(&server->ccc_lock);
+	g_mutex_init(&server->cache_lock);
 	server->adapter = btd_adapter_ref(adapter);
+	server->types = g_hash_table_new_full(type_hash, type_equal, NULL,
+								type_free);
+	server->disc_cache = g_hash_table_new_full(disc_hash, disc_equal,
+								NULL, g_free);
+	server->avail = g_new(uint16_t, 2 * AVAIL_LEAVES);
+	avail_reset(server);
 
 	addr = adapter_get_address(server->adapter);
 
@@ -1322,12 +3878,14 @@ int btd_adapter_gatt_server_start(struct btd_adapter *adapter)
 	if (server->l2cap_io == NULL) {
 		error("%s", gerr->message);
 		g_error_free(gerr);
-		gatt_server_free(server);
+		gatt_server_stop(server);
+		server_unref(server);
 		return -1;
 	}
 
 	if (!register_core_services(server)) {
-		gatt_server_free(server);
+		gatt_server_stop(server);
+		server_unref(server);
 		return -1;
 	}
 
@@ -1345,36 +3903,61 @@ int btd_adapter_gatt_server_start(struct btd_adapter *adapter)
 		/* Doesn't have LE support, continue */
 	}
 
+	g_mutex_lock(&servers_lock);
 	servers = g_slist_prepend(servers, server);
+	g_mutex_unlock(&servers_lock);
+
 	return 0;
 }
 
 void btd_adapter_gatt_server_stop(struct btd_adapter *adapter)
 {
 	struct gatt_server *server;
+	GThreadPool *pool = NULL;
 	GSList *l;
 
+	g_mutex_lock(&servers_lock);
+
 	l = g_slist_find_custom(servers, adapter, adapter_cmp);
-	if (l == NULL)
+	if (l == NULL) {
+		g_mutex_unlock(&servers_lock);
 		return;
-
-	DBG("Stop GATT server in hci%d", btd_adapter_get_index(adapter));
+	}
 
 	server = l->data;
 	servers = g_slist_remove(servers, server);
-	gatt_server_free(server);
+
+	if (servers == NULL) {
+		pool = request_pool;
+		request_pool = NULL;
+	}
+
+	g_mutex_unlock(&servers_lock);
+
+	DBG("Stop GATT server in hci%d", btd_adapter_get_index(adapter));
+
+	gatt_server_stop(server);
+	server_unref(server);
+
+	if (pool != NULL)
+		g_thread_pool_free(pool, FALSE, TRUE);
 }
 
 uint32_t attrib_create_sdp(struct btd_adapter *adapter, uint16_t handle,
 							const char *name)
 {
-	GSList *l;
+	struct gatt_server *server;
+	uint32_t sdp_handle;
 
-	l = g_slist_find_custom(servers, adapter, adapter_cmp);
-	if (l == NULL)
+	server = lock_server(adapter, FALSE);
+	if (server == NULL)
 		return 0;
 
-	return attrib_create_sdp_new(l->data, handle, name);
+	sdp_handle = attrib_create_sdp_new(server, handle, name);
+
+	unlock_server(server);
+
+	return sdp_handle;
 }
 
 void attrib_free_sdp(uint32_t sdp_handle)
@@ -1382,104 +3965,50 @@ void attrib_free_sdp(uint32_t sdp_handle)
 	remove_record_from_server(sdp_handle);
 }
 
-static uint16_t find_uuid16_avail(struct btd_adapter *adapter, uint16_t nitems)
+/*
+ * 16-bit UUID services are laid out upwards from 0x0001, below the first
+ * 128-bit UUID service; 128-bit UUID services downwards from 0xffff,
+ * above the last 16-bit UUID service.
+ */
+static uint16_t find_uuid16_avail(struct gatt_server *server,
+							uint16_t nitems)
 {
-	struct gatt_server *server;
-	uint16_t handle;
-	GSList *l;
-	GList *dl;
-
-	l = g_slist_find_custom(servers, adapter, adapter_cmp);
-	if (l == NULL)
-		return 0;
-
-	server = l->data;
-	if (server->database == NULL)
-		return 0x0001;
-
-	for (dl = server->database, handle = 0x0001; dl; dl = dl->next) {
-		struct attribute *a = dl->data;
-
-		if ((bt_uuid_cmp(&a->uuid, &prim_uuid) == 0 ||
-				bt_uuid_cmp(&a->uuid, &snd_uuid) == 0) &&
-				a->handle - handle >= nitems)
-			/* Note: the range above excludes the current handle */
-			return handle;
-
-		if (a->len == 16 && (bt_uuid_cmp(&a->uuid, &prim_uuid) == 0 ||
-				bt_uuid_cmp(&a->uuid, &snd_uuid) == 0)) {
-			/* 128 bit UUID service definition */
-			return 0;
-		}
+	unsigned int limit = 0xffff;
 
-		if (a->handle == 0xffff)
-			return 0;
-
-		handle = a->handle + 1;
-	}
-
-	if (0xffff - handle + 1 >= nitems)
-		return handle;
+	if (server->svc128.num > 0)
+		limit = server->svc128.handles[0] - 1;
 
-	return 0;
+	return avail_first(server, 1, 0, AVAIL_LEAVES - 1, 0x0001, limit,
+								nitems);
 }
 
-static uint16_t find_uuid128_avail(struct btd_adapter *adapter, uint16_t nitems)
+static uint16_t find_uuid128_avail(struct gatt_server *server,
+							uint16_t nitems)
 {
-	uint16_t handle = 0, end = 0xffff;
-	struct gatt_server *server;
-	GList *dl;
-	GSList *l;
-
-	l = g_slist_find_custom(servers, adapter, adapter_cmp);
-	if (l == NULL)
-		return 0;
-
-	server = l->data;
-	if (server->database == NULL)
-		return 0xffff - nitems + 1;
-
-	for (dl = g_list_last(server->database); dl; dl = dl->prev) {
-		struct attribute *a = dl->data;
-
-		if (handle == 0)
-			handle = a->handle;
-
-		if (bt_uuid_cmp(&a->uuid, &prim_uuid) != 0 &&
-				bt_uuid_cmp(&a->uuid, &snd_uuid) != 0)
-			continue;
-
-		if (end - handle >= nitems)
-			return end - nitems + 1;
-
-		if (a->len == 2) {
-			/* 16 bit UUID service definition */
-			return 0;
-		}
-
-		if (a->handle == 0x0001)
-			return 0;
+	unsigned int start = 0x0001;
+	uint16_t handle;
 
-		end = a->handle - 1;
-		handle = 0;
-	}
+	if (server->svc16.num > 0)
+		start = server->svc16.handles[server->svc16.num - 1] + 1;
 
-	if (end - 0x0001 >= nitems)
-		return end - nitems + 1;
+	handle = avail_last(server, 1, 0, AVAIL_LEAVES - 1, start, 0xffff,
+								nitems);
+	if (handle == 0)
+		return 0;
 
-	return 0;
+	/* Take the top of the range */
+	return handle + server->avail[AVAIL_LEAVES + handle] - nitems;
 }
 
 uint16_t attrib_db_find_avail(struct btd_adapter *adapter, bt_uuid_t *svc_uuid,
 								uint16_t nitems)
 {
+	struct gatt_server *server;
+	uint16_t handle;
+
 	g_assert(nitems > 0);
 
-	if (svc_uuid->type == BT_UUID16)
-		return find_uuid16_avail(adapter, nitems);
-	else if (svc_uuid->type == BT_UUID128)
-		return find_uuid128_avail(adapter, nitems);
-	else {
+	if (svc_uuid->type != BT_UUID16 && svc_uuid->type != BT_UUID128) {
 		char uuidstr[MAX_LEN_UUID_STR];
 
 		bt_uuid_to_string(svc_uuid, uuidstr, MAX_LEN_UUID_STR);
@@ -1487,6 +4016,19 @@ uint16_t attrib_db_find_avail(struct btd_adapter *adapter, bt_uuid_t *svc_uuid,
 								uuidstr);
 		return 0;
 	}
+
+	server = lock_server(adapter, FALSE);
+	if (server == NULL)
+		return 0;
+
+	if (svc_uuid->type == BT_UUID16)
+		handle = find_uuid16_avail(server, nitems);
+	else
+		handle = find_uuid128_avail(server, nitems);
+
+	unlock_server(server);
+
+	return handle;
 }
 
 struct attribute *attrib_db_add(struct btd_adapter *adapter, uint16_t handle,
@@ -1494,98 +4036,175 @@ struct attribute *attrib_db_add(struct btd_adapter *adapter, uint16_t handle,
 					int write_req, const uint8_t *value,
 					size_t len)
 {
-	GSList *l;
+	struct gatt_server *server;
+	struct attribute *a;
 
-	l = g_slist_find_custom(servers, adapter, adapter_cmp);
-	if (l == NULL)
+	server = lock_server(adapter, TRUE);
+	if (server == NULL)
 		return NULL;
 
-	return attrib_db_add_new(l->data, handle, uuid, read_req, write_req,
+	a = attrib_db_add_new(server, handle, uuid, read_req, write_req,
 								value, len);
+
+	unlock_server(server);
+
+	return a;
 }
 
-int attrib_db_update(struct btd_adapter *adapter, uint16_t handle,
+static int db_update_locked(struct gatt_server *server, uint16_t handle,
 					bt_uuid_t *uuid, const uint8_t *value,
 					size_t len, struct attribute **attr)
 {
-	struct gatt_server *server;
 	struct attribute *a;
-	GSList *l;
-	GList *dl;
-	guint h = handle;
-
-	l = g_slist_find_custom(servers, adapter, adapter_cmp);
-	if (l == NULL)
-		return -ENOENT;
-
-	server = l->data;
+	uint8_t *data;
 
 	DBG("handle=0x%04x", handle);
 
-	dl = g_list_find_custom(server->database, GUINT_TO_POINTER(h),
-								handle_cmp);
-	if (dl == NULL)
+	a = db_lookup(server, handle);
+	if (a == NULL)
 		return -ENOENT;
 
-	a = dl->data;
+	/* The service set is picked by the length of the current value */
+	avail_service_del(server, a);
 
-	a->data = g_try_realloc(a->data, len);
-	if (len && a->data == NULL)
+	/* Shared values are never written to, switch back to a copy */
+	if (a->value)
+		attrib_value_release(a);
+
+	data = g_try_realloc(a->data, len);
+	if (len && data == NULL) {
+		avail_service_add(server, a);
 		return -ENOMEM;
+	}
 
+	a->data = data;
 	a->len = len;
 	memcpy(a->data, value, len);
 
-	if (uuid != NULL)
+	if (uuid != NULL) {
+		type_index_del(server, a);
 		a->uuid = *uuid;
+		type_index_add(server, a);
+	}
+
+	avail_service_add(server, a);
 
 	if (attr)
 		*attr = a;
 
+	disc_cache_invalidate(server, handle, uuid == NULL);
+
+	notify_subscribers(server, a);
+
 	return 0;
 }
 
-int attrib_db_del(struct btd_adapter *adapter, uint16_t handle)
+int attrib_db_update(struct btd_adapter *adapter, uint16_t handle,
+					bt_uuid_t *uuid, const uint8_t *value,
+					size_t len, struct attribute **attr)
 {
 	struct gatt_server *server;
+	int err;
+
+	server = lock_server(adapter, TRUE);
+	if (server == NULL)
+		return -ENOENT;
+
+	err = db_update_locked(server, handle, uuid, value, len, attr);
+
+	unlock_server(server);
+
+	return err;
+}
+
+/*
+ * Make @value the value of the attribute at @handle. The attribute takes a
+ * reference and reads are served straight from that memory.
+ */
+static int db_set_value_locked(struct gatt_server *server, uint16_t handle,
+					struct attrib_value *value)
+{
 	struct attribute *a;
-	GSList *l;
-	GList *dl;
-	guint h = handle;
 
-	l = g_slist_find_custom(servers, adapter, adapter_cmp);
-	if (l == NULL)
+	DBG("handle=0x%04x len=%zu", handle, value->len);
+
+	a = db_lookup(server, handle);
+	if (a == NULL)
 		return -ENOENT;
 
-	server = l->data;
+	attrib_value_ref(value);
 
-	DBG("handle=0x%04x", handle);
+	avail_service_del(server, a);
+
+	attrib_value_release(a);
+	a->value = value;
+	a->data = (uint8_t *) value->data;
+	a->len = value->len;
+
+	avail_service_add(server, a);
+
+	disc_cache_invalidate(server, handle, TRUE);
+
+	notify_subscribers(server, a);
 
-	dl = g_list_find_custom(server->database, GUINT_TO_POINTER(h),
-								handle_cmp);
-	if (dl == NULL)
+	return 0;
+}
+
+int attrib_db_set_value(struct btd_adapter *adapter, uint16_t handle,
+					struct attrib_value *value)
+{
+	struct gatt_server *server;
+	int err;
+
+	server = lock_server(adapter, TRUE);
+	if (server == NULL)
 		return -ENOENT;
 
-	a = dl->data;
-	server->database = g_list_remove(server->database, a);
-	g_free(a->data);
-	g_free(a);
+	err = db_set_value_locked(server, handle, value);
+
+	unlock_server(server);
+
+	return err;
+}
+
+static int db_del_locked(struct gatt_server *server, uint16_t handle)
+{
+	struct attribute *a;
+
+	DBG("handle=0x%04x", handle);
+
+	a = db_lookup(server, handle);
+	if (a == NULL)
+		return -ENOENT;
+	type_index_del(server, a);
+	db_remove(server, a);
+	avail_remove(server, a);
+	attrib_free(a);
+	disc_cache_invalidate(server, handle, FALSE);
 
 	return 0;
 }
 
-int attrib_gap_set(struct btd_adapter *adapter, uint16_t uuid,
-					const uint8_t *value, size_t len)
+int attrib_db_del(struct btd_adapter *adapter, uint16_t handle)
 {
 	struct gatt_server *server;
-	uint16_t handle;
-	GSList *l;
+	int err;
 
-	l = g_slist_find_custom(servers, adapter, adapter_cmp);
-	if (l == NULL)
+	server = lock_server(adapter, TRUE);
+	if (server == NULL)
 		return -ENOENT;
 
-	server = l->data;
+	err = db_del_locked(server, handle);
+
+	unlock_server(server);
+
+	return err;
+}
+
+static int gap_set_locked(struct gatt_server *server, uint16_t uuid,
+					const uint8_t *value, size_t len)
+{
+	uint16_t handle;
 
 	/* FIXME: Missing Privacy and Reconnection Address */
 
@@ -1600,5 +4219,63 @@ int attrib_gap_set(struct btd_adapter *adapter, uint16_t uuid,
 		return -ENOSYS;
 	}
 
-	return attrib_db_update(adapter, handle, NULL, value, len, NULL);
+	return db_update_locked(server, handle, NULL, value, len, NULL);
+}
+
+int attrib_gap_set(struct btd_adapter *adapter, uint16_t uuid,
+					const uint8_t *value, size_t len)
+{
+	struct gatt_server *server;
+	int err;
+
+	server = lock_server(adapter, TRUE);
+	if (server == NULL)
+		return -ENOENT;
+
+	err = gap_set_locked(server, uuid, value, len);
+
+	unlock_server(server);
+
+	return err;
+}
+
+int attrib_notify_get_stats(struct btd_adapter *adapter,
+					struct attrib_notify_stats *stats)
+{
+	struct attrib_notify_stats *counters;
+	struct gatt_server *server;
+
+	server = server_get(adapter);
+	if (server == NULL)
+		return -ENOENT;
+
+	counters = &server->notify_stats;
+
+	stats->notifications = __sync_fetch_and_add(&counters->notifications,
+									0);
+	stats->indications = __sync_fetch_and_add(&counters->indications, 0);
+	stats->coalesced = __sync_fetch_and_add(&counters->coalesced, 0);
+	stats->dropped = __sync_fetch_and_add(&counters->dropped, 0);
+
+	server_unref(server);
+
+	return 0;
+}
+
+int attrib_cache_get_stats(struct btd_adapter *adapter,
+					struct attrib_cache_stats *stats)
+{
+	struct gatt_server *server;
+
+	server = server_get(adapter);
+	if (server == NULL)
+		return -ENOENT;
+
+	g_mutex_lock(&server->cache_lock);
+	*stats = server->cache_stats;
+	g_mutex_unlock(&server->cache_lock);
+
+	server_unref(server);
+
+	return 0;
 }
@@ -22,6 +22,20 @@
  *
  */
 
+/* Value updates pushed to subscribed clients, see attrib_db_update() */
+struct attrib_notify_stats {
+	unsigned long notifications;	/* handed to the transport */
+	unsigned long indications;	/* handed to the transport */
+	unsigned long coalesced;	/* replaced by a newer value */
+	unsigned long dropped;		/* queue full or send failed */
+};
+
+/* Discovery responses served from the response cache */
+struct attrib_cache_stats {
+	unsigned long hits;
+	unsigned long misses;
+};
+
 uint16_t attrib_db_find_avail(struct btd_adapter *adapter, bt_uuid_t *svc_uuid,
 							uint16_t nitems);
 struct attribute *attrib_db_add(struct btd_adapter *adapter, uint16_t handle,
@@ -38,4 +52,48 @@ uint32_t attrib_create_sdp(struct btd_adapter *adapter, uint16_t handle,
 							const char *name);
 void attrib_free_sdp(uint32_t sdp_handle);
 guint attrib_channel_attach(GAttrib *attrib);
+gboolean attrib_channel_attach_io(GIOChannel *io);
 gboolean attrib_channel_detach(GAttrib *attrib, guint id);
+/*
+ * Serve new bearers from @count worker threads, or from the main loop when
+ * 0. Call it from the main loop; it returns -EBUSY while a bearer handed
+ * to the current workers has not been released, as stopping the workers
+ * would leave it without a loop.
+ */
+int attrib_server_set_workers(unsigned int count);
+int attrib_notify_get_stats(struct btd_adapter *adapter,
+					struct attrib_notify_stats *stats);
+int attrib_cache_get_stats(struct btd_adapter *adapter,
+					struct attrib_cache_stats *stats);
+
+/*
+ * Completion of deferred reads and writes. The provider calls
+ * attrib_request_complete() exactly once from the thread serving the
+ * bearer (the main loop unless workers are enabled), either
+ * directly or by handing the work to attrib_request_run(), whose function
+ * runs in a worker thread and returns the ATT status.
+ */
+typedef uint8_t (*attrib_request_func_t) (struct attrib_request *req,
+							gpointer user_data);
+
+uint16_t attrib_request_get_handle(struct attrib_request *req);
+const uint8_t *attrib_request_get_value(struct attrib_request *req,
+								size_t *len);
+void attrib_request_set_value(struct attrib_request *req,
+					const uint8_t *value, size_t len);
+void attrib_request_complete(struct attrib_request *req, uint8_t status);
+gboolean attrib_request_run(struct attrib_request *req,
+				attrib_request_func_t func, gpointer user_data);
+
+/*
+ * Reference counted attribute values that are not copied into the
+ * database: a caller owned buffer released through @destroy, or a file
+ * mapped read-only in memory.
+ */
+struct attrib_value *attrib_value_new(const uint8_t *data, size_t len,
+				GDestroyNotify destroy, gpointer user_data);
+struct attrib_value *attrib_value_new_file(const char *path);
+struct attrib_value *attrib_value_ref(struct attrib_value *value);
+void attrib_value_unref(struct attrib_value *value);
+int attrib_db_set_value(struct btd_adapter *adapter, uint16_t handle,
+					struct attrib_value *value);
@@ -0,0 +1,451 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2012  Intel Corporation. All rights reserved.
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Packet capture to a btsnoop file. Frames are copied into a bounded ring
+ * of fixed size slots that any thread may write without locking; a flush
+ * thread drains it to the file. A full ring drops frames rather than
+ * blocking the caller. Disabled, the cost is the capture_enabled() test.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/eventfd.h>
+
+#include "src/shared/capture.h"
+
+#define CAPTURE_SLOTS_DEFAULT	4096
+#define CAPTURE_SNAPLEN		512
+#define CAPTURE_FLUSH_MS	100
+#define CAPTURE_BUF_SIZE	65536
+
+#define BTSNOOP_TYPE_MONITOR	2001
+
+/* Microseconds from 0000-01-01 to the Unix epoch */
+#define BTSNOOP_EPOCH_DELTA	0x00dcddb30f2f8000ULL
+
+struct btsnoop_hdr {
+	uint8_t id[8];
+	uint32_t version;
+	uint32_t type;
+} __attribute__ ((packed));
+
+struct btsnoop_pkt {
+	uint32_t size;
+	uint32_t len;
+	uint32_t flags;
+	uint32_t drops;
+	uint64_t ts;
+} __attribute__ ((packed));
+
+/*
+ * A slot is free for the producer at ring position pos when its sequence
+ * equals pos, and holds a record for the consumer when it equals pos + 1.
+ */
+struct capture_slot {
+	uint64_t seq;
+	uint64_t usec;
+	uint32_t flags;
+	uint16_t size;
+	uint16_t len;
+	uint8_t data[CAPTURE_SNAPLEN];
+};
+
+struct capture {
+	int fd;
+	int wakeup;
+	pthread_t thread;
+	bool stopping;
+	uint64_t mask;
+	uint64_t head;
+	uint64_t tail;
+	uint64_t epoch;		/* btsnoop time at monotonic zero */
+	struct capture_slot *slots;
+	struct capture_stats stats;
+	uint8_t buf[CAPTURE_BUF_SIZE];
+	size_t buflen;
+};
+
+struct capture *capture_active = NULL;
+
+/*
+ * Recorders still using the ring, so capture_stop() can wait for them.
+ * Stop clears capture_active then reads this, recorders raise this then
+ * read capture_active: both sides need sequential consistency, so that
+ * neither load can pass the store before it.
+ */
+static unsigned int capture_users = 0;
+
+/* Last stats of a stopped capture */
+static struct capture_stats capture_last;
+
+static uint64_t monotonic_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void flush_buf(struct capture *cap)
+{
+	size_t off = 0;
+
+	while (off < cap->buflen) {
+		ssize_t n = write(cap->fd, cap->buf + off, cap->buflen - off);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		off += n;
+	}
+
+	cap->buflen = 0;
+}
+
+static void drain(struct capture *cap)
+{
+	for (;;) {
+		struct capture_slot *slot = &cap->slots[cap->tail & cap->mask];
+		struct btsnoop_pkt pkt;
+
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) !=
+							cap->tail + 1)
+			break;
+
+		if (cap->buflen + sizeof(pkt) + slot->len > CAPTURE_BUF_SIZE)
+			flush_buf(cap);
+
+		pkt.size = htobe32(slot->size);
+		pkt.len = htobe32(slot->len);
+		pkt.flags = htobe32(slot->flags);
+		pkt.drops = 0;
+		pkt.ts = htobe64(cap->epoch + slot->usec);
+
+		memcpy(cap->buf + cap->buflen, &pkt, sizeof(pkt));
+		memcpy(cap->buf + cap->buflen + sizeof(pkt), slot->data,
+								slot->len);
+		cap->buflen += sizeof(pkt) + slot->len;
+
+		__atomic_store_n(&slot->seq, cap->tail + cap->mask + 1,
+							__ATOMIC_RELEASE);
+		cap->tail++;
+		cap->stats.written++;
+	}
+
+	flush_buf(cap);
+}
+
+static void *flush_thread(void *data)
+{
+	struct capture *cap = data;
+	struct pollfd pfd = { .fd = cap->wakeup, .events = POLLIN };
+
+	while (!__atomic_load_n(&cap->stopping, __ATOMIC_ACQUIRE)) {
+		poll(&pfd, 1, CAPTURE_FLUSH_MS);
+		drain(cap);
+	}
+
+	return NULL;
+}
+
+static int write_header(int fd)
+{
+	struct btsnoop_hdr hdr;
+
+	memcpy(hdr.id, "btsnoop\0", sizeof(hdr.id));
+	hdr.version = htobe32(1);
+	hdr.type = htobe32(BTSNOOP_TYPE_MONITOR);
+
+	if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+		return -EIO;
+
+	return 0;
+}
+
+/* @slots is rounded up to a power of two, 0 picks the default */
+int capture_start(const char *path, unsigned int slots)
+{
+	struct capture *cap;
+	struct timespec real;
+	uint64_t i, size = 1;
+	int err;
+
+	if (capture_active)
+		return -EALREADY;
+
+	if (slots == 0)
+		slots = CAPTURE_SLOTS_DEFAULT;
+
+	while (size < slots)
+		size <<= 1;
+
+	cap = calloc(1, sizeof(*cap));
+	if (!cap)
+		return -ENOMEM;
+
+	cap->slots = calloc(size, sizeof(*cap->slots));
+	if (!cap->slots) {
+		free(cap);
+		return -ENOMEM;
+	}
+
+	cap->mask = size - 1;
+
+	for (i = 0; i < size; i++)
+		cap->slots[i].seq = i;
+
+	cap->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (cap->fd < 0) {
+		err = -errno;
+		goto failed;
+	}
+
+	err = write_header(cap->fd);
+	if (err < 0)
+		goto close_file;
+
+	cap->wakeup = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (cap->wakeup < 0) {
+		err = -errno;
+		goto close_file;
+	}
+
+	/* Timestamps are monotonic, anchored to the wall clock once */
+	clock_gettime(CLOCK_REALTIME, &real);
+	cap->epoch = BTSNOOP_EPOCH_DELTA + real.tv_sec * 1000000ULL +
+				real.tv_nsec / 1000 - monotonic_usec();
+
+	err = -pthread_create(&cap->thread, NULL, flush_thread, cap);
+	if (err < 0)
+		goto close_wakeup;
+
+	__atomic_store_n(&capture_active, cap, __ATOMIC_RELEASE);
+
+	return 0;
+
+close_wakeup:
+	close(cap->wakeup);
+close_file:
+	close(cap->fd);
+failed:
+	free(cap->slots);
+	free(cap);
+
+	return err;
+}
+
+void capture_stop(void)
+{
+	struct capture *cap = capture_active;
+
+	if (!cap)
+		return;
+
+	__atomic_store_n(&capture_active, NULL, __ATOMIC_SEQ_CST);
+
+	while (__atomic_load_n(&capture_users, __ATOMIC_SEQ_CST) > 0)
+		sched_yield();
+
+	__atomic_store_n(&cap->stopping, true, __ATOMIC_RELEASE);
+
+	/* A failed wakeup is ignored: the thread stops on its next timeout */
+	eventfd_write(cap->wakeup, 1);
+
+	pthread_join(cap->thread, NULL);
+
+	drain(cap);
+
+	capture_last = cap->stats;
+
+	close(cap->wakeup);
+	close(cap->fd);
+	free(cap->slots);
+	free(cap);
+}
+
+bool capture_get_stats(struct capture_stats *stats)
+{
+	struct capture *cap;
+	bool active;
+
+	__atomic_fetch_add(&capture_users, 1, __ATOMIC_SEQ_CST);
+
+	cap = __atomic_load_n(&capture_active, __ATOMIC_SEQ_CST);
+	active = cap != NULL;
+
+	if (cap) {
+		stats->records = __atomic_load_n(&cap->stats.records,
+							__ATOMIC_RELAXED);
+		stats->dropped = __atomic_load_n(&cap->stats.dropped,
+							__ATOMIC_RELAXED);
+		stats->truncated = __atomic_load_n(&cap->stats.truncated,
+							__ATOMIC_RELAXED);
+		stats->written = __atomic_load_n(&cap->stats.written,
+							__ATOMIC_RELAXED);
+	} else {
+		*stats = capture_last;
+	}
+
+	__atomic_fetch_sub(&capture_users, 1, __ATOMIC_RELEASE);
+
+	return active;
+}
+
+static void record(struct capture *cap, uint16_t index, uint16_t type,
+					const struct iovec *iov, int iovcnt)
+{
+	struct capture_slot *slot;
+	uint64_t pos, seq;
+	size_t size = 0, len = 0;
+	int i;
+
+	pos = __atomic_load_n(&cap->head, __ATOMIC_RELAXED);
+
+	for (;;) {
+		int64_t diff;
+
+		slot = &cap->slots[pos & cap->mask];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		diff = (int64_t) (seq - pos);
+
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&cap->head, &pos,
+						pos + 1, true,
+						__ATOMIC_RELAXED,
+						__ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			__atomic_fetch_add(&cap->stats.dropped, 1,
+							__ATOMIC_RELAXED);
+			return;
+		} else {
+			pos = __atomic_load_n(&cap->head, __ATOMIC_RELAXED);
+		}
+	}
+
+	for (i = 0; i < iovcnt; i++) {
+		size_t n = iov[i].iov_len;
+
+		size += n;
+
+		if (n > CAPTURE_SNAPLEN - len)
+			n = CAPTURE_SNAPLEN - len;
+
+		memcpy(slot->data + len, iov[i].iov_base, n);
+		len += n;
+	}
+
+	slot->usec = monotonic_usec();
+	slot->flags = ((uint32_t) index << 16) | type;
+	slot->size = size;
+	slot->len = len;
+
+	if (len < size)
+		__atomic_fetch_add(&cap->stats.truncated, 1, __ATOMIC_RELAXED);
+
+	__atomic_fetch_add(&cap->stats.records, 1, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+void capture_record(uint16_t index, uint16_t type, const struct iovec *iov,
+								int iovcnt)
+{
+	struct capture *cap;
+
+	__atomic_fetch_add(&capture_users, 1, __ATOMIC_SEQ_CST);
+
+	cap = __atomic_load_n(&capture_active, __ATOMIC_SEQ_CST);
+	if (cap)
+		record(cap, index, type, iov, iovcnt);
+
+	__atomic_fetch_sub(&capture_users, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * ATT sockets carry bare PDUs: they are framed as ACL data on the fixed
+ * ATT channel, with the socket as connection handle, for btmon to decode.
+ */
+void capture_att(int fd, bool out, const void *pdu, uint16_t len)
+{
+	uint8_t hdr[8];
+	struct iovec iov[2];
+
+	/* ACL header: handle and flags, length */
+	hdr[0] = fd & 0xff;
+	hdr[1] = (fd >> 8) & 0x0f;
+	hdr[2] = (len + 4) & 0xff;
+	hdr[3] = (len + 4) >> 8;
+
+	/* L2CAP header: length, CID */
+	hdr[4] = len & 0xff;
+	hdr[5] = len >> 8;
+	hdr[6] = 0x04;
+	hdr[7] = 0x00;
+
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = (void *) pdu;
+	iov[1].iov_len = len;
+
+	capture_record(0, out ? CAPTURE_ACL_TX : CAPTURE_ACL_RX, iov, 2);
+}
+
+/* @buf is a management frame, header included */
+void capture_mgmt(bool out, const void *buf, uint16_t len)
+{
+	const uint8_t *hdr = buf;
+	uint8_t cookie[4] = { 0, 0, 0, 0 };
+	struct iovec iov[3];
+
+	if (len < 6)
+		return;
+
+	/* Control records: cookie, opcode or event, parameters */
+	iov[0].iov_base = cookie;
+	iov[0].iov_len = sizeof(cookie);
+	iov[1].iov_base = (void *) hdr;
+	iov[1].iov_len = 2;
+	iov[2].iov_base = (void *) (hdr + 6);
+	iov[2].iov_len = len - 6;
+
+	capture_record(hdr[2] | (hdr[3] << 8), out ? CAPTURE_CTRL_COMMAND :
+						CAPTURE_CTRL_EVENT, iov, 3);
+}
@@ -0,0 +1,64 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2012  Intel Corporation. All rights reserved.
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/* Record types of the btsnoop monitor format (datalink 2001) */
+#define CAPTURE_HCI_COMMAND	2
+#define CAPTURE_HCI_EVENT	3
+#define CAPTURE_ACL_TX		4
+#define CAPTURE_ACL_RX		5
+#define CAPTURE_CTRL_COMMAND	16
+#define CAPTURE_CTRL_EVENT	17
+
+#define CAPTURE_INDEX_NONE	0xffff
+
+struct capture_stats {
+	uint64_t records;	/* Frames taken into the ring */
+	uint64_t dropped;	/* Frames lost to a full ring */
+	uint64_t truncated;	/* Frames cut to the snap length */
+	uint64_t written;	/* Records flushed to the file */
+};
+
+struct capture;
+
+/* NULL unless capturing; check capture_enabled() before recording */
+extern struct capture *capture_active;
+
+static inline bool capture_enabled(void)
+{
+	return __builtin_expect(__atomic_load_n(&capture_active,
+						__ATOMIC_RELAXED) != NULL, 0);
+}
+
+int capture_start(const char *path, unsigned int slots);
+void capture_stop(void);
+bool capture_get_stats(struct capture_stats *stats);
+
+void capture_record(uint16_t index, uint16_t type, const struct iovec *iov,
+								int iovcnt);
+
+void capture_att(int fd, bool out, const void *pdu, uint16_t len);
+void capture_mgmt(bool out, const void *buf, uint16_t len);
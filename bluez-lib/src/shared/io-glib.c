@@ -0,0 +1,230 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2012  Intel Corporation. All rights reserved.
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <glib.h>
+
+#include "src/shared/io.h"
+
+struct io_watch {
+	struct io *io;
+	GSource *source;
+	io_callback_func_t callback;
+	io_destroy_func_t destroy;
+	void *user_data;
+};
+
+/* Watches are dispatched from the thread-default context of the creator */
+struct io {
+	int ref_count;
+	GIOChannel *channel;
+	GMainContext *context;
+	struct io_watch *read_watch;
+	struct io_watch *write_watch;
+	struct io_watch *disconnect_watch;
+};
+
+static struct io *io_ref(struct io *io)
+{
+	io->ref_count++;
+
+	return io;
+}
+
+static void io_unref(struct io *io)
+{
+	if (--io->ref_count > 0)
+		return;
+
+	g_io_channel_unref(io->channel);
+	g_main_context_unref(io->context);
+	g_free(io);
+}
+
+struct io *io_new(int fd)
+{
+	struct io *io;
+
+	if (fd < 0)
+		return NULL;
+
+	io = g_try_new0(struct io, 1);
+	if (!io)
+		return NULL;
+
+	io->channel = g_io_channel_unix_new(fd);
+	io->context = g_main_context_ref_thread_default();
+
+	g_io_channel_set_encoding(io->channel, NULL, NULL);
+	g_io_channel_set_buffered(io->channel, FALSE);
+	g_io_channel_set_close_on_unref(io->channel, FALSE);
+
+	return io_ref(io);
+}
+
+static void watch_remove(struct io_watch **watch)
+{
+	struct io_watch *w = *watch;
+
+	if (!w)
+		return;
+
+	/* The destroy notify may run later if the watch is dispatching */
+	*watch = NULL;
+	g_source_destroy(w->source);
+}
+
+void io_destroy(struct io *io)
+{
+	if (!io)
+		return;
+
+	watch_remove(&io->read_watch);
+	watch_remove(&io->write_watch);
+	watch_remove(&io->disconnect_watch);
+
+	io_unref(io);
+}
+
+int io_get_fd(struct io *io)
+{
+	if (!io)
+		return -1;
+
+	return g_io_channel_unix_get_fd(io->channel);
+}
+
+bool io_set_close_on_destroy(struct io *io, bool do_close)
+{
+	if (!io)
+		return false;
+
+	g_io_channel_set_close_on_unref(io->channel, do_close);
+
+	return true;
+}
+
+static void watch_destroy(gpointer user_data)
+{
+	struct io_watch *watch = user_data;
+	struct io *io = watch->io;
+
+	if (io->read_watch == watch)
+		io->read_watch = NULL;
+	else if (io->write_watch == watch)
+		io->write_watch = NULL;
+	else if (io->disconnect_watch == watch)
+		io->disconnect_watch = NULL;
+
+	if (watch->destroy)
+		watch->destroy(watch->user_data);
+
+	io_unref(io);
+	g_free(watch);
+}
+
+static gboolean watch_callback(GIOChannel *channel, GIOCondition cond,
+							gpointer user_data)
+{
+	struct io_watch *watch = user_data;
+
+	/* Read and write handlers go away with the connection */
+	if (watch != watch->io->disconnect_watch &&
+				(cond & (G_IO_HUP | G_IO_ERR | G_IO_NVAL)))
+		return FALSE;
+
+	return watch->callback(watch->io, watch->user_data) ? TRUE : FALSE;
+}
+
+static bool io_set_handler(struct io *io, struct io_watch **watch,
+				GIOCondition cond, io_callback_func_t callback,
+				void *user_data, io_destroy_func_t destroy)
+{
+	struct io_watch *w;
+
+	if (!io)
+		return false;
+
+	watch_remove(watch);
+
+	if (!callback)
+		return true;
+
+	w = g_try_new0(struct io_watch, 1);
+	if (!w)
+		return false;
+
+	w->io = io_ref(io);
+	w->callback = callback;
+	w->destroy = destroy;
+	w->user_data = user_data;
+
+	*watch = w;
+
+	w->source = g_io_create_watch(io->channel,
+				cond | G_IO_HUP | G_IO_ERR | G_IO_NVAL);
+	g_source_set_callback(w->source, (GSourceFunc) watch_callback, w,
+								watch_destroy);
+	g_source_attach(w->source, io->context);
+	g_source_unref(w->source);
+
+	return true;
+}
+
+bool io_set_read_handler(struct io *io, io_callback_func_t callback,
+				void *user_data, io_destroy_func_t destroy)
+{
+	if (!io)
+		return false;
+
+	return io_set_handler(io, &io->read_watch, G_IO_IN, callback,
+							user_data, destroy);
+}
+
+bool io_set_write_handler(struct io *io, io_callback_func_t callback,
+				void *user_data, io_destroy_func_t destroy)
+{
+	if (!io)
+		return false;
+
+	return io_set_handler(io, &io->write_watch, G_IO_OUT, callback,
+							user_data, destroy);
+}
+
+bool io_set_disconnect_handler(struct io *io, io_callback_func_t callback,
+				void *user_data, io_destroy_func_t destroy)
+{
+	if (!io)
+		return false;
+
+	return io_set_handler(io, &io->disconnect_watch, 0, callback,
+							user_data, destroy);
+}
+
+bool io_main_context(void)
+{
+	return true;
+}
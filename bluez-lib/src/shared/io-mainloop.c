@@ -0,0 +1,276 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2012  Intel Corporation. All rights reserved.
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+
+#include "src/shared/mainloop.h"
+#include "src/shared/io.h"
+
+struct io_handler {
+	io_callback_func_t callback;
+	io_destroy_func_t destroy;
+	void *user_data;
+};
+
+struct io {
+	int ref_count;
+	int fd;
+	uint32_t events;
+	bool close_on_destroy;
+	struct io_handler read;
+	struct io_handler write;
+	struct io_handler disconnect;
+};
+
+static struct io *io_ref(struct io *io)
+{
+	io->ref_count++;
+
+	return io;
+}
+
+static void io_unref(struct io *io)
+{
+	if (--io->ref_count > 0)
+		return;
+
+	free(io);
+}
+
+static void handler_clear(struct io_handler *handler)
+{
+	io_destroy_func_t destroy = handler->destroy;
+	void *user_data = handler->user_data;
+
+	handler->callback = NULL;
+	handler->destroy = NULL;
+	handler->user_data = NULL;
+
+	if (destroy)
+		destroy(user_data);
+}
+
+static void io_cleanup(void *user_data)
+{
+	struct io *io = user_data;
+
+	handler_clear(&io->write);
+	handler_clear(&io->read);
+	handler_clear(&io->disconnect);
+
+	if (io->close_on_destroy)
+		close(io->fd);
+
+	io->fd = -1;
+
+	io_unref(io);
+}
+
+static void io_update(struct io *io, uint32_t events)
+{
+	if (io->fd < 0 || io->events == events)
+		return;
+
+	if (mainloop_modify_fd(io->fd, events) == 0)
+		io->events = events;
+}
+
+/*
+ * Run one handler and drop it when it returns false, unless it was
+ * replaced from within the callback.
+ */
+static void handler_run(struct io *io, struct io_handler *handler,
+							uint32_t event)
+{
+	io_callback_func_t callback = handler->callback;
+
+	if (!callback)
+		return;
+
+	if (callback(io, handler->user_data))
+		return;
+
+	if (handler->callback != callback)
+		return;
+
+	handler_clear(handler);
+	io_update(io, io->events & ~event);
+}
+
+static void io_callback(int fd, uint32_t events, void *user_data)
+{
+	struct io *io = user_data;
+
+	io_ref(io);
+
+	if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+		handler_clear(&io->read);
+		handler_clear(&io->write);
+
+		handler_run(io, &io->disconnect, EPOLLRDHUP);
+
+		/* Nothing left to watch the descriptor for */
+		if (io->fd >= 0 && !io->disconnect.callback)
+			mainloop_remove_fd(io->fd);
+
+		io_unref(io);
+		return;
+	}
+
+	if (events & EPOLLIN)
+		handler_run(io, &io->read, EPOLLIN);
+
+	if ((events & EPOLLOUT) && io->fd >= 0)
+		handler_run(io, &io->write, EPOLLOUT);
+
+	io_unref(io);
+}
+
+struct io *io_new(int fd)
+{
+	struct io *io;
+
+	if (fd < 0)
+		return NULL;
+
+	io = calloc(1, sizeof(*io));
+	if (!io)
+		return NULL;
+
+	io->fd = fd;
+	io->events = 0;
+
+	/* One reference for the caller, one for the main loop entry */
+	io_ref(io);
+	io_ref(io);
+
+	if (mainloop_add_fd(io->fd, io->events, io_callback, io,
+							io_cleanup) < 0) {
+		free(io);
+		return NULL;
+	}
+
+	return io;
+}
+
+void io_destroy(struct io *io)
+{
+	if (!io)
+		return;
+
+	if (io->fd >= 0)
+		mainloop_remove_fd(io->fd);
+
+	io_unref(io);
+}
+
+int io_get_fd(struct io *io)
+{
+	if (!io)
+		return -1;
+
+	return io->fd;
+}
+
+bool io_set_close_on_destroy(struct io *io, bool do_close)
+{
+	if (!io)
+		return false;
+
+	io->close_on_destroy = do_close;
+
+	return true;
+}
+
+static bool io_set_handler(struct io *io, struct io_handler *handler,
+				uint32_t event, io_callback_func_t callback,
+				void *user_data, io_destroy_func_t destroy)
+{
+	uint32_t events;
+
+	if (!io || io->fd < 0)
+		return false;
+
+	handler_clear(handler);
+
+	if (callback)
+		events = io->events | event;
+	else
+		events = io->events & ~event;
+
+	if (events != io->events) {
+		if (mainloop_modify_fd(io->fd, events) < 0)
+			return false;
+
+		io->events = events;
+	}
+
+	handler->callback = callback;
+	handler->destroy = destroy;
+	handler->user_data = user_data;
+
+	return true;
+}
+
+bool io_set_read_handler(struct io *io, io_callback_func_t callback,
+				void *user_data, io_destroy_func_t destroy)
+{
+	if (!io)
+		return false;
+
+	return io_set_handler(io, &io->read, EPOLLIN, callback, user_data,
+								destroy);
+}
+
+bool io_set_write_handler(struct io *io, io_callback_func_t callback,
+				void *user_data, io_destroy_func_t destroy)
+{
+	if (!io)
+		return false;
+
+	return io_set_handler(io, &io->write, EPOLLOUT, callback, user_data,
+								destroy);
+}
+
+bool io_set_disconnect_handler(struct io *io, io_callback_func_t callback,
+				void *user_data, io_destroy_func_t destroy)
+{
+	if (!io)
+		return false;
+
+	return io_set_handler(io, &io->disconnect, EPOLLRDHUP, callback,
+							user_data, destroy);
+}
+
+/* mainloop_run() never iterates a GMainContext */
+bool io_main_context(void)
+{
+	return false;
+}
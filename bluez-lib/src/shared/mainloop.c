@@ -0,0 +1,393 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2012  Intel Corporation. All rights reserved.
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "src/shared/mainloop.h"
+
+/*
+ * Minimal epoll based main loop for builds without GLib's: file
+ * descriptors and timerfd timeouts, dispatched from a single thread.
+ */
+
+#define MAX_EPOLL_EVENTS 32
+
+struct mainloop_data {
+	int fd;
+	uint32_t events;
+	mainloop_event_func callback;
+	mainloop_destroy_func destroy;
+	void *user_data;
+	struct mainloop_data *next;
+};
+
+static int epoll_fd = -1;
+static int epoll_terminate;
+static int exit_status;
+
+/* Registered descriptors, indexed by fd */
+static struct mainloop_data **fd_table;
+static unsigned int fd_table_len;
+
+/*
+ * Entries removed while a batch of events is being dispatched may still
+ * be referenced by later events of the same batch.
+ */
+static struct mainloop_data *removed_list;
+static bool dispatching;
+
+static void free_removed(void)
+{
+	while (removed_list) {
+		struct mainloop_data *data = removed_list;
+
+		removed_list = data->next;
+		free(data);
+	}
+}
+
+void mainloop_init(void)
+{
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+	epoll_terminate = 0;
+	exit_status = EXIT_SUCCESS;
+}
+
+void mainloop_quit(void)
+{
+	epoll_terminate = 1;
+}
+
+int mainloop_run(void)
+{
+	unsigned int i;
+
+	if (epoll_fd < 0)
+		return EXIT_FAILURE;
+
+	while (!epoll_terminate) {
+		struct epoll_event events[MAX_EPOLL_EVENTS];
+		int n, nfds;
+
+		nfds = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, -1);
+		if (nfds < 0) {
+			if (errno == EINTR)
+				continue;
+
+			exit_status = EXIT_FAILURE;
+			break;
+		}
+
+		dispatching = true;
+
+		for (n = 0; n < nfds; n++) {
+			struct mainloop_data *data = events[n].data.ptr;
+
+			/* Removed by an earlier callback of this batch */
+			if (data->callback == NULL)
+				continue;
+
+			data->callback(data->fd, events[n].events,
+							data->user_data);
+		}
+
+		dispatching = false;
+
+		free_removed();
+	}
+
+	for (i = 0; i < fd_table_len; i++) {
+		if (fd_table[i])
+			mainloop_remove_fd(i);
+	}
+
+	free(fd_table);
+	fd_table = NULL;
+	fd_table_len = 0;
+
+	close(epoll_fd);
+	epoll_fd = -1;
+
+	return exit_status;
+}
+
+static int fd_table_grow(int fd)
+{
+	struct mainloop_data **table;
+	unsigned int len = fd_table_len ? fd_table_len : 64;
+
+	while (len <= (unsigned int) fd)
+		len *= 2;
+
+	if (len == fd_table_len)
+		return 0;
+
+	table = realloc(fd_table, len * sizeof(*table));
+	if (!table)
+		return -ENOMEM;
+
+	memset(table + fd_table_len, 0,
+				(len - fd_table_len) * sizeof(*table));
+
+	fd_table = table;
+	fd_table_len = len;
+
+	return 0;
+}
+
+int mainloop_add_fd(int fd, uint32_t events, mainloop_event_func callback,
+				void *user_data, mainloop_destroy_func destroy)
+{
+	struct mainloop_data *data;
+	struct epoll_event ev;
+	int err;
+
+	if (fd < 0 || !callback)
+		return -EINVAL;
+
+	err = fd_table_grow(fd);
+	if (err < 0)
+		return err;
+
+	if (fd_table[fd])
+		return -EEXIST;
+
+	data = calloc(1, sizeof(*data));
+	if (!data)
+		return -ENOMEM;
+
+	data->fd = fd;
+	data->events = events;
+	data->callback = callback;
+	data->destroy = destroy;
+	data->user_data = user_data;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = data;
+
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, data->fd, &ev) < 0) {
+		err = -errno;
+		free(data);
+		return err;
+	}
+
+	fd_table[fd] = data;
+
+	return 0;
+}
+
+int mainloop_modify_fd(int fd, uint32_t events)
+{
+	struct mainloop_data *data;
+	struct epoll_event ev;
+
+	if (fd < 0 || (unsigned int) fd >= fd_table_len)
+		return -EINVAL;
+
+	data = fd_table[fd];
+	if (!data)
+		return -ENXIO;
+
+	if (data->events == events)
+		return 0;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = data;
+
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, data->fd, &ev) < 0)
+		return -errno;
+
+	data->events = events;
+
+	return 0;
+}
+
+int mainloop_remove_fd(int fd)
+{
+	struct mainloop_data *data;
+	int err;
+
+	if (fd < 0 || (unsigned int) fd >= fd_table_len)
+		return -EINVAL;
+
+	data = fd_table[fd];
+	if (!data)
+		return -ENXIO;
+
+	fd_table[fd] = NULL;
+
+	err = epoll_ctl(epoll_fd, EPOLL_CTL_DEL, data->fd, NULL);
+
+	data->callback = NULL;
+
+	if (data->destroy)
+		data->destroy(data->user_data);
+
+	if (dispatching) {
+		data->next = removed_list;
+		removed_list = data;
+	} else
+		free(data);
+
+	return err < 0 ? -errno : 0;
+}
+
+struct timeout_data {
+	int fd;
+	mainloop_timeout_func callback;
+	mainloop_destroy_func destroy;
+	void *user_data;
+};
+
+static void timeout_callback(int fd, uint32_t events, void *user_data)
+{
+	struct timeout_data *data = user_data;
+	uint64_t expired;
+
+	if (events & (EPOLLERR | EPOLLHUP))
+		return;
+
+	if (read(data->fd, &expired, sizeof(expired)) != sizeof(expired))
+		return;
+
+	if (data->callback)
+		data->callback(data->fd, data->user_data);
+}
+
+static void timeout_destroy(void *user_data)
+{
+	struct timeout_data *data = user_data;
+
+	close(data->fd);
+	data->fd = -1;
+
+	if (data->destroy)
+		data->destroy(data->user_data);
+
+	free(data);
+}
+
+static int timeout_set(int fd, unsigned int msec)
+{
+	struct itimerspec itimer;
+
+	memset(&itimer, 0, sizeof(itimer));
+	itimer.it_value.tv_sec = msec / 1000;
+	itimer.it_value.tv_nsec = (msec % 1000) * 1000000;
+	itimer.it_interval = itimer.it_value;
+
+	return timerfd_settime(fd, 0, &itimer, NULL);
+}
+
+/* Timeouts repeat every msec until removed, the id is their timerfd */
+int mainloop_add_timeout(unsigned int msec, mainloop_timeout_func callback,
+				void *user_data, mainloop_destroy_func destroy)
+{
+	struct timeout_data *data;
+	int err;
+
+	if (!callback)
+		return -EINVAL;
+
+	data = calloc(1, sizeof(*data));
+	if (!data)
+		return -ENOMEM;
+
+	data->callback = callback;
+	data->destroy = destroy;
+	data->user_data = user_data;
+
+	data->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (data->fd < 0) {
+		err = -errno;
+		free(data);
+		return err;
+	}
+
+	if (msec > 0 && timeout_set(data->fd, msec) < 0) {
+		err = -errno;
+		close(data->fd);
+		free(data);
+		return err;
+	}
+
+	err = mainloop_add_fd(data->fd, EPOLLIN, timeout_callback, data,
+							timeout_destroy);
+	if (err < 0) {
+		close(data->fd);
+		free(data);
+		return err;
+	}
+
+	return data->fd;
+}
+
+static struct timeout_data *timeout_lookup(int id)
+{
+	struct mainloop_data *data;
+
+	if (id < 0 || (unsigned int) id >= fd_table_len)
+		return NULL;
+
+	/* Only timerfds we created, never another fd that reused the id */
+	data = fd_table[id];
+	if (!data || data->callback != timeout_callback)
+		return NULL;
+
+	return data->user_data;
+}
+
+int mainloop_modify_timeout(int id, unsigned int msec)
+{
+	struct timeout_data *data = timeout_lookup(id);
+
+	if (!data)
+		return -ENXIO;
+
+	if (timeout_set(data->fd, msec) < 0)
+		return -errno;
+
+	return 0;
+}
+
+int mainloop_remove_timeout(int id)
+{
+	if (!timeout_lookup(id))
+		return -ENXIO;
+
+	return mainloop_remove_fd(id);
+}
@@ -36,6 +36,8 @@
 #include "lib/mgmt.h"
 #include "lib/hci.h"
 
+#include "src/shared/io.h"
+#include "src/shared/capture.h"
 #include "src/shared/util.h"
 #include "src/shared/mgmt.h"
 
@@ -43,9 +45,8 @@ struct mgmt {
 	int ref_count;
 	int fd;
 	bool close_on_unref;
-	GIOChannel *io;
-	guint read_watch;
-	guint write_watch;
+	struct io *io;
+	bool writer_active;
 	GQueue *request_queue;
 	GQueue *reply_queue;
 	GList *pending_list;
@@ -120,32 +121,28 @@ static gint compare_notify_id(gconstpointer a, gconstpointer b)
 	return notify->id - id;
 }
 
-static void write_watch_destroy(gpointer user_data)
+static void write_watch_destroy(void *user_data)
 {
 	struct mgmt *mgmt = user_data;
 
-	mgmt->write_watch = 0;
+	mgmt->writer_active = false;
 }
 
-static gboolean can_write_data(GIOChannel *channel, GIOCondition cond,
-							gpointer user_data)
+static bool can_write_data(struct io *io, void *user_data)
 {
 	struct mgmt *mgmt = user_data;
 	struct mgmt_request *request;
 	ssize_t bytes_written;
 
-	if (cond & (G_IO_HUP | G_IO_ERR | G_IO_NVAL))
-		return FALSE;
-
 	request = g_queue_pop_head(mgmt->reply_queue);
 	if (!request) {
 		/* only reply commands can jump the queue */
 		if (mgmt->pending_list)
-			return FALSE;
+			return false;
 
 		request = g_queue_pop_head(mgmt->request_queue);
 		if (!request)
-			return FALSE;
+			return false;
 	}
 
 	bytes_written = write(mgmt->fd, request->buf, request->len);
@@ -156,19 +153,22 @@ static gboolean can_write_data(GIOChannel *channel, GIOCondition cond,
 			request->callback(MGMT_STATUS_FAILED, 0, NULL,
 							request->user_data);
 		destroy_request(request, NULL);
-		return TRUE;
+		return true;
 	}
 
 	util_debug(mgmt->debug_callback, mgmt->debug_data,
 				"[0x%04x] command 0x%04x",
 				request->index, request->opcode);
 
+	if (capture_enabled())
+		capture_mgmt(true, request->buf, bytes_written);
+
 	util_hexdump('<', request->buf, bytes_written,
 				mgmt->debug_callback, mgmt->debug_data);
 
 	mgmt->pending_list = g_list_append(mgmt->pending_list, request);
 
-	return FALSE;
+	return false;
 }
 
 static void wakeup_writer(struct mgmt *mgmt)
@@ -179,12 +179,11 @@ static void wakeup_writer(struct mgmt *mgmt)
 			return;
 	}
 
-	if (mgmt->write_watch > 0)
+	if (mgmt->writer_active)
 		return;
 
-	mgmt->write_watch = g_io_add_watch_full(mgmt->io, G_PRIORITY_HIGH,
-				G_IO_OUT | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
-				can_write_data, mgmt, write_watch_destroy);
+	mgmt->writer_active = io_set_write_handler(mgmt->io, can_write_data,
+						mgmt, write_watch_destroy);
 }
 
 static GList *lookup_pending(struct mgmt *mgmt, uint16_t opcode, uint16_t index)
@@ -264,20 +263,17 @@ static void process_notify(struct mgmt *mgmt, uint16_t event, uint16_t index,
 	mgmt->notify_destroyed = NULL;
 }
 
-static void read_watch_destroy(gpointer user_data)
+static void read_watch_destroy(void *user_data)
 {
 	struct mgmt *mgmt = user_data;
 
 	if (mgmt->destroyed) {
+		io_destroy(mgmt->io);
 		g_free(mgmt);
-		return;
 	}
-
-	mgmt->read_watch = 0;
 }
 
-static gboolean received_data(GIOChannel *channel, GIOCondition cond,
-							gpointer user_data)
+static bool received_data(struct io *io, void *user_data)
 {
 	struct mgmt *mgmt = user_data;
 	struct mgmt_hdr *hdr;
@@ -286,18 +282,18 @@ static gboolean received_data(GIOChannel *channel, GIOCondition cond,
 	ssize_t bytes_read;
 	uint16_t opcode, event, index, length;
 
-	if (cond & (G_IO_HUP | G_IO_ERR | G_IO_NVAL))
-		return FALSE;
-
 	bytes_read = read(mgmt->fd, mgmt->buf, mgmt->len);
 	if (bytes_read < 0)
-		return TRUE;
+		return true;
 
 	util_hexdump('>', mgmt->buf, bytes_read,
 				mgmt->debug_callback, mgmt->debug_data);
 
+	if (capture_enabled())
+		capture_mgmt(false, mgmt->buf, bytes_read);
+
 	if (bytes_read < MGMT_HDR_SIZE)
-		return TRUE;
+		return true;
 
 	hdr = mgmt->buf;
 	event = btohs(hdr->opcode);
@@ -305,7 +301,7 @@ static gboolean received_data(GIOChannel *channel, GIOCondition cond,
 	length = btohs(hdr->len);
 
 	if (bytes_read < length + MGMT_HDR_SIZE)
-		return TRUE;
+		return true;
 
 	switch (event) {
 	case MGMT_EV_CMD_COMPLETE:
@@ -339,9 +335,9 @@ static gboolean received_data(GIOChannel *channel, GIOCondition cond,
 	}
 
 	if (mgmt->destroyed)
-		return FALSE;
+		return false;
 
-	return TRUE;
+	return true;
 }
 
 struct mgmt *mgmt_new(int fd)
@@ -365,17 +361,17 @@ struct mgmt *mgmt_new(int fd)
 		return NULL;
 	}
 
-	mgmt->io = g_io_channel_unix_new(mgmt->fd);
-
-	g_io_channel_set_encoding(mgmt->io, NULL, NULL);
-	g_io_channel_set_buffered(mgmt->io, FALSE);
+	mgmt->io = io_new(mgmt->fd);
+	if (!mgmt->io) {
+		g_free(mgmt->buf);
+		g_free(mgmt);
+		return NULL;
+	}
 
 	mgmt->request_queue = g_queue_new();
 	mgmt->reply_queue = g_queue_new();
 
-	mgmt->read_watch = g_io_add_watch_full(mgmt->io, G_PRIORITY_DEFAULT,
-				G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
-				received_data, mgmt, read_watch_destroy);
+	io_set_read_handler(mgmt->io, received_data, mgmt, read_watch_destroy);
 
 	return mgmt_ref(mgmt);
 }
@@ -436,17 +432,8 @@ void mgmt_unref(struct mgmt *mgmt)
 	g_queue_free(mgmt->reply_queue);
 	g_queue_free(mgmt->request_queue);
 
-	if (mgmt->write_watch > 0)
-		g_source_remove(mgmt->write_watch);
-
-	if (mgmt->read_watch > 0)
-		g_source_remove(mgmt->read_watch);
-
-	g_io_channel_unref(mgmt->io);
-	mgmt->io = NULL;
-
-	if (mgmt->close_on_unref)
-		close(mgmt->fd);
+	io_set_write_handler(mgmt->io, NULL, NULL, NULL);
+	io_set_close_on_destroy(mgmt->io, mgmt->close_on_unref);
 
 	if (mgmt->debug_destroy)
 		mgmt->debug_destroy(mgmt->debug_data);
@@ -455,10 +442,12 @@ void mgmt_unref(struct mgmt *mgmt)
 	mgmt->buf = NULL;
 
 	if (!mgmt->in_notify) {
+		io_destroy(mgmt->io);
 		g_free(mgmt);
 		return;
 	}
 
+	/* The read handler is running, it frees everything on return */
 	mgmt->destroyed = true;
 }
 
@@ -0,0 +1,530 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2010  Nokia Corporation
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * ATT codec cost: each operation encodes one PDU and decodes it again,
+ * with variable length PDUs filled up to the MTU. Encoder inputs (lists,
+ * ranges, values) are built once per MTU, so the allocations reported
+ * are the codec's own.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <glib.h>
+
+#include <bluetooth/bluetooth.h>
+
+#include "lib/uuid.h"
+#include "att.h"
+#include "alloc-count.h"
+
+#define BENCH_MAX_MTU		517
+#define BENCH_HANDLE		0x0020
+#define BENCH_TYPE		0x2800
+
+static const size_t mtus[] = { ATT_DEFAULT_LE_MTU, 185, BENCH_MAX_MTU };
+
+#define MTU_COUNT		(sizeof(mtus) / sizeof(mtus[0]))
+
+struct bench_ctx {
+	size_t mtu;
+	bt_uuid_t uuid;
+	uint8_t value[BENCH_MAX_MTU];
+	uint8_t buf[BENCH_MAX_MTU];
+	uint8_t pdu[BENCH_MAX_MTU];
+	uint16_t handles[BENCH_MAX_MTU / 2];
+	uint8_t *values[BENCH_MAX_MTU / 2];
+	size_t vlens[BENCH_MAX_MTU / 2];
+	size_t nhandles;
+	struct att_data_list *grp_list;
+	struct att_data_list *type_list;
+	struct att_data_list *info_list;
+	GSList *ranges;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static struct att_data_list *list_new(size_t mtu, uint16_t len)
+{
+	struct att_data_list *list;
+	uint16_t num = (mtu - 2) / len;
+	uint16_t i;
+
+	list = att_data_list_alloc(num, len);
+	if (list == NULL)
+		return NULL;
+
+	for (i = 0; i < num; i++) {
+		memset(list->data[i], 0, len);
+		att_put_u16(BENCH_HANDLE + i * 2, list->data[i]);
+	}
+
+	return list;
+}
+
+static void ctx_init(struct bench_ctx *ctx, size_t mtu)
+{
+	size_t i;
+
+	memset(ctx, 0, sizeof(*ctx));
+
+	ctx->mtu = mtu;
+	bt_uuid16_create(&ctx->uuid, BENCH_TYPE);
+
+	for (i = 0; i < sizeof(ctx->value); i++)
+		ctx->value[i] = i;
+
+	/* Two byte values, as many as one Read Multiple carries */
+	ctx->nhandles = (mtu - 1) / 2;
+	for (i = 0; i < ctx->nhandles; i++) {
+		ctx->handles[i] = BENCH_HANDLE + i;
+		ctx->values[i] = &ctx->value[i * 2];
+		ctx->vlens[i] = 2;
+	}
+
+	/* Service, characteristic declaration and handle/UUID16 entries */
+	ctx->grp_list = list_new(mtu, 6);
+	ctx->type_list = list_new(mtu, 7);
+	ctx->info_list = list_new(mtu, 4);
+
+	for (i = 0; i < (mtu - 1) / 4; i++) {
+		struct att_range *range = g_new0(struct att_range, 1);
+
+		range->start = BENCH_HANDLE + i * 4;
+		range->end = range->start + 3;
+		ctx->ranges = g_slist_append(ctx->ranges, range);
+	}
+}
+
+static void ctx_cleanup(struct bench_ctx *ctx)
+{
+	att_data_list_free(ctx->grp_list);
+	att_data_list_free(ctx->type_list);
+	att_data_list_free(ctx->info_list);
+	g_slist_free_full(ctx->ranges, g_free);
+}
+
+/* Each pair returns what the decoder returned, 0 if it failed */
+
+static size_t bench_mtu(struct bench_ctx *ctx)
+{
+	uint16_t mtu, len;
+
+	len = enc_mtu_req(ctx->mtu, ctx->pdu, ctx->mtu);
+
+	return dec_mtu_req(ctx->pdu, len, &mtu);
+}
+
+static size_t bench_find_info_req(struct bench_ctx *ctx)
+{
+	uint16_t start, end, len;
+
+	len = enc_find_info_req(0x0001, 0xffff, ctx->pdu, ctx->mtu);
+
+	return dec_find_info_req(ctx->pdu, len, &start, &end);
+}
+
+static size_t bench_find_info_resp(struct bench_ctx *ctx)
+{
+	struct att_data_list *list;
+	uint8_t format;
+	uint16_t len;
+	size_t num;
+
+	len = enc_find_info_resp(ATT_FIND_INFO_RESP_FMT_16BIT, ctx->info_list,
+							ctx->pdu, ctx->mtu);
+
+	list = dec_find_info_resp(ctx->pdu, len, &format);
+	if (list == NULL)
+		return 0;
+
+	num = list->num;
+	att_data_list_free(list);
+
+	return num;
+}
+
+static size_t bench_find_info_iter(struct bench_ctx *ctx)
+{
+	struct att_data_iter iter;
+	uint8_t format;
+	uint16_t len;
+
+	len = enc_find_info_resp(ATT_FIND_INFO_RESP_FMT_16BIT, ctx->info_list,
+							ctx->pdu, ctx->mtu);
+
+	return dec_find_info_resp_iter(ctx->pdu, len, &format, &iter);
+}
+
+static size_t bench_find_by_type_req(struct bench_ctx *ctx)
+{
+	uint16_t start, end, len;
+	bt_uuid_t uuid;
+	size_t vlen;
+
+	len = enc_find_by_type_req(0x0001, 0xffff, &ctx->uuid, ctx->value,
+				ctx->mtu - 7, ctx->pdu, ctx->mtu);
+
+	return dec_find_by_type_req(ctx->pdu, len, &start, &end, &uuid,
+							ctx->buf, &vlen);
+}
+
+static size_t bench_find_by_type_resp(struct bench_ctx *ctx)
+{
+	GSList *ranges;
+	uint16_t len;
+	size_t num;
+
+	len = enc_find_by_type_resp(ctx->ranges, ctx->pdu, ctx->mtu);
+
+	ranges = dec_find_by_type_resp(ctx->pdu, len);
+	num = g_slist_length(ranges);
+	g_slist_free_full(ranges, g_free);
+
+	return num;
+}
+
+static size_t bench_read_by_type_req(struct bench_ctx *ctx)
+{
+	uint16_t start, end, len;
+	bt_uuid_t uuid;
+
+	len = enc_read_by_type_req(0x0001, 0xffff, &ctx->uuid, ctx->pdu,
+								ctx->mtu);
+
+	return dec_read_by_type_req(ctx->pdu, len, &start, &end, &uuid);
+}
+
+static size_t bench_read_by_type_resp(struct bench_ctx *ctx)
+{
+	struct att_data_list *list;
+	uint16_t len;
+	size_t num;
+
+	len = enc_read_by_type_resp(ctx->type_list, ctx->pdu, ctx->mtu);
+
+	list = dec_read_by_type_resp(ctx->pdu, len);
+	if (list == NULL)
+		return 0;
+
+	num = list->num;
+	att_data_list_free(list);
+
+	return num;
+}
+
+static size_t bench_read_by_type_iter(struct bench_ctx *ctx)
+{
+	struct att_data_iter iter;
+	uint16_t len;
+
+	len = enc_read_by_type_resp(ctx->type_list, ctx->pdu, ctx->mtu);
+
+	return dec_read_by_type_resp_iter(ctx->pdu, len, &iter);
+}
+
+static size_t bench_read_req(struct bench_ctx *ctx)
+{
+	uint16_t handle, len;
+
+	len = enc_read_req(BENCH_HANDLE, ctx->pdu, ctx->mtu);
+
+	return dec_read_req(ctx->pdu, len, &handle);
+}
+
+static size_t bench_read_resp(struct bench_ctx *ctx)
+{
+	uint16_t len;
+	ssize_t vlen;
+
+	len = enc_read_resp(ctx->value, ctx->mtu - 1, ctx->pdu, ctx->mtu);
+
+	vlen = dec_read_resp(ctx->pdu, len, ctx->buf, sizeof(ctx->buf));
+
+	return vlen < 0 ? 0 : vlen;
+}
+
+static size_t bench_read_blob_req(struct bench_ctx *ctx)
+{
+	uint16_t handle, offset, len;
+
+	len = enc_read_blob_req(BENCH_HANDLE, ctx->mtu - 1, ctx->pdu,
+								ctx->mtu);
+
+	return dec_read_blob_req(ctx->pdu, len, &handle, &offset);
+}
+
+static size_t bench_read_multi_req(struct bench_ctx *ctx)
+{
+	uint16_t handles[BENCH_MAX_MTU / 2];
+	size_t num = G_N_ELEMENTS(handles);
+	uint16_t len;
+
+	len = enc_read_multi_req(ctx->handles, ctx->nhandles, ctx->pdu,
+								ctx->mtu);
+
+	return dec_read_multi_req(ctx->pdu, len, handles, &num);
+}
+
+static size_t bench_read_multi_resp(struct bench_ctx *ctx)
+{
+	uint16_t len;
+	ssize_t vlen;
+
+	len = enc_read_multi_resp(ctx->values, ctx->vlens, ctx->nhandles,
+							ctx->pdu, ctx->mtu);
+
+	vlen = dec_read_multi_resp(ctx->pdu, len, ctx->buf, sizeof(ctx->buf));
+
+	return vlen < 0 ? 0 : vlen;
+}
+
+static size_t bench_read_by_grp_req(struct bench_ctx *ctx)
+{
+	uint16_t start, end, len;
+	bt_uuid_t uuid;
+
+	len = enc_read_by_grp_req(0x0001, 0xffff, &ctx->uuid, ctx->pdu,
+								ctx->mtu);
+
+	return dec_read_by_grp_req(ctx->pdu, len, &start, &end, &uuid);
+}
+
+static size_t bench_read_by_grp_resp(struct bench_ctx *ctx)
+{
+	struct att_data_list *list;
+	uint16_t len;
+	size_t num;
+
+	len = enc_read_by_grp_resp(ctx->grp_list, ctx->pdu, ctx->mtu);
+
+	list = dec_read_by_grp_resp(ctx->pdu, len);
+	if (list == NULL)
+		return 0;
+
+	num = list->num;
+	att_data_list_free(list);
+
+	return num;
+}
+
+static size_t bench_read_by_grp_iter(struct bench_ctx *ctx)
+{
+	struct att_data_iter iter;
+	uint16_t len;
+
+	len = enc_read_by_grp_resp(ctx->grp_list, ctx->pdu, ctx->mtu);
+
+	return dec_read_by_grp_resp_iter(ctx->pdu, len, &iter);
+}
+
+static size_t bench_write_req(struct bench_ctx *ctx)
+{
+	uint16_t handle, len;
+	size_t vlen;
+
+	len = enc_write_req(BENCH_HANDLE, ctx->value, ctx->mtu - 3, ctx->pdu,
+								ctx->mtu);
+
+	return dec_write_req(ctx->pdu, len, &handle, ctx->buf, &vlen);
+}
+
+static size_t bench_write_resp(struct bench_ctx *ctx)
+{
+	uint16_t len;
+
+	len = enc_write_resp(ctx->pdu, ctx->mtu);
+
+	return dec_write_resp(ctx->pdu, len);
+}
+
+static size_t bench_write_cmd(struct bench_ctx *ctx)
+{
+	uint16_t handle, len;
+	size_t vlen;
+
+	len = enc_write_cmd(BENCH_HANDLE, ctx->value, ctx->mtu - 3, ctx->pdu,
+								ctx->mtu);
+
+	return dec_write_cmd(ctx->pdu, len, &handle, ctx->buf, &vlen);
+}
+
+static size_t bench_prep_write_req(struct bench_ctx *ctx)
+{
+	uint16_t handle, offset, len;
+	size_t vlen;
+
+	len = enc_prep_write_req(BENCH_HANDLE, 0, ctx->value, ctx->mtu - 5,
+							ctx->pdu, ctx->mtu);
+
+	return dec_prep_write_req(ctx->pdu, len, &handle, &offset, ctx->buf,
+									&vlen);
+}
+
+static size_t bench_prep_write_resp(struct bench_ctx *ctx)
+{
+	uint16_t handle, offset, len;
+	size_t vlen;
+
+	len = enc_prep_write_resp(BENCH_HANDLE, 0, ctx->value, ctx->mtu - 5,
+							ctx->pdu, ctx->mtu);
+
+	return dec_prep_write_resp(ctx->pdu, len, &handle, &offset, ctx->buf,
+									&vlen);
+}
+
+static size_t bench_exec_write_req(struct bench_ctx *ctx)
+{
+	uint16_t len;
+	uint8_t flags;
+
+	len = enc_exec_write_req(ATT_WRITE_ALL_PREP_WRITES, ctx->pdu,
+								ctx->mtu);
+
+	return dec_exec_write_req(ctx->pdu, len, &flags);
+}
+
+static size_t bench_exec_write_resp(struct bench_ctx *ctx)
+{
+	uint16_t len;
+
+	len = enc_exec_write_resp(ctx->pdu, ctx->mtu);
+
+	return dec_exec_write_resp(ctx->pdu, len);
+}
+
+static size_t bench_indication(struct bench_ctx *ctx)
+{
+	uint16_t handle, len;
+
+	len = enc_indication(BENCH_HANDLE, ctx->value, ctx->mtu - 3, ctx->pdu,
+								ctx->mtu);
+
+	return dec_indication(ctx->pdu, len, &handle, ctx->buf,
+							sizeof(ctx->buf));
+}
+
+struct codec_pair {
+	const char *name;
+	size_t (*run)(struct bench_ctx *ctx);
+};
+
+static const struct codec_pair pairs[] = {
+	{ "mtu-req",		bench_mtu		},
+	{ "find-info-req",	bench_find_info_req	},
+	{ "find-info-resp",	bench_find_info_resp	},
+	{ "find-info-iter",	bench_find_info_iter	},
+	{ "find-by-type-req",	bench_find_by_type_req	},
+	{ "find-by-type-resp",	bench_find_by_type_resp	},
+	{ "read-by-type-req",	bench_read_by_type_req	},
+	{ "read-by-type-resp",	bench_read_by_type_resp	},
+	{ "read-by-type-iter",	bench_read_by_type_iter	},
+	{ "read-req",		bench_read_req		},
+	{ "read-resp",		bench_read_resp		},
+	{ "read-blob-req",	bench_read_blob_req	},
+	{ "read-multi-req",	bench_read_multi_req	},
+	{ "read-multi-resp",	bench_read_multi_resp	},
+	{ "read-by-grp-req",	bench_read_by_grp_req	},
+	{ "read-by-grp-resp",	bench_read_by_grp_resp	},
+	{ "read-by-grp-iter",	bench_read_by_grp_iter	},
+	{ "write-req",		bench_write_req		},
+	{ "write-resp",		bench_write_resp	},
+	{ "write-cmd",		bench_write_cmd		},
+	{ "prep-write-req",	bench_prep_write_req	},
+	{ "prep-write-resp",	bench_prep_write_resp	},
+	{ "exec-write-req",	bench_exec_write_req	},
+	{ "exec-write-resp",	bench_exec_write_resp	},
+	{ "indication",		bench_indication	},
+	{ }
+};
+
+int main(int argc, char *argv[])
+{
+	unsigned int count = 100000;
+	const struct codec_pair *pair;
+	unsigned int i, m;
+	size_t sink = 0;
+
+	if (argc > 1)
+		count = atoi(argv[1]);
+
+	if (count == 0)
+		count = 1;
+
+	printf("%-18s %5s %10s %10s\n", "pair", "mtu", "ns/op", "allocs/op");
+
+	for (m = 0; m < MTU_COUNT; m++) {
+		struct bench_ctx ctx;
+
+		ctx_init(&ctx, mtus[m]);
+
+		for (pair = pairs; pair->name; pair++) {
+			unsigned long allocs;
+			double start, elapsed;
+
+			/* One checked round first, a pair that fails is a bug */
+			if (pair->run(&ctx) == 0) {
+				fprintf(stderr, "%s: round trip failed at mtu %zu\n",
+							pair->name, ctx.mtu);
+				ctx_cleanup(&ctx);
+				return 1;
+			}
+
+			allocs = alloc_count();
+			start = now();
+
+			for (i = 0; i < count; i++)
+				sink += pair->run(&ctx);
+
+			elapsed = now() - start;
+			allocs = alloc_count() - allocs;
+
+			printf("%-18s %5zu %10.1f %10.2f\n", pair->name, ctx.mtu,
+						elapsed / count,
+						(double) allocs / count);
+		}
+
+		ctx_cleanup(&ctx);
+	}
+
+	printf("allocs/op is a lower bound, memalign and g_slice not counted\n");
+
+	/* Keeps the decoder results alive under optimization */
+	if (sink == 0)
+		return 1;
+
+	return 0;
+}
@@ -0,0 +1,487 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2010  Nokia Corporation
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Fuzz target for the ATT PDU codec. Every input is handed to each
+ * decoder as a received PDU, and whatever decodes is encoded again at
+ * the 23, 185 and 517 byte MTUs. Built with -DFUZZ_LIBFUZZER this is a
+ * libFuzzer target; otherwise main() runs each file given, or stdin,
+ * once, which is what AFL and crash reproduction expect.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include <bluetooth/bluetooth.h>
+
+#include "lib/uuid.h"
+#include "att.h"
+
+/* Largest PDU an LE bearer delivers: 512 byte value plus headers */
+#define FUZZ_MAX_PDU		517
+
+#define FUZZ_MAX_HANDLES	(FUZZ_MAX_PDU / 2)
+
+static const size_t mtus[] = { ATT_DEFAULT_LE_MTU, 185, FUZZ_MAX_PDU };
+
+#define MTU_COUNT		(sizeof(mtus) / sizeof(mtus[0]))
+
+struct fuzz_ctx {
+	const uint8_t *pdu;
+	size_t len;
+	uint8_t value[FUZZ_MAX_PDU];
+	uint8_t out[FUZZ_MAX_PDU];
+};
+
+/* Encoders must stay inside the buffer they are given */
+static void check_enc(const char *name, uint16_t olen, size_t mtu)
+{
+	if (olen <= mtu)
+		return;
+
+	fprintf(stderr, "%s: %u bytes encoded into %zu\n", name, olen, mtu);
+	abort();
+}
+
+static void fuzz_list(struct fuzz_ctx *ctx, struct att_data_list *list,
+			uint16_t (*enc)(struct att_data_list *list,
+						uint8_t *pdu, size_t len),
+			const char *name)
+{
+	unsigned int i;
+
+	if (list == NULL)
+		return;
+
+	for (i = 0; i < MTU_COUNT; i++)
+		check_enc(name, enc(list, ctx->out, mtus[i]), mtus[i]);
+
+	att_data_list_free(list);
+}
+
+static void fuzz_iter(struct att_data_iter *iter, uint16_t num)
+{
+	const uint8_t *entry;
+	uint16_t count = 0;
+	volatile uint8_t sink = 0;
+
+	while ((entry = att_data_iter_next(iter)) != NULL) {
+		/* Touch both ends so ASan sees an entry running past */
+		sink ^= entry[0] ^ entry[iter->len - 1];
+		count++;
+	}
+
+	if (count != num) {
+		fprintf(stderr, "iterator walked %u of %u entries\n",
+								count, num);
+		abort();
+	}
+}
+
+static void fuzz_read_by_grp(struct fuzz_ctx *ctx)
+{
+	struct att_data_iter iter;
+	uint16_t start, end, num;
+	bt_uuid_t uuid;
+	unsigned int i;
+
+	if (dec_read_by_grp_req(ctx->pdu, ctx->len, &start, &end, &uuid))
+		for (i = 0; i < MTU_COUNT; i++)
+			check_enc("read-by-grp-req", enc_read_by_grp_req(start,
+					end, &uuid, ctx->out, mtus[i]),
+					mtus[i]);
+
+	num = dec_read_by_grp_resp_iter(ctx->pdu, ctx->len, &iter);
+	if (num)
+		fuzz_iter(&iter, num);
+
+	fuzz_list(ctx, dec_read_by_grp_resp(ctx->pdu, ctx->len),
+				enc_read_by_grp_resp, "read-by-grp-resp");
+}
+
+static void fuzz_find_by_type(struct fuzz_ctx *ctx)
+{
+	uint16_t start, end;
+	bt_uuid_t uuid;
+	size_t vlen;
+	GSList *ranges;
+	unsigned int i;
+
+	if (dec_find_by_type_req(ctx->pdu, ctx->len, &start, &end, &uuid,
+						ctx->value, &vlen))
+		for (i = 0; i < MTU_COUNT; i++)
+			check_enc("find-by-type-req", enc_find_by_type_req(
+					start, end, &uuid, ctx->value, vlen,
+					ctx->out, mtus[i]), mtus[i]);
+
+	ranges = dec_find_by_type_resp(ctx->pdu, ctx->len);
+	if (ranges == NULL)
+		return;
+
+	for (i = 0; i < MTU_COUNT; i++)
+		check_enc("find-by-type-resp", enc_find_by_type_resp(ranges,
+					ctx->out, mtus[i]), mtus[i]);
+
+	g_slist_free_full(ranges, g_free);
+}
+
+static void fuzz_read_by_type(struct fuzz_ctx *ctx)
+{
+	struct att_data_iter iter;
+	uint16_t start, end, num;
+	bt_uuid_t uuid;
+	unsigned int i;
+
+	if (dec_read_by_type_req(ctx->pdu, ctx->len, &start, &end, &uuid))
+		for (i = 0; i < MTU_COUNT; i++)
+			check_enc("read-by-type-req", enc_read_by_type_req(
+					start, end, &uuid, ctx->out, mtus[i]),
+					mtus[i]);
+
+	num = dec_read_by_type_resp_iter(ctx->pdu, ctx->len, &iter);
+	if (num)
+		fuzz_iter(&iter, num);
+
+	fuzz_list(ctx, dec_read_by_type_resp(ctx->pdu, ctx->len),
+				enc_read_by_type_resp, "read-by-type-resp");
+}
+
+static void fuzz_find_info(struct fuzz_ctx *ctx)
+{
+	struct att_data_list *list;
+	struct att_data_iter iter;
+	uint16_t start, end, num;
+	uint8_t format;
+	unsigned int i;
+
+	if (dec_find_info_req(ctx->pdu, ctx->len, &start, &end))
+		for (i = 0; i < MTU_COUNT; i++)
+			check_enc("find-info-req", enc_find_info_req(start, end,
+					ctx->out, mtus[i]), mtus[i]);
+
+	num = dec_find_info_resp_iter(ctx->pdu, ctx->len, &format, &iter);
+	if (num)
+		fuzz_iter(&iter, num);
+
+	list = dec_find_info_resp(ctx->pdu, ctx->len, &format);
+	if (list == NULL)
+		return;
+
+	for (i = 0; i < MTU_COUNT; i++)
+		check_enc("find-info-resp", enc_find_info_resp(format, list,
+					ctx->out, mtus[i]), mtus[i]);
+
+	att_data_list_free(list);
+}
+
+static void fuzz_write(struct fuzz_ctx *ctx)
+{
+	uint16_t handle;
+	size_t vlen;
+	unsigned int i;
+
+	if (dec_write_cmd(ctx->pdu, ctx->len, &handle, ctx->value, &vlen))
+		for (i = 0; i < MTU_COUNT; i++)
+			check_enc("write-cmd", enc_write_cmd(handle, ctx->value,
+					vlen, ctx->out, mtus[i]), mtus[i]);
+
+	if (dec_write_req(ctx->pdu, ctx->len, &handle, ctx->value, &vlen))
+		for (i = 0; i < MTU_COUNT; i++)
+			check_enc("write-req", enc_write_req(handle, ctx->value,
+					vlen, ctx->out, mtus[i]), mtus[i]);
+
+	if (dec_write_resp(ctx->pdu, ctx->len))
+		for (i = 0; i < MTU_COUNT; i++)
+			check_enc("write-resp", enc_write_resp(ctx->out,
+						mtus[i]), mtus[i]);
+}
+
+static void fuzz_read(struct fuzz_ctx *ctx)
+{
+	uint16_t handle, offset;
+	ssize_t vlen;
+	unsigned int i;
+
+	if (dec_read_req(ctx->pdu, ctx->len, &handle))
+		for (i = 0; i < MTU_COUNT; i++)
+			check_enc("read-req", enc_read_req(handle, ctx->out,
+						mtus[i]), mtus[i]);
+
+	if (dec_read_blob_req(ctx->pdu, ctx->len, &handle, &offset))
+		for (i = 0; i < MTU_COUNT; i++)
+			check_enc("read-blob-req", enc_read_blob_req(handle,
+					offset, ctx->out, mtus[i]), mtus[i]);
+
+	/* Undersized buffer first: the decoder must refuse, not overrun */
+	vlen = dec_read_resp(ctx->pdu, ctx->len, ctx->value,
+						ATT_DEFAULT_LE_MTU - 1);
+	if (vlen == -ENOBUFS)
+		vlen = dec_read_resp(ctx->pdu, ctx->len, ctx->value,
+							sizeof(ctx->value));
+	if (vlen < 0)
+		return;
+
+	for (i = 0; i < MTU_COUNT; i++) {
+		check_enc("read-resp", enc_read_resp(ctx->value, vlen,
+					ctx->out, mtus[i]), mtus[i]);
+		check_enc("read-blob-resp", enc_read_blob_resp(ctx->value,
+					vlen, 0, ctx->out, mtus[i]), mtus[i]);
+	}
+}
+
+static void fuzz_indication(struct fuzz_ctx *ctx)
+{
+	uint16_t handle, vlen;
+	unsigned int i;
+
+	vlen = dec_indication(ctx->pdu, ctx->len, &handle, ctx->value,
+							sizeof(ctx->value));
+	if (vlen == 0)
+		return;
+
+	for (i = 0; i < MTU_COUNT; i++) {
+		check_enc("notification", enc_notification(handle, ctx->value,
+					vlen, ctx->out, mtus[i]), mtus[i]);
+		check_enc("indication", enc_indication(handle, ctx->value,
+					vlen, ctx->out, mtus[i]), mtus[i]);
+		check_enc("confirmation", enc_confirmation(ctx->out, mtus[i]),
+								mtus[i]);
+	}
+}
+
+static void fuzz_mtu(struct fuzz_ctx *ctx)
+{
+	uint16_t mtu;
+	unsigned int i;
+
+	if (dec_mtu_req(ctx->pdu, ctx->len, &mtu))
+		for (i = 0; i < MTU_COUNT; i++)
+			check_enc("mtu-req", enc_mtu_req(mtu, ctx->out,
+						mtus[i]), mtus[i]);
+
+	if (dec_mtu_resp(ctx->pdu, ctx->len, &mtu))
+		for (i = 0; i < MTU_COUNT; i++)
+			check_enc("mtu-resp", enc_mtu_resp(mtu, ctx->out,
+						mtus[i]), mtus[i]);
+}
+
+static void fuzz_prep_write(struct fuzz_ctx *ctx)
+{
+	uint16_t handle, offset;
+	uint8_t flags;
+	size_t vlen;
+	unsigned int i;
+
+	if (dec_prep_write_req(ctx->pdu, ctx->len, &handle, &offset,
+						ctx->value, &vlen))
+		for (i = 0; i < MTU_COUNT; i++)
+			check_enc("prep-write-req", enc_prep_write_req(handle,
+					offset, ctx->value, vlen, ctx->out,
+					mtus[i]), mtus[i]);
+
+	if (dec_prep_write_resp(ctx->pdu, ctx->len, &handle, &offset,
+						ctx->value, &vlen))
+		for (i = 0; i < MTU_COUNT; i++)
+			check_enc("prep-write-resp", enc_prep_write_resp(handle,
+					offset, ctx->value, vlen, ctx->out,
+					mtus[i]), mtus[i]);
+
+	if (dec_exec_write_req(ctx->pdu, ctx->len, &flags))
+		for (i = 0; i < MTU_COUNT; i++)
+			check_enc("exec-write-req", enc_exec_write_req(flags,
+					ctx->out, mtus[i]), mtus[i]);
+
+	if (dec_exec_write_resp(ctx->pdu, ctx->len))
+		for (i = 0; i < MTU_COUNT; i++)
+			check_enc("exec-write-resp", enc_exec_write_resp(
+					ctx->out, mtus[i]), mtus[i]);
+}
+
+static void fuzz_read_multi(struct fuzz_ctx *ctx)
+{
+	uint16_t handles[FUZZ_MAX_HANDLES];
+	uint8_t *values[FUZZ_MAX_HANDLES];
+	size_t vlens[FUZZ_MAX_HANDLES];
+	size_t num = FUZZ_MAX_HANDLES;
+	unsigned int i;
+
+	if (dec_read_multi_req(ctx->pdu, ctx->len, handles, &num) == 0)
+		return;
+
+	/* Answer with one value per handle, sized by the handle itself */
+	for (i = 0; i < num; i++) {
+		values[i] = ctx->value;
+		vlens[i] = handles[i] % sizeof(ctx->value);
+	}
+
+	for (i = 0; i < MTU_COUNT; i++) {
+		check_enc("read-multi-req", enc_read_multi_req(handles, num,
+					ctx->out, mtus[i]), mtus[i]);
+		check_enc("read-multi-vl-req", enc_read_multi_vl_req(handles,
+					num, ctx->out, mtus[i]), mtus[i]);
+		check_enc("read-multi-resp", enc_read_multi_resp(values, vlens,
+					num, ctx->out, mtus[i]), mtus[i]);
+	}
+}
+
+static void fuzz_read_multi_resp(struct fuzz_ctx *ctx)
+{
+	const uint8_t *values[FUZZ_MAX_HANDLES];
+	uint16_t vlens[FUZZ_MAX_HANDLES];
+	size_t num = FUZZ_MAX_HANDLES;
+	uint8_t *value = ctx->value;
+	volatile uint8_t sink = 0;
+	size_t vlen, total = 0;
+	ssize_t len;
+	unsigned int i;
+
+	len = dec_read_multi_resp(ctx->pdu, ctx->len, ctx->value,
+							sizeof(ctx->value));
+	if (len >= 0) {
+		vlen = len;
+
+		for (i = 0; i < MTU_COUNT; i++)
+			check_enc("read-multi-resp", enc_read_multi_resp(&value,
+					&vlen, 1, ctx->out, mtus[i]), mtus[i]);
+	}
+
+	if (dec_read_multi_vl_resp(ctx->pdu, ctx->len, values, vlens,
+								&num) == 0)
+		return;
+
+	for (i = 0; i < num; i++) {
+		if (vlens[i] > 0)
+			sink ^= values[i][0] ^ values[i][vlens[i] - 1];
+
+		total += sizeof(uint16_t) + vlens[i];
+	}
+
+	/* Tuples account for every byte after the opcode */
+	if (total != ctx->len - 1) {
+		fprintf(stderr, "read-multi-vl-resp: %zu of %zu bytes\n",
+							total, ctx->len - 1);
+		abort();
+	}
+}
+
+static void fuzz_error(struct fuzz_ctx *ctx)
+{
+	uint16_t handle = ctx->len > 2 ? att_get_u16(&ctx->pdu[1]) : 0;
+	unsigned int i;
+
+	for (i = 0; i < MTU_COUNT; i++)
+		check_enc("error-resp", enc_error_resp(ctx->pdu[0], handle,
+				ctx->len > 3 ? ctx->pdu[3] : 0, ctx->out,
+				mtus[i]), mtus[i]);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	struct fuzz_ctx *ctx;
+	uint8_t *pdu;
+
+	/* GAttrib never delivers an empty PDU or one above the bearer MTU */
+	if (size == 0 || size > FUZZ_MAX_PDU)
+		return 0;
+
+	/* Exact size copy, so a read past the PDU end is caught */
+	pdu = malloc(size);
+	ctx = malloc(sizeof(*ctx));
+	if (pdu == NULL || ctx == NULL) {
+		free(pdu);
+		free(ctx);
+		return 0;
+	}
+
+	memcpy(pdu, data, size);
+	ctx->pdu = pdu;
+	ctx->len = size;
+
+	fuzz_read_by_grp(ctx);
+	fuzz_find_by_type(ctx);
+	fuzz_read_by_type(ctx);
+	fuzz_find_info(ctx);
+	fuzz_write(ctx);
+	fuzz_read(ctx);
+	fuzz_indication(ctx);
+	fuzz_mtu(ctx);
+	fuzz_prep_write(ctx);
+	fuzz_read_multi(ctx);
+	fuzz_read_multi_resp(ctx);
+	fuzz_error(ctx);
+
+	free(ctx);
+	free(pdu);
+
+	return 0;
+}
+
+#ifndef FUZZ_LIBFUZZER
+static int run_file(FILE *fp, const char *name)
+{
+	uint8_t buf[FUZZ_MAX_PDU + 1];
+	size_t len;
+
+	len = fread(buf, 1, sizeof(buf), fp);
+	if (ferror(fp)) {
+		perror(name);
+		return -1;
+	}
+
+	LLVMFuzzerTestOneInput(buf, len);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int i, err = 0;
+
+	if (argc < 2)
+		return run_file(stdin, "stdin") < 0;
+
+	for (i = 1; i < argc; i++) {
+		FILE *fp = fopen(argv[i], "rb");
+
+		if (fp == NULL) {
+			perror(argv[i]);
+			err = 1;
+			continue;
+		}
+
+		if (run_file(fp, argv[i]) < 0)
+			err = 1;
+
+		fclose(fp);
+	}
+
+	return err;
+}
+#endif
@@ -0,0 +1,141 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2010  Nokia Corporation
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Discovery cost of the attribute server as a function of the database
+ * size, one client issuing one request at a time.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <glib.h>
+
+#include <bluetooth/bluetooth.h>
+
+#include "lib/uuid.h"
+#include "adapter.h"
+#include "att.h"
+#include "gattrib.h"
+#include "gatt.h"
+#include "att-database.h"
+#include "attrib-server.h"
+#include "attrib-harness.h"
+
+#define BENCH_MTU		ATT_DEFAULT_LE_MTU
+
+static double run_op(int sk, const uint8_t *req, size_t reqlen,
+					uint8_t expected, unsigned int count)
+{
+	uint8_t rsp[ATT_MAX_VALUE_LEN];
+	double start;
+	unsigned int i;
+
+	start = harness_now();
+
+	for (i = 0; i < count; i++) {
+		ssize_t len = harness_transact(sk, req, reqlen, rsp,
+								sizeof(rsp));
+
+		if (len <= 0 || rsp[0] != expected) {
+			fprintf(stderr, "Unexpected response to 0x%02x\n",
+									req[0]);
+			return -1;
+		}
+	}
+
+	return (harness_now() - start) / count;
+}
+
+static void bench_discovery(unsigned int services, unsigned int count)
+{
+	uint8_t req[BENCH_MTU];
+	bt_uuid_t uuid;
+	uint16_t len, last;
+	uint8_t value[2];
+	double grp, type, find;
+	int sk;
+
+	if (btd_adapter_gatt_server_start(harness_adapter) < 0) {
+		fprintf(stderr, "Unable to start GATT server\n");
+		return;
+	}
+
+	harness_populate(services);
+
+	sk = harness_connect();
+	if (sk < 0) {
+		fprintf(stderr, "Unable to attach client\n");
+		btd_adapter_gatt_server_stop(harness_adapter);
+		return;
+	}
+
+	/* Primary Service discovery, first page */
+	bt_uuid16_create(&uuid, GATT_PRIM_SVC_UUID);
+	len = enc_read_by_grp_req(0x0001, 0xffff, &uuid, req, sizeof(req));
+	grp = run_op(sk, req, len, ATT_OP_READ_BY_GROUP_RESP, count);
+
+	/* Read the Device Name by type over the whole handle range */
+	bt_uuid16_create(&uuid, GATT_CHARAC_DEVICE_NAME);
+	len = enc_read_by_type_req(0x0001, 0xffff, &uuid, req, sizeof(req));
+	type = run_op(sk, req, len, ATT_OP_READ_BY_TYPE_RESP, count);
+
+	/* Discover the last registered service by its UUID */
+	last = HARNESS_SVC_UUID + services - 1;
+	att_put_u16(last, value);
+	bt_uuid16_create(&uuid, GATT_PRIM_SVC_UUID);
+	len = enc_find_by_type_req(0x0001, 0xffff, &uuid, value,
+						sizeof(value), req, sizeof(req));
+	find = run_op(sk, req, len, ATT_OP_FIND_BY_TYPE_RESP, count);
+
+	printf("%8u %10u %14.0f %14.0f %14.0f\n", services, services * 4 + 6,
+							grp, type, find);
+
+	close(sk);
+	btd_adapter_gatt_server_stop(harness_adapter);
+}
+
+int main(int argc, char *argv[])
+{
+	static const unsigned int sizes[] = { 16, 64, 256, 1024, 4096, 0 };
+	unsigned int count = 2000;
+	int i;
+
+	if (argc > 1)
+		count = atoi(argv[1]);
+
+	if (count == 0)
+		count = 1;
+
+	printf("%8s %10s %14s %14s %14s\n", "services", "attributes",
+				"grp-type ns", "by-type ns", "find-type ns");
+
+	for (i = 0; sizes[i]; i++)
+		bench_discovery(sizes[i], count);
+
+	return 0;
+}
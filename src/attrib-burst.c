@@ -0,0 +1,175 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2010  Nokia Corporation
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * GAttrib transmit rate for response-less PDUs: a queue of interleaved
+ * Write Commands and notifications is drained to a peer thread, once per
+ * burst budget.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <glib.h>
+
+#include <bluetooth/bluetooth.h>
+
+#include "lib/uuid.h"
+#include "att.h"
+#include "gattrib.h"
+#include "attrib-harness.h"
+
+#define BURST_PDU_LEN		20
+
+struct burst_peer {
+	int sk;
+	unsigned int count;
+	unsigned int received;
+};
+
+static gboolean drained;
+static unsigned int wakeups;
+
+static gpointer peer_thread(gpointer data)
+{
+	struct burst_peer *peer = data;
+	uint8_t pdu[ATT_DEFAULT_LE_MTU];
+
+	while (peer->received < peer->count) {
+		if (recv(peer->sk, pdu, sizeof(pdu), 0) <= 0)
+			break;
+
+		peer->received++;
+	}
+
+	return NULL;
+}
+
+static void last_sent(gpointer user_data)
+{
+	drained = TRUE;
+}
+
+static double run_burst(unsigned int budget, unsigned int count)
+{
+	struct burst_peer peer;
+	uint8_t value[BURST_PDU_LEN - 3], pdu[BURST_PDU_LEN];
+	GIOChannel *io;
+	GAttrib *attrib;
+	GThread *thread;
+	double start, elapsed;
+	unsigned int i;
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0)
+		return -1;
+
+	io = g_io_channel_unix_new(sv[0]);
+	g_io_channel_set_close_on_unref(io, TRUE);
+
+	attrib = g_attrib_new(io);
+	g_io_channel_unref(io);
+	g_attrib_set_burst(attrib, budget);
+
+	memset(value, 0xbe, sizeof(value));
+
+	for (i = 0; i < count; i++) {
+		uint16_t handle = HARNESS_VALUE_HANDLE(i % 16);
+		uint16_t len;
+
+		if (i % 2)
+			len = enc_notification(handle, value, sizeof(value),
+							pdu, sizeof(pdu));
+		else
+			len = enc_write_cmd(handle, value, sizeof(value),
+							pdu, sizeof(pdu));
+
+		g_attrib_send(attrib, 0, pdu, len, NULL, NULL,
+					i == count - 1 ? last_sent : NULL);
+	}
+
+	peer.sk = sv[1];
+	peer.count = count;
+	peer.received = 0;
+
+	drained = FALSE;
+	wakeups = 0;
+
+	start = harness_now();
+
+	thread = g_thread_new("burst-peer", peer_thread, &peer);
+
+	while (!drained) {
+		g_main_context_iteration(NULL, TRUE);
+		wakeups++;
+	}
+
+	g_thread_join(thread);
+
+	elapsed = harness_now() - start;
+
+	g_attrib_unref(attrib);
+	close(sv[1]);
+
+	if (peer.received != count) {
+		fprintf(stderr, "Peer got %u of %u PDUs\n", peer.received,
+									count);
+		return -1;
+	}
+
+	return elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+	static const unsigned int budgets[] = { 1, 4, 16, 32, 64, 0 };
+	unsigned int count = 100000;
+	int i;
+
+	if (argc > 1)
+		count = atoi(argv[1]);
+
+	if (count == 0)
+		count = 1;
+
+	printf("%8s %10s %12s %14s\n", "budget", "wakeups", "ns/pdu",
+								"pdus/s");
+
+	for (i = 0; budgets[i]; i++) {
+		double elapsed = run_burst(budgets[i], count);
+
+		if (elapsed < 0)
+			return 1;
+
+		printf("%8u %10u %12.0f %14.0f\n", budgets[i], wakeups,
+					elapsed / count, count * 1e9 / elapsed);
+	}
+
+	return 0;
+}
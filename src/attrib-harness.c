@@ -0,0 +1,337 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2010  Nokia Corporation
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Harness for the attribute server benchmarks. The GATT server from
+ * bluez-lib/src is linked without the rest of bluetoothd: the adapter,
+ * device, SDP and btio entry points it needs are replaced by the minimal
+ * versions below, and clients talk ATT to it over AF_UNIX sockets instead
+ * of L2CAP.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <glib.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/sdp.h>
+#include <bluetooth/sdp_lib.h>
+
+#include "lib/uuid.h"
+#include <btio/btio.h>
+#include "adapter.h"
+#include "device.h"
+#include "sdpd.h"
+#include "textfile.h"
+#include "att.h"
+#include "gattrib.h"
+#include "gatt.h"
+#include "att-database.h"
+#include "attrib-server.h"
+#include "attrib-harness.h"
+
+struct btd_adapter {
+	bdaddr_t bdaddr;
+};
+
+struct btd_device {
+	bdaddr_t bdaddr;
+};
+
+static struct btd_adapter bench_adapter = {
+	.bdaddr = {{ 0x01, 0x00, 0x00, 0xbe, 0xbe, 0x00 }},
+};
+
+struct btd_adapter *harness_adapter = &bench_adapter;
+
+static struct btd_device bench_device = {
+	.bdaddr = {{ 0x02, 0x00, 0x00, 0xbe, 0xbe, 0x00 }},
+};
+
+static GSList *records = NULL;
+static uint32_t next_record = 0x10000;
+
+static unsigned int workers = 0;
+
+/* bluetoothd entry points used by the attribute server */
+
+const bdaddr_t *adapter_get_address(struct btd_adapter *adapter)
+{
+	return &adapter->bdaddr;
+}
+
+struct btd_device *adapter_find_device(struct btd_adapter *adapter,
+							const bdaddr_t *dst)
+{
+	return &bench_device;
+}
+
+uint16_t btd_adapter_get_index(struct btd_adapter *adapter)
+{
+	return 0;
+}
+
+struct btd_adapter *btd_adapter_ref(struct btd_adapter *adapter)
+{
+	return adapter;
+}
+
+void btd_adapter_unref(struct btd_adapter *adapter)
+{
+}
+
+struct btd_device *btd_device_ref(struct btd_device *device)
+{
+	return device;
+}
+
+void btd_device_unref(struct btd_device *device)
+{
+}
+
+gboolean device_is_bonded(struct btd_device *device)
+{
+	return TRUE;
+}
+
+char *btd_device_get_storage_path(struct btd_device *device,
+							const char *filename)
+{
+	return g_strdup_printf("/tmp/attrib-bench-%d-%s", getpid(), filename);
+}
+
+int create_file(const char *filename, const mode_t mode)
+{
+	return 0;
+}
+
+int add_record_to_server(const bdaddr_t *src, sdp_record_t *rec)
+{
+	rec->handle = next_record++;
+	records = g_slist_prepend(records, rec);
+
+	return 0;
+}
+
+int remove_record_from_server(uint32_t handle)
+{
+	GSList *l;
+
+	for (l = records; l; l = l->next) {
+		sdp_record_t *rec = l->data;
+
+		if (rec->handle != handle)
+			continue;
+
+		records = g_slist_remove(records, rec);
+		sdp_record_free(rec);
+
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+/* btio replacement for AF_UNIX bearers */
+
+gboolean bt_io_get(GIOChannel *io, GError **err, BtIOOption opt1, ...)
+{
+	BtIOOption opt = opt1;
+	va_list args;
+
+	va_start(args, opt1);
+
+	while (opt != BT_IO_OPT_INVALID) {
+		switch (opt) {
+		case BT_IO_OPT_SOURCE_BDADDR:
+			bacpy(va_arg(args, bdaddr_t *), &bench_adapter.bdaddr);
+			break;
+		case BT_IO_OPT_DEST_BDADDR:
+			bacpy(va_arg(args, bdaddr_t *), &bench_device.bdaddr);
+			break;
+		case BT_IO_OPT_CID:
+			*(va_arg(args, uint16_t *)) = ATT_CID;
+			break;
+		case BT_IO_OPT_IMTU:
+		case BT_IO_OPT_OMTU:
+			*(va_arg(args, uint16_t *)) = ATT_MAX_VALUE_LEN;
+			break;
+		case BT_IO_OPT_SEC_LEVEL:
+			*(va_arg(args, int *)) = BT_IO_SEC_LOW;
+			break;
+		default:
+			va_end(args);
+			return FALSE;
+		}
+
+		opt = va_arg(args, int);
+	}
+
+	va_end(args);
+
+	return TRUE;
+}
+
+GIOChannel *bt_io_listen(BtIOConnect connect, BtIOConfirm confirm,
+				gpointer user_data, GDestroyNotify destroy,
+				GError **err, BtIOOption opt1, ...)
+{
+	GIOChannel *io;
+	int sk;
+
+	sk = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (sk < 0)
+		return NULL;
+
+	io = g_io_channel_unix_new(sk);
+	g_io_channel_set_close_on_unref(io, TRUE);
+
+	return io;
+}
+
+gboolean bt_io_accept(GIOChannel *io, BtIOConnect connect, gpointer user_data,
+					GDestroyNotify destroy, GError **err)
+{
+	return FALSE;
+}
+
+/* Database and clients */
+
+double harness_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void harness_populate(unsigned int services)
+{
+	uint8_t atval[5];
+	bt_uuid_t uuid;
+	uint16_t h;
+	unsigned int i;
+
+	for (i = 0; i < services; i++) {
+		h = HARNESS_SVC_HANDLE(i);
+
+		/* Primary service declaration */
+		bt_uuid16_create(&uuid, GATT_PRIM_SVC_UUID);
+		att_put_u16(HARNESS_SVC_UUID + i, atval);
+		attrib_db_add(&bench_adapter, h, &uuid, ATT_NONE,
+						ATT_NOT_PERMITTED, atval, 2);
+
+		/* Characteristic declaration */
+		bt_uuid16_create(&uuid, GATT_CHARAC_UUID);
+		atval[0] = ATT_CHAR_PROPER_READ | ATT_CHAR_PROPER_WRITE |
+						ATT_CHAR_PROPER_NOTIFY;
+		att_put_u16(HARNESS_VALUE_HANDLE(i), &atval[1]);
+		att_put_u16(HARNESS_CHR_UUID, &atval[3]);
+		attrib_db_add(&bench_adapter, h + 1, &uuid, ATT_NONE,
+						ATT_NOT_PERMITTED, atval, 5);
+
+		/* Characteristic value */
+		bt_uuid16_create(&uuid, HARNESS_CHR_UUID);
+		att_put_u16(i, atval);
+		attrib_db_add(&bench_adapter, HARNESS_VALUE_HANDLE(i), &uuid,
+						ATT_NONE, ATT_NONE, atval, 2);
+
+		/* Client Characteristic Configuration */
+		bt_uuid16_create(&uuid, GATT_CLIENT_CHARAC_CFG_UUID);
+		att_put_u16(0x0000, atval);
+		attrib_db_add(&bench_adapter, HARNESS_CCC_HANDLE(i), &uuid,
+						ATT_NONE, ATT_NONE, atval, 2);
+	}
+}
+
+int harness_set_workers(unsigned int count)
+{
+	int err;
+
+	err = attrib_server_set_workers(count);
+	if (err == 0)
+		workers = count;
+
+	return err;
+}
+
+int harness_connect(void)
+{
+	GIOChannel *io;
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0)
+		return -errno;
+
+	io = g_io_channel_unix_new(sv[0]);
+	g_io_channel_set_close_on_unref(io, TRUE);
+
+	if (!attrib_channel_attach_io(io)) {
+		g_io_channel_unref(io);
+		close(sv[1]);
+		return -EIO;
+	}
+
+	g_io_channel_unref(io);
+
+	fcntl(sv[1], F_SETFL, fcntl(sv[1], F_GETFL) | O_NONBLOCK);
+
+	return sv[1];
+}
+
+ssize_t harness_transact(int sk, const uint8_t *req, size_t reqlen,
+						uint8_t *rsp, size_t rsplen)
+{
+	ssize_t len;
+
+	if (send(sk, req, reqlen, 0) < 0)
+		return -errno;
+
+	while ((len = recv(sk, rsp, rsplen, 0)) < 0) {
+		struct pollfd pfd = { .fd = sk, .events = POLLIN };
+
+		if (errno != EAGAIN)
+			return -errno;
+
+		/* With workers the response comes from another thread */
+		if (workers)
+			poll(&pfd, 1, -1);
+		else
+			g_main_context_iteration(NULL, TRUE);
+	}
+
+	return len;
+}
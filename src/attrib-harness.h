@@ -0,0 +1,44 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2010  Nokia Corporation
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* Attribute server harness shared by attrib-bench and attrib-load */
+
+/*
+ * Service i of the harness database: declaration, characteristic
+ * declaration, characteristic value and its CCC descriptor.
+ */
+#define HARNESS_FIRST_HANDLE		0x0020
+#define HARNESS_SVC_HANDLE(i)		(HARNESS_FIRST_HANDLE + 4 * (i))
+#define HARNESS_VALUE_HANDLE(i)		(HARNESS_SVC_HANDLE(i) + 2)
+#define HARNESS_CCC_HANDLE(i)		(HARNESS_SVC_HANDLE(i) + 3)
+#define HARNESS_SVC_UUID		0x8000
+#define HARNESS_CHR_UUID		0x9000
+
+extern struct btd_adapter *harness_adapter;
+
+double harness_now(void);
+void harness_populate(unsigned int services);
+int harness_set_workers(unsigned int count);
+int harness_connect(void);
+ssize_t harness_transact(int sk, const uint8_t *req, size_t reqlen,
+						uint8_t *rsp, size_t rsplen);
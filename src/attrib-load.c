@@ -0,0 +1,426 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2010  Nokia Corporation
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Load generator for the attribute server: N clients, each with its own
+ * GAttrib bearer over a socket pair, keep one request outstanding at a
+ * time while a simulated sensor updates subscribed values. The mix of
+ * discovery, read, write and value updates is configurable, and the
+ * server side bearers can be spread over worker threads.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <glib.h>
+
+#include <bluetooth/bluetooth.h>
+
+#include "lib/uuid.h"
+#include "adapter.h"
+#include "att.h"
+#include "gattrib.h"
+#include "gatt.h"
+#include "att-database.h"
+#include "attrib-server.h"
+#include "src/shared/capture.h"
+#include "attrib-harness.h"
+#include "alloc-count.h"
+
+#define LOAD_MTU		ATT_DEFAULT_LE_MTU
+#define MAX_SAMPLES		(1 << 20)
+#define SUBSCRIPTIONS		8
+
+enum {
+	OP_DISCOVER,
+	OP_READ,
+	OP_WRITE,
+	OP_UPDATE,
+	OP_COUNT,
+};
+
+static const char *op_names[OP_COUNT] = {
+	"discover", "read", "write", "update",
+};
+
+struct client {
+	int sk;
+	gboolean busy;
+	uint8_t expected;
+	double start;
+};
+
+static unsigned int opt_clients = 16;
+static unsigned int opt_services = 64;
+static unsigned int opt_seconds = 5;
+static unsigned int opt_workers = 0;
+static const char *opt_snoop = NULL;
+static unsigned int mix[OP_COUNT] = { 10, 50, 30, 10 };
+
+static double *samples;
+static unsigned int nsamples = 0;
+
+static unsigned long op_count[OP_COUNT];
+static unsigned long completed = 0;
+static unsigned long notifications = 0;
+static unsigned long indications = 0;
+
+static gboolean parse_mix(const char *str)
+{
+	unsigned int v[OP_COUNT];
+
+	if (sscanf(str, "%u:%u:%u:%u", &v[0], &v[1], &v[2], &v[3]) != 4)
+		return FALSE;
+
+	if (v[0] + v[1] + v[2] + v[3] == 0)
+		return FALSE;
+
+	memcpy(mix, v, sizeof(mix));
+
+	return TRUE;
+}
+
+static int pick_op(void)
+{
+	unsigned int total = 0, r;
+	int op;
+
+	for (op = 0; op < OP_COUNT; op++)
+		total += mix[op];
+
+	r = g_random_int_range(0, total);
+
+	for (op = 0; op < OP_COUNT; op++) {
+		if (r < mix[op])
+			return op;
+
+		r -= mix[op];
+	}
+
+	return OP_READ;
+}
+
+static void subscribe(int sk, unsigned int index)
+{
+	uint8_t req[LOAD_MTU], rsp[LOAD_MTU], cfg[2];
+	unsigned int i;
+	uint16_t len;
+
+	for (i = 0; i < SUBSCRIPTIONS && i < opt_services; i++) {
+		unsigned int svc = (index * 7 + i) % opt_services;
+
+		att_put_u16(GATT_CLIENT_CHARAC_CFG_NOTIF_BIT, cfg);
+		len = enc_write_req(HARNESS_CCC_HANDLE(svc), cfg, sizeof(cfg),
+							req, sizeof(req));
+		harness_transact(sk, req, len, rsp, sizeof(rsp));
+	}
+}
+
+static void update_value(void)
+{
+	unsigned int svc = g_random_int_range(0, opt_services);
+	uint8_t value[2];
+
+	att_put_u16(g_random_int(), value);
+	attrib_db_update(harness_adapter, HARNESS_VALUE_HANDLE(svc), NULL,
+						value, sizeof(value), NULL);
+}
+
+static void client_send(struct client *c, int op)
+{
+	uint8_t req[LOAD_MTU], value[2];
+	unsigned int svc = g_random_int_range(0, opt_services);
+	bt_uuid_t uuid;
+	uint16_t len;
+
+	switch (op) {
+	case OP_DISCOVER:
+		bt_uuid16_create(&uuid, GATT_PRIM_SVC_UUID);
+		len = enc_read_by_grp_req(HARNESS_SVC_HANDLE(svc), 0xffff,
+						&uuid, req, sizeof(req));
+		c->expected = ATT_OP_READ_BY_GROUP_RESP;
+		break;
+	case OP_READ:
+		len = enc_read_req(HARNESS_VALUE_HANDLE(svc), req,
+								sizeof(req));
+		c->expected = ATT_OP_READ_RESP;
+		break;
+	case OP_WRITE:
+	default:
+		att_put_u16(g_random_int(), value);
+		len = enc_write_req(HARNESS_VALUE_HANDLE(svc), value,
+					sizeof(value), req, sizeof(req));
+		c->expected = ATT_OP_WRITE_RESP;
+		break;
+	}
+
+	c->start = harness_now();
+	c->busy = TRUE;
+
+	if (send(c->sk, req, len, 0) < 0) {
+		perror("send");
+		c->busy = FALSE;
+	}
+}
+
+static void client_receive(struct client *c)
+{
+	uint8_t pdu[ATT_MAX_VALUE_LEN];
+	ssize_t len;
+
+	while ((len = recv(c->sk, pdu, sizeof(pdu), MSG_DONTWAIT)) > 0) {
+		switch (pdu[0]) {
+		case ATT_OP_HANDLE_NOTIFY:
+			notifications++;
+			continue;
+		case ATT_OP_HANDLE_IND:
+			indications++;
+			len = enc_confirmation(pdu, sizeof(pdu));
+			send(c->sk, pdu, len, 0);
+			continue;
+		}
+
+		if (!c->busy)
+			continue;
+
+		if (pdu[0] != c->expected && pdu[0] != ATT_OP_ERROR)
+			fprintf(stderr, "Unexpected response 0x%02x\n", pdu[0]);
+
+		if (nsamples < MAX_SAMPLES)
+			samples[nsamples++] = harness_now() - c->start;
+
+		completed++;
+		c->busy = FALSE;
+	}
+}
+
+static int sample_cmp(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+static void usage(void)
+{
+	printf("attrib-load - attribute server load generator\n"
+		"Usage:\n"
+		"\tattrib-load [options]\n"
+		"Options:\n"
+		"\t-c, --clients <n>     Concurrent clients (default %u)\n"
+		"\t-s, --services <n>    Services in the database (default %u)\n"
+		"\t-d, --duration <sec>  Measurement time (default %u)\n"
+		"\t-m, --mix <d:r:w:u>   Weights of discover, read, write and\n"
+		"\t                      value update operations (default "
+		"%u:%u:%u:%u)\n"
+		"\t-w, --workers <n>     Server worker threads, 0 to serve\n"
+		"\t                      from the main loop (default %u)\n"
+		"\t-S, --snoop <file>    Capture ATT traffic to a btsnoop file\n",
+		opt_clients, opt_services, opt_seconds,
+		mix[0], mix[1], mix[2], mix[3], opt_workers);
+}
+
+static struct option main_options[] = {
+	{ "clients",	1, 0, 'c' },
+	{ "services",	1, 0, 's' },
+	{ "duration",	1, 0, 'd' },
+	{ "mix",	1, 0, 'm' },
+	{ "workers",	1, 0, 'w' },
+	{ "snoop",	1, 0, 'S' },
+	{ "help",	0, 0, 'h' },
+	{ 0, 0, 0, 0 }
+};
+
+int main(int argc, char *argv[])
+{
+	struct attrib_notify_stats nstats;
+	struct attrib_cache_stats cstats;
+	struct client *clients;
+	unsigned long allocs, ops;
+	double start, deadline, elapsed;
+	unsigned int i;
+	int opt, op;
+
+	while ((opt = getopt_long(argc, argv, "c:s:d:m:w:S:h", main_options,
+								NULL)) != -1) {
+		switch (opt) {
+		case 'c':
+			opt_clients = atoi(optarg);
+			break;
+		case 's':
+			opt_services = atoi(optarg);
+			break;
+		case 'd':
+			opt_seconds = atoi(optarg);
+			break;
+		case 'm':
+			if (!parse_mix(optarg)) {
+				fprintf(stderr, "Invalid mix: %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'w':
+			opt_workers = atoi(optarg);
+			break;
+		case 'S':
+			opt_snoop = optarg;
+			break;
+		case 'h':
+			usage();
+			exit(0);
+		default:
+			usage();
+			exit(1);
+		}
+	}
+
+	if (opt_clients == 0 || opt_services == 0 || opt_seconds == 0) {
+		usage();
+		exit(1);
+	}
+
+	if (btd_adapter_gatt_server_start(harness_adapter) < 0) {
+		fprintf(stderr, "Unable to start GATT server\n");
+		exit(1);
+	}
+
+	harness_populate(opt_services);
+
+	if (opt_snoop && capture_start(opt_snoop, 0) < 0) {
+		fprintf(stderr, "Unable to capture to %s\n", opt_snoop);
+		exit(1);
+	}
+
+	if (harness_set_workers(opt_workers) < 0) {
+		fprintf(stderr, "Unable to start %u workers\n", opt_workers);
+		exit(1);
+	}
+
+	clients = g_new0(struct client, opt_clients);
+	samples = g_new(double, MAX_SAMPLES);
+
+	for (i = 0; i < opt_clients; i++) {
+		clients[i].sk = harness_connect();
+		if (clients[i].sk < 0) {
+			fprintf(stderr, "Unable to attach client %u: %s\n", i,
+						strerror(-clients[i].sk));
+			exit(1);
+		}
+
+		subscribe(clients[i].sk, i);
+	}
+
+	allocs = alloc_count();
+	start = harness_now();
+	deadline = start + opt_seconds * 1e9;
+
+	while (harness_now() < deadline) {
+		for (i = 0; i < opt_clients; i++) {
+			struct client *c = &clients[i];
+
+			if (c->busy)
+				continue;
+
+			op = pick_op();
+			op_count[op]++;
+
+			if (op == OP_UPDATE)
+				update_value();
+			else
+				client_send(c, op);
+		}
+
+		while (g_main_context_iteration(NULL, FALSE))
+			;
+
+		for (i = 0; i < opt_clients; i++)
+			client_receive(&clients[i]);
+	}
+
+	elapsed = (harness_now() - start) / 1e9;
+	allocs = alloc_count() - allocs;
+
+	for (op = 0, ops = 0; op < OP_COUNT; op++)
+		ops += op_count[op];
+
+	qsort(samples, nsamples, sizeof(samples[0]), sample_cmp);
+
+	printf("clients %u, services %u, workers %u, %.1f s\n", opt_clients,
+					opt_services, opt_workers, elapsed);
+
+	for (op = 0; op < OP_COUNT; op++)
+		printf("  %-10s %lu\n", op_names[op], op_count[op]);
+
+	printf("requests/s         %.0f\n", completed / elapsed);
+
+	if (nsamples > 0)
+		printf("latency p50/p99    %.1f / %.1f us\n",
+				samples[nsamples / 2] / 1e3,
+				samples[(unsigned int) (nsamples * 0.99)] / 1e3);
+
+	printf("notifications/s    %.0f\n",
+				(notifications + indications) / elapsed);
+	printf("allocations/op     %.1f (lower bound, no memalign/g_slice)\n",
+					ops ? (double) allocs / ops : 0);
+
+	if (attrib_cache_get_stats(harness_adapter, &cstats) == 0)
+		printf("discovery cache    %lu hits, %lu misses\n",
+						cstats.hits, cstats.misses);
+
+	if (attrib_notify_get_stats(harness_adapter, &nstats) == 0)
+		printf("value updates      %lu coalesced, %lu dropped\n",
+					nstats.coalesced, nstats.dropped);
+
+	if (opt_snoop) {
+		struct capture_stats snoop;
+
+		capture_stop();
+		capture_get_stats(&snoop);
+
+		printf("capture            %llu records, %llu dropped\n",
+					(unsigned long long) snoop.written,
+					(unsigned long long) snoop.dropped);
+	}
+
+	for (i = 0; i < opt_clients; i++)
+		close(clients[i].sk);
+
+	while (g_main_context_iteration(NULL, FALSE))
+		;
+
+	btd_adapter_gatt_server_stop(harness_adapter);
+	harness_set_workers(0);
+
+	g_free(samples);
+	g_free(clients);
+
+	return 0;
+}
@@ -0,0 +1,315 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2010  Nokia Corporation
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Event loop cost under GAttrib: two GAttribs on a socketpair exchange
+ * Read Request/Response round trips, with and without a per-request
+ * deadline, and a stream of notifications. Built once per backend,
+ * attrib-loop-glib and attrib-loop-epoll, so the rows line up.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <glib.h>
+
+#include <bluetooth/bluetooth.h>
+
+#include "lib/uuid.h"
+#include <btio/btio.h>
+#include "att.h"
+#include "gattrib.h"
+
+#ifdef BENCH_MAINLOOP
+#include "src/shared/mainloop.h"
+
+#define BACKEND			"epoll"
+#else
+#define BACKEND			"glib"
+
+static GMainLoop *main_loop;
+#endif
+
+#define LOOP_HANDLE		0x0020
+
+struct loop_bench {
+	GAttrib *client;
+	GAttrib *peer;
+	unsigned int count;
+	unsigned int done;
+	unsigned int deadline;
+};
+
+/* Both ends are AF_UNIX sockets standing in for an LE ATT channel */
+gboolean bt_io_get(GIOChannel *io, GError **err, BtIOOption opt1, ...)
+{
+	BtIOOption opt = opt1;
+	va_list args;
+
+	va_start(args, opt1);
+
+	while (opt != BT_IO_OPT_INVALID) {
+		switch (opt) {
+		case BT_IO_OPT_CID:
+			*(va_arg(args, uint16_t *)) = ATT_CID;
+			break;
+		case BT_IO_OPT_IMTU:
+			*(va_arg(args, uint16_t *)) = ATT_DEFAULT_LE_MTU;
+			break;
+		default:
+			va_end(args);
+			return FALSE;
+		}
+
+		opt = va_arg(args, int);
+	}
+
+	va_end(args);
+
+	return TRUE;
+}
+
+static void loop_init(void)
+{
+#ifdef BENCH_MAINLOOP
+	mainloop_init();
+#else
+	main_loop = g_main_loop_new(NULL, FALSE);
+#endif
+}
+
+static void loop_run(void)
+{
+#ifdef BENCH_MAINLOOP
+	mainloop_run();
+#else
+	g_main_loop_run(main_loop);
+	g_main_loop_unref(main_loop);
+#endif
+}
+
+static void loop_quit(void)
+{
+#ifdef BENCH_MAINLOOP
+	mainloop_quit();
+#else
+	g_main_loop_quit(main_loop);
+#endif
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static GAttrib *attrib_open(int sk)
+{
+	GIOChannel *io;
+	GAttrib *attrib;
+
+	io = g_io_channel_unix_new(sk);
+	g_io_channel_set_close_on_unref(io, TRUE);
+
+	attrib = g_attrib_new(io);
+	g_io_channel_unref(io);
+
+	return attrib;
+}
+
+static void peer_read_req(const uint8_t *pdu, uint16_t len,
+							gpointer user_data)
+{
+	struct loop_bench *bench = user_data;
+	uint8_t value[2] = { 0xbe, 0xef };
+	uint8_t *buf;
+	size_t buflen;
+
+	buf = g_attrib_reserve(bench->peer, &buflen);
+	if (buf == NULL)
+		return;
+
+	g_attrib_commit(bench->peer, 0, enc_read_resp(value, sizeof(value),
+					buf, buflen), NULL, NULL, NULL);
+}
+
+static void send_read(struct loop_bench *bench);
+
+static void read_cb(guint8 status, const guint8 *pdu, guint16 len,
+							gpointer user_data)
+{
+	struct loop_bench *bench = user_data;
+
+	if (status != 0 || ++bench->done == bench->count) {
+		loop_quit();
+		return;
+	}
+
+	send_read(bench);
+}
+
+static void send_read(struct loop_bench *bench)
+{
+	uint8_t *buf;
+	size_t buflen;
+	guint id;
+
+	buf = g_attrib_reserve(bench->client, &buflen);
+	if (buf == NULL)
+		return;
+
+	id = g_attrib_commit(bench->client, 0, enc_read_req(LOOP_HANDLE, buf,
+					buflen), read_cb, bench, NULL);
+
+	if (bench->deadline)
+		g_attrib_set_timeout(bench->client, id, bench->deadline,
+								NULL, NULL);
+}
+
+static void client_notify(const uint8_t *pdu, uint16_t len,
+							gpointer user_data)
+{
+	struct loop_bench *bench = user_data;
+
+	if (++bench->done == bench->count)
+		loop_quit();
+}
+
+static void send_notifications(struct loop_bench *bench)
+{
+	uint8_t value[20];
+	unsigned int i;
+
+	memset(value, 0xbe, sizeof(value));
+
+	for (i = 0; i < bench->count; i++) {
+		uint8_t *buf;
+		size_t buflen;
+
+		buf = g_attrib_reserve(bench->peer, &buflen);
+		if (buf == NULL)
+			return;
+
+		g_attrib_commit(bench->peer, 0, enc_notification(LOOP_HANDLE,
+					value, sizeof(value), buf, buflen),
+					NULL, NULL, NULL);
+	}
+}
+
+enum loop_test {
+	TEST_ROUND_TRIP,
+	TEST_DEADLINE,
+	TEST_NOTIFY,
+};
+
+static const char *test_names[] = {
+	"round-trip", "deadline", "notify",
+};
+
+static double run_test(enum loop_test test, unsigned int count)
+{
+	struct loop_bench bench;
+	double start, elapsed;
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0)
+		return -1;
+
+	loop_init();
+
+	memset(&bench, 0, sizeof(bench));
+	bench.count = count;
+	bench.client = attrib_open(sv[0]);
+	bench.peer = attrib_open(sv[1]);
+
+	g_attrib_register(bench.peer, ATT_OP_READ_REQ, GATTRIB_ALL_HANDLES,
+						peer_read_req, &bench, NULL);
+	g_attrib_register(bench.client, ATT_OP_HANDLE_NOTIFY, LOOP_HANDLE,
+						client_notify, &bench, NULL);
+
+	start = now();
+
+	switch (test) {
+	case TEST_DEADLINE:
+		bench.deadline = 5000;
+		/* fall through */
+	case TEST_ROUND_TRIP:
+		send_read(&bench);
+		break;
+	case TEST_NOTIFY:
+		send_notifications(&bench);
+		break;
+	}
+
+	loop_run();
+
+	elapsed = now() - start;
+
+	g_attrib_unref(bench.client);
+	g_attrib_unref(bench.peer);
+
+	if (bench.done != count) {
+		fprintf(stderr, "%s: %u of %u completed\n", test_names[test],
+							bench.done, count);
+		return -1;
+	}
+
+	return elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int count = 100000;
+	int test;
+
+	if (argc > 1)
+		count = atoi(argv[1]);
+
+	if (count == 0)
+		count = 1;
+
+	printf("%8s %12s %12s %14s\n", "backend", "test", "ns/op", "ops/s");
+
+	for (test = TEST_ROUND_TRIP; test <= TEST_NOTIFY; test++) {
+		double elapsed = run_test(test, count);
+
+		if (elapsed < 0)
+			return 1;
+
+		printf("%8s %12s %12.0f %14.0f\n", BACKEND, test_names[test],
+					elapsed / count, count * 1e9 / elapsed);
+	}
+
+	return 0;
+}
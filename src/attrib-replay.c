@@ -0,0 +1,971 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2010  Nokia Corporation
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Replay of a captured ATT session. The peer side of one bearer in a
+ * btsnoop file is played back over a socket pair, as fast as possible or
+ * with the recorded gaps, against either the attribute server or a
+ * GAttrib client running the gatt.c procedures the recorded requests map
+ * to. Whatever the local side sends is matched against the capture.
+ *
+ * A capture taken with attrib-load -S replays against the server with
+ * the same --services count; one taken with BLUE_CONNECT_SNOOP replays
+ * with --client.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <glib.h>
+
+#include <bluetooth/bluetooth.h>
+
+#include "lib/uuid.h"
+#include "adapter.h"
+#include "att.h"
+#include "gattrib.h"
+#include "gatt.h"
+#include "att-database.h"
+#include "attrib-server.h"
+#include "src/shared/capture.h"
+#include "attrib-harness.h"
+
+#define BTSNOOP_TYPE_H4		1002
+#define BTSNOOP_TYPE_MONITOR	2001
+
+#define H4_ACL_PKT		0x02
+
+#define ACL_PB_CONT		0x01
+
+#define FRAME_MAX		(4 + 65535)
+
+struct btsnoop_hdr {
+	uint8_t id[8];
+	uint32_t version;
+	uint32_t type;
+} __attribute__ ((packed));
+
+struct btsnoop_pkt {
+	uint32_t size;
+	uint32_t len;
+	uint32_t flags;
+	uint32_t drops;
+	uint64_t ts;
+} __attribute__ ((packed));
+
+struct record {
+	gboolean out;		/* Sent by the local side */
+	uint64_t usec;
+	uint16_t len;
+	uint8_t *pdu;
+};
+
+static gboolean opt_client = FALSE;
+static gboolean opt_timing = FALSE;
+static gboolean opt_verbose = FALSE;
+static int opt_handle = -1;
+static unsigned int opt_services = 64;
+static unsigned int opt_workers = 0;
+static unsigned int opt_stall = 500;
+
+static GMainLoop *main_loop;
+static GArray *records;
+static unsigned int pos = 0;
+
+static int peer_sk = -1;
+static guint wait_id = 0;
+static guint out_id = 0;
+
+/* Client mode: the local GAttrib and whether a procedure is running */
+static GAttrib *client;
+static gboolean driver_busy = FALSE;
+
+/* Recorded indications skipped in server mode, awaiting confirmation */
+static unsigned int skipped_ind = 0;
+
+/* Live and recorded time of the last PDU the peer sent */
+static double anchor_live;
+static uint64_t anchor_usec;
+static gboolean anchor_pending = FALSE;
+
+static GArray *lat_live;
+static GArray *lat_recorded;
+
+static unsigned long fragmented = 0;
+static unsigned long truncated = 0;
+static unsigned long other_handle = 0;
+static unsigned long other_cid = 0;
+
+static unsigned long sent = 0;
+static unsigned long sent_bytes = 0;
+static unsigned long received = 0;
+static unsigned long received_bytes = 0;
+static unsigned long matched = 0;
+static unsigned long diverged = 0;
+static unsigned long missing = 0;
+static unsigned long unexpected = 0;
+static unsigned long unsolicited = 0;
+
+static void replay_step(void);
+
+/* Capture parsing */
+
+static gboolean read_full(int fd, void *buf, size_t len)
+{
+	uint8_t *ptr = buf;
+
+	while (len > 0) {
+		ssize_t n = read(fd, ptr, len);
+
+		if (n <= 0)
+			return FALSE;
+
+		ptr += n;
+		len -= n;
+	}
+
+	return TRUE;
+}
+
+static void parse_acl(const uint8_t *data, size_t len, gboolean out,
+								uint64_t usec)
+{
+	struct record r;
+	uint16_t handle, acl_len, l2_len, cid;
+
+	if (len < 8) {
+		fragmented++;
+		return;
+	}
+
+	handle = att_get_u16(data);
+	acl_len = att_get_u16(data + 2);
+	l2_len = att_get_u16(data + 4);
+	cid = att_get_u16(data + 6);
+
+	/* ATT PDUs fit one frame; reassembly is not worth it here */
+	if (((handle >> 12) & 0x03) == ACL_PB_CONT || acl_len != len - 4 ||
+					l2_len != acl_len - 4 || l2_len == 0) {
+		fragmented++;
+		return;
+	}
+
+	if (cid != ATT_CID) {
+		other_cid++;
+		return;
+	}
+
+	handle &= 0x0fff;
+
+	if (opt_handle < 0)
+		opt_handle = handle;
+
+	if (handle != opt_handle) {
+		other_handle++;
+		return;
+	}
+
+	r.out = out;
+	r.usec = usec;
+	r.len = l2_len;
+	r.pdu = g_memdup(data + 8, l2_len);
+
+	g_array_append_val(records, r);
+}
+
+static int load_capture(const char *path)
+{
+	struct btsnoop_hdr hdr;
+	struct btsnoop_pkt pkt;
+	uint8_t *frame;
+	uint32_t type;
+	int fd, err = 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+
+	if (!read_full(fd, &hdr, sizeof(hdr)) ||
+			memcmp(hdr.id, "btsnoop\0", sizeof(hdr.id)) != 0 ||
+			be32toh(hdr.version) != 1) {
+		close(fd);
+		return -EILSEQ;
+	}
+
+	type = be32toh(hdr.type);
+	if (type != BTSNOOP_TYPE_H4 && type != BTSNOOP_TYPE_MONITOR) {
+		close(fd);
+		return -EPROTONOSUPPORT;
+	}
+
+	frame = g_malloc(FRAME_MAX);
+
+	while (read_full(fd, &pkt, sizeof(pkt))) {
+		uint32_t size = be32toh(pkt.size);
+		uint32_t len = be32toh(pkt.len);
+		uint32_t flags = be32toh(pkt.flags);
+		uint64_t usec = be64toh(pkt.ts);
+
+		if (len > FRAME_MAX) {
+			err = -EMSGSIZE;
+			break;
+		}
+
+		if (!read_full(fd, frame, len)) {
+			err = -EILSEQ;
+			break;
+		}
+
+		if (len < size) {
+			truncated++;
+			continue;
+		}
+
+		if (type == BTSNOOP_TYPE_MONITOR) {
+			switch (flags & 0xffff) {
+			case CAPTURE_ACL_TX:
+				parse_acl(frame, len, TRUE, usec);
+				break;
+			case CAPTURE_ACL_RX:
+				parse_acl(frame, len, FALSE, usec);
+				break;
+			}
+		} else if (len > 0 && frame[0] == H4_ACL_PKT) {
+			/* Bit 0 of the flags is set on received frames */
+			parse_acl(frame + 1, len - 1, !(flags & 0x01), usec);
+		}
+	}
+
+	g_free(frame);
+	close(fd);
+
+	return err;
+}
+
+/* Peer side */
+
+static void print_pdu(const char *label, const uint8_t *pdu, uint16_t len)
+{
+	uint16_t i;
+
+	printf("  %-9s", label);
+
+	for (i = 0; i < len && i < 24; i++)
+		printf(" %02x", pdu[i]);
+
+	printf("%s\n", len > 24 ? " ..." : "");
+}
+
+static gboolean is_request(uint8_t opcode)
+{
+	switch (opcode) {
+	case ATT_OP_MTU_REQ:
+	case ATT_OP_FIND_INFO_REQ:
+	case ATT_OP_FIND_BY_TYPE_REQ:
+	case ATT_OP_READ_BY_TYPE_REQ:
+	case ATT_OP_READ_REQ:
+	case ATT_OP_READ_BLOB_REQ:
+	case ATT_OP_READ_MULTI_REQ:
+	case ATT_OP_READ_MULTI_VL_REQ:
+	case ATT_OP_READ_BY_GROUP_REQ:
+	case ATT_OP_WRITE_REQ:
+	case ATT_OP_PREP_WRITE_REQ:
+	case ATT_OP_EXEC_WRITE_REQ:
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+static gboolean is_unsolicited(uint8_t opcode)
+{
+	return opcode == ATT_OP_HANDLE_NOTIFY || opcode == ATT_OP_HANDLE_IND;
+}
+
+/*
+ * Server values only change from the application, which is not part of
+ * the capture, so notifications and indications can't be reproduced.
+ */
+static gboolean skip_record(struct record *r)
+{
+	if (opt_client || !is_unsolicited(r->pdu[0]))
+		return FALSE;
+
+	if (r->pdu[0] == ATT_OP_HANDLE_IND)
+		skipped_ind++;
+
+	unsolicited++;
+
+	return TRUE;
+}
+
+static gboolean peer_writable(GIOChannel *io, GIOCondition cond,
+							gpointer user_data)
+{
+	out_id = 0;
+
+	replay_step();
+
+	return FALSE;
+}
+
+static gboolean peer_send(const uint8_t *pdu, uint16_t len)
+{
+	GIOChannel *io;
+
+	if (send(peer_sk, pdu, len, MSG_DONTWAIT) < 0) {
+		if (errno != EAGAIN) {
+			perror("send");
+			g_main_loop_quit(main_loop);
+			return FALSE;
+		}
+
+		io = g_io_channel_unix_new(peer_sk);
+		out_id = g_io_add_watch(io, G_IO_OUT, peer_writable, NULL);
+		g_io_channel_unref(io);
+
+		return FALSE;
+	}
+
+	sent++;
+	sent_bytes += len;
+
+	return TRUE;
+}
+
+/* Keeps a peer that the capture has no answer for from stalling */
+static void peer_answer(const uint8_t *pdu, uint16_t len)
+{
+	uint8_t rsp[ATT_DEFAULT_LE_MTU];
+	uint16_t plen;
+
+	if (is_request(pdu[0]))
+		plen = enc_error_resp(pdu[0], 0x0000, ATT_ECODE_UNLIKELY, rsp,
+								sizeof(rsp));
+	else if (pdu[0] == ATT_OP_HANDLE_IND)
+		plen = enc_confirmation(rsp, sizeof(rsp));
+	else
+		return;
+
+	peer_send(rsp, plen);
+}
+
+static void local_pdu(const uint8_t *pdu, uint16_t len)
+{
+	struct record *r;
+	unsigned int i;
+	int exact = -1, similar = -1;
+
+	/* Search the output expected before the peer's next turn */
+	for (i = pos; i < records->len; i++) {
+		r = &g_array_index(records, struct record, i);
+
+		if (!r->out)
+			break;
+
+		if (!opt_client && is_unsolicited(r->pdu[0]))
+			continue;
+
+		if (r->len == len && memcmp(r->pdu, pdu, len) == 0) {
+			exact = i;
+			break;
+		}
+
+		if (similar < 0 && r->pdu[0] == pdu[0])
+			similar = i;
+	}
+
+	if (exact < 0 && similar < 0) {
+		unexpected++;
+
+		if (opt_verbose) {
+			printf("record %u: unexpected PDU\n", pos);
+			print_pdu("got", pdu, len);
+		}
+
+		peer_answer(pdu, len);
+		return;
+	}
+
+	i = exact >= 0 ? exact : similar;
+
+	for (; pos < i; pos++) {
+		r = &g_array_index(records, struct record, pos);
+
+		if (!skip_record(r))
+			missing++;
+	}
+
+	r = &g_array_index(records, struct record, pos++);
+
+	if (exact >= 0)
+		matched++;
+	else {
+		diverged++;
+
+		if (opt_verbose) {
+			printf("record %u: diverged\n", i);
+			print_pdu("expected", r->pdu, r->len);
+			print_pdu("got", pdu, len);
+		}
+	}
+
+	if (anchor_pending) {
+		double live = harness_now() - anchor_live;
+		double recorded = (r->usec - anchor_usec) * 1e3;
+
+		g_array_append_val(lat_live, live);
+		g_array_append_val(lat_recorded, recorded);
+		anchor_pending = FALSE;
+	}
+
+	/* Recorded gaps after this point are relative to it */
+	anchor_live = harness_now();
+	anchor_usec = r->usec;
+
+	replay_step();
+}
+
+static gboolean peer_event(GIOChannel *io, GIOCondition cond,
+							gpointer user_data)
+{
+	uint8_t pdu[ATT_MAX_VALUE_LEN];
+	ssize_t len;
+
+	while ((len = recv(peer_sk, pdu, sizeof(pdu), MSG_DONTWAIT)) > 0) {
+		received++;
+		received_bytes += len;
+
+		local_pdu(pdu, len);
+	}
+
+	if (len == 0 || (len < 0 && errno != EAGAIN) ||
+				(cond & (G_IO_HUP | G_IO_ERR | G_IO_NVAL))) {
+		fprintf(stderr, "Local side closed the bearer\n");
+		g_main_loop_quit(main_loop);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Client procedures */
+
+static void driver_done(void);
+
+static void discover_cb(GSList *l, guint8 status, gpointer user_data)
+{
+	driver_done();
+}
+
+static void result_cb(guint8 status, const guint8 *pdu, guint16 len,
+							gpointer user_data)
+{
+	driver_done();
+}
+
+static guint start_read_by_type(const uint8_t *pdu, uint16_t len)
+{
+	uint16_t start, end;
+	bt_uuid_t uuid;
+
+	if (dec_read_by_type_req(pdu, len, &start, &end, &uuid) == 0)
+		return 0;
+
+	if (uuid.type == BT_UUID16 && uuid.value.u16 == GATT_CHARAC_UUID)
+		return gatt_discover_char(client, start, end, NULL,
+							discover_cb, NULL);
+
+	if (uuid.type == BT_UUID16 && uuid.value.u16 == GATT_INCLUDE_UUID)
+		return gatt_find_included(client, start, end, discover_cb,
+									NULL);
+
+	return gatt_read_char_by_uuid(client, start, end, &uuid, result_cb,
+									NULL);
+}
+
+static guint start_find_by_type(const uint8_t *pdu, uint16_t len)
+{
+	uint8_t value[ATT_MAX_VALUE_LEN];
+	uint16_t start, end;
+	size_t vlen;
+	bt_uuid_t type, uuid;
+
+	if (dec_find_by_type_req(pdu, len, &start, &end, &type, value,
+								&vlen) == 0)
+		return 0;
+
+	if (start != 0x0001 || end != 0xffff)
+		return 0;
+
+	if (vlen == 2)
+		uuid = att_get_uuid16(value);
+	else if (vlen == 16)
+		uuid = att_get_uuid128(value);
+	else
+		return 0;
+
+	return gatt_discover_primary(client, &uuid, discover_cb, NULL);
+}
+
+static guint start_procedure(const uint8_t *pdu, uint16_t len)
+{
+	uint8_t value[ATT_MAX_VALUE_LEN];
+	uint16_t handle, start, end, mtu;
+	size_t vlen;
+	bt_uuid_t uuid;
+
+	switch (pdu[0]) {
+	case ATT_OP_READ_BY_GROUP_REQ:
+		if (dec_read_by_grp_req(pdu, len, &start, &end, &uuid) == 0 ||
+					start != 0x0001 || end != 0xffff)
+			return 0;
+
+		return gatt_discover_primary(client, NULL, discover_cb, NULL);
+	case ATT_OP_FIND_BY_TYPE_REQ:
+		return start_find_by_type(pdu, len);
+	case ATT_OP_READ_BY_TYPE_REQ:
+		return start_read_by_type(pdu, len);
+	case ATT_OP_FIND_INFO_REQ:
+		if (dec_find_info_req(pdu, len, &start, &end) == 0)
+			return 0;
+
+		return gatt_find_info(client, start, end, result_cb, NULL);
+	case ATT_OP_READ_REQ:
+		if (dec_read_req(pdu, len, &handle) == 0)
+			return 0;
+
+		return gatt_read_char(client, handle, result_cb, NULL);
+	case ATT_OP_WRITE_REQ:
+		if (dec_write_req(pdu, len, &handle, value, &vlen) == 0)
+			return 0;
+
+		return gatt_write_char(client, handle, value, vlen, result_cb,
+									NULL);
+	case ATT_OP_MTU_REQ:
+		if (dec_mtu_req(pdu, len, &mtu) == 0)
+			return 0;
+
+		return gatt_exchange_mtu(client, mtu, result_cb, NULL);
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Recorded requests start the gatt.c procedure that sends them, so the
+ * continuation requests come from the procedure rather than the capture.
+ * Anything without a procedure goes out as recorded.
+ */
+static void driver_start(struct record *r)
+{
+	uint8_t value[ATT_MAX_VALUE_LEN];
+	uint16_t handle;
+	size_t vlen;
+
+	if (driver_busy)
+		return;
+
+	if (r->pdu[0] == ATT_OP_WRITE_CMD) {
+		if (dec_write_cmd(r->pdu, r->len, &handle, value, &vlen) > 0)
+			gatt_write_cmd(client, handle, value, vlen, NULL, NULL);
+		return;
+	}
+
+	if (!is_request(r->pdu[0])) {
+		/* Confirmations come from the indication handler */
+		if (r->pdu[0] != ATT_OP_HANDLE_CNF && !(r->pdu[0] & 0x01))
+			g_attrib_send(client, 0, r->pdu, r->len, NULL, NULL,
+									NULL);
+		return;
+	}
+
+	driver_busy = TRUE;
+
+	if (start_procedure(r->pdu, r->len) > 0)
+		return;
+
+	if (g_attrib_send(client, 0, r->pdu, r->len, result_cb, NULL,
+								NULL) == 0)
+		driver_busy = FALSE;
+}
+
+static void driver_done(void)
+{
+	struct record *r;
+
+	driver_busy = FALSE;
+
+	if (pos >= records->len)
+		return;
+
+	r = &g_array_index(records, struct record, pos);
+	if (r->out)
+		driver_start(r);
+}
+
+static void client_indication(const uint8_t *pdu, uint16_t len,
+							gpointer user_data)
+{
+	uint8_t *buf;
+	size_t buflen;
+
+	buf = g_attrib_reserve(client, &buflen);
+	if (buf == NULL)
+		return;
+
+	g_attrib_commit(client, 0, enc_confirmation(buf, buflen), NULL, NULL,
+									NULL);
+}
+
+/* Replay */
+
+static gboolean stall_timeout(gpointer user_data)
+{
+	struct record *r = &g_array_index(records, struct record, pos);
+
+	wait_id = 0;
+	missing++;
+
+	if (opt_verbose) {
+		printf("record %u: missing\n", pos);
+		print_pdu("expected", r->pdu, r->len);
+	}
+
+	pos++;
+	replay_step();
+
+	return FALSE;
+}
+
+static gboolean gap_timeout(gpointer user_data)
+{
+	wait_id = 0;
+
+	replay_step();
+
+	return FALSE;
+}
+
+/* Gaps below the main loop resolution of 1 ms are not kept */
+static gboolean wait_gap(struct record *r)
+{
+	double due, now;
+
+	if (!opt_timing)
+		return FALSE;
+
+	due = anchor_live + (double) (r->usec - anchor_usec) * 1e3;
+	now = harness_now();
+
+	if (due - now < 1e6)
+		return FALSE;
+
+	wait_id = g_timeout_add((due - now) / 1e6, gap_timeout, NULL);
+
+	return TRUE;
+}
+
+static void replay_step(void)
+{
+	if (wait_id > 0) {
+		g_source_remove(wait_id);
+		wait_id = 0;
+	}
+
+	if (out_id > 0)
+		return;
+
+	while (pos < records->len) {
+		struct record *r = &g_array_index(records, struct record, pos);
+
+		if (r->out) {
+			if (skip_record(r)) {
+				pos++;
+				continue;
+			}
+
+			if (opt_client)
+				driver_start(r);
+
+			wait_id = g_timeout_add(opt_stall, stall_timeout, NULL);
+			return;
+		}
+
+		if (r->pdu[0] == ATT_OP_HANDLE_CNF && skipped_ind > 0) {
+			skipped_ind--;
+			pos++;
+			continue;
+		}
+
+		if (wait_gap(r))
+			return;
+
+		if (!peer_send(r->pdu, r->len))
+			return;
+
+		anchor_live = harness_now();
+		anchor_usec = r->usec;
+		anchor_pending = TRUE;
+
+		pos++;
+	}
+
+	g_main_loop_quit(main_loop);
+}
+
+static int open_client(void)
+{
+	GIOChannel *io;
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0)
+		return -errno;
+
+	io = g_io_channel_unix_new(sv[0]);
+	g_io_channel_set_close_on_unref(io, TRUE);
+
+	client = g_attrib_new(io);
+	g_io_channel_unref(io);
+
+	g_attrib_register(client, ATT_OP_HANDLE_IND, GATTRIB_ALL_HANDLES,
+					client_indication, NULL, NULL);
+
+	return sv[1];
+}
+
+static int open_server(void)
+{
+	if (btd_adapter_gatt_server_start(harness_adapter) < 0)
+		return -EIO;
+
+	harness_populate(opt_services);
+
+	if (harness_set_workers(opt_workers) < 0)
+		return -EIO;
+
+	return harness_connect();
+}
+
+static int double_cmp(gconstpointer a, gconstpointer b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+static void print_latency(void)
+{
+	unsigned int n = lat_live->len;
+
+	if (n == 0)
+		return;
+
+	g_array_sort(lat_live, double_cmp);
+	g_array_sort(lat_recorded, double_cmp);
+
+	printf("latency p50/p99    %.1f / %.1f us (recorded %.1f / %.1f us)\n",
+		g_array_index(lat_live, double, n / 2) / 1e3,
+		g_array_index(lat_live, double, (unsigned int) (n * 0.99)) / 1e3,
+		g_array_index(lat_recorded, double, n / 2) / 1e3,
+		g_array_index(lat_recorded, double,
+					(unsigned int) (n * 0.99)) / 1e3);
+}
+
+static void usage(void)
+{
+	printf("attrib-replay - replay a captured ATT session\n"
+		"Usage:\n"
+		"\tattrib-replay [options] <btsnoop file>\n"
+		"Options:\n"
+		"\t-C, --client          Replay the server side against a\n"
+		"\t                      GAttrib client (default: replay the\n"
+		"\t                      client side against the server)\n"
+		"\t-t, --timing          Keep the recorded gaps\n"
+		"\t-H, --handle <n>      Connection handle to replay (default\n"
+		"\t                      the first one seen)\n"
+		"\t-s, --services <n>    Services in the database (default %u)\n"
+		"\t-w, --workers <n>     Server worker threads (default %u)\n"
+		"\t-T, --stall <ms>      Wait for an expected PDU before\n"
+		"\t                      counting it missing (default %u)\n"
+		"\t-v, --verbose         Print each divergence\n",
+		opt_services, opt_workers, opt_stall);
+}
+
+static struct option main_options[] = {
+	{ "client",	0, 0, 'C' },
+	{ "timing",	0, 0, 't' },
+	{ "handle",	1, 0, 'H' },
+	{ "services",	1, 0, 's' },
+	{ "workers",	1, 0, 'w' },
+	{ "stall",	1, 0, 'T' },
+	{ "verbose",	0, 0, 'v' },
+	{ "help",	0, 0, 'h' },
+	{ 0, 0, 0, 0 }
+};
+
+int main(int argc, char *argv[])
+{
+	GIOChannel *io;
+	struct record *first, *last;
+	double start, elapsed, recorded;
+	unsigned int i, out = 0;
+	int opt, err;
+
+	while ((opt = getopt_long(argc, argv, "CtH:s:w:T:vh", main_options,
+								NULL)) != -1) {
+		switch (opt) {
+		case 'C':
+			opt_client = TRUE;
+			break;
+		case 't':
+			opt_timing = TRUE;
+			break;
+		case 'H':
+			opt_handle = strtol(optarg, NULL, 0) & 0x0fff;
+			break;
+		case 's':
+			opt_services = atoi(optarg);
+			break;
+		case 'w':
+			opt_workers = atoi(optarg);
+			break;
+		case 'T':
+			opt_stall = atoi(optarg);
+			break;
+		case 'v':
+			opt_verbose = TRUE;
+			break;
+		case 'h':
+			usage();
+			exit(0);
+		default:
+			usage();
+			exit(1);
+		}
+	}
+
+	if (optind != argc - 1 || opt_services == 0 || opt_stall == 0) {
+		usage();
+		exit(1);
+	}
+
+	records = g_array_new(FALSE, FALSE, sizeof(struct record));
+	lat_live = g_array_new(FALSE, FALSE, sizeof(double));
+	lat_recorded = g_array_new(FALSE, FALSE, sizeof(double));
+
+	err = load_capture(argv[optind]);
+	if (err < 0) {
+		fprintf(stderr, "Unable to read %s: %s\n", argv[optind],
+							strerror(-err));
+		exit(1);
+	}
+
+	if (records->len == 0) {
+		fprintf(stderr, "No ATT records in %s\n", argv[optind]);
+		exit(1);
+	}
+
+	for (i = 0; i < records->len; i++)
+		if (g_array_index(records, struct record, i).out)
+			out++;
+
+	peer_sk = opt_client ? open_client() : open_server();
+	if (peer_sk < 0) {
+		fprintf(stderr, "Unable to open the local side: %s\n",
+							strerror(-peer_sk));
+		exit(1);
+	}
+
+	main_loop = g_main_loop_new(NULL, FALSE);
+
+	io = g_io_channel_unix_new(peer_sk);
+	g_io_add_watch(io, G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
+							peer_event, NULL);
+	g_io_channel_unref(io);
+
+	first = &g_array_index(records, struct record, 0);
+	last = &g_array_index(records, struct record, records->len - 1);
+
+	start = harness_now();
+	anchor_live = start;
+	anchor_usec = first->usec;
+
+	replay_step();
+	g_main_loop_run(main_loop);
+
+	elapsed = (harness_now() - start) / 1e9;
+	recorded = (last->usec - first->usec) / 1e6;
+
+	printf("handle 0x%04x, %u records: %u from the peer, %u local\n",
+				opt_handle, records->len, records->len - out, out);
+	printf("skipped            %lu fragmented, %lu truncated, "
+				"%lu other handles, %lu other channels\n",
+				fragmented, truncated, other_handle, other_cid);
+	printf("replayed           %lu PDUs, %lu bytes\n", sent, sent_bytes);
+	printf("received           %lu PDUs, %lu bytes\n", received,
+							received_bytes);
+	printf("  matched          %lu\n", matched);
+	printf("  diverged         %lu\n", diverged);
+	printf("  unexpected       %lu\n", unexpected);
+	printf("  missing          %lu\n", missing);
+
+	if (!opt_client)
+		printf("  unsolicited      %lu\n", unsolicited);
+
+	printf("time               %.3f s (recorded %.3f s)\n", elapsed,
+								recorded);
+	printf("PDUs/s             %.0f\n", (sent + received) / elapsed);
+	printf("bytes/s            %.0f\n",
+				(sent_bytes + received_bytes) / elapsed);
+
+	print_latency();
+
+	g_main_loop_unref(main_loop);
+
+	if (opt_client)
+		g_attrib_unref(client);
+	else
+		harness_set_workers(0);
+
+	close(peer_sk);
+
+	for (i = 0; i < records->len; i++)
+		g_free(g_array_index(records, struct record, i).pdu);
+
+	g_array_free(records, TRUE);
+	g_array_free(lat_live, TRUE);
+	g_array_free(lat_recorded, TRUE);
+
+	return 0;
+}
@@ -43,6 +43,7 @@
 #include <lib/bluetooth.h>
 #include <lib/hci.h>
 #include <lib/hci_lib.h>
+#include "src/shared/capture.h"
 //typedef struct gatt_primary gatt_primary ;
 static GIOChannel *iochannel = NULL;
 static GAttrib *attrib = NULL;
@@ -458,7 +459,8 @@ static const char
   *rsp_DISCOVERY = "find",
   *rsp_DESCRIPTORS = "desc",
   *rsp_READ      = "rd",
-  *rsp_WRITE     = "wr";
+  *rsp_WRITE     = "wr",
+  *rsp_STATS     = "stats";
 
 static const char
   *err_CONN_FAIL = "connect fail",
@@ -825,6 +827,58 @@ static void connect_cb(GIOChannel *io, GError *err, gpointer user_data)
 	set_state(STATE_CONNECTED);
 }
 
+static void cmd_stats(int argcp, char **argvp)
+{
+	const struct gattrib_stats *stats = g_attrib_get_stats(attrib);
+	char tag[16];
+	int i;
+
+	if (stats == NULL) {
+		resp_error(err_BAD_STATE);
+		return;
+	}
+
+	resp_begin(rsp_STATS);
+	send_uint("bytes_out", stats->bytes_out);
+	send_uint("bytes_in", stats->bytes_in);
+	send_uint("reqq_max", stats->requests_max);
+	send_uint("rspq_max", stats->responses_max);
+	send_uint("refused", stats->refused);
+	send_uint("timeouts", stats->timeouts);
+	send_uint("answered", stats->answered);
+
+	if (stats->answered)
+		send_uint("lat_avg_us", stats->latency_usec / stats->answered);
+
+	/* PDUs written and read per opcode, e.g. tx12 for Write Requests */
+	for (i = 0; i < 256; i++) {
+		if (stats->sent[i]) {
+			snprintf(tag, sizeof(tag), "tx%02X", i);
+			send_uint(tag, stats->sent[i]);
+		}
+
+		if (stats->received[i]) {
+			snprintf(tag, sizeof(tag), "rx%02X", i);
+			send_uint(tag, stats->received[i]);
+		}
+	}
+
+	/* lat<N>: responses that took less than N ms */
+	for (i = 0; i < GATTRIB_LATENCY_BUCKETS; i++) {
+		if (stats->latency[i] == 0)
+			continue;
+
+		if (i == GATTRIB_LATENCY_BUCKETS - 1)
+			snprintf(tag, sizeof(tag), "lat_over%u", 1 << (i - 1));
+		else
+			snprintf(tag, sizeof(tag), "lat%u", 1 << i);
+
+		send_uint(tag, stats->latency[i]);
+	}
+
+	resp_end();
+}
+
 static void disconnect_io()
 {
 	if (conn_state == STATE_DISCONNECTED)
@@ -1190,6 +1244,8 @@ static struct {
 //		"Disconnect from a remote device" },
 	{ "wr [ -w ]",			cmd_char_write,	"<handle> <new value>",
 		"Characteristic Value Write (No response)" },
+	{ "stats",		cmd_stats,	"",
+		"Show traffic statistics of the connection" },
 	{ NULL, NULL, NULL}
 };
 
@@ -1286,7 +1342,15 @@ int main(int argc, char *argv[])
 	opt_src = NULL;
 	opt_dst = NULL;
 	opt_dst_type = g_strdup("public");
-	
+
+	/* Packet capture stays off unless a btsnoop file is named */
+	if (getenv("BLUE_CONNECT_SNOOP")) {
+		if (capture_start(getenv("BLUE_CONNECT_SNOOP"), 0) < 0)
+			fprintf(stderr, "Unable to start packet capture\n");
+		else
+			atexit(capture_stop);
+	}
+
 	event_loop = g_main_loop_new(NULL, FALSE);
 	pchan = g_io_channel_unix_new(fileno(stdin));
 	g_io_channel_set_close_on_unref(pchan, TRUE);